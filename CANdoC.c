@@ -14,6 +14,7 @@
 //           3) CANdoPID(...) function added
 //           4) Date of manuf. status added
 //  15/12/14 Modified to load libCANdo.so dynamically
+//           Per-device state moved into struct cando_ctx
 //
 //  LICENSE :-
 //  The SDK (Software Development Kit) provided for use with the CANdo device
@@ -29,124 +30,137 @@
 #include <unistd.h>
 #include <termios.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include "CANdoImport.h"
 #include "CANdoC.h"
 #include "milcan.h"
+#include "utils/futex.h"
+#include "utils/timestamp.h"
 //------------------------------------------------------------------------------
 // GLOBALS
 //------------------------------------------------------------------------------
-// Library handle
 #ifdef _WIN32
-  HINSTANCE DLLHandle = NULL;
 #define GET_ADDRESS GetProcAddress
 #elif __unix
-  void * DLLHandle = NULL;
 #define GET_ADDRESS dlsym
 #endif
-// Pointers to functions exported by library
-PCANdoGetPID CANdoGetPID;
-PCANdoGetDevices CANdoGetDevices;
-PCANdoOpen CANdoOpen;
-PCANdoOpenDevice CANdoOpenDevice;
-PCANdoClose CANdoClose;
-PCANdoFlushBuffers CANdoFlushBuffers;
-PCANdoSetBaudRate CANdoSetBaudRate;
-PCANdoSetMode CANdoSetMode;
-PCANdoSetFilters CANdoSetFilters;
-PCANdoSetState CANdoSetState;
-PCANdoReceive CANdoReceive;
-PCANdoTransmit CANdoTransmit;
-PCANdoRequestStatus CANdoRequestStatus;
-PCANdoRequestDateStatus CANdoRequestDateStatus;
-PCANdoRequestBusLoadStatus CANdoRequestBusLoadStatus;
-PCANdoRequestSetupStatus CANdoRequestSetupStatus;
-PCANdoRequestAnalogInputStatus CANdoRequestAnalogInputStatus;
-PCANdoClearStatus CANdoClearStatus;
-PCANdoGetVersion CANdoGetVersion;
-PCANdoAnalogStoreRead CANdoAnalogStoreRead;
-PCANdoAnalogStoreWrite CANdoAnalogStoreWrite;
-PCANdoAnalogStoreClear CANdoAnalogStoreClear;
-PCANdoTransmitStoreRead CANdoTransmitStoreRead;
-PCANdoTransmitStoreWrite CANdoTransmitStoreWrite;
-PCANdoTransmitStoreClear CANdoTransmitStoreClear;
-
-TCANdoUSB CANdoUSB;  // Store for parameters relating to connected CANdo
-TCANdoCANBuffer CANdoCANBuffer;  // Cyclic store for CAN messages collected from CANdo
-TCANdoStatus CANdoStatus;  // Store for status message collected from CANdo
-
-unsigned char RunState;  // CANdo run state
-unsigned int DeviceType;  // Type of H/W connected
-unsigned char BusLoadEnableFlag;  // CAN bus load enable
-
-TCANdoUSB* CANdoUSBStatus()
+// The library is loaded once per process & shared by every open CANdo. All
+// of the device state (connection, Rx ring, status, run state) is in each
+// interface's struct cando_ctx, so any number of CANdo can be open at once.
+static struct cando_lib CANdoLib;
+static pthread_mutex_t CANdoLibLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int CANdoMapFunctionPointers(struct cando_lib *Lib);
+static void CANdoUnmapFunctionPointers(struct cando_lib *Lib);
+
+TCANdoUSB* CANdoUSBStatus(struct cando_ctx *ctx)
 {
-  return &CANdoUSB;
+  return &ctx->CANdoUSB;
 }
 
-void CANdoCloseAndFinalise() {
-  if(CANdoUSB.OpenFlag) {
-    CANdoStop();
-    CANdoClose(&CANdoUSB);
+//------------------------------------------------------------------------------
+// CANdoCloseAndRelease
+//
+// Close the device. The library & function map are kept so that the next
+// open doesn't have to load & map them again. Call CANdoFinalise() to unload.
+//
+// Returns -
+//    Nothing
+//------------------------------------------------------------------------------
+void CANdoCloseAndRelease(struct cando_ctx *ctx) {
+  if (ctx->Lib == NULL)
+    return;  // Never initialised
+  CANdoReaderStop(ctx);
+  if(ctx->CANdoUSB.OpenFlag) {
+    CANdoStop(ctx);
+    ctx->Lib->CANdoClose(&ctx->CANdoUSB);
   }
-  CANdoFinalise();
+  pthread_mutex_destroy(&ctx->UsbLock);
+  pthread_mutex_lock(&CANdoLibLock);
+  if (CANdoLib.Users > 0)
+    CANdoLib.Users--;
+  pthread_mutex_unlock(&CANdoLibLock);
+  ctx->Lib = NULL;
 }
 
 //------------------------------------------------------------------------------
 // CANdoInitialise2
 //
-// Load the CANdo.dll & map the functions.
+// Clear ctx, then load the CANdo.dll & map the functions. If they are
+// already loaded & mapped (by another open CANdo or an earlier open) they
+// are reused.
 //
 // Returns -
 //    FALSE = Error loading DLL or mapping functions
 //    TRUE = DLL loaded & functions all mapped
 //------------------------------------------------------------------------------
-unsigned char CANdoInitialise2(void)
+unsigned char CANdoInitialise2(struct cando_ctx *ctx)
 {
   unsigned char Status;
 
-  if (DLLHandle == NULL)
+  memset(ctx, 0, sizeof(struct cando_ctx));
+  ctx->DeviceType = CANDO_TYPE_UNKNOWN;
+
+  pthread_mutex_lock(&CANdoLibLock);
+  if (!CANdoLib.FunctionsMapped)
+  {
+    if (CANdoLib.DLLHandle == NULL)
 #ifdef _WIN32
-    DLLHandle = LoadLibrary("CANdo.dll");
+      CANdoLib.DLLHandle = LoadLibrary("CANdo.dll");
 #elif __unix
-    DLLHandle = dlopen("libCANdo.so", RTLD_LAZY);
+      CANdoLib.DLLHandle = dlopen("libCANdo.so", RTLD_LAZY);
 #endif
 
-  if (DLLHandle != NULL)
-  {
     // DLL loaded, so map functions
-    if (CANdoMapFunctionPointers())
-    {
-      // One or more functions not mapped correctly, so deallocate all resources
-      CANdoFinalise();
-      Status = FALSE;  // Error
-    }
-    else
-      Status = TRUE;  // OK
+    if ((CANdoLib.DLLHandle != NULL) && (CANdoMapFunctionPointers(&CANdoLib) == 0))
+      CANdoLib.FunctionsMapped = TRUE;
+  }
+
+  if (CANdoLib.FunctionsMapped)
+  {
+    CANdoLib.Users++;
+    ctx->Lib = &CANdoLib;
+    pthread_mutex_init(&ctx->UsbLock, NULL);
+    Status = TRUE;  // OK
   }
   else
     Status = FALSE;  // Error
+  pthread_mutex_unlock(&CANdoLibLock);
+
+  if (!Status)
+    CANdoFinalise();  // One or more functions not mapped correctly, so deallocate all resources
 
   return Status;
 }
 //--------------------------------------------------------------------------
 // CANdoFinalise
 //
-// Unmap the functions & unload the CANdo.dll.
+// Unmap the functions & unload the CANdo.dll. Does nothing while an open
+// interface is still using it.
 //
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
 void CANdoFinalise(void)
 {
+  pthread_mutex_lock(&CANdoLibLock);
+  if (CANdoLib.Users > 0)
+  {
+    pthread_mutex_unlock(&CANdoLibLock);
+    return;  // Still in use
+  }
   // Unmap the function pointers to the DLL
-  CANdoUnmapFunctionPointers();
+  CANdoUnmapFunctionPointers(&CANdoLib);
+  CANdoLib.FunctionsMapped = FALSE;
   // Unload the library
 #ifdef _WIN32
-  FreeLibrary((HMODULE)DLLHandle);
+  FreeLibrary((HMODULE)CANdoLib.DLLHandle);
 #elif __unix
-  if (DLLHandle != NULL)
-    dlclose((void *)DLLHandle);
+  if (CANdoLib.DLLHandle != NULL)
+    dlclose((void *)CANdoLib.DLLHandle);
 #endif
+  CANdoLib.DLLHandle = NULL;
+  pthread_mutex_unlock(&CANdoLibLock);
 }
 //--------------------------------------------------------------------------
 // CANdoMapFunctionPointers
@@ -157,112 +171,112 @@ void CANdoFinalise(void)
 //    0 = OK
 //    >0 = At least one function not mapped to DLL
 //--------------------------------------------------------------------------
-int CANdoMapFunctionPointers(void)
+static int CANdoMapFunctionPointers(struct cando_lib *Lib)
 {
   int MapState;
 
-  if (DLLHandle != NULL)
+  if (Lib->DLLHandle != NULL)
   {
     MapState = 0x00000000;
 
-    CANdoGetPID = (PCANdoGetPID)GET_ADDRESS(DLLHandle, "CANdoGetPID");
-    if (CANdoGetPID == NULL)
+    Lib->CANdoGetPID = (PCANdoGetPID)GET_ADDRESS(Lib->DLLHandle, "CANdoGetPID");
+    if (Lib->CANdoGetPID == NULL)
       MapState = 0x00000001;  // Function not mapped
 
-    CANdoGetDevices = (PCANdoGetDevices)GET_ADDRESS(DLLHandle, "CANdoGetDevices");
-    if (CANdoGetDevices == NULL)
+    Lib->CANdoGetDevices = (PCANdoGetDevices)GET_ADDRESS(Lib->DLLHandle, "CANdoGetDevices");
+    if (Lib->CANdoGetDevices == NULL)
       MapState |= 0x00000002;  // Function not mapped
 
-    CANdoOpen = (PCANdoOpen)GET_ADDRESS(DLLHandle, "CANdoOpen");
-    if (CANdoOpen == NULL)
+    Lib->CANdoOpen = (PCANdoOpen)GET_ADDRESS(Lib->DLLHandle, "CANdoOpen");
+    if (Lib->CANdoOpen == NULL)
       MapState |= 0x00000004;  // Function not mapped
 
-    CANdoOpenDevice = (PCANdoOpenDevice)GET_ADDRESS(DLLHandle, "CANdoOpenDevice");
-    if (CANdoOpenDevice == NULL)
+    Lib->CANdoOpenDevice = (PCANdoOpenDevice)GET_ADDRESS(Lib->DLLHandle, "CANdoOpenDevice");
+    if (Lib->CANdoOpenDevice == NULL)
       MapState |= 0x00000008;  // Function not mapped
 
-    CANdoClose = (PCANdoClose)GET_ADDRESS(DLLHandle, "CANdoClose");
-    if (CANdoClose == NULL)
+    Lib->CANdoClose = (PCANdoClose)GET_ADDRESS(Lib->DLLHandle, "CANdoClose");
+    if (Lib->CANdoClose == NULL)
       MapState |= 0x00000010;  // Function not mapped
 
-    CANdoFlushBuffers = (PCANdoFlushBuffers)GET_ADDRESS(DLLHandle, "CANdoFlushBuffers");
-    if (CANdoFlushBuffers == NULL)
+    Lib->CANdoFlushBuffers = (PCANdoFlushBuffers)GET_ADDRESS(Lib->DLLHandle, "CANdoFlushBuffers");
+    if (Lib->CANdoFlushBuffers == NULL)
       MapState |= 0x00000020;  // Function not mapped
 
-    CANdoSetBaudRate = (PCANdoSetBaudRate)GET_ADDRESS(DLLHandle, "CANdoSetBaudRate");
-    if (CANdoSetBaudRate == NULL)
+    Lib->CANdoSetBaudRate = (PCANdoSetBaudRate)GET_ADDRESS(Lib->DLLHandle, "CANdoSetBaudRate");
+    if (Lib->CANdoSetBaudRate == NULL)
       MapState |= 0x00000040;  // Function not mapped
 
-    CANdoSetMode = (PCANdoSetMode)GET_ADDRESS(DLLHandle, "CANdoSetMode");
-    if (CANdoSetMode == NULL)
+    Lib->CANdoSetMode = (PCANdoSetMode)GET_ADDRESS(Lib->DLLHandle, "CANdoSetMode");
+    if (Lib->CANdoSetMode == NULL)
       MapState |= 0x00000080;  // Function not mapped
 
-    CANdoSetFilters = (PCANdoSetFilters)GET_ADDRESS(DLLHandle, "CANdoSetFilters");
-    if (CANdoSetFilters == NULL)
+    Lib->CANdoSetFilters = (PCANdoSetFilters)GET_ADDRESS(Lib->DLLHandle, "CANdoSetFilters");
+    if (Lib->CANdoSetFilters == NULL)
       MapState |= 0x00000100;  // Function not mapped
 
-    CANdoSetState = (PCANdoSetState)GET_ADDRESS(DLLHandle, "CANdoSetState");
-    if (CANdoSetState == NULL)
+    Lib->CANdoSetState = (PCANdoSetState)GET_ADDRESS(Lib->DLLHandle, "CANdoSetState");
+    if (Lib->CANdoSetState == NULL)
       MapState |= 0x00000200;  // Function not mapped
 
-    CANdoReceive = (PCANdoReceive)GET_ADDRESS(DLLHandle, "CANdoReceive");
-    if (CANdoReceive == NULL)
+    Lib->CANdoReceive = (PCANdoReceive)GET_ADDRESS(Lib->DLLHandle, "CANdoReceive");
+    if (Lib->CANdoReceive == NULL)
       MapState |= 0x00000400;  // Function not mapped
 
-    CANdoTransmit = (PCANdoTransmit)GET_ADDRESS(DLLHandle, "CANdoTransmit");
-    if (CANdoTransmit == NULL)
+    Lib->CANdoTransmit = (PCANdoTransmit)GET_ADDRESS(Lib->DLLHandle, "CANdoTransmit");
+    if (Lib->CANdoTransmit == NULL)
       MapState |= 0x00000800;  // Function not mapped
 
-    CANdoRequestStatus = (PCANdoRequestStatus)GET_ADDRESS(DLLHandle, "CANdoRequestStatus");
-    if (CANdoRequestStatus == NULL)
+    Lib->CANdoRequestStatus = (PCANdoRequestStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoRequestStatus");
+    if (Lib->CANdoRequestStatus == NULL)
       MapState |= 0x00001000;  // Function not mapped
 
-    CANdoRequestDateStatus = (PCANdoRequestDateStatus)GET_ADDRESS(DLLHandle, "CANdoRequestDateStatus");
-    if (CANdoRequestDateStatus == NULL)
+    Lib->CANdoRequestDateStatus = (PCANdoRequestDateStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoRequestDateStatus");
+    if (Lib->CANdoRequestDateStatus == NULL)
       MapState |= 0x00002000;  // Function not mapped
 
-    CANdoRequestBusLoadStatus = (PCANdoRequestBusLoadStatus)GET_ADDRESS(DLLHandle, "CANdoRequestBusLoadStatus");
-    if (CANdoRequestBusLoadStatus == NULL)
+    Lib->CANdoRequestBusLoadStatus = (PCANdoRequestBusLoadStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoRequestBusLoadStatus");
+    if (Lib->CANdoRequestBusLoadStatus == NULL)
       MapState |= 0x00004000;  // Function not mapped
 
-    CANdoRequestSetupStatus = (PCANdoRequestSetupStatus)GET_ADDRESS(DLLHandle, "CANdoRequestSetupStatus");
-    if (CANdoRequestSetupStatus == NULL)
+    Lib->CANdoRequestSetupStatus = (PCANdoRequestSetupStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoRequestSetupStatus");
+    if (Lib->CANdoRequestSetupStatus == NULL)
       MapState |= 0x00008000;  // Function not mapped
 
-    CANdoRequestAnalogInputStatus = (PCANdoRequestAnalogInputStatus)GET_ADDRESS(DLLHandle, "CANdoRequestAnalogInputStatus");
-    if (CANdoRequestAnalogInputStatus == NULL)
+    Lib->CANdoRequestAnalogInputStatus = (PCANdoRequestAnalogInputStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoRequestAnalogInputStatus");
+    if (Lib->CANdoRequestAnalogInputStatus == NULL)
       MapState |= 0x00010000;  // Function not mapped
 
-    CANdoClearStatus = (PCANdoClearStatus)GET_ADDRESS(DLLHandle, "CANdoClearStatus");
-    if (CANdoClearStatus == NULL)
+    Lib->CANdoClearStatus = (PCANdoClearStatus)GET_ADDRESS(Lib->DLLHandle, "CANdoClearStatus");
+    if (Lib->CANdoClearStatus == NULL)
       MapState |= 0x00020000;  // Function not mapped
 
-    CANdoGetVersion = (PCANdoGetVersion)GET_ADDRESS(DLLHandle, "CANdoGetVersion");
-    if (CANdoGetVersion == NULL)
+    Lib->CANdoGetVersion = (PCANdoGetVersion)GET_ADDRESS(Lib->DLLHandle, "CANdoGetVersion");
+    if (Lib->CANdoGetVersion == NULL)
       MapState |= 0x00040000;  // Function not mapped
 
-    CANdoAnalogStoreRead = (PCANdoAnalogStoreRead)GET_ADDRESS(DLLHandle, "CANdoAnalogStoreRead");
-    if (CANdoAnalogStoreRead == NULL)
+    Lib->CANdoAnalogStoreRead = (PCANdoAnalogStoreRead)GET_ADDRESS(Lib->DLLHandle, "CANdoAnalogStoreRead");
+    if (Lib->CANdoAnalogStoreRead == NULL)
       MapState |= 0x00080000;  // Function not mapped
 
-    CANdoAnalogStoreWrite = (PCANdoAnalogStoreWrite)GET_ADDRESS(DLLHandle, "CANdoAnalogStoreWrite");
-    if (CANdoAnalogStoreWrite == NULL)
+    Lib->CANdoAnalogStoreWrite = (PCANdoAnalogStoreWrite)GET_ADDRESS(Lib->DLLHandle, "CANdoAnalogStoreWrite");
+    if (Lib->CANdoAnalogStoreWrite == NULL)
       MapState |= 0x00100000;  // Function not mapped
 
-    CANdoAnalogStoreClear = (PCANdoAnalogStoreClear)GET_ADDRESS(DLLHandle, "CANdoAnalogStoreClear");
-    if (CANdoAnalogStoreClear == NULL)
+    Lib->CANdoAnalogStoreClear = (PCANdoAnalogStoreClear)GET_ADDRESS(Lib->DLLHandle, "CANdoAnalogStoreClear");
+    if (Lib->CANdoAnalogStoreClear == NULL)
       MapState |= 0x00200000;  // Function not mapped
 
-    CANdoTransmitStoreRead = (PCANdoTransmitStoreRead)GET_ADDRESS(DLLHandle, "CANdoTransmitStoreRead");
-    if (CANdoTransmitStoreRead == NULL)
+    Lib->CANdoTransmitStoreRead = (PCANdoTransmitStoreRead)GET_ADDRESS(Lib->DLLHandle, "CANdoTransmitStoreRead");
+    if (Lib->CANdoTransmitStoreRead == NULL)
       MapState |= 0x00400000;  // Function not mapped
 
-    CANdoTransmitStoreWrite = (PCANdoTransmitStoreWrite)GET_ADDRESS(DLLHandle, "CANdoTransmitStoreWrite");
-    if (CANdoTransmitStoreWrite == NULL)
+    Lib->CANdoTransmitStoreWrite = (PCANdoTransmitStoreWrite)GET_ADDRESS(Lib->DLLHandle, "CANdoTransmitStoreWrite");
+    if (Lib->CANdoTransmitStoreWrite == NULL)
       MapState |= 0x00800000;  // Function not mapped
 
-    CANdoTransmitStoreClear = (PCANdoTransmitStoreClear)GET_ADDRESS(DLLHandle, "CANdoTransmitStoreClear");
-    if (CANdoTransmitStoreClear == NULL)
+    Lib->CANdoTransmitStoreClear = (PCANdoTransmitStoreClear)GET_ADDRESS(Lib->DLLHandle, "CANdoTransmitStoreClear");
+    if (Lib->CANdoTransmitStoreClear == NULL)
       MapState |= 0x01000000;  // Function not mapped
   }
   else
@@ -278,33 +292,33 @@ int CANdoMapFunctionPointers(void)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-void CANdoUnmapFunctionPointers(void)
+static void CANdoUnmapFunctionPointers(struct cando_lib *Lib)
 {
-  CANdoGetPID = NULL;
-  CANdoGetDevices = NULL;
-  CANdoOpen = NULL;
-  CANdoOpenDevice = NULL;
-  CANdoClose = NULL;
-  CANdoFlushBuffers = NULL;
-  CANdoSetBaudRate = NULL;
-  CANdoSetMode = NULL;
-  CANdoSetFilters = NULL;
-  CANdoSetState = NULL;
-  CANdoReceive = NULL;
-  CANdoTransmit = NULL;
-  CANdoRequestStatus = NULL;
-  CANdoRequestDateStatus = NULL;
-  CANdoRequestBusLoadStatus = NULL;
-  CANdoRequestSetupStatus = NULL;
-  CANdoRequestAnalogInputStatus = NULL;
-  CANdoClearStatus = NULL;
-  CANdoGetVersion = NULL;
-  CANdoAnalogStoreRead = NULL;
-  CANdoAnalogStoreWrite = NULL;
-  CANdoAnalogStoreClear = NULL;
-  CANdoTransmitStoreRead = NULL;
-  CANdoTransmitStoreWrite = NULL;
-  CANdoTransmitStoreClear = NULL;
+  Lib->CANdoGetPID = NULL;
+  Lib->CANdoGetDevices = NULL;
+  Lib->CANdoOpen = NULL;
+  Lib->CANdoOpenDevice = NULL;
+  Lib->CANdoClose = NULL;
+  Lib->CANdoFlushBuffers = NULL;
+  Lib->CANdoSetBaudRate = NULL;
+  Lib->CANdoSetMode = NULL;
+  Lib->CANdoSetFilters = NULL;
+  Lib->CANdoSetState = NULL;
+  Lib->CANdoReceive = NULL;
+  Lib->CANdoTransmit = NULL;
+  Lib->CANdoRequestStatus = NULL;
+  Lib->CANdoRequestDateStatus = NULL;
+  Lib->CANdoRequestBusLoadStatus = NULL;
+  Lib->CANdoRequestSetupStatus = NULL;
+  Lib->CANdoRequestAnalogInputStatus = NULL;
+  Lib->CANdoClearStatus = NULL;
+  Lib->CANdoGetVersion = NULL;
+  Lib->CANdoAnalogStoreRead = NULL;
+  Lib->CANdoAnalogStoreWrite = NULL;
+  Lib->CANdoAnalogStoreClear = NULL;
+  Lib->CANdoTransmitStoreRead = NULL;
+  Lib->CANdoTransmitStoreWrite = NULL;
+  Lib->CANdoTransmitStoreClear = NULL;
 }
 //--------------------------------------------------------------------------
 // CANdoConnect
@@ -316,17 +330,19 @@ void CANdoUnmapFunctionPointers(void)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-int CANdoConnect(u_int16_t deviceNum)
+int CANdoConnect(struct cando_ctx *ctx, u_int16_t deviceNum)
 {
   unsigned int NoOfDevices, Status;
   // unsigned int DeviceNo;
   TCANdoDevice CANdoDevices[MAX_NO_OF_DEVICES];
   TCANdoDeviceString Description;
 
-  DeviceType = CANDO_TYPE_UNKNOWN;  // Device type unknown
+  ctx->DeviceType = CANDO_TYPE_UNKNOWN;  // Device type unknown
   NoOfDevices = MAX_NO_OF_DEVICES;  // Max. no. of devices to enumerate
   // CANdoVersion();
-  Status = CANdoGetDevices(CANdoDevices, &NoOfDevices);  // Get a list of the CANdo devices connected
+  pthread_mutex_lock(&CANdoLibLock);  // Enumerate & open one CANdo at a time
+  Status = ctx->Lib->CANdoGetDevices(CANdoDevices, &NoOfDevices);  // Get a list of the CANdo devices connected
+  pthread_mutex_unlock(&CANdoLibLock);
   // printf("Number of CANdo devices available: %u\n", NoOfDevices);
   
   if (Status == CANDO_SUCCESS)
@@ -352,14 +368,17 @@ int CANdoConnect(u_int16_t deviceNum)
 		if (NoOfDevices > 0)
 		{
 			// At least 1 device found, so connect to 1st device
-      // if (CANdoOpen(&CANdoUSB) == CANDO_SUCCESS)
-      if (CANdoOpenDevice(&CANdoUSB, &CANdoDevices[deviceNum]) == CANDO_SUCCESS)
+      // if (CANdoOpen(&ctx->CANdoUSB) == CANDO_SUCCESS)
+      pthread_mutex_lock(&CANdoLibLock);
+      Status = ctx->Lib->CANdoOpenDevice(&ctx->CANdoUSB, &CANdoDevices[deviceNum]);
+      pthread_mutex_unlock(&CANdoLibLock);
+      if (Status == CANDO_SUCCESS)
       {
 			  // Connection open
-        DeviceType = CANdoDevices[deviceNum].HardwareType;
-			  strcpy((char *)Description, (char *)CANdoUSB.Description);
+        ctx->DeviceType = CANdoDevices[deviceNum].HardwareType;
+			  strcpy((char *)Description, (char *)ctx->CANdoUSB.Description);
 			  strcat((char *)Description, " S/N ");
-			  strcat((char *)Description, (char *)CANdoUSB.SerialNo);
+			  strcat((char *)Description, (char *)ctx->CANdoUSB.SerialNo);
 			  printf("%s connected\n", (char *)Description);
 			  return CANDO_CONNECT_OK;
       }
@@ -391,7 +410,7 @@ int CANdoConnect(u_int16_t deviceNum)
 // Returns -
 //    TRUE is running, else FALSE
 //--------------------------------------------------------------------------
-int CANdoStart(unsigned char baudrate)
+int CANdoStart(struct cando_ctx *ctx, unsigned char baudrate)
 {
   unsigned char SJW, BRP, PHSEG1, PHSEG2, PROPSEG, SAM;
   // Note:
@@ -428,19 +447,19 @@ int CANdoStart(unsigned char baudrate)
   SJW = 0;  // Sync Jump Width (0-3). 0 = 1 jump bit ... 3 = 4 jump bits.
   SAM = 1;  // Samples per bit (0-1). 0 = 1 sample per bit, 1 = three samples per bit. 
 
-  RunState = FALSE;  // CANdo stopped
-  if (CANdoUSB.OpenFlag)
+  ctx->RunState = FALSE;  // CANdo stopped
+  if (ctx->CANdoUSB.OpenFlag)
   {
-    // if (CANdoSetBaudRate(&CANdoUSB, 0, 1, 7, 7, 2, 0) == CANDO_SUCCESS)  // Set baud rate to 250k
-    if (CANdoSetBaudRate(&CANdoUSB, SJW, BRP, PHSEG1, PHSEG2, PROPSEG, SAM) == CANDO_SUCCESS)
+    // if (ctx->Lib->CANdoSetBaudRate(&ctx->CANdoUSB, 0, 1, 7, 7, 2, 0) == CANDO_SUCCESS)  // Set baud rate to 250k
+    if (ctx->Lib->CANdoSetBaudRate(&ctx->CANdoUSB, SJW, BRP, PHSEG1, PHSEG2, PROPSEG, SAM) == CANDO_SUCCESS)
     {
       usleep(100000);  // Wait 100ms to allow CANdo to store baud rate in EEPROM, in case modified
       // Set mode to 'Normal'
-      if (CANdoSetMode(&CANdoUSB, CANDO_NORMAL_MODE) == CANDO_SUCCESS)
+      if (ctx->Lib->CANdoSetMode(&ctx->CANdoUSB, CANDO_NORMAL_MODE) == CANDO_SUCCESS)
       {
         usleep(10000);  // Wait 10ms to allow CANdo to store mode in EEPROM, in case modified
         // Set filters to accept all messages
-        if (CANdoSetFilters(&CANdoUSB,
+        if (ctx->Lib->CANdoSetFilters(&ctx->CANdoUSB,
           0,
           CANDO_ID_29_BIT, 0,
           CANDO_ID_11_BIT, 0,
@@ -452,10 +471,10 @@ int CANdoStart(unsigned char baudrate)
           {
             usleep(10000);  // Wait 10ms to allow filters to be configured in CAN module
             // Flush USB buffers
-            if (CANdoFlushBuffers(&CANdoUSB) == CANDO_SUCCESS)
+            if (ctx->Lib->CANdoFlushBuffers(&ctx->CANdoUSB) == CANDO_SUCCESS)
               // Set CANdo state to run
-              if (CANdoSetState(&CANdoUSB, CANDO_RUN) == CANDO_SUCCESS)
-                RunState = TRUE;  // Running
+              if (ctx->Lib->CANdoSetState(&ctx->CANdoUSB, CANDO_RUN) == CANDO_SUCCESS)
+                ctx->RunState = TRUE;  // Running
           }
       }
     }
@@ -463,9 +482,9 @@ int CANdoStart(unsigned char baudrate)
 
   long br = 20000000 / (2*(BRP + 1)*(4 + PROPSEG + PHSEG1 + PHSEG2));
   int sp = (3 + PROPSEG + PHSEG1) * 100 / (4 + PROPSEG + PHSEG1 + PHSEG2);
-  if (RunState)
+  if (ctx->RunState)
     printf("CANdo started at %li (sample point %i).\n", br, sp);
-  return RunState;
+  return ctx->RunState;
 }
 //--------------------------------------------------------------------------
 // CANdoStop
@@ -475,15 +494,15 @@ int CANdoStart(unsigned char baudrate)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-void CANdoStop(void)
+void CANdoStop(struct cando_ctx *ctx)
 {
-  if (RunState)
+  if (ctx->RunState)
   {
-    if (CANdoUSB.OpenFlag)
-      if (CANdoSetState(&CANdoUSB, CANDO_STOP) == CANDO_SUCCESS)
-        RunState = FALSE;  // Stopped
+    if (ctx->CANdoUSB.OpenFlag)
+      if (ctx->Lib->CANdoSetState(&ctx->CANdoUSB, CANDO_STOP) == CANDO_SUCCESS)
+        ctx->RunState = FALSE;  // Stopped
 
-    if (!RunState)
+    if (!ctx->RunState)
       printf("CANdo stopped\n");
   }
 }
@@ -495,14 +514,14 @@ void CANdoStop(void)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-void CANdoGetStatus(unsigned char StatusType)
+void CANdoGetStatus(struct cando_ctx *ctx, unsigned char StatusType)
 {
   // Send status request to CANdo
   switch (StatusType)
   {
-    case CANDO_DEVICE_STATUS : CANdoRequestStatus(&CANdoUSB); break;
-    case CANDO_DATE_STATUS : CANdoRequestDateStatus(&CANdoUSB); break;
-    case CANDO_BUS_LOAD_STATUS : CANdoRequestBusLoadStatus(&CANdoUSB); break;
+    case CANDO_DEVICE_STATUS : ctx->Lib->CANdoRequestStatus(&ctx->CANdoUSB); break;
+    case CANDO_DATE_STATUS : ctx->Lib->CANdoRequestDateStatus(&ctx->CANdoUSB); break;
+    case CANDO_BUS_LOAD_STATUS : ctx->Lib->CANdoRequestBusLoadStatus(&ctx->CANdoUSB); break;
   }
 }
 //--------------------------------------------------------------------------
@@ -513,11 +532,11 @@ void CANdoGetStatus(unsigned char StatusType)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-void CANdoPID(void)
+void CANdoPID(struct cando_ctx *ctx)
 {
   TCANdoDeviceString PID;
 
-  if (CANdoGetPID(CANdoUSB.No, PID) == CANDO_SUCCESS)
+  if (ctx->Lib->CANdoGetPID(ctx->CANdoUSB.No, PID) == CANDO_SUCCESS)
     printf("\n CANdo USB PID 0x%s\n >", (char *)PID);
   else
     printf("\n Error reading USB PID\n >");
@@ -530,11 +549,11 @@ void CANdoPID(void)
 // Returns -
 //    Nothing
 //--------------------------------------------------------------------------
-void CANdoVersion(void)
+void CANdoVersion(struct cando_ctx *ctx)
 {
   unsigned int APIVersion, DLLVersion, DriverVersion;
 
-  CANdoGetVersion(&APIVersion, &DLLVersion, &DriverVersion);
+  ctx->Lib->CANdoGetVersion(&APIVersion, &DLLVersion, &DriverVersion);
 
   printf(" CANdo API DLL v%.1f\n CANdo USB DLL v%.1f\n CANdo driver v%.1f\n",
     (float)APIVersion / 10, (float)DLLVersion / 10, (float)DriverVersion / 10);
@@ -552,12 +571,43 @@ void CANdoVersion(void)
 #define CAN_ERR_CNT  	   0x00000200U   // error counts (data[6] = Tx error counter, data[7] = Rx error counter)
 
 
+// Watches the status of every receive & transmit for the CANdo going away.
+// A closed connection or a USB driver error means it has gone. USB read &
+// write errors can be a glitch, so it takes CANDO_LOST_ERRORS in a row.
+static void CANdoCheckStatus(struct cando_ctx *ctx, int Status) {
+  switch (Status) {
+    case CANDO_SUCCESS:
+      atomic_store_explicit(&ctx->UsbErrors, 0, memory_order_relaxed);
+      break;
+    case CANDO_CONNECTION_CLOSED:
+    case CANDO_USB_DLL_ERROR:
+    case CANDO_USB_DRIVER_ERROR:
+    case CANDO_NOT_FOUND:
+    case CANDO_INVALID_HANDLE:
+      atomic_store(&ctx->Lost, TRUE);
+      break;
+    case CANDO_READ_ERROR:
+    case CANDO_WRITE_ERROR:
+      if ((atomic_fetch_add(&ctx->UsbErrors, 1) + 1) >= CANDO_LOST_ERRORS)
+        atomic_store(&ctx->Lost, TRUE);
+      break;
+    default:
+      break;  // Overflows etc. The CANdo is still there.
+  }
+}
+
 // Fills the Rx buffer
-int CANdoRx() {
-  if (CANdoReceive(&CANdoUSB, &CANdoCANBuffer, &CANdoStatus) != CANDO_SUCCESS)
+int CANdoRx(struct cando_ctx *ctx) {
+  int Status;
+
+  pthread_mutex_lock(&ctx->UsbLock);
+  Status = ctx->Lib->CANdoReceive(&ctx->CANdoUSB, &ctx->CANdoCANBuffer, &ctx->CANdoStatus);
+  pthread_mutex_unlock(&ctx->UsbLock);
+  CANdoCheckStatus(ctx, Status);
+  if (Status != CANDO_SUCCESS)
     return FALSE;
   return TRUE;
-  switch(CANdoReceive(&CANdoUSB, &CANdoCANBuffer, &CANdoStatus)) {
+  switch(ctx->Lib->CANdoReceive(&ctx->CANdoUSB, &ctx->CANdoCANBuffer, &ctx->CANdoStatus)) {
     case CANDO_SUCCESS:
       return MILCAN_OK;
     case CANDO_CONNECTION_CLOSED:
@@ -573,42 +623,198 @@ int CANdoRx() {
   }
 }
 
-// Empties the Rx buffer.
-int CANdoReadRxQueue(struct can_frame *frame) {
-  if((CANdoCANBuffer.ReadIndex != CANdoCANBuffer.WriteIndex) || CANdoCANBuffer.FullFlag) {
-    frame->len = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].DLC;
-    frame->data[0] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[0];
-    frame->data[1] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[1];
-    frame->data[2] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[2];
-    frame->data[3] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[3];
-    frame->data[4] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[4];
-    frame->data[5] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[5];
-    frame->data[6] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[6];
-    frame->data[7] = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].Data[7];
-    frame->can_id = CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].ID;
-    if(CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].IDE) {
-      frame->can_id |= CAN_EFF_FLAG;
+// Are there frames in the Rx buffer that haven't been read yet?
+int CANdoRxPending(struct cando_ctx *ctx) {
+  TCANdoCANBuffer *Buffer = &ctx->CANdoCANBuffer;
+  return (Buffer->ReadIndex != Buffer->WriteIndex) || Buffer->FullFlag;
+}
+
+// Empties up to max frames from the Rx buffer in one pass. The buffer is
+// read in (at most two) runs of consecutive entries, so the loop that
+// converts them is as simple as it can be. Returns how many were read.
+int CANdoReadRxBatch(struct cando_ctx *ctx, struct can_frame *frames, int max) {
+  TCANdoCANBuffer *Buffer = &ctx->CANdoCANBuffer;
+  int Count = 0;
+
+  while ((Count < max) && CANdoRxPending(ctx)) {
+    // Up to the write index or the end of the buffer, whichever comes first
+    int End = (Buffer->WriteIndex > Buffer->ReadIndex) ? Buffer->WriteIndex : CANDO_CAN_BUFFER_LENGTH;
+    int Run = End - Buffer->ReadIndex;
+    if (Run > (max - Count))
+      Run = max - Count;
+
+    const TCANdoCAN *Message = &Buffer->CANMessage[Buffer->ReadIndex];
+    struct can_frame *Frame = &frames[Count];
+    for (int n = 0; n < Run; n++, Message++, Frame++) {
+      Frame->can_id = Message->ID | (Message->IDE ? CAN_EFF_FLAG : 0) | (Message->RTR ? CAN_RTR_FLAG : 0);
+      Frame->len = Message->DLC;
+      memcpy(Frame->data, Message->Data, sizeof(Frame->data));
     }
-    if(CANdoCANBuffer.CANMessage[CANdoCANBuffer.ReadIndex].RTR) {
-      frame->can_id |= CAN_RTR_FLAG;
+
+    // Move read pointer on past the run, wrapping back to the start
+    Buffer->ReadIndex = (Buffer->ReadIndex + Run) % CANDO_CAN_BUFFER_LENGTH;
+    Buffer->FullFlag = FALSE;  // Clear flag as buffer is not full
+    Count += Run;
+  }
+  return Count;
+}
+
+// Empties one frame from the Rx buffer.
+int CANdoReadRxQueue(struct cando_ctx *ctx, struct can_frame *frame) {
+  return (CANdoReadRxBatch(ctx, frame, 1) == 1) ? TRUE : FALSE;
+}
+
+//--------------------------------------------------------------------------
+// CANdoReader
+//
+// The reader thread. It only asks the CANdo for more frames once the Rx
+// buffer has been emptied, converts everything it gets into the reader
+// ring in one pass & time stamps it, then rings the doorbell.
+//
+// Returns -
+//    NULL
+//--------------------------------------------------------------------------
+static void *CANdoReader(void *arg)
+{
+  struct cando_ctx *ctx = (struct cando_ctx *)arg;
+
+  while (atomic_load(&ctx->ReaderRun))
+  {
+    uint32_t Tail = atomic_load_explicit(&ctx->RxTail, memory_order_relaxed);  // Only we change it
+    uint32_t Free = CANDO_READER_RING - (Tail - atomic_load_explicit(&ctx->RxHead, memory_order_acquire));
+
+    if (Free == 0)
+    {
+      usleep(CANDO_READER_IDLE_US);  // The event thread has fallen behind
+      continue;
+    }
+    if (!CANdoRxPending(ctx))
+    {
+      if (!CANdoRx(ctx))
+        atomic_fetch_add(&ctx->RxErrors, 1);
+      if (!CANdoRxPending(ctx))
+      {
+        usleep(CANDO_READER_IDLE_US);  // Nothing on the bus
+        continue;
+      }
     }
 
-    // Move read pointer onto next slot in cyclic buffer
-    if ((CANdoCANBuffer.ReadIndex + 1) < CANDO_CAN_BUFFER_LENGTH)
-      CANdoCANBuffer.ReadIndex++;  // Increment index onto next free slot
-    else
-      CANdoCANBuffer.ReadIndex = 0;  // Wrap back to start
+    uint64_t Now = nanos();
+    uint32_t Index = Tail % CANDO_READER_RING;
+    uint32_t Run = CANDO_READER_RING - Index;
+    if (Run > Free)
+      Run = Free;
+    int Count = CANdoReadRxBatch(ctx, &ctx->RxFrames[Index], Run);
+    if (((uint32_t)Count == Run) && (Free > Run))
+      Count += CANdoReadRxBatch(ctx, &ctx->RxFrames[0], Free - Run);  // Wrapped
+    for (int n = 0; n < Count; n++)
+      ctx->RxTimes[(Tail + n) % CANDO_READER_RING] = Now;
+
+    atomic_store_explicit(&ctx->RxTail, Tail + Count, memory_order_release);
+    atomic_fetch_add(&ctx->Doorbell, 1);
+    futexWake(&ctx->Doorbell);
+  }
+  return NULL;
+}
 
-    CANdoCANBuffer.FullFlag = FALSE;  // Clear flag as buffer is not full
+//--------------------------------------------------------------------------
+// CANdoReaderStart
+//
+// Start a thread that reads from the CANdo. After this use CANdoReaderRead()
+// rather than CANdoRx() & CANdoReadRxQueue().
+//
+// Returns -
+//    TRUE if it's running, else FALSE
+//--------------------------------------------------------------------------
+int CANdoReaderStart(struct cando_ctx *ctx)
+{
+  if (ctx->ReaderRunning)
     return TRUE;
+  atomic_store(&ctx->RxHead, 0);
+  atomic_store(&ctx->RxTail, 0);
+  atomic_store(&ctx->ReaderRun, TRUE);
+  if (pthread_create(&ctx->ReaderId, NULL, CANdoReader, ctx) != 0)
+  {
+    atomic_store(&ctx->ReaderRun, FALSE);
+    return FALSE;
   }
-  return FALSE;
+  ctx->ReaderRunning = TRUE;
+  return TRUE;
+}
+
+//--------------------------------------------------------------------------
+// CANdoReaderStop
+//
+// Stop the reader thread, if it's running. Frames it had read are dropped.
+//
+// Returns -
+//    Nothing
+//--------------------------------------------------------------------------
+void CANdoReaderStop(struct cando_ctx *ctx)
+{
+  if (!ctx->ReaderRunning)
+    return;
+  atomic_store(&ctx->ReaderRun, FALSE);
+  pthread_join(ctx->ReaderId, NULL);
+  ctx->ReaderRunning = FALSE;
 }
 
-int CANdoTx(unsigned char idExtended, unsigned int id, unsigned char dlc, unsigned char * data)
+//--------------------------------------------------------------------------
+// CANdoReaderRead
+//
+// Take up to max frames that the reader thread has read, with the times
+// that it read them. Saves the doorbell first (in DoorbellSeen) so that a
+// frame that arrives after we've looked always changes it.
+//
+// Returns -
+//    How many frames were read
+//--------------------------------------------------------------------------
+int CANdoReaderRead(struct cando_ctx *ctx, struct can_frame *frames, uint64_t *rx_times, int max)
+{
+  ctx->DoorbellSeen = atomic_load(&ctx->Doorbell);
+  uint32_t Head = atomic_load_explicit(&ctx->RxHead, memory_order_relaxed);  // Only we change it
+  uint32_t Count = atomic_load_explicit(&ctx->RxTail, memory_order_acquire) - Head;
+
+  if (Count > (uint32_t)max)
+    Count = max;
+  for (uint32_t Done = 0; Done < Count;)
+  {
+    uint32_t Index = (Head + Done) % CANDO_READER_RING;
+    uint32_t Run = CANDO_READER_RING - Index;
+    if (Run > (Count - Done))
+      Run = Count - Done;
+    memcpy(&frames[Done], &ctx->RxFrames[Index], Run * sizeof(struct can_frame));
+    memcpy(&rx_times[Done], &ctx->RxTimes[Index], Run * sizeof(uint64_t));
+    Done += Run;
+  }
+  atomic_store_explicit(&ctx->RxHead, Head + Count, memory_order_release);
+  return Count;
+}
+
+int CANdoTx(struct cando_ctx *ctx, unsigned char idExtended, unsigned int id, unsigned char dlc, unsigned char * data)
 {
   // Transmit frame of data
-  if (CANdoTransmit(&CANdoUSB, idExtended, id, CANDO_DATA_FRAME, dlc, data, 0, 0) == CANDO_SUCCESS)
+  int Status;
+
+  pthread_mutex_lock(&ctx->UsbLock);
+  Status = ctx->Lib->CANdoTransmit(&ctx->CANdoUSB, idExtended, id, CANDO_DATA_FRAME, dlc, data, 0, 0);
+  pthread_mutex_unlock(&ctx->UsbLock);
+  CANdoCheckStatus(ctx, Status);
+  if (Status == CANDO_SUCCESS)
     return TRUE;
   return FALSE;
 }
+
+//--------------------------------------------------------------------------
+// CANdoLost
+//
+// Has the CANdo gone (unplugged etc.)? Once it has, close it & connect
+// again.
+//
+// Returns -
+//    TRUE if it has gone, else FALSE
+//--------------------------------------------------------------------------
+int CANdoLost(struct cando_ctx *ctx)
+{
+  return atomic_load(&ctx->Lost) ? TRUE : FALSE;
+}
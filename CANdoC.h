@@ -8,6 +8,7 @@
 //  UPDATES :-
 //  08/05/14 Created
 //  15/12/14 Functions added to support dynamic loading of libCANdo.so
+//           Per-device state moved into struct cando_ctx
 //
 //  LICENSE :-
 //  The SDK (Software Development Kit) provided for use with the CANdo device
@@ -20,6 +21,8 @@
 #ifndef CANDOC_H
 #define CANDOC_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include "CANdoImport.h"
 #include "milcan.h"
 
@@ -33,6 +36,9 @@
 #define RX_DISPLAY_TIME 20  // Receive poll time in multiples of SLEEP_TIME
 #define BUS_LOAD_REQUEST_TIME 100  // Bus load request time in multiples of SLEEP_TIME
 #define MAX_NO_OF_DEVICES 10  // Max. no. of CANdo devices to enumerate
+#define CANDO_READER_RING 2048  // Frames the reader thread can hold for the event thread (a power of 2)
+#define CANDO_READER_IDLE_US 100  // How long the reader thread waits when the CANdo has nothing for it
+#define CANDO_LOST_ERRORS 16  // USB read or write errors in a row before we decide the CANdo has gone
 
 #define CANDO_CONNECT_OK                1
 #define CANDO_CONNECT_FAIL              0
@@ -41,23 +47,91 @@
 #define CANDO_CONNECT_USB_DRIVER_ERROR  -3
 #define CANDO_CONNECT_NOT_FOUND         -4
 //------------------------------------------------------------------------------
+// TYPEDEFS
+//------------------------------------------------------------------------------
+// libCANdo.so & the functions mapped from it. There is one per process,
+// shared by every open CANdo.
+struct cando_lib
+{
+#ifdef _WIN32
+  HINSTANCE DLLHandle;
+#elif __unix
+  void * DLLHandle;
+#endif
+  unsigned char FunctionsMapped;  // Library loaded & functions mapped. Kept for the next open.
+  unsigned int Users;  // How many open CANdo are using the library
+  PCANdoGetPID CANdoGetPID;
+  PCANdoGetDevices CANdoGetDevices;
+  PCANdoOpen CANdoOpen;
+  PCANdoOpenDevice CANdoOpenDevice;
+  PCANdoClose CANdoClose;
+  PCANdoFlushBuffers CANdoFlushBuffers;
+  PCANdoSetBaudRate CANdoSetBaudRate;
+  PCANdoSetMode CANdoSetMode;
+  PCANdoSetFilters CANdoSetFilters;
+  PCANdoSetState CANdoSetState;
+  PCANdoReceive CANdoReceive;
+  PCANdoTransmit CANdoTransmit;
+  PCANdoRequestStatus CANdoRequestStatus;
+  PCANdoRequestDateStatus CANdoRequestDateStatus;
+  PCANdoRequestBusLoadStatus CANdoRequestBusLoadStatus;
+  PCANdoRequestSetupStatus CANdoRequestSetupStatus;
+  PCANdoRequestAnalogInputStatus CANdoRequestAnalogInputStatus;
+  PCANdoClearStatus CANdoClearStatus;
+  PCANdoGetVersion CANdoGetVersion;
+  PCANdoAnalogStoreRead CANdoAnalogStoreRead;
+  PCANdoAnalogStoreWrite CANdoAnalogStoreWrite;
+  PCANdoAnalogStoreClear CANdoAnalogStoreClear;
+  PCANdoTransmitStoreRead CANdoTransmitStoreRead;
+  PCANdoTransmitStoreWrite CANdoTransmitStoreWrite;
+  PCANdoTransmitStoreClear CANdoTransmitStoreClear;
+};
+
+// Everything about one open CANdo. Each interface has its own.
+struct cando_ctx
+{
+  struct cando_lib * Lib;  // NULL until CANdoInitialise2() succeeds
+  TCANdoUSB CANdoUSB;  // Store for parameters relating to connected CANdo
+  TCANdoCANBuffer CANdoCANBuffer;  // Cyclic store for CAN messages collected from CANdo
+  TCANdoStatus CANdoStatus;  // Store for status message collected from CANdo
+  unsigned char RunState;  // CANdo run state
+  unsigned int DeviceType;  // Type of H/W connected
+  pthread_mutex_t UsbLock;  // The reader thread receives while the event thread transmits
+  pthread_t ReaderId;  // See CANdoReaderStart()
+  unsigned char ReaderRunning;
+  atomic_uchar ReaderRun;  // Cleared to stop the reader thread
+  struct can_frame RxFrames[CANDO_READER_RING];  // Converted by the reader thread
+  uint64_t RxTimes[CANDO_READER_RING];  // When the reader thread read each one
+  _Atomic uint32_t RxHead;  // Next to read. Only CANdoReaderRead() changes it
+  _Atomic uint32_t RxTail;  // Next to write. Only the reader thread changes it
+  _Atomic uint32_t Doorbell;  // Bumped by the reader thread when it adds frames
+  uint32_t DoorbellSeen;  // The doorbell when we last looked (see governorSetFutex())
+  _Atomic uint64_t RxErrors;  // Failed receives (CANdo buffer overflows etc.)
+  _Atomic uint32_t UsbErrors;  // USB read & write errors in a row
+  atomic_uchar Lost;  // Set once the CANdo has gone (unplugged etc.). See CANdoLost()
+};
+//------------------------------------------------------------------------------
 // PROTOTYPES
 //------------------------------------------------------------------------------
-TCANdoUSB* CANdoUSBStatus();
-void CANdoCloseAndFinalise();
-unsigned char CANdoInitialise2(void);
+TCANdoUSB* CANdoUSBStatus(struct cando_ctx *ctx);
+void CANdoCloseAndRelease(struct cando_ctx *ctx);
+unsigned char CANdoInitialise2(struct cando_ctx *ctx);
 void CANdoFinalise(void);
-int CANdoTx(unsigned char idExtended, unsigned int id, unsigned char dlc, unsigned char * data);
-int CANdoMapFunctionPointers(void);
-void CANdoUnmapFunctionPointers(void);
-int CANdoConnect(u_int16_t deviceNum);
-int CANdoStart(unsigned char baudrate);
-void CANdoStop(void);
-void CANdoGetStatus(unsigned char);
-void CANdoPID(void);
-void CANdoVersion(void);
-int CANdoRx(void);
-int CANdoReadRxQueue(struct can_frame *frame);
+int CANdoTx(struct cando_ctx *ctx, unsigned char idExtended, unsigned int id, unsigned char dlc, unsigned char * data);
+int CANdoConnect(struct cando_ctx *ctx, u_int16_t deviceNum);
+int CANdoStart(struct cando_ctx *ctx, unsigned char baudrate);
+void CANdoStop(struct cando_ctx *ctx);
+void CANdoGetStatus(struct cando_ctx *ctx, unsigned char);
+void CANdoPID(struct cando_ctx *ctx);
+void CANdoVersion(struct cando_ctx *ctx);
+int CANdoRx(struct cando_ctx *ctx);
+int CANdoRxPending(struct cando_ctx *ctx);
+int CANdoReadRxBatch(struct cando_ctx *ctx, struct can_frame *frames, int max);
+int CANdoReadRxQueue(struct cando_ctx *ctx, struct can_frame *frame);
+int CANdoReaderStart(struct cando_ctx *ctx);
+void CANdoReaderStop(struct cando_ctx *ctx);
+int CANdoReaderRead(struct cando_ctx *ctx, struct can_frame *frames, uint64_t *rx_times, int max);
+int CANdoLost(struct cando_ctx *ctx);
 //------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 #endif
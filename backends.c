@@ -0,0 +1,495 @@
+// backends.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <string.h>     /* String function definitions */
+#include <inttypes.h>
+#include <pthread.h>
+#include "backends.h"
+#include "interfaces.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+#include "CANdoImport.h"
+#include "CANdoC.h"
+#include "gsusb.h"
+
+#define TAG "backends"
+
+// Each kind of CAN adapter is a struct milcan_backend. interface_open() looks the backend up once and everything after that is an
+// indirect call through it. The built in ones are below. Received frames are always read in batches (recv_batch) so that adapters
+// that can read more than one frame per call do so. The others just loop.
+
+// CANdo
+
+static int cando_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  LOGI(TAG, "Opening CANdo (%u)...", moduleNumber);
+  if(!CANdoInitialise2(&i->cando)) {
+    LOGE(TAG, "CANdo API library not found!");
+    return MILCAN_ERROR;
+  }
+  i->startup.driver_loaded = nanos();
+  CANdoConnect(&i->cando, moduleNumber);  // Open a connection to a CANdo device
+  if(!CANdoUSBStatus(&i->cando)->OpenFlag) {
+    LOGE(TAG, "CANdo is not open!");
+    CANdoCloseAndRelease(&i->cando);
+    return MILCAN_ERROR;
+  }
+  LOGI(TAG, "CANdo is open.");
+  i->startup.device_opened = nanos();
+  if(FALSE == CANdoStart(&i->cando, speed)) {
+    LOGE(TAG, "Unable to set CANdo baud rate!");
+    CANdoCloseAndRelease(&i->cando);
+    return MILCAN_ERROR;
+  }
+  i->startup.bit_timing_set = nanos();
+  // Read in the background (unless the application is driving us with milcan_poll()) and sleep on the reader's doorbell.
+  if(!(i->options & MILCAN_A_OPTION_NO_THREAD)) {
+    if(CANdoReaderStart(&i->cando)) {
+      governorSetFutex(&(i->gov), &(i->cando.Doorbell), &(i->cando.DoorbellSeen));
+    } else {
+      LOGW(TAG, "Unable to start the CANdo reader. Reading from the event thread instead.");
+    }
+  }
+  return MILCAN_OK;
+}
+
+static void cando_close(void* interface) {
+  CANdoCloseAndRelease(&((struct milcan_a*)interface)->cando);
+}
+
+static int cando_send(void* interface, struct can_frame* frame) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  uint32_t id = frame->can_id;
+  uint8_t extended = 0;
+  if(frame->can_id & CAN_EFF_FLAG) {
+    id &= CAN_EFF_MASK;
+    extended = 1;
+  } else {
+    id &= CAN_SFF_MASK;
+  }
+  return (CANdoTx(&i->cando, extended, id, frame->len, frame->data) == TRUE) ? MILCAN_OK : MILCAN_ERROR;
+}
+
+static int cando_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct cando_ctx* cando = &((struct milcan_a*)interface)->cando;
+  if(cando->ReaderRunning) {
+    return CANdoReaderRead(cando, frames, rx_times, max);
+  }
+  // Only go to the CANdo when everything that it gave us last time has been used.
+  if(!CANdoRxPending(cando) && !CANdoRx(cando)) {
+    atomic_fetch_add(&(cando->RxErrors), 1);
+  }
+  int n = CANdoReadRxBatch(cando, frames, max);
+  uint64_t now = nanos_cached();
+  for(int f = 0; f < n; f++) {
+    rx_times[f] = now;
+  }
+  return n;
+}
+
+static int cando_get_stats(void* interface, struct milcan_backend_stats* stats) {
+  stats->rx_dropped = atomic_load(&(((struct milcan_a*)interface)->cando.RxErrors));
+  stats->tx_errors = 0;
+  return MILCAN_OK;
+}
+
+static int cando_connected(void* interface) {
+  return CANdoLost(&((struct milcan_a*)interface)->cando) ? FALSE : TRUE;
+}
+
+static const struct milcan_backend cando_backend = {
+  .name = "CANdo",
+  .open = cando_open,
+  .close = cando_close,
+  .send = cando_send,
+  .recv_batch = cando_recv_batch,
+  .get_stats = cando_get_stats,
+  .connected = cando_connected,
+};
+
+// GSUSB
+// Built without libGSUSB (-DMILCAN_NO_GSUSB, e.g. the Linux build) there's no GSUSB backend and opening one fails as unrecognised.
+
+#ifndef MILCAN_NO_GSUSB
+static int gsusb_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  LOGI(TAG, "Opening GSUSB (%u)...", moduleNumber);
+  int rep = gsusbInit(&i->ctx);
+  if(rep == GSUSB_OK) {
+    i->startup.driver_loaded = nanos();
+    // gsusbOpen() finds the device, claims it and sets the bit timing all in one go.
+    switch(speed) {
+      case MILCAN_A_250K:
+        rep = gsusbOpen(&i->ctx, moduleNumber, 6, 7, 2, 1, 12); // Sample point: 87.5%
+        break;
+      case MILCAN_A_500K:
+        rep = gsusbOpen(&i->ctx, moduleNumber, 6, 7, 2, 1, 6); // Sample point: 87.5%
+        break;
+      case MILCAN_A_1M:
+        rep = gsusbOpen(&i->ctx, moduleNumber, 6, 7, 2, 1, 3); // Sample point: 87.5%
+        break;
+    }
+    if(rep != GSUSB_OK) {
+      gsusbExit(&i->ctx);
+    }
+  }
+  if(rep != GSUSB_OK) {
+    LOGE(TAG, "Error opening!");
+    return MILCAN_ERROR;
+  }
+  i->startup.device_opened = nanos();
+  i->startup.bit_timing_set = i->startup.device_opened;
+  i->gsusb_lost = FALSE;
+  i->count_tx_echoes = TRUE;  // For gsusb_tx_free().
+  LOGI(TAG, "Device opened!");
+  return MILCAN_OK;
+}
+
+static void gsusb_close(void* interface) {
+  gsusbExit(&(((struct milcan_a*)interface)->ctx));
+}
+
+static int gsusb_send(void* interface, struct can_frame* frame) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int rep = gsusbWrite(&i->ctx, frame);
+  if(rep == GSUSB_ERROR_NO_DEVICE) {
+    i->gsusb_lost = TRUE;
+  }
+  return (GSUSB_OK == rep) ? MILCAN_OK : MILCAN_ERROR;
+}
+
+static int gsusb_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0, rep = GSUSB_OK;
+  while((n < max) && (GSUSB_OK == (rep = gsusbRead(&i->ctx, &(frames[n]))))) {
+    rx_times[n++] = 0;  // No time stamps.
+  }
+  if(rep == GSUSB_ERROR_NO_DEVICE) {
+    i->gsusb_lost = TRUE;
+  }
+  return n;
+}
+
+// libGSUSB has GSUSB_MAX_TX_REQ Tx slots and frees one when the adapter echoes its frame. It doesn't tell us how many are free (and its
+// slots are its own business) so we count the frames that we've given it and haven't seen come back. Frames that aren't echoed are
+// given up on after INTERFACE_TX_ECHO_TIMEOUT_NS, so the worst we can do is hold back for that long. Not tried on real hardware yet.
+static int gsusb_tx_free(void* interface) {
+  int in_flight = (int)interface_tx_in_flight((struct milcan_a*)interface);
+  return (in_flight < GSUSB_MAX_TX_REQ) ? (GSUSB_MAX_TX_REQ - in_flight) : 0;
+}
+
+// libusb reports the device as gone once it has been unplugged.
+static int gsusb_connected(void* interface) {
+  return ((struct milcan_a*)interface)->gsusb_lost ? FALSE : TRUE;
+}
+
+static const struct milcan_backend gsusb_backend = {
+  .name = "GSUSB",
+  .open = gsusb_open,
+  .close = gsusb_close,
+  .send = gsusb_send,
+  .recv_batch = gsusb_recv_batch,
+  .tx_free = gsusb_tx_free,
+  .connected = gsusb_connected,
+};
+#endif  // MILCAN_NO_GSUSB
+
+// SocketCAN
+
+static int socketcan_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  char name[SOCKETCAN_NAME_LENGTH];
+  snprintf(name, sizeof(name), "%scan%u", (moduleNumber & CAN_INTERFACE_SOCKET_CAN_VIRTUAL) ? "v" : "", moduleNumber & ~CAN_INTERFACE_SOCKET_CAN_VIRTUAL);
+  LOGI(TAG, "Opening SocketCAN %s...", name);
+  if(socketcanOpen(&i->sock, name) != MILCAN_OK) {
+    return MILCAN_ERROR;
+  }
+  i->startup.driver_loaded = nanos();
+  i->startup.device_opened = i->startup.driver_loaded;
+  i->startup.bit_timing_set = i->startup.driver_loaded;  // The bit rate is set with ip link.
+  return MILCAN_OK;
+}
+
+static void socketcan_close(void* interface) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  socketcanFlush(&i->sock);
+  socketcanClose(&i->sock);
+}
+
+static int socketcan_send(void* interface, struct can_frame* frame) {
+  return socketcanWrite(&(((struct milcan_a*)interface)->sock), frame); // It goes with the rest of the batch in flush.
+}
+
+static int socketcan_send_batch(void* interface, struct can_frame* frames, int count) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < count) && (socketcanWrite(&i->sock, &(frames[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int socketcan_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < max) && (socketcanRead(&i->sock, &(frames[n]), &(rx_times[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int socketcan_flush(void* interface) {
+  return socketcanFlush(&(((struct milcan_a*)interface)->sock));
+}
+
+static int socketcan_tx_free(void* interface) {
+  return socketcanTxFree(&(((struct milcan_a*)interface)->sock));
+}
+
+static int socketcan_get_fd(void* interface) {
+  return ((struct milcan_a*)interface)->sock.fd;
+}
+
+static const struct milcan_backend socketcan_backend = {
+  .name = "SocketCAN",
+  .open = socketcan_open,
+  .close = socketcan_close,
+  .send = socketcan_send,
+  .send_batch = socketcan_send_batch,
+  .recv_batch = socketcan_recv_batch,
+  .flush = socketcan_flush,
+  .tx_free = socketcan_tx_free,
+  .get_fd = socketcan_get_fd,
+};
+
+// Virtual bus
+
+static int vbus_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  LOGI(TAG, "Attaching to virtual bus %u...", moduleNumber);
+  if(vbusAttach(&i->vbus, moduleNumber, speed) != MILCAN_OK) {
+    return MILCAN_ERROR;
+  }
+  i->startup.driver_loaded = nanos();
+  i->startup.device_opened = i->startup.driver_loaded;
+  i->startup.bit_timing_set = i->startup.driver_loaded;
+  return MILCAN_OK;
+}
+
+static void vbus_close(void* interface) {
+  vbusDetach(&(((struct milcan_a*)interface)->vbus));
+}
+
+static int vbus_send(void* interface, struct can_frame* frame) {
+  return vbusWrite(&(((struct milcan_a*)interface)->vbus), frame);
+}
+
+static int vbus_send_batch(void* interface, struct can_frame* frames, int count) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < count) && (vbusWrite(&i->vbus, &(frames[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int vbus_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < max) && (vbusRead(&i->vbus, &(frames[n]), &(rx_times[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int vbus_tx_free(void* interface) {
+  return vbusTxFree(&(((struct milcan_a*)interface)->vbus));
+}
+
+static uint64_t vbus_next_event(void* interface) {
+  return vbusNextEvent(&(((struct milcan_a*)interface)->vbus));
+}
+
+static int vbus_get_stats(void* interface, struct milcan_backend_stats* stats) {
+  stats->rx_dropped = ((struct milcan_a*)interface)->vbus.rx_dropped;
+  return MILCAN_OK;
+}
+
+static const struct milcan_backend vbus_backend = {
+  .name = "vbus",
+  .open = vbus_open,
+  .close = vbus_close,
+  .send = vbus_send,
+  .send_batch = vbus_send_batch,
+  .recv_batch = vbus_recv_batch,
+  .tx_free = vbus_tx_free,
+  .next_event = vbus_next_event,
+  .get_stats = vbus_get_stats,
+};
+
+// Shared memory bus
+
+static int shmbus_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  LOGI(TAG, "Attaching to shared bus %u...", moduleNumber);
+  if(shmbusAttach(&i->shm, moduleNumber, speed) != MILCAN_OK) {
+    return MILCAN_ERROR;
+  }
+  // Frames from other processes ring our doorbell, so sleep on that.
+  governorSetFutex(&(i->gov), shmbusDoorbell(&i->shm), &(i->shm.doorbell_seen));
+  i->startup.driver_loaded = nanos();
+  i->startup.device_opened = i->startup.driver_loaded;
+  i->startup.bit_timing_set = i->startup.driver_loaded;
+  return MILCAN_OK;
+}
+
+static void shmbus_close(void* interface) {
+  shmbusDetach(&(((struct milcan_a*)interface)->shm));
+}
+
+static int shmbus_send(void* interface, struct can_frame* frame) {
+  return shmbusWrite(&(((struct milcan_a*)interface)->shm), frame);
+}
+
+static int shmbus_send_batch(void* interface, struct can_frame* frames, int count) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < count) && (shmbusWrite(&i->shm, &(frames[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int shmbus_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < max) && (shmbusRead(&i->shm, &(frames[n]), &(rx_times[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static int shmbus_tx_free(void* interface) {
+  return shmbusTxFree(&(((struct milcan_a*)interface)->shm));
+}
+
+static uint64_t shmbus_next_event(void* interface) {
+  return shmbusNextEvent(&(((struct milcan_a*)interface)->shm));
+}
+
+static int shmbus_get_stats(void* interface, struct milcan_backend_stats* stats) {
+  stats->rx_dropped = ((struct milcan_a*)interface)->shm.rx_dropped;
+  return MILCAN_OK;
+}
+
+static const struct milcan_backend shmbus_backend = {
+  .name = "shmbus",
+  .open = shmbus_open,
+  .close = shmbus_close,
+  .send = shmbus_send,
+  .send_batch = shmbus_send_batch,
+  .recv_batch = shmbus_recv_batch,
+  .tx_free = shmbus_tx_free,
+  .next_event = shmbus_next_event,
+  .get_stats = shmbus_get_stats,
+};
+
+// Replay
+
+static int replay_open(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  LOGI(TAG, "Opening replay %u...", moduleNumber);
+  if(replayAttach(&i->replay, moduleNumber) != MILCAN_OK) {
+    return MILCAN_ERROR;
+  }
+  i->startup.driver_loaded = nanos();
+  i->startup.device_opened = i->startup.driver_loaded;
+  i->startup.bit_timing_set = i->startup.driver_loaded;
+  return MILCAN_OK;
+}
+
+static void replay_close(void* interface) {
+  replayDetach(&(((struct milcan_a*)interface)->replay));
+}
+
+// There's no bus to send on. Everything is taken (and dropped) so that the Tx Q never backs up.
+static int replay_send(void* interface, struct can_frame* frame) {
+  return MILCAN_OK;
+}
+
+static int replay_recv_batch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  int n = 0;
+  while((n < max) && (replayRead(&i->replay, &(frames[n]), &(rx_times[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static uint64_t replay_next_event(void* interface) {
+  return replayNextEvent(&(((struct milcan_a*)interface)->replay));
+}
+
+static int replay_get_stats(void* interface, struct milcan_backend_stats* stats) {
+  stats->rx_dropped = ((struct milcan_a*)interface)->replay.skipped;
+  return MILCAN_OK;
+}
+
+static const struct milcan_backend replay_backend = {
+  .name = "replay",
+  .open = replay_open,
+  .close = replay_close,
+  .send = replay_send,
+  .recv_batch = replay_recv_batch,
+  .next_event = replay_next_event,
+  .get_stats = replay_get_stats,
+};
+
+// The registry. Indexed by can_interface_type.
+
+static const struct milcan_backend* backends[MILCAN_MAX_BACKENDS] = {
+  [CAN_INTERFACE_SOCKET_CAN] = &socketcan_backend,
+  [CAN_INTERFACE_CANDO] = &cando_backend,
+#ifndef MILCAN_NO_GSUSB
+  [CAN_INTERFACE_GSUSB_SO] = &gsusb_backend,
+#endif
+  [CAN_INTERFACE_VBUS] = &vbus_backend,
+  [CAN_INTERFACE_SHMBUS] = &shmbus_backend,
+  [CAN_INTERFACE_REPLAY] = &replay_backend,
+};
+static pthread_mutex_t backendsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief Finds the backend for can_interface_type. Returns NULL if there isn't one.
+const struct milcan_backend* backendFind(uint8_t can_interface_type) {
+  const struct milcan_backend* backend = NULL;
+  if(can_interface_type < MILCAN_MAX_BACKENDS) {
+    pthread_mutex_lock(&backendsLock);
+    backend = backends[can_interface_type];
+    pthread_mutex_unlock(&backendsLock);
+  }
+  return backend;
+}
+
+/// @brief Adds (or with NULL, removes) the backend for can_interface_type. Returns MILCAN_OK or MILCAN_ERROR.
+int backendRegister(uint8_t can_interface_type, const struct milcan_backend* backend) {
+  int ret = MILCAN_ERROR;
+  if((can_interface_type == CAN_INTERFACE_NONE) || (can_interface_type >= MILCAN_MAX_BACKENDS)) {
+    LOGE(TAG, "Backends can only be registered for types 1 to %u.", MILCAN_MAX_BACKENDS - 1);
+    return MILCAN_ERROR;
+  }
+  if((backend != NULL) && ((backend->open == NULL) || (backend->close == NULL) || (backend->send == NULL) || (backend->recv_batch == NULL))) {
+    LOGE(TAG, "A backend must have open, close, send and recv_batch.");
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&backendsLock);
+  if((backend == NULL) || (backends[can_interface_type] == NULL)) {
+    backends[can_interface_type] = backend;
+    ret = MILCAN_OK;
+  } else {
+    // Log while we hold the lock, or it could be unregistered (and its name freed) under us.
+    const char* name = backends[can_interface_type]->name;
+    LOGE(TAG, "There is already a backend for type %u (%s).", can_interface_type, (name != NULL) ? name : "unnamed");
+  }
+  pthread_mutex_unlock(&backendsLock);
+  return ret;
+}
@@ -0,0 +1,14 @@
+// backends.h
+#ifndef __BACKENDS_H__
+#define __BACKENDS_H__
+
+#include <inttypes.h>
+#include "milcan.h"
+
+/// @brief Finds the backend for can_interface_type. Returns NULL if there isn't one.
+extern const struct milcan_backend* backendFind(uint8_t can_interface_type);
+
+/// @brief Adds (or with NULL, removes) the backend for can_interface_type. Returns MILCAN_OK or MILCAN_ERROR.
+extern int backendRegister(uint8_t can_interface_type, const struct milcan_backend* backend);
+
+#endif  // __BACKENDS_H__
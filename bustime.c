@@ -0,0 +1,106 @@
+// bustime.c
+#include <inttypes.h>
+#include <string.h>     /* String function definitions */
+#include "bustime.h"
+#include "utils/canbits.h"
+
+// Every frame on the bus (ours or anyone else's) uses up part of the PTU. We count them and hold back SRT and NRT frames that would take
+// the PTU past the ceiling, so that HRT frames and the next sync frame always have room.
+
+/// @brief Returns how long one bit takes (ns) at the MilCAN speed (MILCAN_A_250K, MILCAN_A_500K or MILCAN_A_1M).
+uint64_t busTimeBitNs(uint8_t speed) {
+  switch(speed) {
+    case MILCAN_A_250K:
+      return 4000;  // One bit is 4000ns long.
+    case MILCAN_A_500K:
+      return 2000;  // One bit is 2000ns long.
+    default:
+    case MILCAN_A_1M:
+      return 1000;  // One bit is 1000ns long.
+  }
+}
+
+/// @brief Returns the worst case number of bits (with bit stuffing and interframe space) that an extended ID frame with this DLC takes.
+uint32_t busTimeWorstBits(uint8_t dlc) {
+  return canBitsWorst(dlc);
+}
+
+/// @brief Returns the number of bits that this frame takes on the bus, including interframe space.
+uint32_t busTimeFrameBits(struct milcan_frame* frame) {
+  if(!(frame->frame.can_id & CAN_EFF_FLAG)) {
+    return canBitsWorst(frame->frame.len);  // MilCAN only uses extended IDs. A standard one can't be any longer than this.
+  }
+  return canBitsExtended(frame->frame.can_id & CAN_EFF_MASK, (frame->frame.can_id & CAN_RTR_FLAG) ? 1 : 0, frame->frame.len, frame->frame.data);
+}
+
+/// @brief Sets up the budget for our speed and PTU. ceiling_pc is the percentage of each PTU that SRT and NRT frames can fill.
+void busTimeInit(struct bus_budget* budget, uint8_t speed, uint64_t ptu_ns, uint8_t ceiling_pc) {
+  memset(budget, 0, sizeof(struct bus_budget));
+  budget->bit_ns = busTimeBitNs(speed);
+  budget->ptu_ns = ptu_ns;
+  budget->ptu_bits = (uint32_t)(ptu_ns / budget->bit_ns);
+  budget->reserve_bits = busTimeWorstBits(BUS_TIME_SYNC_DLC);
+  busTimeSetCeiling(budget, ceiling_pc);
+}
+
+/// @brief Changes the ceiling (percentage of each PTU).
+void busTimeSetCeiling(struct bus_budget* budget, uint8_t ceiling_pc) {
+  if(ceiling_pc > 100) {
+    ceiling_pc = 100;
+  }
+  budget->ceiling_bits = (uint32_t)(((uint64_t)budget->ptu_bits * ceiling_pc) / 100);
+}
+
+/// @brief Starts a new PTU at time now (i.e. a sync frame has been sent or received).
+void busTimeNewPTU(struct bus_budget* budget, uint64_t now) {
+  budget->last_ptu_bits = budget->committed_bits;
+  budget->ptu_start = now;
+  budget->committed_bits = 0;
+  budget->deferred = FALSE;
+}
+
+// If there hasn't been a sync frame (e.g. we're Pre-Operational) then carry on along the last PTU grid.
+static void busTimeRoll(struct bus_budget* budget, uint64_t now) {
+  if(now >= (budget->ptu_start + budget->ptu_ns)) {
+    busTimeNewPTU(budget, budget->ptu_start + (((now - budget->ptu_start) / budget->ptu_ns) * budget->ptu_ns));
+  }
+}
+
+/// @brief Adds a frame that has been sent or received to the current PTU.
+void busTimeCommit(struct bus_budget* budget, uint64_t now, uint32_t bits) {
+  busTimeRoll(budget, now);
+  budget->committed_bits += bits;
+}
+
+/// @brief Takes back a frame that was committed to the current PTU but never sent (e.g. the adapter wouldn't take it).
+void busTimeRefund(struct bus_budget* budget, uint64_t now, uint32_t bits) {
+  busTimeRoll(budget, now);
+  budget->committed_bits = (budget->committed_bits > bits) ? (budget->committed_bits - bits) : 0;
+}
+
+/// @brief Can a frame of this priority and size be sent now? HRT frames always can. Returns TRUE or FALSE.
+int busTimeAdmit(struct bus_budget* budget, uint64_t now, uint8_t priority, uint32_t bits) {
+  busTimeRoll(budget, now);
+  if(priority < BUS_TIME_DEFERRABLE_PRIORITY) {
+    return TRUE;
+  }
+  if((budget->committed_bits + bits + budget->reserve_bits) <= budget->ceiling_bits) {
+    return TRUE;
+  }
+  budget->deferred = TRUE;
+  return FALSE;
+}
+
+/// @brief Returns how busy the bus was during the last PTU, in percent.
+uint8_t busTimeLoad(struct bus_budget* budget) {
+  if(budget->ptu_bits == 0) {
+    return 0;
+  }
+  uint32_t load = (uint32_t)(((uint64_t)budget->last_ptu_bits * 100) / budget->ptu_bits);
+  return (load > 100) ? 100 : (uint8_t)load;
+}
+
+/// @brief When the next PTU starts (i.e. when deferred frames can be tried again).
+uint64_t busTimeNextPTU(struct bus_budget* budget) {
+  return budget->ptu_start + budget->ptu_ns;
+}
@@ -0,0 +1,58 @@
+// bustime.h
+#ifndef __BUSTIME_H__
+#define __BUSTIME_H__
+
+#include <inttypes.h>
+#include "milcan.h"
+
+#define BUS_TIME_DEFAULT_CEILING_PC   (80)  // By default SRT and NRT frames can't take the bus past 80% of a PTU.
+#define BUS_TIME_SYNC_DLC             (2)   // Sync frames carry the 2 byte sync counter.
+#define BUS_TIME_DEFERRABLE_PRIORITY  (4)   // SRT1. This priority and lower (SRT and NRT) can be held back.
+
+/// @brief Keeps track of how much of the current PTU the bus has been busy for.
+struct bus_budget {
+  uint64_t bit_ns;            // How long one bit takes at our speed.
+  uint64_t ptu_ns;            // The PTU.
+  uint32_t ptu_bits;          // How many bits fit in a PTU.
+  uint32_t ceiling_bits;      // SRT and NRT frames aren't admitted if they'd take the PTU past this.
+  uint32_t reserve_bits;      // Always kept free for the next sync frame.
+  uint64_t ptu_start;         // When the current PTU started.
+  uint32_t committed_bits;    // Bits seen on the bus (sent or received) so far this PTU.
+  uint32_t last_ptu_bits;     // Bits seen on the bus in the last PTU.
+  uint8_t deferred;           // Set if we've held back a frame this PTU.
+};
+
+/// @brief Returns how long one bit takes (ns) at the MilCAN speed (MILCAN_A_250K, MILCAN_A_500K or MILCAN_A_1M).
+extern uint64_t busTimeBitNs(uint8_t speed);
+
+/// @brief Returns the worst case number of bits (with bit stuffing and interframe space) that an extended ID frame with this DLC takes.
+extern uint32_t busTimeWorstBits(uint8_t dlc);
+
+/// @brief Returns the number of bits that this frame takes on the bus, including interframe space.
+extern uint32_t busTimeFrameBits(struct milcan_frame* frame);
+
+/// @brief Sets up the budget for our speed and PTU. ceiling_pc is the percentage of each PTU that SRT and NRT frames can fill.
+extern void busTimeInit(struct bus_budget* budget, uint8_t speed, uint64_t ptu_ns, uint8_t ceiling_pc);
+
+/// @brief Changes the ceiling (percentage of each PTU).
+extern void busTimeSetCeiling(struct bus_budget* budget, uint8_t ceiling_pc);
+
+/// @brief Starts a new PTU at time now (i.e. a sync frame has been sent or received).
+extern void busTimeNewPTU(struct bus_budget* budget, uint64_t now);
+
+/// @brief Adds a frame that has been sent or received to the current PTU.
+extern void busTimeCommit(struct bus_budget* budget, uint64_t now, uint32_t bits);
+
+/// @brief Takes back a frame that was committed to the current PTU but never sent (e.g. the adapter wouldn't take it).
+extern void busTimeRefund(struct bus_budget* budget, uint64_t now, uint32_t bits);
+
+/// @brief Can a frame of this priority and size be sent now? HRT frames always can. Returns TRUE or FALSE.
+extern int busTimeAdmit(struct bus_budget* budget, uint64_t now, uint8_t priority, uint32_t bits);
+
+/// @brief Returns how busy the bus was during the last PTU, in percent.
+extern uint8_t busTimeLoad(struct bus_budget* budget);
+
+/// @brief When the next PTU starts (i.e. when deferred frames can be tried again).
+extern uint64_t busTimeNextPTU(struct bus_budget* budget);
+
+#endif  // __BUSTIME_H__
@@ -0,0 +1,212 @@
+// capture.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>     /* String function definitions */
+#include <inttypes.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "capture.h"
+#include "milcan.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+
+#define TAG "capture"
+
+// Records every frame that the stack receives and sends in a pcapng file that Wireshark can read. Copying a frame into the ring is all
+// that the event thread does. A thread of our own turns the ring into pcapng blocks in a big buffer and writes that out in one go.
+
+#define PCAPNG_SHB            (0x0A0D0D0A)  // Section Header Block.
+#define PCAPNG_IDB            (0x00000001)  // Interface Description Block.
+#define PCAPNG_EPB            (0x00000006)  // Enhanced Packet Block.
+#define PCAPNG_BYTE_ORDER     (0x1A2B3C4D)
+#define PCAPNG_OPT_END        (0)
+#define PCAPNG_OPT_TSRESOL    (9)           // if_tsresol
+#define PCAPNG_OPT_EPB_FLAGS  (2)           // epb_flags
+#define PCAPNG_EPB_LENGTH     (28 + sizeof(struct can_frame) + 8 + 4 + 4)
+
+static void put32(uint8_t** p, uint32_t value) {
+  memcpy(*p, &value, sizeof(value));
+  *p += sizeof(value);
+}
+
+static void put16(uint8_t** p, uint16_t value) {
+  memcpy(*p, &value, sizeof(value));
+  *p += sizeof(value);
+}
+
+// Write out the buffer.
+static void captureWriteBuffer(struct capture* capture) {
+  uint8_t* p = capture->buffer;
+  while(capture->used > 0) {
+    ssize_t n = write(capture->fd, p, capture->used);
+    if(n <= 0) {
+      if(!capture->write_failed) {
+        LOGE(TAG, "Unable to write the capture file.");
+      }
+      capture->write_failed = TRUE;
+      break;
+    }
+    p += n;
+    capture->used -= n;
+  }
+  capture->used = 0;
+}
+
+// Add an Enhanced Packet Block for entry to the buffer. The CAN ID goes in network byte order, like SocketCAN's own captures.
+static void captureAddPacket(struct capture* capture, struct capture_entry* entry) {
+  uint8_t* p = capture->buffer + capture->used;
+  uint64_t stamp = entry->time + capture->clock_offset;
+  struct can_frame frame = entry->frame;
+  frame.can_id = htonl(frame.can_id);
+  put32(&p, PCAPNG_EPB);
+  put32(&p, PCAPNG_EPB_LENGTH);
+  put32(&p, 0); // Interface 0.
+  put32(&p, (uint32_t)(stamp >> 32));
+  put32(&p, (uint32_t)stamp);
+  put32(&p, sizeof(struct can_frame));
+  put32(&p, sizeof(struct can_frame));
+  memcpy(p, &frame, sizeof(struct can_frame));
+  p += sizeof(struct can_frame);
+  put16(&p, PCAPNG_OPT_EPB_FLAGS);
+  put16(&p, 4);
+  put32(&p, entry->direction);
+  put32(&p, PCAPNG_OPT_END);
+  put32(&p, PCAPNG_EPB_LENGTH);
+  capture->used += PCAPNG_EPB_LENGTH;
+}
+
+// Write everything that's in the ring. Returns how many frames there were.
+static uint64_t captureDrain(struct capture* capture) {
+  uint64_t tail = atomic_load_explicit(&(capture->tail), memory_order_relaxed);  // Only we change it
+  uint64_t head = atomic_load_explicit(&(capture->head), memory_order_acquire);
+  for(uint64_t n = tail; n < head; n++) {
+    if((capture->used + PCAPNG_EPB_LENGTH) > CAPTURE_BUFFER_SIZE) {
+      captureWriteBuffer(capture);
+    }
+    captureAddPacket(capture, &(capture->ring[n % CAPTURE_RING_SIZE]));
+    atomic_store_explicit(&(capture->tail), n + 1, memory_order_release);
+  }
+  capture->written += head - tail;
+  return head - tail;
+}
+
+static void* captureWriter(void* arg) {
+  struct capture* capture = (struct capture*)arg;
+  while(atomic_load(&(capture->run))) {
+    if(captureDrain(capture) == 0) {
+      captureWriteBuffer(capture);  // Don't keep frames back while it's quiet.
+      usleep(CAPTURE_IDLE_US);
+    }
+  }
+  captureDrain(capture);  // Anything added before we were stopped.
+  captureWriteBuffer(capture);
+  return NULL;
+}
+
+// The Section Header Block and the one Interface Description Block.
+static void captureAddHeader(struct capture* capture) {
+  uint8_t* p = capture->buffer;
+  put32(&p, PCAPNG_SHB);
+  put32(&p, 28);
+  put32(&p, PCAPNG_BYTE_ORDER);
+  put16(&p, 1); // Version 1.0
+  put16(&p, 0);
+  put32(&p, 0xFFFFFFFF);  // The section length isn't known.
+  put32(&p, 0xFFFFFFFF);
+  put32(&p, 28);
+
+  put32(&p, PCAPNG_IDB);
+  put32(&p, 32);
+  put16(&p, LINKTYPE_CAN_SOCKETCAN);
+  put16(&p, 0);
+  put32(&p, 0); // No snap length.
+  put16(&p, PCAPNG_OPT_TSRESOL);
+  put16(&p, 1);
+  put32(&p, 9); // Nanoseconds (the 9 and 3 bytes of padding).
+  put32(&p, PCAPNG_OPT_END);
+  put32(&p, 32);
+  capture->used = p - capture->buffer;
+}
+
+/// @brief Starts capturing to a new pcapng file at path (LINKTYPE_CAN_SOCKETCAN, nanosecond time stamps). Returns MILCAN_OK or MILCAN_ERROR.
+int captureStart(struct capture* capture, const char* path) {
+  struct timespec rt;
+  if(atomic_load(&(capture->enabled))) {
+    LOGE(TAG, "Already capturing.");
+    return MILCAN_ERROR;
+  }
+  if(capture->ring == NULL) {
+    capture->ring = calloc(CAPTURE_RING_SIZE, sizeof(struct capture_entry));
+    capture->buffer = malloc(CAPTURE_BUFFER_SIZE);
+    if((capture->ring == NULL) || (capture->buffer == NULL)) {
+      LOGE(TAG, "Unable to allocate the capture buffers.");
+      captureFree(capture);
+      return MILCAN_ERROR;
+    }
+  }
+  capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(capture->fd < 0) {
+    LOGE(TAG, "Unable to create %s.", path);
+    return MILCAN_ERROR;
+  }
+  clock_gettime(CLOCK_REALTIME, &rt);
+  capture->clock_offset = ((uint64_t)rt.tv_sec * 1000000000L) + rt.tv_nsec - nanos();
+  capture->written = 0;
+  capture->write_failed = FALSE;
+  captureAddHeader(capture);
+  // Anything left in the ring from an earlier capture was from before we started.
+  atomic_store(&(capture->tail), atomic_load(&(capture->head)));
+  atomic_store(&(capture->run), TRUE);
+  if(pthread_create(&(capture->writer), NULL, captureWriter, capture) != 0) {
+    LOGE(TAG, "Unable to start the capture writer.");
+    atomic_store(&(capture->run), FALSE);
+    close(capture->fd);
+    return MILCAN_ERROR;
+  }
+  atomic_store_explicit(&(capture->enabled), TRUE, memory_order_release);
+  return MILCAN_OK;
+}
+
+/// @brief Stops capturing, writes out everything that's been captured and closes the file. Returns MILCAN_OK or MILCAN_ERROR if the
+/// file couldn't be written.
+int captureStop(struct capture* capture) {
+  if(!atomic_load(&(capture->enabled))) {
+    return MILCAN_ERROR;
+  }
+  atomic_store(&(capture->enabled), FALSE);
+  atomic_store(&(capture->run), FALSE);
+  pthread_join(capture->writer, NULL);
+  if(close(capture->fd) != 0) {
+    capture->write_failed = TRUE;
+  }
+  LOGI(TAG, "Captured %lu frames.", capture->written);
+  return capture->write_failed ? MILCAN_ERROR : MILCAN_OK;
+}
+
+/// @brief Stops any capture and frees the ring.
+void captureFree(struct capture* capture) {
+  captureStop(capture);
+  free(capture->ring);
+  capture->ring = NULL;
+  free(capture->buffer);
+  capture->buffer = NULL;
+}
+
+/// @brief Adds a frame to the ring. Only call it from the event thread, and only while capture->enabled. Returns TRUE, or FALSE if the
+/// ring was full and the frame was dropped.
+int captureFrame(struct capture* capture, struct can_frame* frame, uint64_t time, uint32_t direction) {
+  uint64_t head = atomic_load_explicit(&(capture->head), memory_order_relaxed);  // Only we change it
+  if((head - atomic_load_explicit(&(capture->tail), memory_order_acquire)) >= CAPTURE_RING_SIZE) {
+    return FALSE;
+  }
+  struct capture_entry* entry = &(capture->ring[head % CAPTURE_RING_SIZE]);
+  entry->frame = *frame;
+  entry->time = time;
+  entry->direction = direction;
+  atomic_store_explicit(&(capture->head), head + 1, memory_order_release);
+  return TRUE;
+}
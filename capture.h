@@ -0,0 +1,57 @@
+// capture.h
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "can.h"
+
+#define CAPTURE_RING_SIZE     (8192)        // Frames waiting to be written. If the writer falls this far behind, frames are dropped.
+#define CAPTURE_BUFFER_SIZE   (256 * 1024)  // The writer's output buffer. It's written out whenever it's full or the ring is empty.
+#define CAPTURE_IDLE_US       (1000)        // How long the writer sleeps when there's nothing to write.
+
+#define CAPTURE_RX            (1)           // The direction of a frame, as in the pcapng epb_flags option.
+#define CAPTURE_TX            (2)
+
+#define LINKTYPE_CAN_SOCKETCAN  (227)
+
+/// @brief One frame on its way to the file.
+struct capture_entry {
+  struct can_frame frame;
+  uint64_t time;                          // nanos() time base.
+  uint32_t direction;                     // CAPTURE_RX or CAPTURE_TX.
+};
+
+/// @brief A pcapng capture of every frame an interface receives and sends. The event thread adds frames to the ring and the writer thread
+/// takes them off, so neither ever waits for the other.
+struct capture {
+  _Atomic uint8_t enabled;                // Is a capture running? The event thread checks this for every frame.
+  struct capture_entry* ring;             // CAPTURE_RING_SIZE entries. Allocated by the first captureStart() and kept until captureFree().
+  _Atomic uint64_t head;                  // The next entry to add. Only the event thread changes it.
+  _Atomic uint64_t tail;                  // The next entry to write. Only the writer changes it.
+  pthread_t writer;
+  _Atomic uint8_t run;                    // Cleared to stop the writer.
+  int fd;                                 // The file.
+  uint64_t clock_offset;                  // Add to a nanos() time to get the time since the epoch.
+  uint8_t* buffer;                        // CAPTURE_BUFFER_SIZE bytes of pcapng blocks waiting to be written.
+  size_t used;
+  uint64_t written;                       // Frames written to the file.
+  uint8_t write_failed;                   // Set if the file couldn't be written to. The writer carries on emptying the ring.
+};
+
+/// @brief Starts capturing to a new pcapng file at path (LINKTYPE_CAN_SOCKETCAN, nanosecond time stamps). Returns MILCAN_OK or MILCAN_ERROR.
+extern int captureStart(struct capture* capture, const char* path);
+
+/// @brief Stops capturing, writes out everything that's been captured and closes the file. Returns MILCAN_OK or MILCAN_ERROR if the
+/// file couldn't be written.
+extern int captureStop(struct capture* capture);
+
+/// @brief Stops any capture and frees the ring.
+extern void captureFree(struct capture* capture);
+
+/// @brief Adds a frame to the ring. Only call it from the event thread, and only while capture->enabled. Returns TRUE, or FALSE if the
+/// ring was full and the frame was dropped.
+extern int captureFrame(struct capture* capture, struct can_frame* frame, uint64_t time, uint32_t direction);
+
+#endif  // __CAPTURE_H__
@@ -0,0 +1,129 @@
+// governor.c
+#include <inttypes.h>
+#include <string.h>     /* String function definitions */
+#include <errno.h>      /* Error number definitions */
+#include <sched.h>
+#include <time.h>
+#include "governor.h"
+#include "utils/futex.h"
+#include "utils/timestamp.h"
+
+// None of the adapters can block until a frame arrives, so the event thread polls. Spinning all the time burns a core and a fixed sleep
+// adds latency. Instead we spin while frames are arriving, yield for a while once they stop, then sleep for longer and longer (up to
+// max_sleep_ns) but never past the next thing that the state machine has to do. Queuing a frame wakes us straight away.
+
+/// @brief Sets up the governor with the default timings.
+int governorInit(struct governor* gov) {
+  pthread_condattr_t attr;
+  memset(gov, 0, sizeof(struct governor));
+  governorSet(gov, GOVERNOR_DEFAULT_SPIN_NS, GOVERNOR_DEFAULT_YIELD_NS, GOVERNOR_DEFAULT_MAX_SLEEP_NS);
+  gov->sleep_ns = GOVERNOR_MIN_SLEEP_NS;
+  atomic_init(&(gov->sleeping), FALSE);
+  atomic_init(&(gov->kicked), FALSE);
+  if(pthread_mutex_init(&(gov->lock), NULL) != 0) {
+    return MILCAN_ERROR;
+  }
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);  // The same time base as nanos().
+  int ret = pthread_cond_init(&(gov->wake), &attr);
+  pthread_condattr_destroy(&attr);
+  if(ret != 0) {
+    pthread_mutex_destroy(&(gov->lock));
+    return MILCAN_ERROR;
+  }
+  return MILCAN_OK;
+}
+
+/// @brief Frees the governor's mutex and condition variable.
+void governorDestroy(struct governor* gov) {
+  pthread_cond_destroy(&(gov->wake));
+  pthread_mutex_destroy(&(gov->lock));
+}
+
+/// @brief Changes the timings.
+void governorSet(struct governor* gov, uint64_t spin_ns, uint64_t yield_ns, uint64_t max_sleep_ns) {
+  gov->spin_ns = spin_ns;
+  gov->yield_ns = yield_ns;
+  gov->max_sleep_ns = max_sleep_ns;
+}
+
+/// @brief Sleep on word (a futex that the adapter changes when a frame arrives, maybe from another process) rather than a condition
+/// variable. seen is where the adapter saves the word each time it finds nothing to read, so a frame that arrives after that wakes us.
+void governorSetFutex(struct governor* gov, _Atomic uint32_t* word, uint32_t* seen) {
+  gov->futex_seen = seen;
+  gov->futex = word;
+}
+
+/// @brief A pass of the loop found something to do (e.g. received a frame). Go back to spinning.
+void governorBusy(struct governor* gov, uint64_t now) {
+  gov->last_busy = now;
+  gov->sleep_ns = GOVERNOR_MIN_SLEEP_NS;
+}
+
+/// @brief A pass of the loop found nothing to do. Spin, yield or sleep (until deadline at the latest) and count it in stats.
+void governorIdle(struct governor* gov, struct milcan_stats* stats, uint64_t now, uint64_t deadline) {
+  uint64_t idle = (now > gov->last_busy) ? (now - gov->last_busy) : 0;
+
+  if((idle < gov->spin_ns) || (deadline <= now)) {
+    stats->gov_spins++;
+    return;
+  }
+  if((idle < (gov->spin_ns + gov->yield_ns)) || (gov->max_sleep_ns == 0)) {
+    stats->gov_yields++;
+    sched_yield();
+    return;
+  }
+
+  uint64_t sleep_ns = gov->sleep_ns;
+  if(sleep_ns > gov->max_sleep_ns) sleep_ns = gov->max_sleep_ns;
+  if(sleep_ns > (deadline - now)) sleep_ns = deadline - now;
+  uint64_t start = nanos();
+  uint64_t wake_ns = start + sleep_ns;
+  struct timespec wake;
+  wake.tv_sec = wake_ns / 1000000000L;
+  wake.tv_nsec = wake_ns % 1000000000L;
+
+  // governorWake() sets kicked before it looks at sleeping, and we set sleeping before we look at kicked, so a wake up can't be lost.
+  if(gov->futex != NULL) {
+    // The same again, but governorWake() changes the word so that the wait returns straight away.
+    atomic_store(&(gov->sleeping), TRUE);
+    if(!atomic_load(&(gov->kicked))) {
+      futexWait(gov->futex, *(gov->futex_seen), sleep_ns);
+    }
+    atomic_store(&(gov->sleeping), FALSE);
+  } else {
+    int ret = 0;
+    pthread_mutex_lock(&(gov->lock));
+    atomic_store(&(gov->sleeping), TRUE);
+    while(!atomic_load(&(gov->kicked)) && (ret == 0)) {
+      ret = pthread_cond_timedwait(&(gov->wake), &(gov->lock), &wake);
+    }
+    atomic_store(&(gov->sleeping), FALSE);
+    pthread_mutex_unlock(&(gov->lock));
+  }
+
+  uint64_t woke = nanos();
+  stats->gov_wakeups++;
+  stats->gov_sleep_ns += woke - start;
+  if(atomic_exchange(&(gov->kicked), FALSE)) {
+    stats->gov_kicks++;
+    governorBusy(gov, woke);  // Something's been queued, so expect more.
+  } else if(gov->sleep_ns < gov->max_sleep_ns) {
+    gov->sleep_ns *= 2;
+  }
+}
+
+/// @brief Wakes the event thread if it's asleep (e.g. a frame has been queued). Safe to call from any thread.
+void governorWake(struct governor* gov) {
+  atomic_store(&(gov->kicked), TRUE);
+  if(atomic_load(&(gov->sleeping))) {
+    if(gov->futex != NULL) {
+      atomic_fetch_add(gov->futex, 1);
+      futexWake(gov->futex);
+    } else {
+      pthread_mutex_lock(&(gov->lock));
+      pthread_cond_signal(&(gov->wake));
+      pthread_mutex_unlock(&(gov->lock));
+    }
+  }
+}
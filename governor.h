@@ -0,0 +1,52 @@
+// governor.h
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "milcan.h"
+
+#define GOVERNOR_DEFAULT_SPIN_NS        (50000)     // Keep polling flat out for 50us after the last frame,
+#define GOVERNOR_DEFAULT_YIELD_NS       (200000)    // then poll with sched_yield() for another 200us,
+#define GOVERNOR_MIN_SLEEP_NS           (10000)     // then sleep, starting at 10us
+#define GOVERNOR_DEFAULT_MAX_SLEEP_NS   (1000000)   // and doubling up to 1ms.
+
+/// @brief Decides what the event thread does when a pass of the loop had nothing to do: spin, yield or sleep.
+struct governor {
+  uint64_t spin_ns;           // How long to spin for after the last busy pass. UINT64_MAX always spins.
+  uint64_t yield_ns;          // How long to yield for after that.
+  uint64_t max_sleep_ns;      // The longest sleep. 0 yields rather than sleeping.
+  uint64_t last_busy;         // When the last busy pass was.
+  uint64_t sleep_ns;          // How long the next sleep will be.
+  pthread_mutex_t lock;       // Protects the sleep.
+  pthread_cond_t wake;        // Signalled by governorWake().
+  atomic_int sleeping;        // Set while the event thread is (about to be) asleep.
+  atomic_int kicked;          // Set by governorWake().
+  _Atomic uint32_t* futex;    // If set, sleep on this word rather than wake (see governorSetFutex()).
+  uint32_t* futex_seen;       // What the word was when the adapter last found nothing to read.
+};
+
+/// @brief Sets up the governor with the default timings.
+extern int governorInit(struct governor* gov);
+
+/// @brief Frees the governor's mutex and condition variable.
+extern void governorDestroy(struct governor* gov);
+
+/// @brief Changes the timings.
+extern void governorSet(struct governor* gov, uint64_t spin_ns, uint64_t yield_ns, uint64_t max_sleep_ns);
+
+/// @brief Sleep on word (a futex that the adapter changes when a frame arrives, maybe from another process) rather than a condition
+/// variable. seen is where the adapter saves the word each time it finds nothing to read, so a frame that arrives after that wakes us.
+extern void governorSetFutex(struct governor* gov, _Atomic uint32_t* word, uint32_t* seen);
+
+/// @brief A pass of the loop found something to do (e.g. received a frame). Go back to spinning.
+extern void governorBusy(struct governor* gov, uint64_t now);
+
+/// @brief A pass of the loop found nothing to do. Spin, yield or sleep (until deadline at the latest) and count it in stats.
+extern void governorIdle(struct governor* gov, struct milcan_stats* stats, uint64_t now, uint64_t deadline);
+
+/// @brief Wakes the event thread if it's asleep (e.g. a frame has been queued). Safe to call from any thread.
+extern void governorWake(struct governor* gov);
+
+#endif  // __GOVERNOR_H__
@@ -4,6 +4,10 @@
 #include "libusb.h"
 #include "can.h"
 
+#ifndef __packed
+#define __packed  __attribute__((packed)) // FreeBSD's sys/cdefs.h defines this but glibc's doesn't.
+#endif
+
 // We only send a maximum of GSUSB_MAX_TX_REQ per channel at any one time.
 // We keep track of how many are in play at a time by setting the echo_id and
 // looking for it when it comes back.
@@ -8,7 +8,9 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h>
 #include <sys/un.h>     // ?
+#ifndef __linux__
 #include <sys/event.h>  // Events
+#endif
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
@@ -21,14 +23,14 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>   // mlockall()
 #include "interfaces.h"
 #include "txq.h"
 // #define LOG_LEVEL 3
 #include "utils/logs.h"
 #include "utils/timestamp.h"
-#include "CANdoImport.h"
-#include "CANdoC.h"
 #include "gsusb.h"
+#include "backends.h"
 
 #define TAG "Interfaces"
 
@@ -37,9 +39,9 @@ void print_milcan_frame(const char* tag, struct milcan_frame *frame, const char
 
   if(frame->frame.can_id & CAN_ERR_FLAG) {
     fd = stderr;
-    fprintf(fd, "%lu: ERROR: %s: %s() line %i: %s: ID: ", nanos(), __FILE__, __FUNCTION__, __LINE__, tag);
+    fprintf(fd, "%lu: ERROR: %s: %s() line %i: %s: ID: ", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag);
   } else {
-    fprintf(fd, "%lu:  INFO: %s: %s() line %i: %s: ID: ", nanos(), __FILE__, __FUNCTION__, __LINE__, tag);
+    fprintf(fd, "%lu:  INFO: %s: %s() line %i: %s: ID: ", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag);
   }
 
   if((frame->frame.can_id & CAN_EFF_FLAG) || (frame->frame.can_id & CAN_ERR_FLAG)) {
@@ -58,7 +60,7 @@ void print_milcan_frame(const char* tag, struct milcan_frame *frame, const char
   }
 
   if(frame->mortal > 0) {
-    fprintf(fd, ", mortal: %10luns remaining", nanos() - frame->mortal);
+    fprintf(fd, ", mortal: %10luns remaining", nanos_fast() - frame->mortal);
   }
 
   va_list args;
@@ -82,21 +84,28 @@ struct milcan_a* interface_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t so
   } else {
     interface->sourceAddress = sourceAddress;
     interface->can_interface_type = can_interface_type;
+    interface->moduleNumber = moduleNumber;
     interface->speed = speed;
     interface->sync = 0xFFFF;
     interface->syncTimer = nanos();
     interface->sync_freq_hz = sync_freq_hz;
     interface->sync_time_ns = (uint64_t) (1000000000L/sync_freq_hz);
+    syncEstInit(&(interface->sync_est), interface->sync_time_ns);
+    busTimeInit(&(interface->budget), speed, interface->sync_time_ns, BUS_TIME_DEFAULT_CEILING_PC);
+    governorInit(&(interface->gov));
+    interface->standby_grace_ns = MILCAN_HOT_STANDBY_GRACE_FRAMES * busTimeWorstBits(CAN_MAX_DLEN) * busTimeBitNs(speed);
+    if(interface->standby_grace_ns < SYNC_PERIOD_PC(interface->sync_time_ns, MILCAN_HOT_STANDBY_GRACE_PC)) {
+      interface->standby_grace_ns = SYNC_PERIOD_PC(interface->sync_time_ns, MILCAN_HOT_STANDBY_GRACE_PC);
+    }
     interface->current_sync_master = 0;
+    interface->sock.fd = -1;
     interface->rfdfifo = -1;
     interface->wfdfifo = -1;
     interface->options = options;
     interface->mode = MILCAN_A_MODE_POWER_OFF;
-    interface->rxThreadId = NULL;
+    interface->rxThreadRunning = FALSE;
     interface->eventRunFlag = FALSE;
-    interface->rx.rxBufferMutex = NULL;
     interface->rx.write_offset = 0;
-    interface->tx.txBufferMutex = NULL;
     for(uint8_t i = 0; i < MILCAN_ID_PRIORITY_COUNT; i++) {
       interface->tx.tx_queue[i] = NULL;
     }
@@ -107,67 +116,26 @@ struct milcan_a* interface_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t so
 
     // interface_display_mode(interface);
 
-    switch (can_interface_type)
-    {
-      case CAN_INTERFACE_CANDO:
-        LOGI(TAG, "Opening CANdo (%u)...", moduleNumber);
-        // unsigned char status = CANdoInitialise();
-        unsigned char status = CANdoInitialise2();
-        if(status) {
-          CANdoConnect(moduleNumber);  // Open a connection to a CANdo device
-          if(CANdoUSBStatus()->OpenFlag) {
-            LOGI(TAG, "CANdo is open.");
-          } else {
-            LOGE(TAG, "CANdo is not open!");
-            interface = interface_close(interface);
-          }
-          if((interface != NULL) && (FALSE == CANdoStart(interface->speed))) {  // Set baud rate to 500k
-            LOGE(TAG, "Unable to set CANdo baud rate!");
-            interface = interface_close(interface);
-          }
-        } else {
-          LOGE(TAG, "CANdo API library not found!");
-          interface = interface_close(interface);
-          break;
-        }
-        break;
-      case CAN_INTERFACE_GSUSB_SO:
-        LOGI(TAG, "Opening GSUSB (%u)...", moduleNumber);
-        
-        int rep = gsusbInit(&interface->ctx);
-        if(rep == GSUSB_OK) {
-          switch(interface->speed) {
-            case MILCAN_A_250K:
-              rep = gsusbOpen(&interface->ctx, moduleNumber, 6, 7, 2, 1, 12); // Sample point: 87.5%
-              break;
-            case MILCAN_A_500K:
-              rep = gsusbOpen(&interface->ctx, moduleNumber, 6, 7, 2, 1, 6); // Sample point: 87.5%
-              break;
-            case MILCAN_A_1M:
-              rep = gsusbOpen(&interface->ctx, moduleNumber, 6, 7, 2, 1, 3); // Sample point: 87.5%
-              break;        
-          }
-          if(rep != GSUSB_OK) {
-            gsusbExit(&interface->ctx);
-          }
-        }
-        if(rep == GSUSB_OK) {
-          LOGI(TAG, "Device opened!");
-        } else {
-          LOGE(TAG, "Error opening!");
-          interface = interface_close(interface);
-        }
-        break;
-      default:
-        LOGE(TAG, "CAN interface type is unrecognised or unsupported.");
-        interface = interface_close(interface);
-        break;
+    const struct milcan_backend* backend = backendFind(can_interface_type);
+    if(backend == NULL) {
+      LOGE(TAG, "CAN interface type is unrecognised or unsupported.");
+      interface = interface_close(interface);
+    } else if(backend->open(interface, moduleNumber, speed) != MILCAN_OK) {
+      interface = interface_close(interface);
+    } else {
+      interface->backend = backend;
+      // A backend that doesn't record its own startup times was ready as soon as open() returned.
+      uint64_t now = nanos();
+      if(interface->startup.driver_loaded == 0) interface->startup.driver_loaded = now;
+      if(interface->startup.device_opened == 0) interface->startup.device_opened = now;
+      if(interface->startup.bit_timing_set == 0) interface->startup.bit_timing_set = now;
     }
   }
 
   if(interface != NULL) {
     pthread_mutex_init(&(interface->rx.rxBufferMutex), NULL);  // Init. mutex
     pthread_mutex_init(&(interface->tx.txBufferMutex), NULL);  // Init. mutex
+    pthread_mutex_init(&(interface->commands.lock), NULL);
   }
 
   return interface;
@@ -176,15 +144,26 @@ struct milcan_a* interface_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t so
 struct milcan_a* interface_close(struct milcan_a* interface) {
   if(interface != NULL) {
     interface->eventRunFlag = FALSE;
-    switch(interface->can_interface_type) {
-      case CAN_INTERFACE_CANDO:
-        CANdoCloseAndFinalise();
-        break;
-      case CAN_INTERFACE_GSUSB_SO:
-        gsusbExit(&interface->ctx);
-        break;
+    if(interface->rxThreadRunning) {
+      governorWake(&(interface->gov));  // Don't wait for it to finish sleeping.
+      pthread_join(interface->rxThreadId, NULL);
+      interface->rxThreadRunning = FALSE;
     }
+    if(interface->reconnectRunning) {
+      atomic_store(&(interface->reconnectRun), FALSE);
+      pthread_join(interface->reconnectThreadId, NULL);
+      interface->reconnectRunning = FALSE;
+    }
+    if(interface->backend != NULL) {
+      if(atomic_load(&(interface->link)) != INTERFACE_LINK_DOWN) {  // If it's down, the reconnect thread has already closed it.
+        interface->backend->close(interface);
+      }
+      interface->backend = NULL;
+    }
+    captureFree(&(interface->capture));
     LOGI(TAG, "Freeing memory...");
+    txQPoolFree(interface);
+    governorDestroy(&(interface->gov));
     free(interface);
     interface = NULL;
     LOGI(TAG, "Done.");
@@ -192,36 +171,197 @@ struct milcan_a* interface_close(struct milcan_a* interface) {
   return interface;
 }
 
+// Is the adapter there? Only ever FALSE with MILCAN_A_OPTION_AUTO_RECONNECT, while the reconnect thread is reopening it.
+static inline int interface_link_up(struct milcan_a* interface) {
+  return (atomic_load_explicit(&(interface->link), memory_order_acquire) == INTERFACE_LINK_UP) ? TRUE : FALSE;
+}
+
+// Reopen the adapter (MILCAN_A_OPTION_AUTO_RECONNECT). Everything else about the interface is left as it is. Only this thread touches the
+// backend until the link is RESTORED.
+static void* interface_reconnect(void* arg) {
+  struct milcan_a* interface = (struct milcan_a*)arg;
+  struct milcan_startup_times startup = interface->startup;  // open() would overwrite the first three.
+  uint64_t backoff = INTERFACE_RECONNECT_MIN_NS;
+
+  interface->backend->close(interface); // What's left of it.
+  while(atomic_load(&(interface->reconnectRun))) {
+    interface->stats.reconnect_attempts++;
+    if(interface->backend->open(interface, interface->moduleNumber, interface->speed) == MILCAN_OK) {
+      interface->startup.driver_loaded = startup.driver_loaded;
+      interface->startup.device_opened = startup.device_opened;
+      interface->startup.bit_timing_set = startup.bit_timing_set;
+      atomic_store_explicit(&(interface->link), INTERFACE_LINK_RESTORED, memory_order_release);
+      governorWake(&(interface->gov));
+      return NULL;
+    }
+    uint64_t until = nanos() + backoff;
+    while(atomic_load(&(interface->reconnectRun)) && (nanos() < until)) {
+      usleep(INTERFACE_RECONNECT_SLICE_US);
+    }
+    backoff = ((backoff * 2) < INTERFACE_RECONNECT_MAX_NS) ? (backoff * 2) : INTERFACE_RECONNECT_MAX_NS;
+  }
+  return NULL;
+}
+
+// Called by the event thread at the start of each pass. With MILCAN_A_OPTION_AUTO_RECONNECT, spots the adapter going and starts the
+// reconnect thread, and picks the adapter back up once it has been reopened. The Tx Q, the schedule, the sync state and everything else
+// are kept. Returns MILCAN_ADAPTER_LOST or MILCAN_ADAPTER_RESTORED if that has just happened, else 0.
+int interface_link_check(struct milcan_a* interface) {
+  if(!(interface->options & MILCAN_A_OPTION_AUTO_RECONNECT)) {
+    return 0;
+  }
+  switch(atomic_load_explicit(&(interface->link), memory_order_acquire)) {
+    case INTERFACE_LINK_UP:
+      if((interface->backend->connected == NULL) || interface->backend->connected(interface)) {
+        return 0;
+      }
+      LOGW(TAG, "The %s adapter has gone. Reopening it...", interface->backend->name);
+      atomic_store(&(interface->link), INTERFACE_LINK_DOWN);
+      atomic_store(&(interface->reconnectRun), TRUE);
+      if(pthread_create(&(interface->reconnectThreadId), NULL, interface_reconnect, interface) != 0) {
+        LOGE(TAG, "Unable to start the reconnect thread.");
+        atomic_store(&(interface->reconnectRun), FALSE);
+        atomic_store(&(interface->link), INTERFACE_LINK_UP);  // We'll try again next pass.
+        return 0;
+      }
+      interface->reconnectRunning = TRUE;
+      interface->outage_start = nanos_cached();
+      interface->stats.adapter_lost++;
+      return MILCAN_ADAPTER_LOST;
+    case INTERFACE_LINK_RESTORED:
+      pthread_join(interface->reconnectThreadId, NULL);
+      interface->reconnectRunning = FALSE;
+      uint64_t outage = nanos_cached() - interface->outage_start;
+      interface->stats.reconnects++;
+      interface->stats.outage_last_ns = outage;
+      interface->stats.outage_total_ns += outage;
+      if(outage > interface->stats.outage_max_ns) {
+        interface->stats.outage_max_ns = outage;
+      }
+      // We won't see the echoes of frames sent on the old connection now.
+      for(uint32_t n = 0; n < interface->inflight_count; n++) {
+        if(interface->inflight[n].notify) {
+          interface->stats.tx_unconfirmed++;
+        }
+      }
+      interface->inflight_count = 0;
+      LOGI(TAG, "The %s adapter is back after %lums.", interface->backend->name, outage / 1000000);
+      atomic_store(&(interface->link), INTERFACE_LINK_UP);
+      return MILCAN_ADAPTER_RESTORED;
+  }
+  return 0;
+}
+
+// Copy a frame to the capture ring, if we're capturing.
+static inline void interface_capture(struct milcan_a* interface, struct can_frame* frame, uint64_t time, uint32_t direction) {
+  if(atomic_load_explicit(&(interface->capture.enabled), memory_order_acquire)) {
+    if(!captureFrame(&(interface->capture), frame, time, direction)) {
+      interface->stats.capture_dropped++;
+    }
+  }
+}
+
+// Start recording every frame received and sent to a pcapng file.
+int interface_capture_start(struct milcan_a* interface, const char* path) {
+  return captureStart(&(interface->capture), path);
+}
+
+// Stop recording and close the file.
+int interface_capture_stop(struct milcan_a* interface) {
+  return captureStop(&(interface->capture));
+}
+
 int interface_send(struct milcan_a* interface, struct milcan_frame * frame) {
-  // ssize_t ret = -1;
   int rep = FALSE;
-  uint32_t id;
-  uint8_t extended = 0;
 
   // print_milcan_frame(TAG, frame, "PIPE OUT");
-  switch(interface->can_interface_type) {
-    case CAN_INTERFACE_CANDO:
-      id = frame->frame.can_id;
-      if(frame->frame.can_id & CAN_EFF_FLAG) {
-        id &= CAN_EFF_MASK;
-        extended = 1;
-      } else {
-        id &= CAN_SFF_MASK;
-      }
-      rep= CANdoTx(extended, id, frame->frame.len, frame->frame.data);
-      break;
+  if(interface_link_up(interface) && interface->backend->send(interface, &(frame->frame)) == MILCAN_OK) {
+    rep = TRUE;
+    busTimeCommit(&(interface->budget), nanos_cached(), busTimeFrameBits(frame));
+    interface_capture(interface, &(frame->frame), nanos_cached(), CAPTURE_TX);
+  }
+  return rep;
+}
+
+static void interface_tx_track(struct milcan_a* interface, struct milcan_frame* frame, uint8_t notify);
 
-    case CAN_INTERFACE_GSUSB_SO:
-      if(GSUSB_OK == gsusbWrite(&interface->ctx, &(frame->frame))) {
-        rep = TRUE;
+// Send a system frame (sync or enter/exit config). These can use the reserved Tx slots and are retried a few times rather than dropped.
+int interface_send_system(struct milcan_a* interface, struct milcan_frame * frame) {
+  if(!interface_link_up(interface)) {
+    return FALSE; // There's nothing to retry with.
+  }
+  for(int attempt = 0; attempt < MILCAN_SYSTEM_TX_ATTEMPTS; attempt++) {
+    if(attempt > 0) {
+      interface->stats.system_tx_retries++;
+      uint64_t until = nanos_fast() + MILCAN_SYSTEM_TX_RETRY_NS;
+      while(nanos_fast() < until);  // Give the adapter a moment to finish something. Spin so we don't lose the CPU.
+    }
+    if(interface_send(interface, frame) == TRUE) {
+      if(interface->count_tx_echoes) {
+        interface_tx_track(interface, frame, FALSE);  // It's using one of the adapter's slots until it's echoed.
       }
-      break;
+      interface_flush(interface); // Don't wait for the end of the pass.
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
 
-    default:
-      LOGE(TAG, "CAN interface type is unrecognised or unsupported.");
-      break;
+// Send anything that's been batched up. Called at the end of each pass of the event loop.
+void interface_flush(struct milcan_a* interface) {
+  if((interface->backend->flush != NULL) && interface_link_up(interface)) {
+    interface->backend->flush(interface);
   }
-  return rep;
+}
+
+// When the backend next has something for us without being asked (e.g. a frame finishing on a virtual bus). The event thread mustn't
+// sleep past it. UINT64_MAX for real adapters.
+uint64_t interface_next_event(struct milcan_a* interface) {
+  if((interface->backend->next_event != NULL) && interface_link_up(interface)) {
+    return interface->backend->next_event(interface);
+  }
+  return UINT64_MAX;
+}
+
+// "Now" for anything that the application's threads call. The event loop uses nanos_cached(), but an application thread may never
+// tick, so its cached time can be anything. A MILCAN_A_OPTION_NO_THREAD interface runs on the time last given to milcan_poll() (which
+// may not be our clock) and until then, like every other interface, on the clock.
+uint64_t interface_now(struct milcan_a* interface) {
+  if(interface->options & MILCAN_A_OPTION_NO_THREAD) {
+    uint64_t polled = atomic_load(&(interface->poll_now));
+    if(polled != 0) {
+      return polled;
+    }
+  }
+  return nanos_fast();
+}
+
+// How many more frames can the adapter take right now?
+int interface_tx_slots_free(struct milcan_a* interface) {
+  if(!interface_link_up(interface)) {
+    return 0;
+  }
+  if(interface->backend->tx_free != NULL) {
+    return interface->backend->tx_free(interface);
+  }
+  return GSUSB_MAX_TX_REQ; // We can't see how busy it is.
+}
+
+// A file descriptor that becomes readable when frames arrive, or -1.
+int interface_get_fd(struct milcan_a* interface) {
+  if((interface->backend->get_fd != NULL) && interface_link_up(interface)) {
+    return interface->backend->get_fd(interface);
+  }
+  return -1;
+}
+
+// Read the backend's own counters. Backends that don't keep any read as 0.
+int interface_get_backend_stats(struct milcan_a* interface, struct milcan_backend_stats* stats) {
+  memset(stats, 0, sizeof(struct milcan_backend_stats));
+  if((interface->backend->get_stats != NULL) && interface_link_up(interface)) {
+    return interface->backend->get_stats(interface, stats);
+  }
+  return MILCAN_OK;
 }
 
 // void interface_add_to_rx_buffer(struct milcan_a* interface, struct milcan_frame *frame) {
@@ -287,27 +427,32 @@ uint16_t interface_rx_buffer_size(struct milcan_a* interface) {
 
 // Check the interface queue and return anything found.
 int interface_handle_rx(struct milcan_a* interface, struct milcan_frame* frame) {
-  int ret = MILCAN_ERROR_EOF;
+  struct interface_rx_batch* batch = &(interface->rx_batch);
   frame->frame_type = MILCAN_FRAME_TYPE_MESSAGE;
   frame->mortal = 0;
-  
-  switch(interface->can_interface_type) {
-    case CAN_INTERFACE_CANDO:
-      CANdoRx();
-      if(TRUE == CANdoReadRxQueue(&(frame->frame))) {
-        ret = MILCAN_OK;
-        // interface_handle_rx_message(interface, frame);
-      }
-      break;
-    case CAN_INTERFACE_GSUSB_SO:
-      if(GSUSB_OK == gsusbRead(&interface->ctx, &(frame->frame))) {
-        ret = MILCAN_OK;
-        // interface_handle_rx_message(interface, frame);
-      }
-      break;
+  frame->rx_timestamp = 0;
+
+  if(batch->next >= batch->count) {
+    if(!interface_link_up(interface)) {
+      return MILCAN_ERROR_EOF;
+    }
+    batch->next = 0;
+    batch->count = interface->backend->recv_batch(interface, batch->frames, batch->rx_times, INTERFACE_RX_BATCH);
+    if(batch->count <= 0) {
+      batch->count = 0;
+      return MILCAN_ERROR_EOF;
+    }
   }
+  memcpy(&(frame->frame), &(batch->frames[batch->next]), sizeof(struct can_frame));
+  frame->rx_timestamp = batch->rx_times[batch->next];
+  batch->next++;
+  interface_capture(interface, &(frame->frame), (frame->rx_timestamp != 0) ? frame->rx_timestamp : nanos_cached(), CAPTURE_RX);
+  return MILCAN_OK;
+}
 
-  return ret;
+// Are there frames read from the backend that haven't been handled yet?
+uint8_t interface_rx_pending(struct milcan_a* interface) {
+  return (interface->rx_batch.next < interface->rx_batch.count) ? TRUE : FALSE;
 }
 
 // void interface_display_mode(struct milcan_a* interface) {
@@ -336,25 +481,266 @@ int interface_tx_add_to_q(struct milcan_a* interface, struct milcan_frame *frame
   // CFG messages, etc should be controlled by check sync.
   // Will need a state to keep track of sending a CFG mesage and how far through we are.
 
-  struct milcan_frame *frame2 = calloc(sizeof(struct milcan_frame), 1);
+  int ret = 0;
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  struct milcan_frame *frame2 = txQFrameAlloc(interface);
   if(frame2 == NULL) {
-    return ENOMEM;
+    ret = ENOMEM;
+  } else {
+    memcpy(frame2, frame, sizeof(struct milcan_frame));
+    frame2->tx_queued = interface_now(interface);
+    ret = txQAdd(interface, frame2);
+    if(ret != 0) {
+      txQFrameFree(interface, frame2);
+    }
   }
-  memcpy(frame2, frame, sizeof(struct milcan_frame));
-  pthread_mutex_lock(&(interface->tx.txBufferMutex));
-  txQAdd(interface, frame2);
   pthread_mutex_unlock(&(interface->tx.txBufferMutex));
-  return 0;
+  return ret;
 }
 
+static struct milcan_frame * interface_tx_take_q(struct milcan_a* interface);
+
 struct milcan_frame * interface_tx_read_q(struct milcan_a* interface) {
+  if(interface_tx_slots_free(interface) <= MILCAN_SYSTEM_TX_RESERVE) {
+    return NULL;  // What's left is kept for system frames.
+  }
+  return interface_tx_take_q(interface);
+}
+
+// Take the next frame that the bus time budget lets us send from the Tx Q, without checking that the adapter has room for it.
+static struct milcan_frame * interface_tx_take_q(struct milcan_a* interface) {
   struct milcan_frame *frame = NULL;
 
   pthread_mutex_lock(&(interface->tx.txBufferMutex));
   for(int i = 0; (i < MILCAN_ID_PRIORITY_COUNT) && (frame == NULL); i++) {
-    frame = txQRead(interface, i);
+    frame = txQPeek(interface, i);
+    if(frame != NULL) {
+      // Hold back SRT and NRT frames that won't fit in this PTU. Everything lower priority has to wait too.
+      uint8_t deferred = interface->budget.deferred;
+      if(busTimeAdmit(&(interface->budget), nanos_cached(), i, busTimeFrameBits(frame)) == FALSE) {
+        if(deferred == FALSE) {
+          interface->stats.tx_deferred++;
+        }
+        frame = NULL;
+        break;
+      }
+      frame = txQRead(interface, i);
+    }
   }
   pthread_mutex_unlock(&(interface->tx.txBufferMutex));
 
   return frame;
-}
\ No newline at end of file
+}
+
+// Is there anything waiting in the Tx Q that can be sent? While the adapter is gone it has to wait.
+int interface_tx_pending(struct milcan_a* interface) {
+  int ret = FALSE;
+
+  if(!interface_link_up(interface)) {
+    return FALSE;
+  }
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  for(int i = 0; (i < MILCAN_ID_PRIORITY_COUNT) && (ret == FALSE); i++) {
+    if(interface->tx.tx_queue[i] != NULL) {
+      ret = TRUE;
+    }
+  }
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+
+  return ret;
+}
+
+// Remember a frame that the adapter has taken so that we can spot its echo. If we're already waiting for as many as we can, the
+// oldest is given up on.
+static void interface_tx_track(struct milcan_a* interface, struct milcan_frame* frame, uint8_t notify) {
+  if(interface->inflight_count >= INTERFACE_TX_INFLIGHT) {
+    if(interface->inflight[0].notify) {
+      interface->stats.tx_unconfirmed++;
+    }
+    memmove(&(interface->inflight[0]), &(interface->inflight[1]), sizeof(struct interface_tx_inflight) * (INTERFACE_TX_INFLIGHT - 1));
+    interface->inflight_count--;
+  }
+  struct interface_tx_inflight* entry = &(interface->inflight[interface->inflight_count++]);
+  memcpy(&(entry->frame), &(frame->frame), sizeof(struct can_frame));
+  entry->queued = frame->tx_queued;
+  entry->sent = nanos_cached();
+  entry->notify = notify;
+}
+
+// Forget the frames that have waited too long for their echo (the adapter doesn't echo, or the frame was lost).
+static void interface_tx_expire(struct milcan_a* interface, uint64_t now) {
+  uint32_t n = 0;
+
+  while((n < interface->inflight_count) && ((interface->inflight[n].sent + INTERFACE_TX_ECHO_TIMEOUT_NS) < now)) {
+    if(interface->inflight[n].notify) {
+      interface->stats.tx_unconfirmed++;
+    }
+    n++;
+  }
+  if(n > 0) {
+    interface->inflight_count -= n;
+    memmove(&(interface->inflight[0]), &(interface->inflight[n]), sizeof(struct interface_tx_inflight) * interface->inflight_count);
+  }
+}
+
+// How many frames the adapter has taken that we haven't seen the echo of yet. For backends (GSUSB) that can only tell how busy the
+// adapter is from its echoes. Only the event thread may call it.
+uint32_t interface_tx_in_flight(struct milcan_a* interface) {
+  interface_tx_expire(interface, nanos_cached());
+  return interface->inflight_count;
+}
+
+// Put a frame that the adapter wouldn't take back on the front of the Tx Q for the next pass rather than losing it.
+static void interface_tx_requeue(struct milcan_a* interface, struct milcan_frame* frame) {
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  if(txQReturn(interface, frame) != 0) {
+    txQFrameFree(interface, frame);
+    LOGE(TAG, "No room to requeue a frame that the adapter wouldn't take.");
+  }
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+  interface->stats.tx_requeued++;
+}
+
+// A frame from the Tx Q has been taken by the adapter.
+static void interface_tx_sent(struct milcan_a* interface, struct milcan_frame* frame) {
+  if((interface->options & MILCAN_A_OPTION_TX_COMPLETE) || interface->count_tx_echoes) {
+    interface_tx_track(interface, frame, (interface->options & MILCAN_A_OPTION_TX_COMPLETE) ? TRUE : FALSE);
+  }
+  interface_tx_free(interface, frame);
+}
+
+// interface_tx_drain() for backends with send_batch: everything that there's room for goes to the adapter in one call.
+static int interface_tx_drain_batch(struct milcan_a* interface) {
+  struct milcan_frame* frames[INTERFACE_TX_BATCH];
+  struct can_frame wire[INTERFACE_TX_BATCH];
+  int count = 0;
+  int room = interface_tx_slots_free(interface) - MILCAN_SYSTEM_TX_RESERVE;  // What's left is kept for system frames.
+
+  if(room > INTERFACE_TX_BATCH) {
+    room = INTERFACE_TX_BATCH;
+  }
+  while((count < room) && ((frames[count] = interface_tx_take_q(interface)) != NULL)) {
+    busTimeCommit(&(interface->budget), nanos_cached(), busTimeFrameBits(frames[count]));  // So the next one is admitted against it.
+    memcpy(&(wire[count]), &(frames[count]->frame), sizeof(struct can_frame));
+    count++;
+  }
+  if(count == 0) {
+    return 0;
+  }
+  int sent = interface->backend->send_batch(interface, wire, count);
+  if(sent < 0) {
+    sent = 0;
+  }
+  for(int n = 0; n < sent; n++) {
+    interface_capture(interface, &(wire[n]), nanos_cached(), CAPTURE_TX);
+    interface_tx_sent(interface, frames[n]);
+  }
+  // Last first, so that they keep their order at the front of the Tx Q.
+  for(int n = count - 1; n >= sent; n--) {
+    busTimeRefund(&(interface->budget), nanos_cached(), busTimeFrameBits(frames[n]));
+    interface_tx_requeue(interface, frames[n]);
+  }
+  return sent;
+}
+
+// Hand frames from the Tx Q to the adapter until it's full (less the slots kept for system frames), the Q is empty or we've sent
+// INTERFACE_TX_BATCH. This keeps every slot of an adapter like the GSUSB busy. Backends with send_batch are given them all in one
+// call, the rest one at a time with send. A frame that the adapter won't take goes back on the front of the Tx Q for the next pass
+// rather than being lost. Returns how many were sent.
+int interface_tx_drain(struct milcan_a* interface) {
+  struct milcan_frame* frame;
+  int sent = 0;
+
+  if(interface->backend->send_batch != NULL) {
+    return interface_tx_drain_batch(interface);
+  }
+  while((sent < INTERFACE_TX_BATCH) && ((frame = interface_tx_read_q(interface)) != NULL)) {
+    if(interface_send(interface, frame) != TRUE) {
+      interface_tx_requeue(interface, frame);
+      break;
+    }
+    interface_tx_sent(interface, frame);
+    sent++;
+  }
+  return sent;
+}
+
+// Is rx the echo of a frame that we sent? If so, it's no longer in flight and, if it came from the Tx Q with
+// MILCAN_A_OPTION_TX_COMPLETE, fills in done as its MILCAN_FRAME_TYPE_TX_COMPLETE frame and returns TRUE. Frames that have waited too
+// long for their echo are given up on.
+int interface_tx_echo(struct milcan_a* interface, struct milcan_frame* rx, struct milcan_frame* done) {
+  uint64_t now = nanos_cached();
+
+  interface_tx_expire(interface, now);
+  for(uint32_t n = 0; n < interface->inflight_count; n++) {
+    struct interface_tx_inflight* entry = &(interface->inflight[n]);
+    if((entry->frame.can_id == rx->frame.can_id) && (entry->frame.len == rx->frame.len) &&
+      (memcmp(entry->frame.data, rx->frame.data, entry->frame.len) == 0)) {
+      if(!entry->notify) {
+        interface->inflight_count--;
+        memmove(entry, entry + 1, sizeof(struct interface_tx_inflight) * (interface->inflight_count - n));
+        return FALSE;
+      }
+      memset(done, 0, sizeof(struct milcan_frame));
+      done->frame_type = MILCAN_FRAME_TYPE_TX_COMPLETE;
+      memcpy(&(done->frame), &(entry->frame), sizeof(struct can_frame));
+      done->tx_queued = entry->queued;
+      done->rx_timestamp = (rx->rx_timestamp != 0) ? rx->rx_timestamp : now;
+      if((done->rx_timestamp > done->tx_queued) && ((done->rx_timestamp - done->tx_queued) > interface->stats.tx_latency_max_ns)) {
+        interface->stats.tx_latency_max_ns = done->rx_timestamp - done->tx_queued;
+      }
+      interface->stats.tx_completed++;
+      interface->inflight_count--;
+      memmove(entry, entry + 1, sizeof(struct interface_tx_inflight) * (interface->inflight_count - n));
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+// Return a frame from interface_tx_read_q() once it has been sent.
+void interface_tx_free(struct milcan_a* interface, struct milcan_frame *frame) {
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  txQFrameFree(interface, frame);
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+}
+
+// All heap allocations made after milcan_open() go through here so that we can count them in real time mode.
+void * interface_calloc(struct milcan_a* interface, size_t count, size_t size) {
+  if(interface->rt_ready) {
+    interface->stats.late_allocations++;
+    LOGW(TAG, "Heap allocation after open (%lu so far).", (unsigned long)interface->stats.late_allocations);
+  }
+  return calloc(count, size);
+}
+
+// Preallocate and touch everything that the interface will use so that nothing allocates or page faults after open (MILCAN_A_OPTION_RT_MEMORY).
+int interface_rt_prepare(struct milcan_a* interface) {
+  int ret = MILCAN_OK;
+
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  if(txQPoolInit(interface, MILCAN_RT_TX_POOL_SIZE) != 0) {
+    LOGE(TAG, "Unable to allocate the Tx pool.");
+    ret = MILCAN_ERROR_MEM;
+  }
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+
+  // The Rx Q and the driver contexts live in the interface itself. Touch them all.
+  memset(interface->rx.buffer, 0, sizeof(interface->rx.buffer));
+  memset(&(interface->ctx.rxBuffer), 0, sizeof(interface->ctx.rxBuffer));
+
+  if(interface->options & MILCAN_A_OPTION_RT_MLOCK) {
+    if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      LOGE(TAG, "mlockall() failed (%i). Try running as root.", errno);
+    }
+  }
+  return ret;
+}
+
+// Touch the top of the calling thread's stack so that the event loop doesn't fault on it later.
+void interface_rt_prefault_stack() {
+  volatile char stack[MILCAN_RT_STACK_PREFAULT];
+  for(size_t n = 0; n < sizeof(stack); n += 256) {
+    stack[n] = 0;
+  }
+}
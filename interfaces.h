@@ -2,10 +2,21 @@
 #ifndef __INTERFACES_H__
 #define __INTERFACES_H__
 #include <inttypes.h>
+#include <stdatomic.h>
 #include "milcan.h"
 #include "gsusb.h"
+#include "CANdoC.h"
+#include "syncest.h"
+#include "bustime.h"
+#include "schedule.h"
+#include "governor.h"
+#include "socketcan.h"
+#include "vbus.h"
+#include "shmbus.h"
+#include "replay.h"
+#include "capture.h"
 
-#define MAX_BITS_PER_FRAME  (143) // The maximum with bit stuffing is 140 then 3 bits of interframe spacing.
+#define MAX_BITS_PER_FRAME  (160) // The maximum for an extended ID frame with bit stuffing and 3 bits of interframe spacing (see canBitsWorst()).
 
 #define RX_BUFFER_SIZE  (30)  // How big our receive buffer is.
 
@@ -16,6 +27,27 @@
 #define SYNC_PERIOD_20PC(a) (uint64_t)((a) * 0.2)
 #define SYNC_PERIOD_80PC(a) (uint64_t)((a) * 0.8)
 
+// The Sync Master waits for its deadline in the event thread once it is this close, sleeping until SYNC_SPIN_NS before it and then spinning.
+#define SYNC_WAIT_LEAD_NS   (300000)  // 300us
+#define SYNC_SPIN_NS        (50000)   // 50us
+
+#define MILCAN_POLL_RX_BUDGET (8)     // The most frames that milcan_poll() will read in one call.
+
+#define INTERFACE_RX_BATCH    (32)    // The most frames read from the backend in one go.
+
+// GSUSB adapters only have GSUSB_MAX_TX_REQ transfers in flight at once. Frames from the Tx Q always leave MILCAN_SYSTEM_TX_RESERVE of
+// them free for system frames (sync and enter/exit config), which are retried if the adapter still won't take them.
+#define MILCAN_SYSTEM_TX_RESERVE    (2)
+#define MILCAN_SYSTEM_TX_ATTEMPTS   (3)
+#define MILCAN_SYSTEM_TX_RETRY_NS   (20000)   // 20us between attempts.
+
+// A hot standby sends the sync frame that the Sync Master missed once it's this late (whichever is longer), on the Sync Master's grid.
+#define MILCAN_HOT_STANDBY_GRACE_PC     (0.05)  // 5% of a PTU
+#define MILCAN_HOT_STANDBY_GRACE_FRAMES (2)     // or two maximum length frames.
+
+#define MILCAN_RT_TX_POOL_SIZE      (256)       // How many frames can be in the Tx Q at once without touching the heap (MILCAN_A_OPTION_RT_MEMORY).
+#define MILCAN_RT_STACK_PREFAULT    (64 * 1024) // How much of the event thread's stack we touch before entering the loop.
+
 struct milcan_rx_q {
   pthread_mutex_t rxBufferMutex;  // Mutex to control threaded access to read data buffer.
   struct milcan_frame buffer[RX_BUFFER_SIZE]; // The input buffer.
@@ -28,9 +60,73 @@ struct list_milcan_frame {
     struct list_milcan_frame* next;
 };
 
+/// @brief Preallocated Tx frames and list entries (MILCAN_A_OPTION_RT_MEMORY). Protected by txBufferMutex.
+struct milcan_tx_pool {
+  uint32_t size;                          // 0 if we aren't using a pool.
+  struct milcan_frame* frames;            // size frames.
+  struct list_milcan_frame* nodes;        // size list entries.
+  struct milcan_frame** free_frames;      // Stack of the unused frames.
+  uint32_t free_frame_count;
+  struct list_milcan_frame* free_nodes;   // List of the unused list entries.
+};
+
 struct milcan_tx_q {
   pthread_mutex_t txBufferMutex;  // Mutex to control threaded access to read data buffer.
   struct list_milcan_frame* tx_queue[MILCAN_ID_PRIORITY_COUNT];
+  struct milcan_tx_pool pool;
+};
+
+// Commands posted by the application to the event thread (see milcan_a.commands).
+#define MILCAN_COMMAND_NONE           (0)
+#define MILCAN_COMMAND_ENTER_CONFIG   (1)
+#define MILCAN_COMMAND_EXIT_CONFIG    (2)
+#define MILCAN_COMMAND_QUEUE          (8)           // Commands that can be waiting for the event thread. A power of 2.
+#define MILCAN_COMMAND_HOLD_NS        (1000000000L) // The longest that a command waits for the sequence the one before it started to be sent.
+
+/// @brief Commands from the application, in the order that they were posted. The application's threads take the lock to post, so
+/// there's only ever one writer, and only the event thread takes them, so neither side has to wait for the other.
+struct milcan_command_q {
+  pthread_mutex_t lock;         // Serialises the application's threads.
+  _Atomic uint32_t head;        // Where the next command goes. Only the application moves it.
+  _Atomic uint32_t tail;        // The next command to take. Only the event thread moves it.
+  uint8_t commands[MILCAN_COMMAND_QUEUE];
+  uint64_t hold_until;          // Event thread only. When the next command stops waiting for the last one's sequence to be sent.
+};
+
+/// @brief The status snapshot. Only the event thread writes it. seq is odd while a write is in progress.
+struct milcan_status_lock {
+  _Atomic uint32_t seq;
+  struct milcan_status status;
+};
+
+/// @brief Frames read from the backend with one recv_batch() call, handed to the state machine one at a time.
+struct interface_rx_batch {
+  struct can_frame frames[INTERFACE_RX_BATCH];
+  uint64_t rx_times[INTERFACE_RX_BATCH];
+  int count;                    // How many were read.
+  int next;                     // The next one to hand out.
+};
+
+#define INTERFACE_TX_BATCH            (32)          // The most frames handed from the Tx Q to the adapter in one pass.
+#define INTERFACE_TX_INFLIGHT         (32)          // Frames sent that we're waiting to see the echo of (MILCAN_A_OPTION_TX_COMPLETE or count_tx_echoes).
+#define INTERFACE_TX_ECHO_TIMEOUT_NS  (100000000L)  // Stop waiting for an echo after this long (e.g. the adapter doesn't echo).
+
+// The adapter's link (MILCAN_A_OPTION_AUTO_RECONNECT). The event thread moves it from UP to DOWN when the backend says the adapter has
+// gone, the reconnect thread from DOWN to RESTORED once it has reopened it, and the event thread from RESTORED back to UP.
+#define INTERFACE_LINK_UP             (0)
+#define INTERFACE_LINK_DOWN           (1)           // The reconnect thread owns the backend. Nothing is sent or received.
+#define INTERFACE_LINK_RESTORED       (2)
+
+#define INTERFACE_RECONNECT_MIN_NS    (10000000L)   // 10ms before the second attempt to reopen the adapter,
+#define INTERFACE_RECONNECT_MAX_NS    (1000000000L) // doubling each time up to 1s.
+#define INTERFACE_RECONNECT_SLICE_US  (10000)       // The reconnect thread sleeps in slices this long so that milcan_close() isn't kept waiting.
+
+/// @brief A frame from the Tx Q that the adapter has taken and that we haven't seen the echo of yet.
+struct interface_tx_inflight {
+  struct can_frame frame;
+  uint64_t queued;              // When milcan_send() queued it.
+  uint64_t sent;                // When it was handed to the adapter.
+  uint8_t notify;               // Post a MILCAN_FRAME_TYPE_TX_COMPLETE when it's echoed. Otherwise it's only counted.
 };
 
 struct milcan_a {
@@ -47,7 +143,13 @@ struct milcan_a {
   int mode;                     // The current MILCAN_A_MODE
   uint16_t options;             // The various MILCAN_A_OPTION
   struct gsusb_ctx ctx;         // The context for the GSUSB USB to CAN driver
+  struct cando_ctx cando;       // The CANdo connection and its Rx ring.
+  struct socketcan_ctx sock;    // The SocketCAN socket and its Rx and Tx batches.
+  struct vbus_node vbus;        // Our connection to a virtual bus.
+  struct shmbus_node shm;       // Our connection to a shared memory virtual bus.
+  struct replay_node replay;    // The recording that we're playing back.
   pthread_t rxThreadId;         // Read thread ID.
+  uint8_t rxThreadRunning;      // TRUE while rxThreadId needs joining (pthread_t isn't always a pointer).
   uint8_t eventRunFlag;         // Used to close the therad when exiting.
   struct milcan_rx_q rx;        // The input buffer.
   struct milcan_tx_q tx;        // The output buffer.
@@ -58,16 +160,62 @@ struct milcan_a {
   uint64_t config_timer;        // Used for a 1 second timer to Tx the next Enter Config Message Chain
   uint8_t config_enter_count;   // Count our position through reading the enter config messages.
   uint64_t config_enter_timeout;// Whole message must be less than 400ms or start again.
+  uint64_t last_sync_time;      // When the current sync frame was sent or received.
+  struct milcan_command_q commands; // Commands from the application. The event thread takes them at the start of each pass.
+  _Atomic uint64_t poll_now;    // The time given to the last milcan_poll() (MILCAN_A_OPTION_NO_THREAD), or 0 before the first one.
+  struct milcan_status_lock status; // What milcan_get_status() reads.
+  uint8_t rt_ready;             // Set once a MILCAN_A_OPTION_RT_MEMORY open has finished preallocating. Any allocation after this is counted.
+  struct milcan_stats stats;    // What milcan_get_stats() reads.
+  struct sync_estimator sync_est; // Fits the Sync Master's period and phase to the sync frames that we see.
+  struct bus_budget budget;     // How much of the current PTU the bus has been busy for. Only the event thread uses it.
+  uint64_t standby_grace_ns;    // How late the Sync Master's sync frame can be before a hot standby takes over.
+  struct milcan_startup_times startup; // What milcan_get_startup_times() reads.
+  uint64_t frame_number;        // The sync counter unwrapped to 64 bits. Only moves forwards.
+  struct milcan_schedule schedule; // Reserved Tx slots on the sync grid (protected by tx.txBufferMutex).
+  struct governor gov;          // Decides whether the event thread spins, yields or sleeps when it's idle.
+  const struct milcan_backend* backend; // The adapter's driver. Set once it's open.
+  void* backend_ctx;            // What milcan_backend_ctx() points to.
+  struct interface_rx_batch rx_batch; // Frames read from the backend that haven't been handled yet.
+  struct interface_tx_inflight inflight[INTERFACE_TX_INFLIGHT]; // Oldest first. Only the event thread uses it.
+  uint32_t inflight_count;
+  uint8_t count_tx_echoes;      // Set by a backend whose tx_free needs interface_tx_in_flight(), so every frame it takes is tracked.
+  struct capture capture;       // What milcan_capture_start() records to.
+  uint16_t moduleNumber;        // Which adapter we opened, so that we can open it again.
+  uint8_t gsusb_lost;           // Set by the GSUSB backend once libusb says the device has gone.
+  _Atomic uint8_t link;         // INTERFACE_LINK_UP, DOWN or RESTORED.
+  pthread_t reconnectThreadId;  // Reopens the adapter while the link is down.
+  uint8_t reconnectRunning;
+  _Atomic uint8_t reconnectRun; // Cleared to stop the reconnect thread.
+  uint64_t outage_start;        // When the adapter went.
 };
 
 // Function definitions
+uint8_t interface_rx_pending(struct milcan_a* interface);
+int interface_get_fd(struct milcan_a* interface);
+int interface_get_backend_stats(struct milcan_a* interface, struct milcan_backend_stats* stats);
+int interface_capture_start(struct milcan_a* interface, const char* path);
+int interface_capture_stop(struct milcan_a* interface);
 struct milcan_a* interface_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t sourceAddress, uint8_t can_interface_type, uint16_t moduleNumber, uint16_t options);
 struct milcan_a* interface_close(struct milcan_a* milcan_a);
 int interface_send(struct milcan_a* interface, struct milcan_frame * frame);
+int interface_send_system(struct milcan_a* interface, struct milcan_frame * frame);
+int interface_tx_slots_free(struct milcan_a* interface);
+int interface_link_check(struct milcan_a* interface);
+void interface_flush(struct milcan_a* interface);
+uint64_t interface_next_event(struct milcan_a* interface);
+uint64_t interface_now(struct milcan_a* interface);
 // void interface_display_mode(struct milcan_a* interface);
 // int interface_recv(struct milcan_a* interface, struct milcan_frame *frame);
 int interface_handle_rx(struct milcan_a* interface, struct milcan_frame* frame);
 int interface_tx_add_to_q(struct milcan_a* interface, struct milcan_frame *frame);
 struct milcan_frame * interface_tx_read_q(struct milcan_a* interface);
+int interface_tx_drain(struct milcan_a* interface);
+int interface_tx_echo(struct milcan_a* interface, struct milcan_frame* rx, struct milcan_frame* done);
+uint32_t interface_tx_in_flight(struct milcan_a* interface);
+int interface_tx_pending(struct milcan_a* interface);
+void interface_tx_free(struct milcan_a* interface, struct milcan_frame *frame);
+int interface_rt_prepare(struct milcan_a* interface);
+void interface_rt_prefault_stack();
+void * interface_calloc(struct milcan_a* interface, size_t count, size_t size);
 
 #endif  // __INTERFACES_H__
@@ -9,7 +9,9 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h>
 #include <sys/un.h>     // ?
+#ifndef __linux__
 #include <sys/event.h>  // Events
+#endif
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
@@ -21,16 +23,20 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <limits.h>
+#ifndef __linux__
 #include <sys/rtprio.h>
+#endif
 #include <pthread.h>
 
 
 // #define LOG_LEVEL 3
 #include "utils/logs.h"
 #include "utils/timestamp.h"
+#include "utils/canbits.h"
 #include "utils/priorities.h"
 #include "milcan.h"
 #include "interfaces.h"
+#include "backends.h"
 #include "txq.h"
 
 // #define BUFSIZE 1024
@@ -47,34 +53,34 @@ void check_config_flags(struct milcan_a* interface) {
       if(interface->config_counter == 0) {
         // printf(" Sending C (%02x) ", 'C');
         struct milcan_frame frame = MILCAN_MAKE_ENTER_CONFIG_0(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
       } else if(interface->config_counter == 1) {
         // printf(" Sending F (%02x) ", 'F');
         struct milcan_frame frame = MILCAN_MAKE_ENTER_CONFIG_1(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
       } else if(interface->config_counter == 2) {
         // printf(" Sending G (%02x) ", 'G');
         struct milcan_frame frame = MILCAN_MAKE_ENTER_CONFIG_2(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
-        interface->mode_exit_timer = nanos() + SECS_TO_NS(8);
+        interface->mode_exit_timer = nanos_cached() + SECS_TO_NS(8);
         change_mode(interface, MILCAN_A_MODE_SYSTEM_CONFIGURATION);
       }
       break;
     case MILCAN_CONFIG_MODE_SEQ_LEAVE:
       if(interface->config_counter == 0) {
         struct milcan_frame frame = MILCAN_MAKE_EXIT_CONFIG_0(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
       } else if(interface->config_counter == 1) {
         struct milcan_frame frame = MILCAN_MAKE_EXIT_CONFIG_1(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
       } else if(interface->config_counter == 2) {
         struct milcan_frame frame = MILCAN_MAKE_EXIT_CONFIG_2(interface->sourceAddress);
-        interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+        interface_send_system(interface, &frame);  // System frames bypass the Tx queue
         interface->config_counter++;
         change_mode(interface, MILCAN_A_MODE_PRE_OPERATIONAL);
       }
@@ -84,6 +90,36 @@ void check_config_flags(struct milcan_a* interface) {
   }
 }
 
+// Add the 64 bit frame number and the bus time to a frame going into the Rx Q.
+void stamp_frame(struct milcan_a* interface, struct milcan_frame *frame) {
+  if(interface->sync_est.count == 0) {
+    frame->frame_number = 0;  // We haven't seen a sync frame yet.
+    frame->bus_time = 0;
+    return;
+  }
+  uint64_t now = (frame->rx_timestamp != 0) ? frame->rx_timestamp : nanos_cached();
+  uint64_t into_ptu = (now > interface->sync_est.phase_ns) ? (now - interface->sync_est.phase_ns) : 0;
+  frame->frame_number = interface->frame_number;
+  frame->bus_time = (uint64_t)(interface->frame_number * interface->sync_est.period_ns) + into_ptu;
+}
+
+// Move the 64 bit frame number on for a new sync frame. Call before the estimator sees the sync frame.
+void advance_frame_number(struct milcan_a* interface) {
+  struct sync_estimator* est = &(interface->sync_est);
+  if(est->count == 0) {
+    interface->frame_number = interface->sync;  // The first one. Start in step with the counter.
+    return;
+  }
+  // How many PTUs have passed by the clock, and by the counter (picking the wrap that best fits the clock)?
+  int64_t elapsed = (int64_t)((interface->last_sync_time - est->last_t + (interface->sync_time_ns / 2)) / interface->sync_time_ns);
+  int64_t step = (interface->sync - est->last_counter) & MILCAN_A_SYNC_COUNT_MASK;
+  step += ((elapsed - step + (MILCAN_A_SYNC_COUNT_MASK / 2)) / (MILCAN_A_SYNC_COUNT_MASK + 1)) * (MILCAN_A_SYNC_COUNT_MASK + 1);
+  if((est->source != interface->current_sync_master) || (step < (elapsed - 1)) || (step > (elapsed + 1))) {
+    step = elapsed;  // A new Sync Master (or a jump in the counter) so go by the clock.
+  }
+  interface->frame_number += (step > 0) ? step : 1;
+}
+
 int milcan_add_to_rx_buffer(struct milcan_a* interface, struct milcan_frame *frame) {
   int ret = MILCAN_OK;
   pthread_mutex_lock(&(interface->rx.rxBufferMutex));
@@ -91,24 +127,78 @@ int milcan_add_to_rx_buffer(struct milcan_a* interface, struct milcan_frame *fra
     // LOGI(TAG, "1. Id = %08x, Len = %u", frame->frame.can_id, frame->frame.len);
     memcpy(&(interface->rx.buffer[interface->rx.write_offset]), frame, sizeof(struct milcan_frame));
     // LOGI(TAG, "2. Id = %08x, Len = %u", interface->rx.buffer[interface->rx.write_offset].frame.can_id, interface->rx.buffer[interface->rx.write_offset].frame.len);
+    stamp_frame(interface, &(interface->rx.buffer[interface->rx.write_offset]));
     interface->rx.write_offset++;
     // LOGI(TAG, "Rx buffer contains %u messages.", interface->rx.write_offset);
+    if((frame->frame_type == MILCAN_FRAME_TYPE_MESSAGE) && (interface->startup.first_frame == 0)) {
+      interface->startup.first_frame = nanos_cached();
+    }
   } else {
     LOGE(TAG, "Rx Buffer full!");
+    interface->stats.rx_overflows++;
     ret = MILCAN_ERROR_MEM;
   }
   pthread_mutex_unlock(&(interface->rx.rxBufferMutex));
   return ret;
 }
 
-int notify_new_sync(struct milcan_a* interface) {
+int notify_new_sync(struct milcan_a* interface, uint64_t when) {
+  interface->last_sync_time = when;
+  if(interface->startup.first_sync == 0) {
+    interface->startup.first_sync = interface->last_sync_time;
+  }
+  // How well did the last sync frame follow on from the one before?
+  if(interface->sync_est.count > 0) {
+    if(((interface->sync - interface->sync_est.last_counter) & MILCAN_A_SYNC_COUNT_MASK) != 1) {
+      interface->stats.sync_discontinuities++;
+    }
+    uint64_t gap = interface->last_sync_time - interface->sync_est.last_t;
+    uint64_t ptus = (gap + (interface->sync_time_ns / 2)) / interface->sync_time_ns;
+    if(ptus > 1) {
+      interface->stats.ptus_lost += (uint32_t)(ptus - 1);
+    }
+  }
+  advance_frame_number(interface);
+  // Refit the sync grid. A new Sync Master has its own clock so start again.
+  if(interface->sync_est.source != interface->current_sync_master) {
+    syncEstReset(&(interface->sync_est));
+    interface->sync_est.source = interface->current_sync_master;
+  }
+  syncEstAdd(&(interface->sync_est), interface->sync, interface->last_sync_time);
+  // A new PTU has started. The sync frame is the first thing in it.
+  busTimeNewPTU(&(interface->budget), interface->last_sync_time);
+  busTimeCommit(&(interface->budget), interface->last_sync_time, busTimeWorstBits(BUS_TIME_SYNC_DLC));
   check_config_flags(interface);
+  // Anything with a reserved slot in this PTU goes now, before anything else can get on the bus.
+  if(interface->mode == MILCAN_A_MODE_OPERATIONAL) {
+    scheduleRelease(interface);
+  }
   // Notify application that the frame has changed.
   uint16_t sync = interface->sync;
   struct milcan_frame mode_sync = MILCAN_MAKE_NEW_FRAME(sync);
   return milcan_add_to_rx_buffer(interface, &mode_sync);
 }
 
+// If frame is the echo of one that we sent from the Tx Q, tell the application that it's been on the bus.
+int notify_tx_complete(struct milcan_a* interface, struct milcan_frame* frame) {
+  struct milcan_frame done;
+  if(interface_tx_echo(interface, frame, &done) == FALSE) {
+    return MILCAN_OK;
+  }
+  return milcan_add_to_rx_buffer(interface, &done);
+}
+
+// If the adapter has just gone or come back (MILCAN_A_OPTION_AUTO_RECONNECT), tell the application.
+int notify_adapter(struct milcan_a* interface) {
+  int event = interface_link_check(interface);
+  if(event == 0) {
+    return MILCAN_OK;
+  }
+  struct milcan_frame adapter = MILCAN_MAKE_ADAPTER(event);
+  adapter.rx_timestamp = nanos_cached();
+  return milcan_add_to_rx_buffer(interface, &adapter);
+}
+
 int notify_new_sync_master(struct milcan_a* interface) {
   // Notify application that teh frame has changed.
   uint16_t id = interface->current_sync_master;
@@ -128,21 +218,27 @@ int change_mode(struct milcan_a* interface, int mode) {
         interface->config_flags = 0;
         break;
       case MILCAN_A_MODE_PRE_OPERATIONAL:
+        if(interface->startup.pre_operational == 0) {
+          interface->startup.pre_operational = nanos_cached();
+        }
         // Start the Sync Slave Timeout Period timer.
         interface->current_sync_master = 0;
-        interface->mode_exit_timer = nanos() + interface->sync_slave_time_ns;
+        interface->mode_exit_timer = nanos_cached() + interface->sync_slave_time_ns;
         notify_new_sync_master(interface);
         interface->config_flags = 0;
         break;
       case MILCAN_A_MODE_OPERATIONAL:
+        if(interface->startup.operational == 0) {
+          interface->startup.operational = nanos_cached();
+        }
         // Start the 8 PDUs timer that is reset whenever a SYNC is received. If it times out then enter MILCAN_A_MODE_PRE_OPERATIONAL.
-        interface->mode_exit_timer = nanos() + (8 * interface->sync_time_ns);
+        interface->mode_exit_timer = nanos_cached() + (8 * interface->sync_time_ns);
         interface->config_flags = 0;
         break;
       case MILCAN_A_MODE_SYSTEM_CONFIGURATION:
         // Start the 8 second timer that is reset by the enter config mode sequence. If it times out then enter MILCAN_A_MODE_PRE_OPERATIONAL.
-        interface->mode_exit_timer = nanos() + SECS_TO_NS(8);
-        interface->config_timer = nanos() + SECS_TO_NS(1);
+        interface->mode_exit_timer = nanos_cached() + SECS_TO_NS(8);
+        interface->config_timer = nanos_cached() + SECS_TO_NS(1);
         break;
     }
     struct milcan_frame mode_frame = MILCAN_MAKE_CHANGE_MODE(mode);
@@ -151,32 +247,46 @@ int change_mode(struct milcan_a* interface, int mode) {
   return MILCAN_OK;
 }
 
-int send_sync_frame(struct milcan_a* interface) {
-  interface->syncTimer = nanos() + interface->sync_time_ns; // Next period from when we should've been.
+/// @brief Sends the next sync frame.
+/// @param deadline - When this sync frame was due. The next one is due one PTU after it, not one PTU after we got round to sending this one.
+int send_sync_frame(struct milcan_a* interface, uint64_t deadline) {
+  interface->syncTimer = deadline + interface->sync_time_ns; // Next period from when we should've been.
+  if(interface->syncTimer <= nanos_cached()) {
+    // We've missed a whole period (e.g. we were stalled) so start a new grid from now rather than bursting to catch up.
+    interface->syncTimer = nanos_cached() + interface->sync_time_ns;
+  }
   // MilCAN Sync Frame
   interface->sync++;
   interface->sync &= 0x000003FF;
   struct milcan_frame frame = MILCAN_MAKE_SYNC(interface->sourceAddress, interface->sync);
-  return interface_send(interface, &frame);  // Sync frames bypass the Tx queue
+  if(interface_send_system(interface, &frame) == FALSE) {  // Sync frames bypass the Tx queue
+    interface->stats.sync_tx_failures++;
+    LOGW(TAG, "Failed to send sync frame %u.", interface->sync);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/// @brief Is our sync frame due? If we own the event thread and the deadline is close we wait it out here (and update now).
+/// When we're polled the caller owns the timing so we never sleep.
+int sync_due(struct milcan_a* interface, uint64_t* now) {
+  if(interface->options & MILCAN_A_OPTION_NO_THREAD) {
+    return (*now >= interface->syncTimer);
+  }
+  if((*now + SYNC_WAIT_LEAD_NS) >= interface->syncTimer) {
+    *now = nanos_sleep_until(interface->syncTimer, SYNC_SPIN_NS);
+    return TRUE;
+  }
+  return FALSE;
 }
 
 uint64_t set_sync_slave_time_ns(struct milcan_a* interface, uint64_t new_time) {
   uint64_t min_time = 0;
   uint64_t one_bit = 0;
-  switch(interface->speed) {
-    case MILCAN_A_250K:
-      one_bit = 4000; // One bit is 4000ns long.
-      break;
-    case MILCAN_A_500K:
-      one_bit = 2000; // One bit is 2000ns long.
-      break;
-    case MILCAN_A_1M:
-      one_bit = 1000; // One bit is 1000ns long.
-      break;
-  }
+  one_bit = busTimeBitNs(interface->speed);
   // The formula is one PTU + (2 * time to transmit to messages of maximum length including bit stuffing)
-  // The maximum length including bit stuffing is 140 bits with an extra 3 bits of interframe spacing.
-  min_time = interface->sync_time_ns + (2 * (140 + 3) * one_bit);
+  // The maximum length of an extended ID frame, including bit stuffing and interframe spacing.
+  min_time = interface->sync_time_ns + (2 * canBitsWorst(CAN_MAX_DLEN) * one_bit);
   if(new_time < min_time) {
     new_time = min_time;
   }
@@ -185,18 +295,122 @@ uint64_t set_sync_slave_time_ns(struct milcan_a* interface, uint64_t new_time) {
   return interface->sync_slave_time_ns;
 }
 
+// Publish the status snapshot (seqlock write side). Only ever called from the event thread.
+void publish_status(struct milcan_a* interface) {
+  struct milcan_status* s = &(interface->status.status);
+  if((s->mode == interface->mode) && (s->sync == interface->sync) && (s->sync_master == interface->current_sync_master)
+    && (s->last_sync == interface->last_sync_time) && (s->sync_phase == interface->sync_est.phase_ns)
+    && (s->bus_load == busTimeLoad(&(interface->budget)))) {
+    return; // Nothing has changed.
+  }
+  uint32_t seq = atomic_load_explicit(&(interface->status.seq), memory_order_relaxed);
+  atomic_store_explicit(&(interface->status.seq), seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  s->mode = interface->mode;
+  s->sync = interface->sync;
+  s->sync_master = interface->current_sync_master;
+  s->last_sync = interface->last_sync_time;
+  s->sync_phase = interface->sync_est.phase_ns;
+  s->sync_period = (uint64_t)interface->sync_est.period_ns;
+  s->bus_load = busTimeLoad(&(interface->budget));
+  s->frame_number = interface->frame_number;
+  atomic_store_explicit(&(interface->status.seq), seq + 2, memory_order_release);
+}
+
+// Is the enter or exit config sequence that the last command started still being sent?
+static int config_sequence_running(struct milcan_a* interface) {
+  return (interface->config_flags != MILCAN_CONFIG_MODE_SEQ_NONE) && (interface->config_counter < 3);
+}
+
+// When the next command that the application has posted can be taken, or UINT64_MAX if there isn't one.
+static uint64_t command_due(struct milcan_a* interface) {
+  struct milcan_command_q* q = &(interface->commands);
+  if(atomic_load_explicit(&(q->tail), memory_order_relaxed) == atomic_load_explicit(&(q->head), memory_order_acquire)) {
+    return UINT64_MAX;
+  }
+  return config_sequence_running(interface) ? q->hold_until : 0;
+}
+
+// Act on the next command that the application has posted. Commands are taken in order, one per pass, and each one waits for the
+// sequence that the one before it started to be sent (so milcan_change_to_config_mode() straight after milcan_exit_configuration_mode()
+// does both). The enter sequence only moves on with the sync frames so we don't wait for more than MILCAN_COMMAND_HOLD_NS.
+void take_command(struct milcan_a* interface) {
+  struct milcan_command_q* q = &(interface->commands);
+  if(command_due(interface) > nanos_cached()) {
+    return;
+  }
+  uint32_t tail = atomic_load_explicit(&(q->tail), memory_order_relaxed);
+  uint8_t command = q->commands[tail & (MILCAN_COMMAND_QUEUE - 1)];
+  atomic_store_explicit(&(q->tail), tail + 1, memory_order_release);
+  q->hold_until = nanos_cached() + MILCAN_COMMAND_HOLD_NS;
+  switch(command) {
+    case MILCAN_COMMAND_ENTER_CONFIG:
+      interface->config_flags = MILCAN_CONFIG_MODE_SEQ_ENTER;
+      interface->config_counter = 0;
+      interface->config_timer = nanos_cached() + SECS_TO_NS(1);
+      interface->mode_exit_timer = nanos_cached() + SECS_TO_NS(8);
+      break;
+    case MILCAN_COMMAND_EXIT_CONFIG:
+      interface->config_flags = MILCAN_CONFIG_MODE_SEQ_LEAVE;
+      interface->config_counter = 0;
+      break;
+    default:
+      break;
+  }
+}
+
+// When the Sync Master that we're following should send its next sync frame.
+uint64_t sync_expected(struct milcan_a* interface) {
+  return syncEstTimeOf(&(interface->sync_est), interface->sync_est.last_k + 1);
+}
+
+/// @brief Has the Sync Master that we're following missed its sync frame? If so we'll take a sync frame from a lower priority node
+/// (i.e. a hot standby) rather than waiting to drop back to Pre-Operational.
+int sync_master_overdue(struct milcan_a* interface, uint64_t now) {
+  if((interface->current_sync_master == 0) || (interface->current_sync_master == interface->sourceAddress) || (interface->sync_est.count == 0)) {
+    return FALSE;
+  }
+  return (now >= (sync_expected(interface) + (interface->standby_grace_ns / 2)));
+}
+
+/// @brief If we're a hot standby and the Sync Master has missed its sync frame then send it for them, on their grid, with the counter
+/// that they would have used. Returns TRUE if we've taken over.
+int hot_standby_takeover(struct milcan_a* interface, uint64_t now) {
+  if(!(interface->options & MILCAN_A_OPTION_HOT_STANDBY) || !sync_master_overdue(interface, now)) {
+    return FALSE;
+  }
+  uint64_t expected = sync_expected(interface);
+  if(now < (expected + interface->standby_grace_ns)) {
+    return FALSE;
+  }
+  // If more than one has been missed then catch up with the grid (and the counter).
+  uint64_t missed = (now - expected) / interface->sync_time_ns;
+  expected += missed * interface->sync_time_ns;
+  interface->sync = (interface->sync + missed) & MILCAN_A_SYNC_COUNT_MASK;
+  LOGI(TAG, "Sync Master %02x missed sync frame %u. Taking over.", interface->current_sync_master, (interface->sync + 1) & MILCAN_A_SYNC_COUNT_MASK);
+  send_sync_frame(interface, expected);
+  interface->current_sync_master = interface->sourceAddress;
+  interface->stats.failovers++;
+  return TRUE;
+}
+
 // React to any MilCAN mesages the we receive, send any messages that we need to send and react to Mode changes.
 void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_frame* rxframe) {
-  uint64_t now = nanos();
-  struct milcan_frame * qframe = NULL;
+  uint64_t now = nanos_cached();
   uint8_t rxframeIsSelf = FALSE;
   uint8_t rxframeIsControl = FALSE;
+  uint64_t rx_time = now;
 
   // Calculate some useful state information here.
   if(rxframeValid == MILCAN_OK) {
+    if((rxframe->rx_timestamp != 0) && (rxframe->rx_timestamp <= now)) {
+      rx_time = rxframe->rx_timestamp;  // The adapter (or kernel) knows better than we do when it arrived.
+    }
     // Is it from us?
     if((rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK) == interface->sourceAddress) {
       rxframeIsSelf = TRUE;
+    } else {
+      busTimeCommit(&(interface->budget), now, busTimeFrameBits(rxframe));  // Our own were counted when we sent them.
     }
     // Is it a control message (i.e. Sync, Enter Config or Exit Config)
     if(((rxframe->frame.can_id & MILCAN_ID_PRIMARY_MASK) == (MILCAN_ID_PRIMARY_SYSTEM_MANAGEMENT << 16))
@@ -223,7 +437,8 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
       if((rxframeValid == MILCAN_OK) && ((rxframe->frame.can_id & MILCAN_ID_PRIMARY_MASK) == MILCAN_ID_PRIMARY_SYSTEM_MANAGEMENT) && ((rxframe->frame.can_id & MILCAN_ID_SECONDARY_MASK) == (MILCAN_ID_SECONDARY_SYSTEM_MANAGEMENT_SYNC_FRAME << 8))) {
         // It's a Sync Frame!
         // Is it higher priority or the same as the last one?
-        if((interface->current_sync_master == 0) || ((rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK) <= interface->current_sync_master)) {
+        if((interface->current_sync_master == 0) || ((rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK) <= interface->current_sync_master)
+          || sync_master_overdue(interface, now)) {
           if(rxframeIsSelf == FALSE) {
             // Save the Sync Value.
             int changes = FALSE;
@@ -231,9 +446,9 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
               changes = TRUE;
             }
             interface->current_sync_master = (uint8_t) (rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK);
-            interface->syncTimer = now + interface->sync_time_ns;  // Next period from now.
+            interface->syncTimer = rx_time + interface->sync_time_ns;  // Next period from when it arrived.
             interface->sync = rxframe->frame.data[0] + ((uint16_t) rxframe->frame.data[1] * 256);
-            notify_new_sync(interface);
+            notify_new_sync(interface, rx_time);
             if(changes == TRUE) {
               notify_new_sync_master(interface);
             }
@@ -280,20 +495,19 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
         // We can be sync master.
         // Send a sync if the sync time has 80% expired and if we're higher priority than anything that we've seen so far.
         if((now >= (interface->syncTimer - SYNC_PERIOD_20PC(interface->sync_time_ns))) && ((interface->current_sync_master == 0) || (interface->sourceAddress < interface->current_sync_master))) {
-          send_sync_frame(interface);
+          send_sync_frame(interface, now);
           interface->current_sync_master = interface->sourceAddress;
-          notify_new_sync(interface);
+          notify_new_sync(interface, nanos_cached());
           notify_new_sync_master(interface);
         }
-        // Send a sync if the sync time has 99% expired and we're already the highest priority seen so far.
-        // if((now >= (interface->syncTimer - SYNC_PERIOD_1PC(interface->sync_time_ns))) && (interface->sourceAddress == interface->current_sync_master)) {
-        if((now >= interface->syncTimer) && (interface->sourceAddress == interface->current_sync_master)) {
-          send_sync_frame(interface);
-          notify_new_sync(interface);
+        // Send a sync if the sync time has expired and we're already the highest priority seen so far.
+        if((interface->sourceAddress == interface->current_sync_master) && sync_due(interface, &now)) {
+          send_sync_frame(interface, interface->syncTimer);
+          notify_new_sync(interface, nanos_cached());
         }
       }
       // Leave Pre-Operational mode to Operational mode if there has been a sync frame and the Sync Slave Timeout Period has occurred.
-      if((nanos() >= interface->mode_exit_timer) && (interface->current_sync_master != 0x00)) {
+      if((now >= interface->mode_exit_timer) && (interface->current_sync_master != 0x00)) {
         change_mode(interface, MILCAN_A_MODE_OPERATIONAL);
       }
       break;
@@ -307,7 +521,8 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
 
         if(((rxframe->frame.can_id & MILCAN_ID_PRIMARY_MASK) == MILCAN_ID_PRIMARY_SYSTEM_MANAGEMENT) && ((rxframe->frame.can_id & MILCAN_ID_SECONDARY_MASK) == (MILCAN_ID_SECONDARY_SYSTEM_MANAGEMENT_SYNC_FRAME << 8))) {
           // It's a Sync Frame!
-          if((interface->current_sync_master == 0) || ((rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK) <= interface->current_sync_master)) {
+          if((interface->current_sync_master == 0) || ((rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK) <= interface->current_sync_master)
+            || sync_master_overdue(interface, now)) {
             if(rxframeIsSelf == FALSE) {
               // Save the Sync Value.
               int changes = FALSE;
@@ -315,10 +530,10 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
                 changes = TRUE;
               }
               interface->current_sync_master = (uint8_t) (rxframe->frame.can_id & MILCAN_ID_SOURCE_MASK);
-              interface->syncTimer = now + interface->sync_time_ns;  // Next period from now.
+              interface->syncTimer = rx_time + interface->sync_time_ns;  // Next period from when it arrived.
               interface->sync = rxframe->frame.data[0] + ((uint16_t) rxframe->frame.data[1] * 256);
               interface->mode_exit_timer = now + (8 * interface->sync_time_ns);
-              notify_new_sync(interface);
+              notify_new_sync(interface, rx_time);
               if(changes == TRUE) {
                 notify_new_sync_master(interface);
               }
@@ -364,33 +579,32 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
       if((interface->options & MILCAN_A_OPTION_SYNC_MASTER) == MILCAN_A_OPTION_SYNC_MASTER) {
         // We can be a SYNC MASTER
         if(interface->current_sync_master == interface->sourceAddress) {
-          // We are the current SYNC MASTER - Tx at 99% PTU (we've found that seems to work best).
-          // if(now >= (interface->syncTimer - SYNC_PERIOD_1PC(interface->sync_time_ns))) {
-          if(now >= interface->syncTimer) {
-            send_sync_frame(interface);
+          // We are the current SYNC MASTER - Tx on the PTU grid. Once we're close we wait for the deadline here.
+          if(sync_due(interface, &now)) {
+            send_sync_frame(interface, interface->syncTimer);
             interface->mode_exit_timer = now + (8 * interface->sync_time_ns);
-            notify_new_sync(interface);
+            notify_new_sync(interface, nanos_cached());
           }
         } else if((interface->current_sync_master == 0) || (interface->sourceAddress < interface->current_sync_master)) {
           // We aren't the current SYNC MASTER but we have higher priority than the current SYNC MASTER so we Tx at 80% of PTU.
           if(now >= (interface->syncTimer - SYNC_PERIOD_20PC(interface->sync_time_ns))) {
-            send_sync_frame(interface);
+            send_sync_frame(interface, now);
             interface->current_sync_master = interface->sourceAddress;
             interface->mode_exit_timer = now + (8 * interface->sync_time_ns);
-            notify_new_sync(interface);
+            notify_new_sync(interface, nanos_cached());
             notify_new_sync_master(interface);
           }
+        } else if(hot_standby_takeover(interface, now)) {
+          // We're a lower priority hot standby and the SYNC MASTER has missed a sync frame so we've sent it for them.
+          interface->mode_exit_timer = now + (8 * interface->sync_time_ns);
+          notify_new_sync(interface, nanos_cached());
+          notify_new_sync_master(interface);
         // } else {
         //   // We aren't the current SYNC MASTER and we have a lower priority than them so don't transmit sync frames.
         }
       }
       // Transmit anything that need transmitting form the Tx Q.
-      qframe = interface_tx_read_q(interface);
-      if(qframe != NULL) {
-        interface_send(interface, qframe);
-        free(qframe);
-        qframe = NULL;
-      }
+      interface_tx_drain(interface);
       // Have we had a sync frame in time? If not, go to PRE-OPERATIONAL mode.
       if(now >= interface->mode_exit_timer) {
         change_mode(interface, MILCAN_A_MODE_PRE_OPERATIONAL);
@@ -470,12 +684,7 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
       }
 
       // Transmit anything that need transmitting form the Tx Q.
-      qframe = interface_tx_read_q(interface);
-      if(qframe != NULL) {
-        interface_send(interface, qframe);
-        free(qframe);
-        qframe = NULL;
-      }
+      interface_tx_drain(interface);
       break;
   }
 
@@ -485,15 +694,92 @@ void doStateMachine(struct milcan_a* interface, int rxframeValid, struct milcan_
   }
 }
 
+// One pass of the event loop. Returns MILCAN_OK if a frame was received.
+int event_step(struct milcan_a* interface) {
+  struct milcan_frame frame;
+  int frameValid = MILCAN_ERROR_EOF;
+  take_command(interface);
+  notify_adapter(interface);
+  frameValid = interface_handle_rx(interface, &frame);  // Check anything to read an put it in the Rx Q.
+  if((frameValid == MILCAN_OK) && (interface->inflight_count > 0)) {
+    notify_tx_complete(interface, &frame);
+  }
+  doStateMachine(interface, frameValid, &frame); // The state machne goes here.
+  interface_flush(interface);  // Send anything that's been batched up.
+  publish_status(interface);
+  return frameValid;
+}
+
+// When does the state machine next need to run, if nothing is received before then?
+uint64_t next_deadline(struct milcan_a* interface) {
+  uint64_t now = nanos_cached();
+  uint64_t deadline = interface->mode_exit_timer;
+
+  if((interface->mode == MILCAN_A_MODE_POWER_OFF) || interface_rx_pending(interface)) {
+    return now;
+  }
+  if(interface_tx_pending(interface)) {
+    if(interface->budget.deferred == FALSE) {
+      return now;
+    }
+    deadline = busTimeNextPTU(&(interface->budget));  // What's left is waiting for the next PTU.
+    if(deadline > interface->mode_exit_timer) deadline = interface->mode_exit_timer;
+  }
+  if((interface->options & MILCAN_A_OPTION_SYNC_MASTER) && (interface->mode != MILCAN_A_MODE_SYSTEM_CONFIGURATION)) {
+    uint64_t sync_deadline = interface->syncTimer;
+    if(interface->current_sync_master != interface->sourceAddress) {
+      if((interface->current_sync_master == 0) || (interface->sourceAddress < interface->current_sync_master)) {
+        sync_deadline -= SYNC_PERIOD_20PC(interface->sync_time_ns);  // We'll try to take over.
+      } else if((interface->options & MILCAN_A_OPTION_HOT_STANDBY) && (interface->sync_est.count > 0)) {
+        sync_deadline = sync_expected(interface) + interface->standby_grace_ns;  // We'll take over if it's missed.
+      } else {
+        sync_deadline = UINT64_MAX;
+      }
+    }
+    if(sync_deadline < deadline) deadline = sync_deadline;
+  }
+  if((interface->mode == MILCAN_A_MODE_SYSTEM_CONFIGURATION) && (interface->config_flags & MILCAN_CONFIG_MODE_SEQ_ENTER)) {
+    if(interface->config_timer < deadline) deadline = interface->config_timer;
+    if(interface->config_counter < 3) return now; // Still sending the sequence.
+  }
+  if((interface->config_enter_count > 0) && (interface->config_enter_timeout < deadline)) {
+    deadline = interface->config_enter_timeout;
+  }
+  uint64_t command = command_due(interface);
+  if(command < deadline) deadline = command;
+  return (deadline < now) ? now : deadline;
+}
+
+// How long the event thread can sleep for. As next_deadline() but a slave also stays awake from just before the next sync frame is
+// expected until it arrives (or is well overdue), so that its Rx time stamp isn't late, and wakes when a frame on a virtual bus finishes.
+static uint64_t governor_deadline(struct milcan_a* interface) {
+  uint64_t deadline = next_deadline(interface);
+  uint64_t bus_event = interface_next_event(interface);
+  if(bus_event < deadline) deadline = bus_event;
+  if((interface->sync_est.count > 0) && (interface->current_sync_master != interface->sourceAddress)) {
+    uint64_t expected = sync_expected(interface);
+    if(nanos_cached() < (expected + interface->standby_grace_ns)) {
+      uint64_t lead = (expected > SYNC_WAIT_LEAD_NS) ? (expected - SYNC_WAIT_LEAD_NS) : 0;
+      if(lead < deadline) deadline = lead;
+    }
+  }
+  return deadline;
+}
+
 static void * EventHandler(void * eventContext)
 {
   struct milcan_a* interface = (struct milcan_a*)eventContext;
-  struct milcan_frame frame;
-  int frameValid = MILCAN_ERROR_EOF;
+  if(interface->options & MILCAN_A_OPTION_RT_MEMORY) {
+    interface_rt_prefault_stack();
+  }
   LOGI(TAG, "Enter event handler");
   while (interface->eventRunFlag == TRUE) {
-    frameValid = interface_handle_rx(interface, &frame);  // Check anything to read an put it in the Rx Q.
-    doStateMachine(interface, frameValid, &frame); // The state machne goes here.
+    nanos_tick();  // One clock read per pass. Everything below uses nanos_cached().
+    if(event_step(interface) == MILCAN_OK) {
+      governorBusy(&(interface->gov), nanos_cached());
+    } else {
+      governorIdle(&(interface->gov), &(interface->stats), nanos_cached(), governor_deadline(interface));
+    }
   }
   LOGI(TAG, "Exit event handler");
   
@@ -501,8 +787,9 @@ static void * EventHandler(void * eventContext)
 }
 
 void milcan_display_mode(void* interface) {
-  struct milcan_a* i = (struct milcan_a*)interface;
-  switch(i->mode) {
+  struct milcan_status status;
+  milcan_get_status(interface, &status);
+  switch(status.mode) {
     case MILCAN_A_MODE_POWER_OFF:
         LOGI(TAG, "Mode: Power Off");
         break;
@@ -516,26 +803,58 @@ void milcan_display_mode(void* interface) {
         LOGI(TAG, "Mode: System Configuration");
         break;
     default:
-        LOGE(TAG, "Mode: Unrecognised (%u)", i->mode);
+        LOGE(TAG, "Mode: Unrecognised (%u)", status.mode);
         break;
   }
 }
 
+// Calibrating the CPU counter takes a few ms so it's done while the device is being opened.
+static void * CalibrateClock(void * unused) {
+  if(nanos_set_source(TIMESTAMP_SOURCE_COUNTER) != TIMESTAMP_SOURCE_COUNTER) {
+    LOGW(TAG, "No usable CPU counter, using the coarse monotonic clock.");
+  }
+  return NULL;
+}
+
 /// @brief Open a new interface.
 void * milcan_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t sourceAddress, uint8_t can_interface_type, uint16_t moduleNumber, uint16_t options) {
   struct milcan_a* interface = NULL;
+  uint64_t open_called = nanos();
+  pthread_t clockThreadId;
+  int clockThread = FALSE;
+  if(options & MILCAN_A_OPTION_FAST_CLOCK) {
+    clockThread = (pthread_create(&clockThreadId, NULL, CalibrateClock, NULL) == 0);
+  }
   interface = interface_open(speed, sync_freq_hz, sourceAddress, can_interface_type, moduleNumber, options);
+  if(clockThread) {
+    pthread_join(clockThreadId, NULL);
+  } else if(options & MILCAN_A_OPTION_FAST_CLOCK) {
+    CalibrateClock(NULL);
+  }
   if(NULL == interface) {
     return NULL;
   }
+  interface->startup.open_called = open_called;
   set_sync_slave_time_ns(interface, 0); // Set the slave sync time to the minimum acceptable value.
+  if(options & MILCAN_A_OPTION_RT_MEMORY) {
+    if(interface_rt_prepare(interface) != MILCAN_OK) {
+      return interface_close(interface);
+    }
+  }
 
   // We've connected so start the background tasks.
-  // Start the rx thread.
+  // Start the rx thread (unless the application is going to drive us with milcan_poll()).
   interface->eventRunFlag = TRUE;
-  if (pthread_create(&(interface->rxThreadId), NULL, EventHandler, (void *)interface) == 0)
+  if(options & MILCAN_A_OPTION_NO_THREAD)
+  {
+    // The application owns the thread.
+    LOGI(TAG, "No event thread. Call milcan_poll().");
+    milcan_display_mode(interface);
+  }
+  else if (pthread_create(&(interface->rxThreadId), NULL, EventHandler, (void *)interface) == 0)
   {
     // Thread started.
+    interface->rxThreadRunning = TRUE;
     LOGI(TAG, "Thread started!");
     milcan_display_mode(interface);
   }
@@ -544,6 +863,12 @@ void * milcan_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t sourceAddress,
     LOGE(TAG, "Unable to create thread.");
     interface = interface_close(interface);
   }
+  if((interface != NULL) && (options & MILCAN_A_OPTION_RT_MEMORY)) {
+    interface->rt_ready = TRUE;  // From here on every allocation is counted.
+  }
+  if(interface != NULL) {
+    interface->startup.ready = nanos();
+  }
 
   return (void*) interface;
 }
@@ -555,7 +880,9 @@ void milcan_close(void * interface) {
 
 // Add a message to the output stack.
 int milcan_send(void* interface, struct milcan_frame * frame) {
-  return interface_tx_add_to_q(interface, frame);
+  int ret = interface_tx_add_to_q(interface, frame);
+  governorWake(&(((struct milcan_a*)interface)->gov));
+  return ret;
 }
 
 // Read a mesage from the incoming stack.
@@ -576,18 +903,218 @@ int milcan_recv(void* interface, struct milcan_frame * frame) {
   return ret;
 }
 
+// Queue a command for the event thread. If MILCAN_COMMAND_QUEUE commands are already waiting we wait for room, unless we are the
+// event thread (MILCAN_A_OPTION_NO_THREAD) when the command is dropped.
+static void post_command(struct milcan_a* i, uint8_t command) {
+  struct milcan_command_q* q = &(i->commands);
+  pthread_mutex_lock(&(q->lock));
+  uint32_t head = atomic_load_explicit(&(q->head), memory_order_relaxed);
+  while((head - atomic_load_explicit(&(q->tail), memory_order_acquire)) >= MILCAN_COMMAND_QUEUE) {
+    if(i->options & MILCAN_A_OPTION_NO_THREAD) {
+      LOGW(TAG, "The command queue is full. Command %u dropped.", command);
+      pthread_mutex_unlock(&(q->lock));
+      return;
+    }
+    governorWake(&(i->gov));
+    usleep(1000);
+  }
+  q->commands[head & (MILCAN_COMMAND_QUEUE - 1)] = command;
+  atomic_store_explicit(&(q->head), head + 1, memory_order_release);
+  pthread_mutex_unlock(&(q->lock));
+  governorWake(&(i->gov));
+}
+
 // Start the process of changing to the Configuration Mode.
 void milcan_change_to_config_mode(void* interface) {
-  struct milcan_a* i = (struct milcan_a*)interface;
-  i->config_flags = MILCAN_CONFIG_MODE_SEQ_ENTER;
-  i->config_counter = 0;
-  i->config_timer = nanos() + SECS_TO_NS(1);
-  i->mode_exit_timer = nanos() + SECS_TO_NS(8); 
+  post_command((struct milcan_a*)interface, MILCAN_COMMAND_ENTER_CONFIG);
 }
 
 // Start the process of leaving the Configuration Mode.
 void milcan_exit_configuration_mode(void* interface) {
+  post_command((struct milcan_a*)interface, MILCAN_COMMAND_EXIT_CONFIG);
+}
+
+// Copy the interface's counters.
+int milcan_get_stats(void* interface, struct milcan_stats* stats) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if((i == NULL) || (stats == NULL)) {
+    return MILCAN_ERROR;
+  }
+  memcpy(stats, &(i->stats), sizeof(struct milcan_stats));
+  return MILCAN_OK;
+}
+
+// Do one bounded step of Rx, state machine and Tx. Only for interfaces opened with MILCAN_A_OPTION_NO_THREAD.
+uint64_t milcan_poll(void* interface, uint64_t now_ns) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if((i == NULL) || !(i->options & MILCAN_A_OPTION_NO_THREAD)) {
+    return 0;
+  }
+  uint64_t now = (now_ns != 0) ? now_ns : nanos_fast();
+  atomic_store(&(i->poll_now), now); // For the application's own calls (milcan_send() and so on) between polls.
+  nanos_set_cached(now);
+  for(int n = 0; n < MILCAN_POLL_RX_BUDGET; n++) {
+    if(event_step(i) != MILCAN_OK) {
+      break;  // Nothing more to read.
+    }
+  }
+  uint64_t deadline = next_deadline(i);
+  uint64_t backend_event = interface_next_event(i);  // A frame finishing on a virtual bus, or the next frame of a recording.
+  return (backend_event < deadline) ? backend_event : deadline;
+}
+
+// Read the current mode, sync counter and sync master (seqlock read side). Never blocks the event thread.
+int milcan_get_status(void* interface, struct milcan_status* status) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  uint32_t seq;
+  if((i == NULL) || (status == NULL)) {
+    return MILCAN_ERROR;
+  }
+  do {
+    seq = atomic_load_explicit(&(i->status.seq), memory_order_acquire);
+    memcpy(status, &(i->status.status), sizeof(struct milcan_status));
+    atomic_thread_fence(memory_order_acquire);
+  } while((seq & 1) || (seq != atomic_load_explicit(&(i->status.seq), memory_order_relaxed)));
+  return MILCAN_OK;
+}
+
+// Reserve a slot on the sync grid.
+int milcan_schedule_add(void* interface, uint16_t modulo, uint16_t slot, uint32_t can_id) {
+  if(interface == NULL) {
+    return MILCAN_ERROR;
+  }
+  return scheduleAdd((struct milcan_a*)interface, modulo, slot, can_id);
+}
+
+// Give up a reserved slot.
+int milcan_schedule_remove(void* interface, int entry) {
+  if(interface == NULL) {
+    return MILCAN_ERROR;
+  }
+  return scheduleRemove((struct milcan_a*)interface, entry);
+}
+
+// Send a frame in its reserved slot.
+int milcan_schedule_post(void* interface, int entry, struct milcan_frame* frame) {
+  if(interface == NULL) {
+    return MILCAN_ERROR;
+  }
+  return schedulePost((struct milcan_a*)interface, entry, frame);
+}
+
+// Copy the startup times.
+int milcan_get_startup_times(void* interface, struct milcan_startup_times* times) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if((i == NULL) || (times == NULL)) {
+    return MILCAN_ERROR;
+  }
+  memcpy(times, &(i->startup), sizeof(struct milcan_startup_times));
+  return MILCAN_OK;
+}
+
+// Set how much of each PTU SRT and NRT frames can fill.
+int milcan_set_bus_ceiling(void* interface, uint8_t percent) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if((i == NULL) || (percent > 100)) {
+    return MILCAN_ERROR;
+  }
+  busTimeSetCeiling(&(i->budget), percent);
+  return MILCAN_OK;
+}
+
+// Tune how the event thread behaves when it's idle.
+int milcan_set_governor(void* interface, uint64_t spin_ns, uint64_t yield_ns, uint64_t max_sleep_ns) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if(i == NULL) {
+    return MILCAN_ERROR;
+  }
+  governorSet(&(i->gov), spin_ns, yield_ns, max_sleep_ns);
+  governorWake(&(i->gov));  // Start using the new timings now.
+  return MILCAN_OK;
+}
+
+// Add a backend for can_interface_type, which must not already have one.
+int milcan_register_backend(uint8_t can_interface_type, const struct milcan_backend* backend) {
+  if(backend == NULL) {
+    return MILCAN_ERROR;
+  }
+  return backendRegister(can_interface_type, backend);
+}
+
+// Where a backend keeps its own state for this interface.
+void** milcan_backend_ctx(void* interface) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if(i == NULL) {
+    return NULL;
+  }
+  return &(i->backend_ctx);
+}
+
+// A file descriptor that becomes readable when frames arrive, or -1.
+int milcan_get_fd(void* interface) {
   struct milcan_a* i = (struct milcan_a*)interface;
-  i->config_flags = MILCAN_CONFIG_MODE_SEQ_LEAVE;
-  i->config_counter = 0;
-}
\ No newline at end of file
+  if((i == NULL) || (i->backend == NULL)) {
+    return -1;
+  }
+  return interface_get_fd(i);
+}
+
+// Read the backend's own counters.
+int milcan_get_backend_stats(void* interface, struct milcan_backend_stats* stats) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  if((i == NULL) || (stats == NULL) || (i->backend == NULL)) {
+    return MILCAN_ERROR;
+  }
+  return interface_get_backend_stats(i, stats);
+}
+
+// How long until the next sync frame is due, from the estimated sync grid.
+int64_t milcan_time_to_next_sync(void* interface) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  struct milcan_status status;
+  if((milcan_get_status(interface, &status) != MILCAN_OK) || (status.sync_phase == 0) || (status.sync_period == 0)) {
+    return MILCAN_ERROR;
+  }
+  uint64_t now = interface_now(i);
+  uint64_t next = status.sync_phase + status.sync_period;
+  if(now >= next) {
+    // We've missed some (or the Sync Master has gone). Carry on along the grid.
+    next += (((now - next) / status.sync_period) + 1) * status.sync_period;
+  }
+  return (int64_t)(next - now);
+}
+
+// When the slot with this sync counter next starts, from the estimated sync grid.
+uint64_t milcan_slot_time(void* interface, uint16_t counter) {
+  struct milcan_a* i = (struct milcan_a*)interface;
+  struct milcan_status status;
+  if((milcan_get_status(interface, &status) != MILCAN_OK) || (status.sync_phase == 0) || (status.sync_period == 0)) {
+    return 0;
+  }
+  uint64_t slots = (counter - status.sync) & MILCAN_A_SYNC_COUNT_MASK;
+  uint64_t start = status.sync_phase + (slots * status.sync_period);
+  uint64_t now = interface_now(i);
+  if(start <= now) {
+    // It's already started (the current slot always has), so it's the next time round the counter. Carry on along the grid if
+    // we've missed some.
+    uint64_t cycle = (MILCAN_A_SYNC_COUNT_MASK + 1) * status.sync_period;
+    start += (((now - start) / cycle) + 1) * cycle;
+  }
+  return start;
+}
+
+// Start recording every frame received and sent to a pcapng file.
+int milcan_capture_start(void* interface, const char* path) {
+  if((interface == NULL) || (path == NULL)) {
+    return MILCAN_ERROR;
+  }
+  return interface_capture_start((struct milcan_a*)interface, path);
+}
+
+// Stop recording and close the file.
+int milcan_capture_stop(void* interface) {
+  if(interface == NULL) {
+    return MILCAN_ERROR;
+  }
+  return interface_capture_stop((struct milcan_a*)interface);
+}
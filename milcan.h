@@ -74,6 +74,11 @@
 #define MILCAN_FRAME_TYPE_CHANGE_MODE           0x01
 #define MILCAN_FRAME_TYPE_NEW_FRAME             0x02
 #define MILCAN_FRAME_TYPE_CHANGE_SYNC_MASTER    0x03
+#define MILCAN_FRAME_TYPE_TX_COMPLETE           0x04  // A frame that we queued has been on the bus (MILCAN_A_OPTION_TX_COMPLETE).
+#define MILCAN_FRAME_TYPE_ADAPTER               0x05  // The adapter has gone or is back (MILCAN_A_OPTION_AUTO_RECONNECT). can_id is a MILCAN_ADAPTER.
+
+#define MILCAN_ADAPTER_LOST       0x01  // The adapter has gone. Frames queued from now on wait in the Tx Q until it's back.
+#define MILCAN_ADAPTER_RESTORED   0x02  // The adapter has been reopened. The stats say how long it was gone for.
 
 #define MILCAN_CONFIG_MODE_SEQ_NONE   0x00
 #define MILCAN_CONFIG_MODE_SEQ_ENTER  0x01
@@ -84,6 +89,66 @@ struct milcan_frame {
   uint8_t frame_type;
   struct can_frame frame;
   uint64_t mortal;
+  uint64_t frame_number;  // Rx only: the sync counter unwrapped to 64 bits (keeps counting across rollovers and Sync Master changes).
+  uint64_t bus_time;      // Rx only: when it was received, in ns on the Sync Master's clock (frame_number PTUs plus the time into the PTU).
+  uint64_t rx_timestamp;  // Rx only: when the adapter or kernel received it (ns, nanos() time base). 0 if the adapter doesn't time stamp.
+  uint64_t tx_queued;     // Tx only: when milcan_send() queued it (set by the library). rx_timestamp - tx_queued of a Tx complete frame is its queue to wire latency.
+};
+
+/// @brief A snapshot of an interface's protocol state. Filled in by milcan_get_status().
+struct milcan_status {
+  uint8_t mode;           // The current MILCAN_A_MODE.
+  uint8_t sync_master;    // The address of the current Sync Master (0 if there isn't one).
+  uint16_t sync;          // The Sync Slot Counter (0 to 1023).
+  uint64_t last_sync;     // When the current sync frame was sent or received (ns, nanos() time base).
+  uint64_t sync_phase;    // When the current sync frame should have been, from the fitted sync grid (0 if there's no estimate yet).
+  uint64_t sync_period;   // The Sync Master's PTU as measured by us (ns).
+  uint8_t bus_load;       // How busy the bus was during the last PTU, in percent (exact frame lengths, including bit stuffing).
+  uint64_t frame_number;  // The sync counter unwrapped to 64 bits (see struct milcan_frame).
+};
+
+/// @brief When each stage of bringing an interface up happened (ns, nanos() time base). 0 if it hasn't happened yet. Filled in by milcan_get_startup_times().
+struct milcan_startup_times {
+  uint64_t open_called;       // milcan_open() was called.
+  uint64_t driver_loaded;     // The driver is loaded (CANdo: libCANdo.so mapped, GSUSB: libusb initialised).
+  uint64_t device_opened;     // The device has been found and opened (GSUSB: libGSUSB sets the bit timing in the same call).
+  uint64_t bit_timing_set;    // The baud rate has been set.
+  uint64_t ready;             // milcan_open() returned.
+  uint64_t pre_operational;   // First entered Pre-Operational mode.
+  uint64_t first_sync;        // First sync frame sent or received.
+  uint64_t operational;       // First entered Operational mode.
+  uint64_t first_frame;       // First application frame put in the Rx Q.
+};
+
+/// @brief Counters kept by an interface. Filled in by milcan_get_stats(). They are updated without locking so treat them as approximate.
+struct milcan_stats {
+  uint32_t rx_overflows;        // Frames dropped because the Rx Q was full.
+  uint32_t tx_pool_exhausted;   // Times the real time Tx pool was empty when a frame was queued.
+  uint32_t late_allocations;    // Heap allocations made after a MILCAN_A_OPTION_RT_MEMORY open completed (should stay 0).
+  uint32_t tx_deferred;         // PTUs in which SRT or NRT frames were held back because the bus was at its ceiling.
+  uint32_t sync_tx_failures;    // Sync frames that the adapter wouldn't take, even after retrying.
+  uint32_t system_tx_retries;   // Times a system frame (sync or enter/exit config) had to be retried.
+  uint32_t failovers;           // Times we took over as Sync Master because the one we were standing by for missed a sync frame.
+  uint32_t ptus_lost;           // PTUs that passed without a sync frame.
+  uint32_t sync_discontinuities;// Sync frames whose counter wasn't one more than the last one.
+  uint32_t scheduled_sent;      // Frames sent in their reserved slot.
+  uint32_t schedule_misses;     // Frames that couldn't be sent in their reserved slot (they wait for the next one).
+  uint64_t gov_spins;           // Idle passes of the event loop that went straight round again.
+  uint64_t gov_yields;          // Idle passes that called sched_yield().
+  uint32_t gov_wakeups;         // Times the event thread slept and woke up again.
+  uint32_t gov_kicks;           // Wake ups that were early because something was queued.
+  uint64_t gov_sleep_ns;        // Total time the event thread has spent asleep.
+  uint32_t tx_requeued;         // Frames from the Tx Q that the adapter wouldn't take. They go back on the front of the Tx Q.
+  uint32_t tx_completed;        // Frames from the Tx Q that we've seen the adapter's echo of (MILCAN_A_OPTION_TX_COMPLETE).
+  uint32_t tx_unconfirmed;      // Frames from the Tx Q that we stopped waiting for the echo of (MILCAN_A_OPTION_TX_COMPLETE).
+  uint64_t tx_latency_max_ns;   // The longest queue to wire latency of a completed frame.
+  uint32_t capture_dropped;     // Frames that weren't captured because the capture writer had fallen behind (see milcan_capture_start()).
+  uint32_t adapter_lost;        // Times the adapter has gone (MILCAN_A_OPTION_AUTO_RECONNECT).
+  uint32_t reconnects;          // Times it has been reopened.
+  uint32_t reconnect_attempts;  // Attempts to reopen it, including the ones that worked.
+  uint64_t outage_last_ns;      // How long the adapter was gone for last time.
+  uint64_t outage_max_ns;       // The longest it has been gone for.
+  uint64_t outage_total_ns;     // How long it has been gone for altogether.
 };
 
 /// @brief Creates a valid MilCAN ID
@@ -255,6 +320,20 @@ struct milcan_frame {
     .mortal = 0\
   }
 
+/// @brief Creates the adapter lost or restored message
+/// @param event - MILCAN_ADAPTER_LOST or MILCAN_ADAPTER_RESTORED
+#define MILCAN_MAKE_ADAPTER(event)\
+  {\
+    .frame_type = MILCAN_FRAME_TYPE_ADAPTER,\
+    .frame.can_id = (event),\
+    .frame.data = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},\
+    .frame.len = 0,\
+    .frame.__pad = 0,\
+    .frame.__res0 = 0,\
+    .frame.__res1 = 0,\
+    .mortal = 0\
+  }
+
 /// @brief Creates the change of sync master message
 /// @param id - The ID os the new sync master
 #define MILCAN_MAKE_NEW_SYNC_MASTER(id)\
@@ -276,9 +355,50 @@ struct milcan_frame {
 #define MILCAN_ERROR_MEM            -4  // Unable to allocate enough memory.
 
 #define CAN_INTERFACE_NONE          0   // Basically, NULL
-#define CAN_INTERFACE_SOCKET_CAN    1   // Not supported yet
+#define CAN_INTERFACE_SOCKET_CAN    1   // Linux SocketCAN. The moduleNumber N opens canN.
 #define CAN_INTERFACE_CANDO         2   // The CANdo module from netronics
 #define CAN_INTERFACE_GSUSB_SO      3   // Our GSUSB (including candleLight) Shared Object implementation.
+#define CAN_INTERFACE_VBUS          4   // A virtual bus in this process (see vbus.h). The moduleNumber is the bus number.
+#define CAN_INTERFACE_SHMBUS        5   // A virtual bus shared between processes (see shmbus.h). The moduleNumber is the bus number.
+#define CAN_INTERFACE_REPLAY        6   // Plays back a recording (see replay.h). The moduleNumber is the file set with replaySetFile().
+
+#define CAN_INTERFACE_SOCKET_CAN_VIRTUAL  0x80  // OR with the SocketCAN moduleNumber to open vcanN instead (testing without hardware).
+
+#define MILCAN_MAX_BACKENDS         16  // can_interface_type 1 to 15 can have a backend. Register your own with milcan_register_backend().
+
+/// @brief Counters that a backend keeps for itself (see milcan_get_backend_stats()).
+struct milcan_backend_stats {
+  uint64_t rx_dropped;          // Frames lost before we read them (e.g. the adapter's buffer was full).
+  uint64_t tx_errors;           // Frames that were taken but couldn't be sent.
+};
+
+/// @brief A CAN adapter driver. Each entry is passed the interface (the pointer that milcan_open() returns). Anything the backend
+/// needs to keep for each interface can hang off milcan_backend_ctx(). Entries marked optional can be NULL.
+struct milcan_backend {
+  const char* name;
+  // Open the adapter. Returns MILCAN_OK or MILCAN_ERROR (having cleaned up after itself).
+  int (*open)(void* interface, uint16_t moduleNumber, uint8_t speed);
+  // Close the adapter.
+  void (*close)(void* interface);
+  // Send a frame. Returns MILCAN_OK, or MILCAN_ERROR if the adapter won't take it right now.
+  int (*send)(void* interface, struct can_frame* frame);
+  // Optional. Send up to count frames, in order. Returns how many the adapter took (the first ones). Used instead of send to drain the Tx Q.
+  int (*send_batch)(void* interface, struct can_frame* frames, int count);
+  // Read up to max frames, and when each one was received (ns, nanos() time base, 0 if unknown). Returns how many were read.
+  int (*recv_batch)(void* interface, struct can_frame* frames, uint64_t* rx_times, int max);
+  // Optional. Send anything that send() has batched up. Called at the end of each pass of the event loop. Returns how many are left.
+  int (*flush)(void* interface);
+  // Optional. How many more frames the adapter can take right now.
+  int (*tx_free)(void* interface);
+  // Optional. When the adapter next has something for us without being asked (ns, nanos() time base). The event thread won't sleep past it.
+  uint64_t (*next_event)(void* interface);
+  // Optional. A file descriptor that becomes readable when frames arrive, or -1.
+  int (*get_fd)(void* interface);
+  // Optional. Fill in the backend's counters. Returns MILCAN_OK or MILCAN_ERROR.
+  int (*get_stats)(void* interface, struct milcan_backend_stats* stats);
+  // Optional. Is the adapter still there? FALSE once it has gone (e.g. unplugged) and has to be closed and opened again.
+  int (*connected)(void* interface);
+};
 
 
 // Sync Frame Frequencies as defined in MWG-MILA-001 Rev 3 Section 3.2.5.3 (Page 19 of 79)
@@ -296,6 +416,13 @@ struct milcan_frame {
 #define MILCAN_A_OPTION_SYNC_MASTER     (0x0001)  // This device can be a Sync Master
 #define MILCAN_A_OPTION_ECHO            (0x0002)  // Messages from ourselevs will also be added to RX Q
 #define MILCAN_A_OPTION_LISTEN_CONTROL  (0x0004)  // Control messages (Sync, Enter Config and Exit Config) will be added to Rx Q.
+#define MILCAN_A_OPTION_FAST_CLOCK      (0x0008)  // Time stamp with the calibrated CPU counter (falls back to the coarse monotonic clock).
+#define MILCAN_A_OPTION_NO_THREAD       (0x0010)  // Don't start the event thread. The application calls milcan_poll() instead.
+#define MILCAN_A_OPTION_RT_MEMORY       (0x0020)  // Preallocate and pre-touch every buffer at open so nothing allocates or page faults afterwards.
+#define MILCAN_A_OPTION_RT_MLOCK        (0x0040)  // With MILCAN_A_OPTION_RT_MEMORY, also mlockall() the process.
+#define MILCAN_A_OPTION_HOT_STANDBY     (0x0080)  // With MILCAN_A_OPTION_SYNC_MASTER, send the next sync frame in place of a higher priority Sync Master that misses it.
+#define MILCAN_A_OPTION_TX_COMPLETE     (0x0100)  // Add a MILCAN_FRAME_TYPE_TX_COMPLETE frame to the Rx Q when the adapter echoes a frame from the Tx Q.
+#define MILCAN_A_OPTION_AUTO_RECONNECT  (0x0200)  // Reopen the adapter in the background if it goes, keeping the Tx Q and everything else.
 
 void milcan_display_mode(void* interface);
 void * milcan_open(uint8_t speed, uint16_t sync_freq_hz, uint8_t sourceAddress, uint8_t can_interface_type, uint16_t moduleNumber, uint16_t options);
@@ -306,5 +433,39 @@ int milcan_recv(void* interface, struct milcan_frame * frame);
 void milcan_change_to_config_mode(void* interface);
 // Start the process of leaving the Configuration Mode.
 void milcan_exit_configuration_mode(void* interface);
+// Copy the interface's counters.
+int milcan_get_stats(void* interface, struct milcan_stats* stats);
+// Do one bounded step of Rx, state machine and Tx (MILCAN_A_OPTION_NO_THREAD only). Returns when it next needs calling.
+uint64_t milcan_poll(void* interface, uint64_t now_ns);
+// Read the current mode, sync counter and sync master without going through the Rx Q.
+int milcan_get_status(void* interface, struct milcan_status* status);
+// Reserve a slot on the sync grid for can_id: every PTU whose sync counter is slot (modulo modulo). Returns the entry or MILCAN_ERROR.
+int milcan_schedule_add(void* interface, uint16_t modulo, uint16_t slot, uint32_t can_id);
+// Give up a reserved slot.
+int milcan_schedule_remove(void* interface, int entry);
+// Send a frame in an entry's next slot. It replaces any frame posted to that entry that hasn't been sent yet.
+int milcan_schedule_post(void* interface, int entry, struct milcan_frame* frame);
+// Read when each stage of startup happened.
+int milcan_get_startup_times(void* interface, struct milcan_startup_times* times);
+// Set how much of each PTU (in percent) SRT and NRT frames can fill before they are held back until the next PTU.
+int milcan_set_bus_ceiling(void* interface, uint8_t percent);
+// Tune the event thread's idle behaviour: spin for spin_ns after the last frame, then yield for yield_ns, then sleep (up to max_sleep_ns).
+int milcan_set_governor(void* interface, uint64_t spin_ns, uint64_t yield_ns, uint64_t max_sleep_ns);
+// How long until the next sync frame is due (ns), from the estimated sync grid. Negative if there's no estimate.
+int64_t milcan_time_to_next_sync(void* interface);
+// When the slot with this sync counter next starts (ns, nanos() time base). Always in the future, so the current slot is 1024 periods on. 0 if there's no estimate.
+uint64_t milcan_slot_time(void* interface, uint16_t counter);
+// Add a backend for can_interface_type, which must not already have one. Call it before opening any interfaces of that type.
+int milcan_register_backend(uint8_t can_interface_type, const struct milcan_backend* backend);
+// Where a backend keeps its own state for this interface (NULL until the backend sets it).
+void** milcan_backend_ctx(void* interface);
+// A file descriptor that becomes readable when frames arrive (for MILCAN_A_OPTION_NO_THREAD users' own poll() or kqueue()), or -1.
+int milcan_get_fd(void* interface);
+// Read the backend's own counters.
+int milcan_get_backend_stats(void* interface, struct milcan_backend_stats* stats);
+// Start recording every frame received and sent to a pcapng file at path.
+int milcan_capture_start(void* interface, const char* path);
+// Stop recording and close the file.
+int milcan_capture_stop(void* interface);
 
 #endif // __MILCAN_H__
\ No newline at end of file
@@ -0,0 +1,185 @@
+// milcan_wcrt.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <string.h>     /* String function definitions */
+#include <stdint.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+#include "milcan.h"
+#include "wcrt.h"
+
+#define TAG "milcan_wcrt"
+
+// Offline worst case response time analysis of a MilCAN message set. Reads a message table, one message per line:
+//   <ID (hex)> <DLC> <period us> [<priority> [<jitter us> [<deadline us>]]]
+// The priority (0 to 7) replaces the priority bits in the ID, "-" keeps them. A deadline of 0 (or none) uses the MilCAN
+// deadline for the priority. Anything after a '#' is a comment.
+
+#define MAX_MESSAGES  (4096)
+#define LINE_LENGTH   (256)
+
+static struct wcrt_message messages[MAX_MESSAGES];
+
+static void usage(char* name) {
+  fprintf(stderr, "usage: %s s<speed> f<sync Hz> [m<sync master>] [j<sync jitter us>] <message table | ->\n", name);
+  fprintf(stderr, "   <speed> - 250, 500 or 1000 (kbit/s).\n");
+  fprintf(stderr, "   <sync Hz> - The sync frame frequency. 0 to leave the sync frames out.\n");
+  fprintf(stderr, "   <sync master> - The Sync Master's address (default 1).\n");
+  fprintf(stderr, "   <sync jitter us> - How late the Sync Master can send each sync frame (default 0).\n");
+  fprintf(stderr, "   <message table> - One message per line: <ID (hex)> <DLC> <period us> [<priority> [<jitter us> [<deadline us>]]]\n");
+  exit(EXIT_FAILURE);
+}
+
+// Reads the message table. Returns how many messages were read or -1 on error.
+static int readTable(FILE* f) {
+  char line[LINE_LENGTH];
+  int count = 0;
+  int lineNo = 0;
+
+  while(fgets(line, sizeof(line), f) != NULL) {
+    lineNo++;
+    char* hash = strchr(line, '#');
+    if(hash != NULL) *hash = '\0';
+
+    char priority[8] = "-";
+    unsigned long id, dlc;
+    double period_us, jitter_us = 0, deadline_us = 0;
+    int fields = sscanf(line, "%lx %lu %lf %7s %lf %lf", &id, &dlc, &period_us, priority, &jitter_us, &deadline_us);
+    if(fields <= 0) {
+      continue; // Blank or comment.
+    }
+    if((fields < 3) || (dlc > 8) || (period_us <= 0)) {
+      LOGE(TAG, "Line %d: expected <ID (hex)> <DLC 0-8> <period us> [<priority> [<jitter us> [<deadline us>]]]", lineNo);
+      return -1;
+    }
+    if(count >= MAX_MESSAGES) {
+      LOGE(TAG, "Too many messages. The limit is %d.", MAX_MESSAGES);
+      return -1;
+    }
+    struct wcrt_message* m = &messages[count++];
+    memset(m, 0, sizeof(struct wcrt_message));
+    m->id = (uint32_t)id & MILCAN_ID_MASK;
+    if(priority[0] != '-') {
+      unsigned long p = strtoul(priority, NULL, 10);
+      if(p > MILCAN_ID_PRIORITY_MAX) {
+        LOGE(TAG, "Line %d: priority must be 0 to 7 or -", lineNo);
+        return -1;
+      }
+      m->id = (m->id & ~MILCAN_ID_PRIORITY_MASK) | ((p << 26) & MILCAN_ID_PRIORITY_MASK);
+    }
+    m->dlc = (uint8_t)dlc;
+    m->period_ns = (uint64_t)(period_us * 1000.0);
+    m->jitter_ns = (uint64_t)(jitter_us * 1000.0);
+    m->deadline_ns = (uint64_t)(deadline_us * 1000.0);
+  }
+  return count;
+}
+
+static void printTime(uint64_t ns) {
+  if(ns == WCRT_UNBOUNDED) {
+    printf(" %12s", "unbounded");
+  } else {
+    printf(" %12.1f", (double)ns / 1000.0);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct wcrt_bus bus = { .speed = MILCAN_A_1M, .sync_freq_hz = 0, .sync_source = 1, .sync_jitter_ns = 0 };
+  struct wcrt_summary summary;
+  char* tableName = NULL;
+  int haveSpeed = 0, haveSync = 0;
+  unsigned long tempLong;
+
+  for(int i = 1; i < argc; i++) {
+    switch(argv[i][0]) {
+    case 's':
+      tempLong = strtoul(&argv[i][1], NULL, 10);
+      switch(tempLong) {
+        case 250:   bus.speed = MILCAN_A_250K; break;
+        case 500:   bus.speed = MILCAN_A_500K; break;
+        case 1000:  bus.speed = MILCAN_A_1M; break;
+        default:
+          LOGE(TAG, "The speed must be 250, 500 or 1000.");
+          exit(EXIT_FAILURE);
+      }
+      haveSpeed = 1;
+      break;
+    case 'f':
+      tempLong = strtoul(&argv[i][1], NULL, 10);
+      if(tempLong > 65535) {
+        LOGE(TAG, "The sync frequency is invalid.");
+        exit(EXIT_FAILURE);
+      }
+      bus.sync_freq_hz = (uint16_t)tempLong;
+      haveSync = 1;
+      break;
+    case 'm':
+      tempLong = strtoul(&argv[i][1], NULL, 10);
+      if((tempLong > 255) || (tempLong < 1)) {
+        LOGE(TAG, "The Sync Master address must be between 1 and 255.");
+        exit(EXIT_FAILURE);
+      }
+      bus.sync_source = (uint8_t)tempLong;
+      break;
+    case 'j':
+      bus.sync_jitter_ns = strtoul(&argv[i][1], NULL, 10) * 1000;
+      break;
+    default:
+      if(tableName != NULL) {
+        usage(argv[0]);
+      }
+      tableName = argv[i];
+      break;
+    }
+  }
+  if(!haveSpeed || !haveSync || (tableName == NULL)) {
+    usage(argv[0]);
+  }
+
+  FILE* f = (strcmp(tableName, "-") == 0) ? stdin : fopen(tableName, "r");
+  if(f == NULL) {
+    LOGE(TAG, "Unable to open %s", tableName);
+    exit(EXIT_FAILURE);
+  }
+  int count = readTable(f);
+  if(f != stdin) fclose(f);
+  if(count < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t start = nanos();
+  int result = wcrtAnalyse(&bus, messages, (uint32_t)count, &summary);
+  uint64_t taken = nanos() - start;
+
+  printf("%-10s %1s %3s %12s %12s %12s %12s %12s %12s\n", "ID", "P", "DLC", "period us", "tx us", "blocking us", "response us", "deadline us", "slack us");
+  for(int i = 0; i < count; i++) {
+    struct wcrt_message* m = &messages[i];
+    printf("0x%08X %1u %3u", m->id, ((m->id & MILCAN_ID_PRIORITY_MASK) >> 26) & 0x07, m->dlc);
+    printTime(m->period_ns);
+    printTime(m->tx_ns);
+    printTime(m->blocking_ns);
+    printTime(m->response_ns);
+    if(m->checked_ns == WCRT_NO_DEADLINE) {
+      printf(" %12s %12s", "-", "-");
+    } else {
+      printTime(m->checked_ns);
+      if(m->slack_ns == INT64_MIN) {
+        printf(" %12s", "-");
+      } else {
+        printf(" %12.1f", (double)m->slack_ns / 1000.0);
+      }
+    }
+    printf("%s\n", m->schedulable ? "" : "  MISSES");
+  }
+  printf("\n%d messages, bus utilisation %.1f%% (including sync frames), %u can miss their deadline.\n", count, summary.utilisation * 100.0, summary.unschedulable);
+  if((count > 0) && (summary.min_slack_ns != INT64_MAX) && (summary.min_slack_ns != INT64_MIN)) {
+    printf("Least slack: 0x%08X with %.1fus.\n", messages[summary.min_slack_index].id, (double)summary.min_slack_ns / 1000.0);
+  }
+  printf("Analysed in %luus.\n", taken / 1000);
+
+  return (result == MILCAN_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,307 @@
+// replay.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <string.h>     /* String function definitions */
+#include <inttypes.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "replay.h"
+#include "milcan.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+
+#define TAG "replay"
+
+// Plays a recording of a bus back as if it were being received, so that a problem seen in the field can be run through the state
+// machine again. The file is mmap()ed and read in place (the text is parsed as we go), so a capture of any size opens straight away and
+// only the pages around the current frame need to be in memory. Like the virtual bus there's no thread of our own: each frame is handed
+// out once nanos_cached() reaches the time it was recorded at (scaled by speed_pc) counting from the first read, so with
+// MILCAN_A_OPTION_NO_THREAD and milcan_poll() a recording can be run with its original timing far faster than real time.
+
+#define REPLAY_WRITE_BUFFER   (1024 * 1024) // replayConvert()'s stdio buffer.
+
+struct replay_file {
+  char path[REPLAY_PATH_LENGTH];          // Empty if nothing has been set.
+  uint32_t speed_pc;
+};
+
+static struct replay_file replayFiles[REPLAY_MAX_FILES];
+static pthread_mutex_t replayRegistry = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int hexDigit(uint8_t c) {
+  if((c >= '0') && (c <= '9')) return c - '0';
+  if((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  if((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+
+// Parse one line of candump log ("(1436509052.249713) can0 123#11223344", "12345678#R" for a remote frame with an extended ID).
+// CAN FD ("##") and error frames are skipped. Returns TRUE if it was a frame.
+static int replayParseLine(const uint8_t* p, const uint8_t* end, struct can_frame* frame, uint64_t* time) {
+  uint64_t secs = 0, frac = 0;
+  int digits = 0;
+  while((p < end) && ((*p == ' ') || (*p == '\t'))) p++;
+  if((p >= end) || (*p++ != '(')) return FALSE;
+  while((p < end) && (*p >= '0') && (*p <= '9')) secs = (secs * 10) + (*p++ - '0');
+  if((p < end) && (*p == '.')) {
+    p++;
+    for(; (p < end) && (*p >= '0') && (*p <= '9'); p++, digits++) {
+      if(digits < 9) frac = (frac * 10) + (*p - '0');
+    }
+  }
+  if((p >= end) || (*p++ != ')')) return FALSE;
+  for(; digits < 9; digits++) frac *= 10;
+  *time = (secs * 1000000000UL) + frac;
+
+  // The interface name, which we don't need.
+  while((p < end) && (*p == ' ')) p++;
+  while((p < end) && (*p != ' ')) p++;
+  while((p < end) && (*p == ' ')) p++;
+
+  uint32_t id = 0;
+  int d;
+  for(digits = 0; (p < end) && ((d = hexDigit(*p)) >= 0); p++, digits++) id = (id << 4) | d;
+  if((p >= end) || (*p++ != '#') || (digits == 0) || (digits > 8)) return FALSE;
+  if((p < end) && (*p == '#')) return FALSE;  // CAN FD
+  memset(frame, 0, sizeof(struct can_frame));
+  if(digits > 3) {
+    if(id & CAN_ERR_FLAG) return FALSE;
+    frame->can_id = CAN_EFF_FLAG | (id & CAN_EFF_MASK);
+  } else {
+    frame->can_id = id & CAN_SFF_MASK;
+  }
+  if((p < end) && ((*p == 'R') || (*p == 'r'))) {
+    frame->can_id |= CAN_RTR_FLAG;
+    p++;
+    if((p < end) && (*p >= '0') && (*p <= '8')) frame->len = *p - '0';
+    return TRUE;
+  }
+  int hi, lo;
+  while((frame->len < CAN_MAX_DLEN) && ((end - p) >= 2) && ((hi = hexDigit(p[0])) >= 0) && ((lo = hexDigit(p[1])) >= 0)) {
+    frame->data[frame->len++] = (hi << 4) | lo;
+    p += 2;
+  }
+  return TRUE;
+}
+
+// Read the next frame from the file into node->next. Returns FALSE at the end of the file.
+static int replayFetch(struct replay_node* node) {
+  while(node->pos < node->size) {
+    if(node->binary) {
+      if((node->size - node->pos) < sizeof(struct replay_record)) {
+        node->pos = node->size; // A partial record at the end (the recording was cut short).
+        break;
+      }
+      const struct replay_record* record = (const struct replay_record*)(node->map + node->pos);
+      node->pos += sizeof(struct replay_record);
+      node->next.can_id = record->can_id;
+      node->next.len = (record->len > CAN_MAX_DLEN) ? CAN_MAX_DLEN : record->len;
+      memcpy(node->next.data, record->data, CAN_MAX_DLEN);
+      node->next_time = record->time_ns;
+      return TRUE;
+    }
+    const uint8_t* line = node->map + node->pos;
+    const uint8_t* end = memchr(line, '\n', node->size - node->pos);
+    if(end == NULL) {
+      end = node->map + node->size;
+    }
+    node->pos = (end - node->map) + 1;
+    if(replayParseLine(line, end, &(node->next), &(node->next_time))) {
+      return TRUE;
+    }
+    if((end - line) > 1) {
+      node->skipped++;
+    }
+  }
+  node->pos = node->size;
+  return FALSE;
+}
+
+// When node->next is due, in our time.
+static uint64_t replayDue(struct replay_node* node) {
+  if(node->next_time <= node->file_start) {
+    return node->start;
+  }
+  return node->start + (((node->next_time - node->file_start) * REPLAY_REALTIME) / node->speed_pc);
+}
+
+// Make sure that node->next is there, starting the clock on the first frame. Returns FALSE at the end of the file.
+static int replayPeek(struct replay_node* node) {
+  if(!node->have_next) {
+    if((node->map == NULL) || !replayFetch(node)) {
+      return FALSE;
+    }
+    node->have_next = TRUE;
+    if(node->frames == 0) {
+      node->file_start = node->next_time;
+    }
+  }
+  if(node->start == 0) {
+    node->start = nanos_cached();
+  }
+  return TRUE;
+}
+
+static int replayMap(struct replay_node* node, const char* path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    LOGE(TAG, "Unable to open %s.", path);
+    return MILCAN_ERROR;
+  }
+  if((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+    LOGE(TAG, "%s is empty.", path);
+    close(fd);
+    return MILCAN_ERROR;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // The mapping keeps the file.
+  if(map == MAP_FAILED) {
+    LOGE(TAG, "Unable to map %s.", path);
+    return MILCAN_ERROR;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL); // Read ahead, and drop the pages that we've finished with.
+  node->map = (const uint8_t*)map;
+  node->size = st.st_size;
+
+  const struct replay_header* header = (const struct replay_header*)node->map;
+  if((node->size >= sizeof(struct replay_header)) && (memcmp(header->magic, REPLAY_MAGIC, sizeof(header->magic)) == 0)) {
+    if((header->version != REPLAY_VERSION) || (header->record_size != sizeof(struct replay_record))) {
+      LOGE(TAG, "%s is version %u of the replay format. We only read version %u.", path, header->version, REPLAY_VERSION);
+      replayDetach(node);
+      return MILCAN_ERROR;
+    }
+    node->binary = TRUE;
+    node->pos = sizeof(struct replay_header);
+  }
+  return MILCAN_OK;
+}
+
+/// @brief Sets the file that moduleNumber number replays and at what speed (see struct replay_node). Call it before the interface is
+/// opened. Returns MILCAN_OK or MILCAN_ERROR.
+int replaySetFile(uint16_t number, const char* path, uint32_t speed_pc) {
+  if((number >= REPLAY_MAX_FILES) || (path == NULL) || (strlen(path) >= REPLAY_PATH_LENGTH)) {
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&replayRegistry);
+  strcpy(replayFiles[number].path, path);
+  replayFiles[number].speed_pc = speed_pc;
+  pthread_mutex_unlock(&replayRegistry);
+  return MILCAN_OK;
+}
+
+/// @brief Opens the file set for number with replaySetFile(). Returns MILCAN_OK or MILCAN_ERROR.
+int replayAttach(struct replay_node* node, uint16_t number) {
+  char path[REPLAY_PATH_LENGTH];
+  memset(node, 0, sizeof(struct replay_node));
+  if(number >= REPLAY_MAX_FILES) {
+    LOGE(TAG, "There is no replay file %u.", number);
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&replayRegistry);
+  strcpy(path, replayFiles[number].path);
+  node->speed_pc = replayFiles[number].speed_pc;
+  pthread_mutex_unlock(&replayRegistry);
+  if(path[0] == 0) {
+    LOGE(TAG, "No file has been set for replay %u (see replaySetFile()).", number);
+    return MILCAN_ERROR;
+  }
+  return replayMap(node, path);
+}
+
+/// @brief Closes the file.
+void replayDetach(struct replay_node* node) {
+  if(node->map != NULL) {
+    munmap((void*)node->map, node->size);
+    node->map = NULL;
+  }
+}
+
+/// @brief Gets the next frame if it's due at nanos_cached(), and the time that it was due. Returns MILCAN_OK or MILCAN_ERROR_EOF if
+/// there's nothing to read yet (or at all).
+int replayRead(struct replay_node* node, struct can_frame* frame, uint64_t* rx_time) {
+  if(!replayPeek(node)) {
+    return MILCAN_ERROR_EOF;
+  }
+  uint64_t now = nanos_cached();
+  if(node->speed_pc == REPLAY_UNPACED) {
+    *rx_time = now;
+  } else {
+    *rx_time = replayDue(node);
+    if(*rx_time > now) {
+      return MILCAN_ERROR_EOF;
+    }
+  }
+  memcpy(frame, &(node->next), sizeof(struct can_frame));
+  node->have_next = FALSE;
+  node->frames++;
+  return MILCAN_OK;
+}
+
+/// @brief When the next frame is due. UINT64_MAX at the end of the file.
+uint64_t replayNextEvent(struct replay_node* node) {
+  if(!replayPeek(node)) {
+    return UINT64_MAX;
+  }
+  return (node->speed_pc == REPLAY_UNPACED) ? nanos_cached() : replayDue(node);
+}
+
+/// @brief Has every frame been handed out? Returns TRUE or FALSE.
+int replayDone(struct replay_node* node) {
+  return (!node->have_next && (node->pos >= node->size)) ? TRUE : FALSE;
+}
+
+/// @brief Converts candump log text to a binary replay file, which is smaller and much quicker to read. Returns how many frames were
+/// written or MILCAN_ERROR.
+int64_t replayConvert(const char* text_path, const char* binary_path) {
+  struct replay_node node;
+  struct replay_header header;
+  struct replay_record record;
+  int64_t count = 0;
+
+  memset(&node, 0, sizeof(struct replay_node));
+  if(replayMap(&node, text_path) != MILCAN_OK) {
+    return MILCAN_ERROR;
+  }
+  if(node.binary) {
+    LOGE(TAG, "%s is already a binary replay file.", text_path);
+    replayDetach(&node);
+    return MILCAN_ERROR;
+  }
+  FILE* out = fopen(binary_path, "wb");
+  if(out == NULL) {
+    LOGE(TAG, "Unable to create %s.", binary_path);
+    replayDetach(&node);
+    return MILCAN_ERROR;
+  }
+  setvbuf(out, NULL, _IOFBF, REPLAY_WRITE_BUFFER);
+  memset(&header, 0, sizeof(struct replay_header));
+  memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+  header.version = REPLAY_VERSION;
+  header.record_size = sizeof(struct replay_record);
+  int ok = (fwrite(&header, sizeof(struct replay_header), 1, out) == 1);
+  memset(&record, 0, sizeof(struct replay_record));
+  while(ok && replayFetch(&node)) {
+    record.time_ns = node.next_time;
+    record.can_id = node.next.can_id;
+    record.len = node.next.len;
+    memcpy(record.data, node.next.data, CAN_MAX_DLEN);
+    ok = (fwrite(&record, sizeof(struct replay_record), 1, out) == 1);
+    count++;
+  }
+  if(fclose(out) != 0) {
+    ok = FALSE;
+  }
+  replayDetach(&node);
+  if(!ok) {
+    LOGE(TAG, "Unable to write %s.", binary_path);
+    return MILCAN_ERROR;
+  }
+  if(node.skipped > 0) {
+    LOGW(TAG, "Skipped %lu lines of %s that weren't CAN frames.", node.skipped, text_path);
+  }
+  return count;
+}
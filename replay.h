@@ -0,0 +1,73 @@
+// replay.h
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+#include "can.h"
+
+#define REPLAY_MAX_FILES      (16)          // moduleNumbers 0 to 15.
+#define REPLAY_PATH_LENGTH    (256)         // The longest file name that replaySetFile() takes.
+#define REPLAY_REALTIME       (100)         // speed_pc for the recorded timing.
+#define REPLAY_UNPACED        (0)           // speed_pc for handing frames out as fast as they're read.
+#define REPLAY_MAGIC          "MCANRPL1"    // The first 8 bytes of a binary replay file.
+#define REPLAY_VERSION        (1)           // Change this if struct replay_record changes.
+
+/// @brief The start of a binary replay file. It's followed by struct replay_records up to the end of the file.
+struct replay_header {
+  char magic[8];                          // REPLAY_MAGIC (not terminated).
+  uint32_t version;                       // REPLAY_VERSION.
+  uint32_t record_size;                   // sizeof(struct replay_record).
+};
+
+/// @brief One frame in a binary replay file (little endian).
+struct replay_record {
+  uint64_t time_ns;                       // When it was received. Only the differences between frames matter.
+  uint32_t can_id;                        // As in struct can_frame (with CAN_EFF_FLAG and CAN_RTR_FLAG).
+  uint8_t len;
+  uint8_t pad[3];
+  uint8_t data[8];
+};
+
+/// @brief One interface's read through a replay file.
+struct replay_node {
+  const uint8_t* map;                     // The file, mmap()ed. NULL if not attached.
+  size_t size;                            // Of the file.
+  size_t pos;                             // Where the next frame starts.
+  uint8_t binary;                         // Is it a binary file (rather than candump text)?
+  uint32_t speed_pc;                      // 100 is the recorded timing, 200 twice as fast... REPLAY_UNPACED is as fast as possible.
+  uint8_t have_next;                      // Has next been read from the file?
+  struct can_frame next;                  // The next frame to hand out.
+  uint64_t next_time;                     // When next was recorded.
+  uint64_t file_start;                    // When the first frame was recorded.
+  uint64_t start;                         // Our time that the first frame was handed out at (0 until then).
+  uint64_t frames;                        // Frames handed out.
+  uint64_t skipped;                       // Lines that weren't CAN frames that we understand.
+};
+
+/// @brief Sets the file that moduleNumber number replays and at what speed (see struct replay_node). Call it before the interface is
+/// opened. The file is either candump log text ("(1436509052.249713) can0 123#11223344") or binary (see replayConvert()).
+/// Returns MILCAN_OK or MILCAN_ERROR.
+extern int replaySetFile(uint16_t number, const char* path, uint32_t speed_pc);
+
+/// @brief Opens the file set for number with replaySetFile(). Returns MILCAN_OK or MILCAN_ERROR.
+extern int replayAttach(struct replay_node* node, uint16_t number);
+
+/// @brief Closes the file.
+extern void replayDetach(struct replay_node* node);
+
+/// @brief Gets the next frame if it's due at nanos_cached(), and the time that it was due. Returns MILCAN_OK or MILCAN_ERROR_EOF if
+/// there's nothing to read yet (or at all).
+extern int replayRead(struct replay_node* node, struct can_frame* frame, uint64_t* rx_time);
+
+/// @brief When the next frame is due. UINT64_MAX at the end of the file.
+extern uint64_t replayNextEvent(struct replay_node* node);
+
+/// @brief Has every frame been handed out? Returns TRUE or FALSE.
+extern int replayDone(struct replay_node* node);
+
+/// @brief Converts candump log text to a binary replay file, which is smaller and much quicker to read. Returns how many frames were
+/// written or MILCAN_ERROR.
+extern int64_t replayConvert(const char* text_path, const char* binary_path);
+
+#endif  // __REPLAY_H__
@@ -20,4 +20,22 @@
 ./tests_hy 20 9
 ./tests_pc 21 A
 ./tests_hy 22 A
+./tests_pc 23 B
+./tests_hy 24 B
 
+./tests_pc 25 D
+./tests_hy 26 D
+./tests_pc 27 E
+./tests_hy 28 E
+./tests_pc 29 F
+./tests_hy 30 F
+./tests_pc 31 G
+./tests_hy 32 G
+./tests_pc 33 H
+./tests_hy 34 H
+./tests_pc 35 I
+./tests_hy 36 I
+./tests_pc 37 J
+./tests_hy 38 J
+./tests_pc 39 K
+./tests_hy 40 K
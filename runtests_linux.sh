@@ -0,0 +1,11 @@
+# The Linux build (make linux). There's no CANdo or GSUSB hardware here so tests 0 to B aren't run.
+# C needs vcan0 first: ip link add dev vcan0 type vcan && ip link set up vcan0
+./tests_linux 1 C
+./tests_linux 2 D
+./tests_linux 3 E
+./tests_linux 4 F
+./tests_linux 5 G
+./tests_linux 6 H
+./tests_linux 7 I
+./tests_linux 8 J
+./tests_linux 9 K
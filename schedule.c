@@ -0,0 +1,104 @@
+// schedule.c
+#include <inttypes.h>
+#include <string.h>     /* String function definitions */
+#include <pthread.h>
+#include "milcan.h"
+#include "utils/timestamp.h"
+#include "utils/logs.h"
+#include "interfaces.h"
+#include "schedule.h"
+
+#define TAG "SCHEDULE"
+
+// Time triggered transmission. Each entry reserves a slot on the sync grid for one ID. The application posts frames into the entry's
+// mailbox whenever it likes and the event thread sends them straight after the sync frame that starts the slot, so a node that keeps
+// to its slots never has to arbitrate against the other nodes' scheduled traffic. The table lives in struct milcan_a so nothing is
+// allocated. It is protected by the txBufferMutex.
+
+/// @brief Reserves a slot for can_id. Returns the entry number or MILCAN_ERROR.
+int scheduleAdd(struct milcan_a* interface, uint16_t modulo, uint16_t slot, uint32_t can_id) {
+  int ret = MILCAN_ERROR;
+  if((modulo == 0) || (modulo > (MILCAN_A_SYNC_COUNT_MASK + 1)) || (((MILCAN_A_SYNC_COUNT_MASK + 1) % modulo) != 0) || (slot >= modulo)) {
+    LOGE(TAG, "Invalid slot %u of %u.", slot, modulo);
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  for(int i = 0; i < MILCAN_SCHEDULE_SIZE; i++) {
+    struct milcan_schedule_entry* e = &(interface->schedule.entries[i]);
+    if(e->used == FALSE) {
+      memset(e, 0, sizeof(struct milcan_schedule_entry));
+      e->modulo = modulo;
+      e->slot = slot;
+      e->can_id = can_id;
+      e->used = TRUE;
+      ret = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+  if(ret == MILCAN_ERROR) {
+    LOGE(TAG, "Schedule table full.");
+  }
+  return ret;
+}
+
+/// @brief Frees an entry.
+int scheduleRemove(struct milcan_a* interface, int entry) {
+  if((entry < 0) || (entry >= MILCAN_SCHEDULE_SIZE)) {
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  interface->schedule.entries[entry].used = FALSE;
+  interface->schedule.entries[entry].pending = FALSE;
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+  return MILCAN_OK;
+}
+
+/// @brief Puts a frame in an entry's mailbox to go in its next slot.
+int schedulePost(struct milcan_a* interface, int entry, struct milcan_frame* frame) {
+  int ret = MILCAN_ERROR;
+  if((entry < 0) || (entry >= MILCAN_SCHEDULE_SIZE) || (frame == NULL)) {
+    return MILCAN_ERROR;
+  }
+  pthread_mutex_lock(&(interface->tx.txBufferMutex));
+  struct milcan_schedule_entry* e = &(interface->schedule.entries[entry]);
+  if((e->used == TRUE) && ((frame->frame.can_id & CAN_EFF_MASK) == (e->can_id & CAN_EFF_MASK))) {
+    memcpy(&(e->frame), frame, sizeof(struct milcan_frame));
+    e->frame.frame.can_id |= CAN_EFF_FLAG;
+    e->pending = TRUE;
+    ret = MILCAN_OK;
+  }
+  pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+  return ret;
+}
+
+/// @brief Sends everything whose slot has just started. Called by the event thread after each sync frame.
+void scheduleRelease(struct milcan_a* interface) {
+  struct milcan_frame frame;
+  for(int i = 0; i < MILCAN_SCHEDULE_SIZE; i++) {
+    struct milcan_schedule_entry* e = &(interface->schedule.entries[i]);
+    // Look without the lock first. Most entries aren't due.
+    if((e->used == FALSE) || (e->pending == FALSE) || ((interface->sync % e->modulo) != e->slot)) {
+      continue;
+    }
+    pthread_mutex_lock(&(interface->tx.txBufferMutex));
+    int due = (e->used == TRUE) && (e->pending == TRUE);
+    if(due) {
+      memcpy(&frame, &(e->frame), sizeof(struct milcan_frame));
+      e->pending = FALSE;
+    }
+    pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+    if(due) {
+      if(interface_send(interface, &frame) == TRUE) {
+        interface->stats.scheduled_sent++;
+      } else {
+        interface->stats.schedule_misses++;   // It'll have to wait for the next slot.
+        pthread_mutex_lock(&(interface->tx.txBufferMutex));
+        if(e->pending == FALSE) {
+          e->pending = TRUE;
+        }
+        pthread_mutex_unlock(&(interface->tx.txBufferMutex));
+      }
+    }
+  }
+}
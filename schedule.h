@@ -0,0 +1,38 @@
+// schedule.h
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+#include <inttypes.h>
+#include "milcan.h"
+
+#define MILCAN_SCHEDULE_SIZE    (32)  // How many slot reservations an interface can have.
+
+/// @brief A reserved slot. Its frame is sent straight after every sync frame whose counter is slot (modulo modulo).
+struct milcan_schedule_entry {
+  uint8_t used;               // Is this entry in use?
+  uint8_t pending;            // Is there a frame waiting in the mailbox?
+  uint16_t modulo;            // Repeat every this many PTUs. Must divide 1024 so that it survives the counter rolling over.
+  uint16_t slot;              // Which PTU (0 to modulo - 1).
+  uint32_t can_id;            // The ID that can be sent in this slot.
+  struct milcan_frame frame;  // The mailbox. The latest frame posted replaces any that hasn't gone yet.
+};
+
+struct milcan_schedule {
+  struct milcan_schedule_entry entries[MILCAN_SCHEDULE_SIZE];
+};
+
+struct milcan_a;
+
+/// @brief Reserves a slot for can_id. Returns the entry number or MILCAN_ERROR.
+extern int scheduleAdd(struct milcan_a* interface, uint16_t modulo, uint16_t slot, uint32_t can_id);
+
+/// @brief Frees an entry.
+extern int scheduleRemove(struct milcan_a* interface, int entry);
+
+/// @brief Puts a frame in an entry's mailbox to go in its next slot.
+extern int schedulePost(struct milcan_a* interface, int entry, struct milcan_frame* frame);
+
+/// @brief Sends everything whose slot has just started. Called by the event thread after each sync frame.
+extern void scheduleRelease(struct milcan_a* interface);
+
+#endif  // __SCHEDULE_H__
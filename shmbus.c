@@ -0,0 +1,428 @@
+// shmbus.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <string.h>     /* String function definitions */
+#include <unistd.h>     /* UNIX standard function definitions */
+#include <fcntl.h>      /* File control definitions */
+#include <errno.h>      /* Error number definitions */
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmbus.h"
+#include "bustime.h"
+#include "milcan.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/futex.h"
+#include "utils/timestamp.h"
+
+#define TAG "shmbus"
+
+// The virtual bus (vbus.c) for nodes in different processes, so that each ECU application can run as its own process on one machine.
+// The bus is a shared memory object (SHMBUS_NAME) holding the frame on the wire, each node's Tx queue and a ring of every frame that
+// has finished. As with vbus, nothing runs in the background: whoever reads or writes moves the bus on under the lock, arbitrates with
+// the same rules and appends finished frames to the ring. Readers don't need the lock. Each node keeps its own place in the ring and
+// its event thread sleeps on its doorbell, which is bumped and woken (futex) whenever a frame is added.
+//
+// The lock is a futex too, rather than a process shared pthread mutex, so that the layout doesn't depend on the ABI. It holds the
+// owner's pid so that if a process dies holding it the others can take it back.
+//
+// Every process must use the same clock, so don't attach a shmbus to an interface driven by milcan_poll() with a made up time.
+
+// Take the bus lock. Don't call anything that could block while holding it.
+static void shmbusLock(struct shmbus_shared* shared) {
+  uint32_t me = (uint32_t)getpid();
+  uint32_t want = me;
+  uint32_t owner = 0;
+  while(!atomic_compare_exchange_weak(&(shared->lock), &owner, want)) {
+    if(owner == 0) {
+      continue;
+    }
+    if(!(owner & SHMBUS_LOCK_WAITERS)) {
+      if(!atomic_compare_exchange_weak(&(shared->lock), &owner, owner | SHMBUS_LOCK_WAITERS)) {
+        continue;
+      }
+      owner |= SHMBUS_LOCK_WAITERS;
+    }
+    want = me | SHMBUS_LOCK_WAITERS;  // There may be others waiting, so whoever gets it next has to wake them.
+    uint64_t start = nanos();
+    futexWait(&(shared->lock), owner, SHMBUS_LOCK_CHECK_NS);
+    if((atomic_load(&(shared->lock)) == owner) && ((nanos() - start) >= SHMBUS_LOCK_CHECK_NS)) {
+      pid_t pid = owner & ~SHMBUS_LOCK_WAITERS;
+      if((kill(pid, 0) < 0) && (errno == ESRCH) && atomic_compare_exchange_strong(&(shared->lock), &owner, want)) {
+        LOGW(TAG, "Process %d died holding the bus lock. Taking it back.", pid);
+        return;
+      }
+    }
+    owner = 0;
+  }
+}
+
+static void shmbusUnlock(struct shmbus_shared* shared) {
+  if(atomic_exchange(&(shared->lock), 0) & SHMBUS_LOCK_WAITERS) {
+    futexWake(&(shared->lock));
+  }
+}
+
+// Add the frame that's just finished to the ring and ring everyone's doorbell. Call with the bus locked.
+static void shmbusPublish(struct shmbus_shared* shared) {
+  uint64_t n = atomic_load_explicit(&(shared->claimed), memory_order_relaxed);
+  atomic_store_explicit(&(shared->claimed), n + 1, memory_order_relaxed);  // Readers of the slot that we're about to overwrite will see this and drop it.
+  atomic_thread_fence(memory_order_release);  // ...so it must be seen before any of the new slot is. Pairs with the fence in shmbusRead().
+  memcpy(&(shared->ring[n % SHMBUS_RING_SIZE]), &(shared->wire), sizeof(struct vbus_frame));
+  atomic_store(&(shared->published), n + 1);
+  for(int i = 0; i < SHMBUS_MAX_NODES; i++) {
+    struct shmbus_slot* slot = &(shared->nodes[i]);
+    if(atomic_load(&(slot->pid)) != 0) {
+      atomic_fetch_add(&(slot->doorbell), 1);
+      futexWake(&(slot->doorbell));
+    }
+  }
+}
+
+// When the next frame waiting can start (UINT64_MAX if there isn't one). Call with the bus locked.
+static uint64_t shmbusNextStart(struct shmbus_shared* shared) {
+  uint64_t start = UINT64_MAX;
+  for(int i = 0; i < SHMBUS_MAX_NODES; i++) {
+    struct shmbus_slot* slot = &(shared->nodes[i]);
+    if((atomic_load(&(slot->pid)) != 0) && (slot->tx_count > 0) && (slot->tx[slot->tx_head].time < start)) {
+      start = slot->tx[slot->tx_head].time;
+    }
+  }
+  if((start != UINT64_MAX) && (start < shared->idle_since)) {
+    start = shared->idle_since;
+  }
+  return start;
+}
+
+// Run the bus up to now, exactly as vbusAdvance() does. Call with the bus locked.
+static void shmbusAdvance(struct shmbus_shared* shared, uint64_t now) {
+  for(;;) {
+    if(shared->busy) {
+      if(now < shared->wire.time) {
+        break;  // Still on the wire.
+      }
+      shmbusPublish(shared);
+      shared->busy = FALSE;
+      shared->idle_since = shared->wire.time;
+    }
+
+    uint64_t start = shmbusNextStart(shared);
+    if(start > now) {
+      break;    // Nothing to send yet.
+    }
+    struct shmbus_slot* winner = NULL;
+    uint32_t winner_key = UINT32_MAX;
+    for(int i = 0; i < SHMBUS_MAX_NODES; i++) {
+      struct shmbus_slot* slot = &(shared->nodes[i]);
+      if((atomic_load(&(slot->pid)) != 0) && (slot->tx_count > 0) && (slot->tx[slot->tx_head].time <= start)) {
+        uint32_t key = vbusArbitrationKey(&(slot->tx[slot->tx_head].frame));
+        if((winner == NULL) || (key < winner_key)) {
+          winner = slot;
+          winner_key = key;
+        }
+      }
+    }
+    uint64_t length = (vbusFrameBits(&(winner->tx[winner->tx_head].frame)) * shared->bit_ns) / shared->speedup;
+    memcpy(&(shared->wire.frame), &(winner->tx[winner->tx_head].frame), sizeof(struct can_frame));
+    shared->wire.time = start + length;
+    shared->busy = TRUE;
+    shared->frames++;
+    shared->busy_ns += length;
+    winner->tx_head = (winner->tx_head + 1) % SHMBUS_TX_SIZE;
+    winner->tx_count--;
+  }
+  atomic_store(&(shared->next_event), shared->busy ? shared->wire.time : shmbusNextStart(shared));
+}
+
+// Open (and if create is set, make) bus number and map it. Returns NULL if it can't.
+static struct shmbus_shared* shmbusMap(uint16_t number, int create, int* fd) {
+  char name[32];
+  struct stat st;
+  struct shmbus_shared* shared;
+  int created = FALSE;
+
+  snprintf(name, sizeof(name), SHMBUS_NAME, number);
+  *fd = create ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660) : -1;
+  if(*fd >= 0) {
+    created = TRUE;
+    if(ftruncate(*fd, sizeof(struct shmbus_shared)) < 0) {
+      LOGE(TAG, "Unable to size %s: %s", name, strerror(errno));
+      close(*fd);
+      shm_unlink(name);
+      return NULL;
+    }
+  } else {
+    if(create && (errno != EEXIST)) {
+      LOGE(TAG, "Unable to create %s: %s", name, strerror(errno));
+      return NULL;
+    }
+    *fd = shm_open(name, O_RDWR, 0);
+    if(*fd < 0) {
+      if(create) {
+        LOGE(TAG, "Unable to open %s: %s", name, strerror(errno));
+      }
+      return NULL;
+    }
+    // Whoever created it may not have sized it yet.
+    uint64_t until = nanos() + SHMBUS_OPEN_WAIT_NS;
+    while((fstat(*fd, &st) == 0) && (st.st_size == 0) && (nanos() < until)) {
+      usleep(1000);
+    }
+    if(st.st_size != sizeof(struct shmbus_shared)) {
+      LOGE(TAG, "%s is the wrong size. Is another version of the library using it?", name);
+      close(*fd);
+      return NULL;
+    }
+  }
+
+  shared = mmap(NULL, sizeof(struct shmbus_shared), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if(shared == MAP_FAILED) {
+    LOGE(TAG, "Unable to map %s: %s", name, strerror(errno));
+    close(*fd);
+    if(created) {
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+
+  if(created) {
+    // ftruncate() filled it with zeros.
+    shared->version = SHMBUS_VERSION;
+    shared->speedup = 1;
+    atomic_store(&(shared->next_event), UINT64_MAX);
+    atomic_store(&(shared->magic), SHMBUS_MAGIC);
+    LOGI(TAG, "Created %s", name);
+  } else {
+    uint64_t until = nanos() + SHMBUS_OPEN_WAIT_NS;
+    while((atomic_load(&(shared->magic)) != SHMBUS_MAGIC) && (nanos() < until)) {
+      usleep(1000);
+    }
+    if((atomic_load(&(shared->magic)) != SHMBUS_MAGIC) || (shared->version != SHMBUS_VERSION)) {
+      LOGE(TAG, "%s hasn't been set up or is the wrong version.", name);
+      munmap(shared, sizeof(struct shmbus_shared));
+      close(*fd);
+      return NULL;
+    }
+  }
+  return shared;
+}
+
+static void shmbusUnmap(struct shmbus_shared* shared, int fd) {
+  munmap(shared, sizeof(struct shmbus_shared));
+  close(fd);
+}
+
+/// @brief Attaches node to shared bus number (0 to SHMBUS_MAX_BUSES - 1) running at speed (MILCAN_A_250K etc.), setting the bus up if this
+/// is the first node. Returns MILCAN_OK or MILCAN_ERROR.
+int shmbusAttach(struct shmbus_node* node, uint16_t number, uint8_t speed) {
+  int fd;
+  int live = 0;
+  int index = -1;
+  uint32_t me = (uint32_t)getpid();
+
+  memset(node, 0, sizeof(struct shmbus_node));
+  node->fd = -1;
+  node->index = -1;
+  if(number >= SHMBUS_MAX_BUSES) {
+    LOGE(TAG, "There is no shared bus %u.", number);
+    return MILCAN_ERROR;
+  }
+  struct shmbus_shared* shared = shmbusMap(number, TRUE, &fd);
+  if(shared == NULL) {
+    return MILCAN_ERROR;
+  }
+
+  shmbusLock(shared);
+  for(int i = 0; i < SHMBUS_MAX_NODES; i++) {
+    struct shmbus_slot* slot = &(shared->nodes[i]);
+    uint32_t pid = atomic_load(&(slot->pid));
+    if((pid != 0) && (pid != me) && (kill(pid, 0) < 0) && (errno == ESRCH)) {
+      LOGW(TAG, "Process %u left shared bus %u without detaching.", pid, number);
+      slot->tx_count = 0;
+      atomic_store(&(slot->pid), 0);
+      pid = 0;
+    }
+    if(pid != 0) {
+      live++;
+    } else if(index < 0) {
+      index = i;
+    }
+  }
+  if(index >= 0) {
+    if(live == 0) {
+      // A new session. Start with an idle bus at our speed.
+      shared->bit_ns = busTimeBitNs(speed);
+      shared->busy = FALSE;
+      shared->idle_since = 0;
+      atomic_store(&(shared->next_event), UINT64_MAX);
+    } else if(shared->bit_ns != busTimeBitNs(speed)) {
+      LOGW(TAG, "Shared bus %u is already running at a different speed. Using its speed.", number);
+    }
+    struct shmbus_slot* slot = &(shared->nodes[index]);
+    slot->tx_head = 0;
+    slot->tx_count = 0;
+    atomic_store(&(slot->pid), me);
+    node->rx_next = atomic_load(&(shared->published));  // Only frames from now on.
+    node->doorbell_seen = atomic_load(&(slot->doorbell));
+  }
+  shmbusUnlock(shared);
+
+  if(index < 0) {
+    LOGE(TAG, "Shared bus %u already has %u nodes.", number, SHMBUS_MAX_NODES);
+    shmbusUnmap(shared, fd);
+    return MILCAN_ERROR;
+  }
+  node->shared = shared;
+  node->fd = fd;
+  node->index = index;
+  return MILCAN_OK;
+}
+
+/// @brief Detaches node from its bus. Anything it hadn't sent is dropped. The bus stays until shmbusRemove().
+void shmbusDetach(struct shmbus_node* node) {
+  struct shmbus_shared* shared = node->shared;
+  if(shared == NULL) {
+    return;
+  }
+  shmbusLock(shared);
+  shared->nodes[node->index].tx_count = 0;
+  atomic_store(&(shared->nodes[node->index].pid), 0);
+  shmbusUnlock(shared);
+  shmbusUnmap(shared, node->fd);
+  node->shared = NULL;
+  node->fd = -1;
+  node->index = -1;
+}
+
+/// @brief Queues a frame to send. It goes on the bus when it wins arbitration. Returns MILCAN_OK or MILCAN_ERROR if the Tx slots are full.
+int shmbusWrite(struct shmbus_node* node, struct can_frame* frame) {
+  struct shmbus_shared* shared = node->shared;
+  int ret = MILCAN_ERROR;
+  if(shared == NULL) {
+    return MILCAN_ERROR;
+  }
+  struct shmbus_slot* slot = &(shared->nodes[node->index]);
+  uint64_t now = nanos_cached();
+  shmbusLock(shared);
+  shmbusAdvance(shared, now);
+  if(slot->tx_count < SHMBUS_TX_SIZE) {
+    struct vbus_frame* entry = &(slot->tx[(slot->tx_head + slot->tx_count) % SHMBUS_TX_SIZE]);
+    memcpy(&(entry->frame), frame, sizeof(struct can_frame));
+    entry->time = now;
+    slot->tx_count++;
+    shmbusAdvance(shared, now); // If the bus is idle it starts now.
+    ret = MILCAN_OK;
+  }
+  shmbusUnlock(shared);
+  return ret;
+}
+
+/// @brief Gets the next received frame and when it finished on the bus. Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+int shmbusRead(struct shmbus_node* node, struct can_frame* frame, uint64_t* rx_time) {
+  struct shmbus_shared* shared = node->shared;
+  struct vbus_frame entry;
+  if(shared == NULL) {
+    return MILCAN_ERROR_EOF;
+  }
+  // Look at the doorbell before the ring, so that a frame added after we've looked rings it and the governor doesn't sleep.
+  node->doorbell_seen = atomic_load(&(shared->nodes[node->index].doorbell));
+  uint64_t now = nanos_cached();
+  if((node->rx_next == atomic_load(&(shared->published))) && (atomic_load(&(shared->next_event)) <= now)) {
+    shmbusLock(shared);
+    shmbusAdvance(shared, now);
+    shmbusUnlock(shared);
+  }
+
+  for(;;) {
+    uint64_t published = atomic_load(&(shared->published));
+    if(node->rx_next >= published) {
+      return MILCAN_ERROR_EOF;
+    }
+    if((published - node->rx_next) > SHMBUS_RING_SIZE) {
+      node->rx_dropped += published - SHMBUS_RING_SIZE - node->rx_next;
+      node->rx_next = published - SHMBUS_RING_SIZE;
+    }
+    memcpy(&entry, &(shared->ring[node->rx_next % SHMBUS_RING_SIZE]), sizeof(struct vbus_frame));
+    atomic_thread_fence(memory_order_acquire);  // Pairs with the fence in shmbusPublish(). If we saw any of a newer frame, we see its claim.
+    if((atomic_load_explicit(&(shared->claimed), memory_order_relaxed) - node->rx_next) > SHMBUS_RING_SIZE) {
+      node->rx_dropped++; // It was overwritten while we copied it.
+      node->rx_next++;
+      continue;
+    }
+    node->rx_next++;
+    memcpy(frame, &(entry.frame), sizeof(struct can_frame));
+    *rx_time = entry.time;
+    return MILCAN_OK;
+  }
+}
+
+/// @brief How many more frames can be queued with shmbusWrite().
+int shmbusTxFree(struct shmbus_node* node) {
+  if(node->shared == NULL) {
+    return 0;
+  }
+  return SHMBUS_TX_SIZE - node->shared->nodes[node->index].tx_count;
+}
+
+/// @brief When the bus next has something to do (a frame finishing or starting). UINT64_MAX if nothing is waiting.
+uint64_t shmbusNextEvent(struct shmbus_node* node) {
+  if(node->shared == NULL) {
+    return UINT64_MAX;
+  }
+  return atomic_load(&(node->shared->next_event));
+}
+
+/// @brief The word that node's event thread should sleep on (see governorSetFutex()).
+_Atomic uint32_t* shmbusDoorbell(struct shmbus_node* node) {
+  return &(node->shared->nodes[node->index].doorbell);
+}
+
+/// @brief Makes frames on bus number take 1/speedup of their real time (1 is wire rate, VBUS_UNPACED is no time at all).
+/// Sets the bus up if it doesn't exist yet. Returns MILCAN_OK or MILCAN_ERROR.
+int shmbusSetSpeedup(uint16_t number, uint32_t speedup) {
+  int fd;
+  if((number >= SHMBUS_MAX_BUSES) || (speedup == 0)) {
+    return MILCAN_ERROR;
+  }
+  struct shmbus_shared* shared = shmbusMap(number, TRUE, &fd);
+  if(shared == NULL) {
+    return MILCAN_ERROR;
+  }
+  shmbusLock(shared);
+  shared->speedup = speedup;
+  shmbusUnlock(shared);
+  shmbusUnmap(shared, fd);
+  return MILCAN_OK;
+}
+
+/// @brief Reads how many frames bus number has carried and for how long it has been busy. Returns MILCAN_OK or MILCAN_ERROR.
+int shmbusGetStats(uint16_t number, uint64_t* frames, uint64_t* busy_ns) {
+  int fd;
+  if(number >= SHMBUS_MAX_BUSES) {
+    return MILCAN_ERROR;
+  }
+  struct shmbus_shared* shared = shmbusMap(number, FALSE, &fd);
+  if(shared == NULL) {
+    return MILCAN_ERROR;
+  }
+  shmbusLock(shared);
+  *frames = shared->frames;
+  *busy_ns = shared->busy_ns;
+  shmbusUnlock(shared);
+  shmbusUnmap(shared, fd);
+  return MILCAN_OK;
+}
+
+/// @brief Removes bus number from the system. Processes still attached keep using it, but anything attaching later gets a new bus.
+int shmbusRemove(uint16_t number) {
+  char name[32];
+  if(number >= SHMBUS_MAX_BUSES) {
+    return MILCAN_ERROR;
+  }
+  snprintf(name, sizeof(name), SHMBUS_NAME, number);
+  if(shm_unlink(name) < 0) {
+    return MILCAN_ERROR;
+  }
+  return MILCAN_OK;
+}
@@ -0,0 +1,91 @@
+// shmbus.h
+#ifndef __SHMBUS_H__
+#define __SHMBUS_H__
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "can.h"
+#include "vbus.h"
+
+#define SHMBUS_MAX_BUSES      (16)                  // Bus numbers 0 to 15.
+#define SHMBUS_MAX_NODES      (32)                  // How many interfaces (in any number of processes) can attach to one bus.
+#define SHMBUS_RING_SIZE      (1024)                // Frames kept for the nodes to read. A node that falls further behind loses frames.
+#define SHMBUS_TX_SIZE        (16)                  // Frames each node can have waiting to win arbitration.
+#define SHMBUS_NAME           "/milcan_shmbus%u"    // The shm_open() name of each bus.
+#define SHMBUS_MAGIC          (0x4D43534D)          // Set once the bus has been set up.
+#define SHMBUS_VERSION        (1)                   // Change this if struct shmbus_shared changes.
+#define SHMBUS_OPEN_WAIT_NS   (1000000000L)         // How long to wait for another process to finish setting up the bus.
+#define SHMBUS_LOCK_CHECK_NS  (10000000L)           // How often someone waiting for the lock checks that its owner is still alive.
+#define SHMBUS_LOCK_WAITERS   (0x80000000)          // Set in the lock while anyone is waiting for it.
+
+/// @brief One node's place on a shared bus. In shared memory.
+struct shmbus_slot {
+  _Atomic uint32_t pid;                   // The process that has it (0 if it's free).
+  _Atomic uint32_t doorbell;              // Bumped whenever there's a new frame to read. The node's event thread sleeps on it.
+  struct vbus_frame tx[SHMBUS_TX_SIZE];   // Frames waiting for the bus, oldest first.
+  uint32_t tx_head;
+  uint32_t tx_count;
+};
+
+/// @brief A simulated CAN bus in shared memory. There are no pointers in it, so purecap and hybrid processes can share it.
+struct shmbus_shared {
+  _Atomic uint32_t magic;                 // SHMBUS_MAGIC once it's been set up.
+  uint32_t version;                       // SHMBUS_VERSION.
+  _Atomic uint32_t lock;                  // 0 or the pid of the process that holds it, with SHMBUS_LOCK_WAITERS if anyone's waiting.
+  uint32_t speedup;                       // 1 runs at wire rate. See shmbusSetSpeedup().
+  uint64_t bit_ns;                        // One bit at the bus speed.
+  uint8_t busy;                           // Is a frame on the wire?
+  struct vbus_frame wire;                 // The frame on the wire and when it finishes.
+  uint64_t idle_since;                    // When the bus last went idle.
+  _Atomic uint64_t next_event;            // When the bus next has something to do (UINT64_MAX for nothing).
+  uint64_t frames;                        // Frames sent on the bus.
+  uint64_t busy_ns;                       // Time the bus has been busy.
+  _Atomic uint64_t claimed;               // Frames that have been (or are being) written to ring.
+  _Atomic uint64_t published;             // Frames that can be read from ring.
+  struct vbus_frame ring[SHMBUS_RING_SIZE]; // Every frame that's finished, with the time that it finished.
+  struct shmbus_slot nodes[SHMBUS_MAX_NODES];
+};
+
+/// @brief One interface's connection to a shared bus. In the process's own memory.
+struct shmbus_node {
+  struct shmbus_shared* shared;           // NULL if not attached.
+  int fd;                                 // The shared memory object.
+  int index;                              // Our slot in shared->nodes.
+  uint64_t rx_next;                       // The next frame in the ring to read.
+  uint64_t rx_dropped;                    // Frames lost because we fell too far behind.
+  uint32_t doorbell_seen;                 // The doorbell when we last found nothing to read. See governorSetFutex().
+};
+
+/// @brief Attaches node to shared bus number (0 to SHMBUS_MAX_BUSES - 1) running at speed (MILCAN_A_250K etc.), setting the bus up if this
+/// is the first node. Returns MILCAN_OK or MILCAN_ERROR.
+extern int shmbusAttach(struct shmbus_node* node, uint16_t number, uint8_t speed);
+
+/// @brief Detaches node from its bus. Anything it hadn't sent is dropped. The bus stays until shmbusRemove().
+extern void shmbusDetach(struct shmbus_node* node);
+
+/// @brief Queues a frame to send. It goes on the bus when it wins arbitration. Returns MILCAN_OK or MILCAN_ERROR if the Tx slots are full.
+extern int shmbusWrite(struct shmbus_node* node, struct can_frame* frame);
+
+/// @brief Gets the next received frame and when it finished on the bus. Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+extern int shmbusRead(struct shmbus_node* node, struct can_frame* frame, uint64_t* rx_time);
+
+/// @brief How many more frames can be queued with shmbusWrite().
+extern int shmbusTxFree(struct shmbus_node* node);
+
+/// @brief When the bus next has something to do (a frame finishing or starting). UINT64_MAX if nothing is waiting.
+extern uint64_t shmbusNextEvent(struct shmbus_node* node);
+
+/// @brief The word that node's event thread should sleep on (see governorSetFutex()).
+extern _Atomic uint32_t* shmbusDoorbell(struct shmbus_node* node);
+
+/// @brief Makes frames on bus number take 1/speedup of their real time (1 is wire rate, VBUS_UNPACED is no time at all).
+/// Sets the bus up if it doesn't exist yet. Returns MILCAN_OK or MILCAN_ERROR.
+extern int shmbusSetSpeedup(uint16_t number, uint32_t speedup);
+
+/// @brief Reads how many frames bus number has carried and for how long it has been busy. Returns MILCAN_OK or MILCAN_ERROR.
+extern int shmbusGetStats(uint16_t number, uint64_t* frames, uint64_t* busy_ns);
+
+/// @brief Removes bus number from the system. Processes still attached keep using it, but anything attaching later gets a new bus.
+extern int shmbusRemove(uint16_t number);
+
+#endif  // __SHMBUS_H__
@@ -0,0 +1,241 @@
+// socketcan.c
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // struct mmsghdr, recvmmsg() and sendmmsg()
+#endif
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>     /* String function definitions */
+#include <unistd.h>     /* UNIX standard function definitions */
+#include <fcntl.h>      /* File control definitions */
+#include <errno.h>      /* Error number definitions */
+#include <inttypes.h>
+#include "socketcan.h"
+#include "milcan.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+
+#define TAG "SocketCAN"
+
+// Linux SocketCAN raw sockets. Every syscall is expensive next to a CAN frame, so received frames are read SOCKETCAN_BATCH at a time
+// with recvmmsg() and handed out one at a time, and frames to send are collected and sent together with sendmmsg(). The kernel time
+// stamps each frame as it's received (SO_TIMESTAMPING) so the time that we see a frame doesn't depend on how quickly we poll.
+
+#ifdef __linux__
+#include <sys/socket.h> // Sockets
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+
+#ifndef PF_CAN
+#define PF_CAN  (29)
+#endif
+#define SOCKETCAN_CAN_RAW (1)
+
+// can.h already defines struct can_frame (the same layout as the kernel's) so we can't include linux/can.h as well. This is the start
+// of its struct sockaddr_can, which is all that CAN_RAW looks at.
+struct socketcan_sockaddr {
+  sa_family_t can_family;
+  int can_ifindex;
+  uint32_t rx_id;
+  uint32_t tx_id;
+};
+
+struct socketcan_msgs {
+  struct mmsghdr rx_msgs[SOCKETCAN_BATCH];
+  struct iovec rx_iov[SOCKETCAN_BATCH];
+  uint8_t rx_control[SOCKETCAN_BATCH][64];      // Room for the SCM_TIMESTAMPING control message.
+  struct mmsghdr tx_msgs[SOCKETCAN_BATCH];
+  struct iovec tx_iov[SOCKETCAN_BATCH];
+};
+
+/// @brief Opens the SocketCAN interface name (e.g. "can0" or "vcan0"). The bit rate is set outside of us (e.g. with ip link). Returns MILCAN_OK or MILCAN_ERROR.
+int socketcanOpen(struct socketcan_ctx* ctx, const char* name) {
+  struct ifreq ifr;
+  struct socketcan_sockaddr addr;
+
+  memset(ctx, 0, sizeof(struct socketcan_ctx));
+  snprintf(ctx->name, sizeof(ctx->name), "%s", name);
+  ctx->msgs = calloc(1, sizeof(struct socketcan_msgs));
+  if(ctx->msgs == NULL) {
+    LOGE(TAG, "Unable to allocate the message headers for %s", ctx->name);
+    ctx->fd = -1;
+    return MILCAN_ERROR_MEM;
+  }
+  ctx->fd = socket(PF_CAN, SOCK_RAW, SOCKETCAN_CAN_RAW);
+  if(ctx->fd < 0) {
+    LOGE(TAG, "Unable to open a CAN socket: %s", strerror(errno));
+    socketcanClose(ctx);
+    return MILCAN_ERROR;
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ctx->name);
+  if(ioctl(ctx->fd, SIOCGIFINDEX, &ifr) < 0) {
+    LOGE(TAG, "No such interface %s: %s", ctx->name, strerror(errno));
+    socketcanClose(ctx);
+    return MILCAN_ERROR;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = PF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if(bind(ctx->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    LOGE(TAG, "Unable to bind to %s: %s", ctx->name, strerror(errno));
+    socketcanClose(ctx);
+    return MILCAN_ERROR;
+  }
+  if((ioctl(ctx->fd, SIOCGIFFLAGS, &ifr) == 0) && !(ifr.ifr_flags & IFF_UP)) {
+    LOGW(TAG, "%s is down. Set the bit rate and bring it up with ip link first.", ctx->name);
+  }
+
+  int stamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if(setsockopt(ctx->fd, SOL_SOCKET, SO_TIMESTAMPING, &stamping, sizeof(stamping)) < 0) {
+    LOGW(TAG, "No kernel Rx time stamps on %s: %s", ctx->name, strerror(errno));
+  }
+  fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL, 0) | O_NONBLOCK);
+
+  // The message headers never change, so set them up once.
+  struct socketcan_msgs* m = ctx->msgs;
+  for(int i = 0; i < SOCKETCAN_BATCH; i++) {
+    m->rx_iov[i].iov_base = &(ctx->rx_frames[i]);
+    m->rx_iov[i].iov_len = sizeof(struct can_frame);
+    m->rx_msgs[i].msg_hdr.msg_iov = &(m->rx_iov[i]);
+    m->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    m->rx_msgs[i].msg_hdr.msg_control = m->rx_control[i];
+    m->tx_iov[i].iov_base = &(ctx->tx_frames[i]);
+    m->tx_iov[i].iov_len = sizeof(struct can_frame);
+    m->tx_msgs[i].msg_hdr.msg_iov = &(m->tx_iov[i]);
+    m->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  LOGI(TAG, "Opened %s", ctx->name);
+  return MILCAN_OK;
+}
+
+/// @brief Closes the socket.
+void socketcanClose(struct socketcan_ctx* ctx) {
+  if(ctx->fd >= 0) {
+    close(ctx->fd);
+  }
+  free(ctx->msgs);
+  ctx->msgs = NULL;
+  ctx->fd = -1;
+  ctx->rx_count = 0;
+  ctx->rx_next = 0;
+  ctx->tx_count = 0;
+}
+
+// Read the next batch. The kernel's time stamps are CLOCK_REALTIME so they're moved onto the nanos() time base.
+static int socketcanReadBatch(struct socketcan_ctx* ctx) {
+  struct socketcan_msgs* m = ctx->msgs;
+  if(m == NULL) {
+    return 0;
+  }
+  for(int i = 0; i < SOCKETCAN_BATCH; i++) {
+    m->rx_msgs[i].msg_hdr.msg_controllen = sizeof(m->rx_control[i]);
+  }
+  int n = recvmmsg(ctx->fd, m->rx_msgs, SOCKETCAN_BATCH, MSG_DONTWAIT, NULL);
+  if(n <= 0) {
+    return 0;
+  }
+  struct timespec rt;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  uint64_t offset = ((uint64_t)rt.tv_sec * 1000000000L) + rt.tv_nsec - nanos();
+
+  for(int i = 0; i < n; i++) {
+    ctx->rx_times[i] = 0;
+    for(struct cmsghdr* c = CMSG_FIRSTHDR(&(m->rx_msgs[i].msg_hdr)); c != NULL; c = CMSG_NXTHDR(&(m->rx_msgs[i].msg_hdr), c)) {
+      if((c->cmsg_level == SOL_SOCKET) && (c->cmsg_type == SO_TIMESTAMPING)) {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(c), sizeof(ts));  // The first of the three is the software time stamp.
+        uint64_t stamp = ((uint64_t)ts.tv_sec * 1000000000L) + ts.tv_nsec;
+        if(stamp > offset) {
+          ctx->rx_times[i] = stamp - offset;
+        }
+      }
+    }
+  }
+  ctx->rx_count = n;
+  ctx->rx_next = 0;
+  return n;
+}
+
+/// @brief Gets the next received frame, reading up to SOCKETCAN_BATCH frames with one recvmmsg() when the last batch has been used.
+/// rx_time is set to when the kernel received it (0 if unknown). Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+int socketcanRead(struct socketcan_ctx* ctx, struct can_frame* frame, uint64_t* rx_time) {
+  while(ctx->rx_next < ctx->rx_count || socketcanReadBatch(ctx) > 0) {
+    uint32_t i = ctx->rx_next++;
+    if(ctx->msgs->rx_msgs[i].msg_len != sizeof(struct can_frame)) {
+      continue; // Not a classic CAN frame.
+    }
+    memcpy(frame, &(ctx->rx_frames[i]), sizeof(struct can_frame));
+    *rx_time = ctx->rx_times[i];
+    return MILCAN_OK;
+  }
+  return MILCAN_ERROR_EOF;
+}
+
+/// @brief Sends the Tx batch with one sendmmsg(). Anything the kernel won't take yet stays for the next flush. Returns how many are left.
+int socketcanFlush(struct socketcan_ctx* ctx) {
+  if(ctx->tx_count == 0) {
+    return 0;
+  }
+  if(ctx->msgs == NULL) {
+    return ctx->tx_count;
+  }
+  int n = sendmmsg(ctx->fd, ctx->msgs->tx_msgs, ctx->tx_count, MSG_DONTWAIT);
+  if(n < 0) {
+    if((errno != EAGAIN) && (errno != ENOBUFS)) {
+      LOGE(TAG, "Unable to send on %s: %s", ctx->name, strerror(errno));
+    }
+    return ctx->tx_count;
+  }
+  if((uint32_t)n < ctx->tx_count) {
+    memmove(&(ctx->tx_frames[0]), &(ctx->tx_frames[n]), sizeof(struct can_frame) * (ctx->tx_count - n));
+  }
+  ctx->tx_count -= n;
+  return ctx->tx_count;
+}
+
+#else
+
+/// @brief Opens the SocketCAN interface name (e.g. "can0" or "vcan0"). The bit rate is set outside of us (e.g. with ip link). Returns MILCAN_OK or MILCAN_ERROR.
+int socketcanOpen(struct socketcan_ctx* ctx, const char* name) {
+  memset(ctx, 0, sizeof(struct socketcan_ctx));
+  ctx->fd = -1;
+  LOGE(TAG, "SocketCAN is only available on Linux.");
+  return MILCAN_ERROR;
+}
+
+/// @brief Closes the socket.
+void socketcanClose(struct socketcan_ctx* ctx) {
+  ctx->fd = -1;
+}
+
+/// @brief Gets the next received frame. Returns MILCAN_ERROR_EOF.
+int socketcanRead(struct socketcan_ctx* ctx, struct can_frame* frame, uint64_t* rx_time) {
+  return MILCAN_ERROR_EOF;
+}
+
+/// @brief Sends the Tx batch. Returns how many are left.
+int socketcanFlush(struct socketcan_ctx* ctx) {
+  return ctx->tx_count;
+}
+
+#endif  // __linux__
+
+/// @brief Adds a frame to the Tx batch, sending the batch first if it's full. Returns MILCAN_OK or MILCAN_ERROR if there's no room.
+int socketcanWrite(struct socketcan_ctx* ctx, struct can_frame* frame) {
+  if((ctx->tx_count >= SOCKETCAN_BATCH) && (socketcanFlush(ctx) >= SOCKETCAN_BATCH)) {
+    return MILCAN_ERROR;
+  }
+  memcpy(&(ctx->tx_frames[ctx->tx_count]), frame, sizeof(struct can_frame));
+  ctx->tx_count++;
+  return MILCAN_OK;
+}
+
+/// @brief How many more frames can be added to the Tx batch.
+int socketcanTxFree(struct socketcan_ctx* ctx) {
+  return SOCKETCAN_BATCH - ctx->tx_count;
+}
@@ -0,0 +1,45 @@
+// socketcan.h
+#ifndef __SOCKETCAN_H__
+#define __SOCKETCAN_H__
+
+#include <inttypes.h>
+#include "can.h"
+
+#define SOCKETCAN_BATCH         (32)  // The most frames moved by one recvmmsg() or sendmmsg().
+#define SOCKETCAN_NAME_LENGTH   (16)  // IFNAMSIZ
+
+struct socketcan_msgs;  // The recvmmsg() and sendmmsg() headers. Only socketcan.c needs to know what's in them.
+
+/// @brief A SocketCAN raw socket, with the buffers for batched Rx and Tx.
+struct socketcan_ctx {
+  int fd;                                       // The CAN_RAW socket (-1 if it isn't open).
+  char name[SOCKETCAN_NAME_LENGTH];             // e.g. can0 or vcan0.
+  struct can_frame rx_frames[SOCKETCAN_BATCH];  // The last batch read.
+  uint64_t rx_times[SOCKETCAN_BATCH];           // When the kernel received each one (nanos() time base, 0 if we don't know).
+  uint32_t rx_count;                            // How many frames are in the batch.
+  uint32_t rx_next;                             // The next one to hand out.
+  struct can_frame tx_frames[SOCKETCAN_BATCH];  // Frames waiting for the next sendmmsg().
+  uint32_t tx_count;                            // How many there are.
+  struct socketcan_msgs* msgs;                  // Allocated by socketcanOpen() and freed by socketcanClose().
+};
+
+/// @brief Opens the SocketCAN interface name (e.g. "can0" or "vcan0"). The bit rate is set outside of us (e.g. with ip link). Returns MILCAN_OK or MILCAN_ERROR.
+extern int socketcanOpen(struct socketcan_ctx* ctx, const char* name);
+
+/// @brief Closes the socket.
+extern void socketcanClose(struct socketcan_ctx* ctx);
+
+/// @brief Gets the next received frame, reading up to SOCKETCAN_BATCH frames with one recvmmsg() when the last batch has been used.
+/// rx_time is set to when the kernel received it (0 if unknown). Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+extern int socketcanRead(struct socketcan_ctx* ctx, struct can_frame* frame, uint64_t* rx_time);
+
+/// @brief Adds a frame to the Tx batch, sending the batch first if it's full. Returns MILCAN_OK or MILCAN_ERROR if there's no room.
+extern int socketcanWrite(struct socketcan_ctx* ctx, struct can_frame* frame);
+
+/// @brief Sends the Tx batch with one sendmmsg(). Anything the kernel won't take yet stays for the next flush. Returns how many are left.
+extern int socketcanFlush(struct socketcan_ctx* ctx);
+
+/// @brief How many more frames can be added to the Tx batch.
+extern int socketcanTxFree(struct socketcan_ctx* ctx);
+
+#endif  // __SOCKETCAN_H__
@@ -0,0 +1,93 @@
+// syncest.c
+#include <inttypes.h>
+#include <string.h>     /* String function definitions */
+#include "syncest.h"
+
+// Slaves only know when they received each sync frame, which includes all of the Rx latency jitter. Fitting a line through the last
+// SYNC_EST_WINDOW (counter, time) pairs gives the Sync Master's actual period and phase, so slot boundaries can be predicted.
+
+/// @brief Starts an estimator with no samples.
+void syncEstInit(struct sync_estimator* est, uint64_t nominal_ns) {
+  memset(est, 0, sizeof(struct sync_estimator));
+  est->nominal_ns = nominal_ns;
+  est->period_ns = (double)nominal_ns;
+}
+
+/// @brief Forgets all the samples (e.g. when the Sync Master changes).
+void syncEstReset(struct sync_estimator* est) {
+  uint8_t source = est->source;
+  syncEstInit(est, est->nominal_ns);
+  est->source = source;
+}
+
+// Least squares fit of t against k over the window. Everything is relative to the oldest sample to keep the doubles precise.
+static void syncEstFit(struct sync_estimator* est) {
+  uint8_t oldest = (est->head + SYNC_EST_WINDOW - est->count) % SYNC_EST_WINDOW;
+  int64_t k0 = est->k[oldest];
+  uint64_t t0 = est->t[oldest];
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  double n = est->count;
+
+  for(uint8_t i = 0; i < est->count; i++) {
+    uint8_t s = (oldest + i) % SYNC_EST_WINDOW;
+    double x = (double)(est->k[s] - k0);
+    double y = (double)(est->t[s] - t0);
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  double den = (n * sxx) - (sx * sx);
+  double period = est->nominal_ns;
+  if(den > 0) {
+    period = ((n * sxy) - (sx * sy)) / den;
+  }
+  if((period < (est->nominal_ns * (1.0 - SYNC_EST_MAX_ERROR_PC))) || (period > (est->nominal_ns * (1.0 + SYNC_EST_MAX_ERROR_PC)))) {
+    period = est->nominal_ns;  // Not enough spread in the samples yet (or they're nonsense).
+  }
+  double intercept = (sy - (period * sx)) / n;
+  est->period_ns = period;
+  est->phase_ns = t0 + (uint64_t)(intercept + (period * (double)(est->last_k - k0)));
+}
+
+/// @brief Adds a sync frame seen at time t. Returns the unwrapped counter.
+int64_t syncEstAdd(struct sync_estimator* est, uint16_t counter, uint64_t t) {
+  counter &= SYNC_EST_COUNTER_MASK;
+  if(est->count == 0) {
+    est->last_k = counter;
+  } else {
+    // Pick the step (modulo the counter size) that best matches the time that has passed.
+    int64_t elapsed = (int64_t)((t - est->last_t + (uint64_t)(est->period_ns / 2)) / (uint64_t)est->period_ns);
+    int64_t step = (counter - est->last_counter) & SYNC_EST_COUNTER_MASK;
+    if(step == 0) {
+      return est->last_k;  // We've seen this one.
+    }
+    step += ((elapsed - step + (SYNC_EST_COUNTER_MASK / 2)) / (SYNC_EST_COUNTER_MASK + 1)) * (SYNC_EST_COUNTER_MASK + 1);
+    if((step <= 0) || (step > (SYNC_EST_WINDOW * 4))) {
+      // The counter has jumped a long way from where it should be. Whatever we had no longer applies.
+      int64_t k = est->last_k + ((step > 0) ? step : 1);
+      syncEstReset(est);
+      est->last_k = k;
+    } else {
+      est->last_k += step;
+    }
+  }
+  est->last_counter = counter;
+  est->last_t = t;
+  est->k[est->head] = est->last_k;
+  est->t[est->head] = t;
+  est->head = (est->head + 1) % SYNC_EST_WINDOW;
+  if(est->count < SYNC_EST_WINDOW) {
+    est->count++;
+  }
+  syncEstFit(est);
+  return est->last_k;
+}
+
+/// @brief Returns the estimated time of the sync frame with the unwrapped counter k. 0 if we have no samples.
+uint64_t syncEstTimeOf(struct sync_estimator* est, int64_t k) {
+  if(est->count == 0) {
+    return 0;
+  }
+  return est->phase_ns + (int64_t)(est->period_ns * (double)(k - est->last_k));
+}
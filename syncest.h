@@ -0,0 +1,38 @@
+// syncest.h
+#ifndef __SYNCEST_H__
+#define __SYNCEST_H__
+
+#include <inttypes.h>
+
+#define SYNC_EST_WINDOW         (32)    // How many sync frames the regression is fitted over.
+#define SYNC_EST_MAX_ERROR_PC   (0.05)  // Discard a fitted period more than 5% from the nominal PTU.
+#define SYNC_EST_COUNTER_MASK   (0x03FF)  // The same as MILCAN_A_SYNC_COUNT_MASK.
+
+/// @brief Estimates the Sync Master's period and phase from the times that we see its sync frames.
+struct sync_estimator {
+  uint64_t nominal_ns;            // The PTU that we were configured with.
+  uint8_t source;                 // Who sent the sync frames in the window (the Sync Master).
+  uint64_t t[SYNC_EST_WINDOW];    // When each sync frame was seen.
+  int64_t k[SYNC_EST_WINDOW];     // Its sync counter, unwrapped.
+  uint8_t count;                  // How many samples are in the window.
+  uint8_t head;                   // Where the next sample goes.
+  uint16_t last_counter;          // The last (wrapped) sync counter.
+  int64_t last_k;                 // The last unwrapped sync counter.
+  uint64_t last_t;                // When the last sync frame was seen.
+  double period_ns;               // The estimated PTU.
+  uint64_t phase_ns;              // The estimated time of sync frame last_k.
+};
+
+/// @brief Starts an estimator with no samples.
+extern void syncEstInit(struct sync_estimator* est, uint64_t nominal_ns);
+
+/// @brief Forgets all the samples (e.g. when the Sync Master changes).
+extern void syncEstReset(struct sync_estimator* est);
+
+/// @brief Adds a sync frame seen at time t. Returns the unwrapped counter.
+extern int64_t syncEstAdd(struct sync_estimator* est, uint16_t counter, uint64_t t);
+
+/// @brief Returns the estimated time of the sync frame with the unwrapped counter k. 0 if we have no samples.
+extern uint64_t syncEstTimeOf(struct sync_estimator* est, int64_t k);
+
+#endif  // __SYNCEST_H__
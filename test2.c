@@ -8,7 +8,9 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h>
 #include <sys/un.h>     // ?
+#ifndef __linux__
 #include <sys/event.h>  // Events
+#endif
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
@@ -20,7 +22,9 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <limits.h>
+#ifndef __linux__
 #include <sys/rtprio.h>
+#endif
 
 #define LOG_LEVEL 3
 #include "utils/logs.h"
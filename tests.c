@@ -8,7 +8,9 @@
 #include <sys/socket.h> // Sockets
 #include <netinet/in.h>
 #include <sys/un.h>     // ?
+#ifndef __linux__
 #include <sys/event.h>  // Events
+#endif
 #include <assert.h>     // The assert function
 #include <unistd.h>     // ?
 #include <stdint.h>
@@ -20,13 +22,21 @@
 #include <stdarg.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifndef __linux__
 #include <sys/rtprio.h>
+#endif
 
 // #define LOG_LEVEL 3
 #include "utils/logs.h"
 #include "utils/timestamp.h"
 #include "utils/priorities.h"
 #include "milcan.h"
+#include "vbus.h"
+#include "replay.h"
+#include "capture.h"
+#include <arpa/inet.h>
 // #include "interfaces.h"
 
 #define TAG "test"
@@ -1645,6 +1655,600 @@ int test4(uint8_t testNo, uint16_t syncFreqHz,
   return ret;
 }
 
+// Print how long each stage of startup took, from milcan_open() being called.
+void startupResults(void* device) {
+  struct milcan_startup_times t;
+  milcan_get_startup_times(device, &t);
+  const char* names[] = {"Driver loaded", "Device opened", "Bit timing set", "milcan_open() returned", "Pre-Operational", "First sync frame", "Operational", "First application frame"};
+  uint64_t times[] = {t.driver_loaded, t.device_opened, t.bit_timing_set, t.ready, t.pre_operational, t.first_sync, t.operational, t.first_frame};
+  for(int i = 0; i < 8; i++) {
+    if(times[i] == 0) {
+      printf("    %-24s\tnever\n", names[i]);
+    } else {
+      printf("    %-24s\t%10.3fms\n", names[i], (double)(times[i] - t.open_called) / 1000000.0);
+    }
+  }
+}
+
+// Startup latency. Device 0 is the Sync Master and sends a heartbeat. Measure how long device 1 takes from milcan_open() to receiving
+// it, then close and reopen device 1 to see how much a warm start saves.
+int testStartup(uint8_t testNo, uint16_t syncFreqHz, uint8_t device0type, uint8_t device0num, uint8_t device0addr, uint8_t device1type, uint8_t device1num, uint8_t device1addr, uint16_t options) {
+  int ret = EXIT_SUCCESS;
+  struct milcan_frame framein;
+  struct milcan_frame heartbeat;
+  struct milcan_startup_times t;
+  uint64_t heartbeatPeriodNs = MS_TO_NS(HEARTBEAT_PERIOD_MS);
+
+  memset(&heartbeat, 0, sizeof(struct milcan_frame));
+  heartbeat.frame_type = MILCAN_FRAME_TYPE_MESSAGE;
+  heartbeat.frame.can_id = MILCAN_MAKE_ID(1, 0, 11, 12, device0addr);
+  heartbeat.frame.len = 2;
+  heartbeat.frame.data[0] = 0x00;
+  heartbeat.frame.data[1] = 0x5A;
+
+  printf("Starting Test %u\n", testNo);
+  printf("Device 0: ");
+  printDeviceType(device0type);
+  printf(" %u on address %u as Sync Master.\n", device0num, device0addr);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, device0addr, device0type, device0num, MILCAN_A_OPTION_SYNC_MASTER | options);
+  if(device0 == NULL) {
+    LOGE(TAG, "Unable to open device0.");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+
+  for(int pass = 0; (pass < 2) && (ret == EXIT_SUCCESS); pass++) {
+    printf("Device 1 (%s start): ", (pass == 0) ? "cold" : "warm");
+    printDeviceType(device1type);
+    printf(" %u on address %u.\n", device1num, device1addr);
+    device1 = milcan_open(MILCAN_A_500K, syncFreqHz, device1addr, device1type, device1num, options);
+    if(device1 == NULL) {
+      LOGE(TAG, "Unable to open device1.");
+      tidyTestsExit();
+      return EXIT_FAILURE;
+    }
+    uint64_t timeout = nanos() + SECS_TO_NS(10);
+    uint64_t heartbeat_time = nanos();
+    do {
+      if(nanos() >= heartbeat_time) {
+        milcan_send(device0, &heartbeat);
+        heartbeat_time += heartbeatPeriodNs;
+      }
+      while(milcan_recv(device0, &framein) > 0);  // We don't care what device 0 receives.
+      while(milcan_recv(device1, &framein) > 0);
+      milcan_get_startup_times(device1, &t);
+      usleep(SLEEP_TIME_US);
+    } while((t.first_frame == 0) && (nanos() < timeout));
+    startupResults(device1);
+    if(t.first_frame == 0) {
+      ret = EXIT_FAILURE;
+    }
+    milcan_close(device1);
+    device1 = NULL;
+  }
+
+  milcan_close(device0);
+  device0 = NULL;
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
+// Tx complete notifications. Device 0 is the Sync Master, opened with MILCAN_A_OPTION_TX_COMPLETE. Once it's Operational it queues
+// frameCount frames in bursts and should get a MILCAN_FRAME_TYPE_TX_COMPLETE frame back for every one of them.
+int testTxComplete(uint8_t testNo, uint16_t syncFreqHz, uint8_t device0type, uint8_t device0num, uint8_t device0addr, uint8_t device1type, uint8_t device1num, uint8_t device1addr, uint32_t frameCount) {
+  int ret = EXIT_SUCCESS;
+  struct milcan_frame framein;
+  struct milcan_frame frameout;
+  struct milcan_status status;
+  struct milcan_stats stats;
+  uint32_t queued = 0, completed = 0;
+  uint64_t latency_total = 0;
+
+  memset(&frameout, 0, sizeof(struct milcan_frame));
+  frameout.frame_type = MILCAN_FRAME_TYPE_MESSAGE;
+  frameout.frame.can_id = MILCAN_MAKE_ID(1, 0, 11, 12, device0addr);
+  frameout.frame.len = 4;
+
+  printf("Starting Test %u\n", testNo);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, device0addr, device0type, device0num, MILCAN_A_OPTION_SYNC_MASTER | MILCAN_A_OPTION_TX_COMPLETE);
+  device1 = milcan_open(MILCAN_A_500K, syncFreqHz, device1addr, device1type, device1num, 0);
+  if((device0 == NULL) || (device1 == NULL)) {
+    LOGE(TAG, "Unable to open the devices.");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+
+  uint64_t timeout = nanos() + SECS_TO_NS(20);
+  do {
+    milcan_get_status(device0, &status);
+    if((status.mode == MILCAN_A_MODE_OPERATIONAL) && (queued < frameCount) && (queued == completed)) {
+      for(int burst = 0; (burst < 20) && (queued < frameCount); burst++, queued++) {
+        frameout.frame.data[0] = queued & 0xFF;
+        frameout.frame.data[1] = (queued >> 8) & 0xFF;
+        milcan_send(device0, &frameout);
+      }
+    }
+    while(milcan_recv(device0, &framein) > 0) {
+      if(framein.frame_type == MILCAN_FRAME_TYPE_TX_COMPLETE) {
+        completed++;
+        latency_total += framein.rx_timestamp - framein.tx_queued;
+      }
+    }
+    while(milcan_recv(device1, &framein) > 0);
+    usleep(SLEEP_TIME_US);
+  } while((completed < frameCount) && (nanos() < timeout));
+
+  milcan_get_stats(device0, &stats);
+  printf("Queued %u, completed %u (%u unconfirmed, %u requeued)\n", queued, completed, stats.tx_unconfirmed, stats.tx_requeued);
+  if(completed > 0) {
+    printf("Queue to wire latency: average %luns, max %luns\n", latency_total / completed, stats.tx_latency_max_ns);
+  }
+  if(completed != frameCount) {
+    ret = EXIT_FAILURE;
+  }
+  milcan_close(device1);
+  device1 = NULL;
+  milcan_close(device0);
+  device0 = NULL;
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
+// Records syncFreqHz sync frames from syncMaster for seconds, each followed by a message, and plays it back through the state machine
+// on a made up clock (MILCAN_A_OPTION_NO_THREAD) at the recorded timing. The node should follow the Sync Master into Operational mode
+// and, from then on, receive every message, in much less than the real time.
+#define REPLAY_TEST_FILE  "/tmp/milcan_replay.log"
+
+// Asks for the time to the next sync from a thread that has never polled, so has no time of its own.
+static void * timeToNextSync(void * result) {
+  *((int64_t*)result) = milcan_time_to_next_sync(device0);
+  return NULL;
+}
+
+int testReplay(uint8_t testNo, uint16_t syncFreqHz, uint8_t syncMaster, uint8_t deviceaddr, uint16_t seconds) {
+  int ret = EXIT_SUCCESS;
+  struct milcan_frame framein;
+  struct milcan_status status;
+  struct milcan_stats stats;
+  uint32_t syncs = syncFreqHz * seconds, received = 0, first = 0;
+  uint32_t message_id = MILCAN_MAKE_ID(1, 0, 11, 12, syncMaster);
+  uint64_t period_us = 1000000 / syncFreqHz;
+
+  printf("Starting Test %u\n", testNo);
+  FILE* log = fopen(REPLAY_TEST_FILE, "w");
+  if(log == NULL) {
+    printf("Test FAILED. Unable to write %s\n", REPLAY_TEST_FILE);
+    return EXIT_FAILURE;
+  }
+  for(uint32_t n = 0; n < syncs; n++) {
+    uint64_t us = n * period_us;
+    struct milcan_frame sync = MILCAN_MAKE_SYNC(syncMaster, n);
+    fprintf(log, "(%lu.%06lu) can0 %08X#%02X%02X\n", 1700000000 + (us / 1000000), us % 1000000, sync.frame.can_id & CAN_EFF_MASK, sync.frame.data[0], sync.frame.data[1]);
+    us += 200;
+    fprintf(log, "(%lu.%06lu) can0 %08X#%02X%02X%02X%02X\n", 1700000000 + (us / 1000000), us % 1000000, message_id & CAN_EFF_MASK, n & 0xFF, (n >> 8) & 0xFF, 0, 0);
+  }
+  fclose(log);
+
+  replaySetFile(0, REPLAY_TEST_FILE, REPLAY_REALTIME);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, deviceaddr, CAN_INTERFACE_REPLAY, 0, MILCAN_A_OPTION_NO_THREAD);
+  if(device0 == NULL) {
+    LOGE(TAG, "Unable to open the replay.");
+    unlink(REPLAY_TEST_FILE);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t started = nanos();
+  uint64_t now = started, end = started + SECS_TO_NS(seconds);
+  for(uint32_t passes = 0; (now < end) && (passes < 10000000); passes++) {
+    uint64_t next = milcan_poll(device0, now);
+    while(milcan_recv(device0, &framein) > 0) {
+      if((framein.frame_type == MILCAN_FRAME_TYPE_MESSAGE) && (framein.frame.can_id == message_id)) {
+        uint32_t number = framein.frame.data[0] | (framein.frame.data[1] << 8);
+        if(received == 0) {
+          first = number;
+        } else if(number != (first + received)) {
+          printf("Message %u arrived after message %u\n", number, first + received - 1);
+          ret = EXIT_FAILURE;
+        }
+        received++;
+      }
+    }
+    if(next > now) {
+      now = (next < end) ? next : end;
+    }
+  }
+  uint64_t took = nanos() - started;
+  milcan_poll(device0, now);  // The loop stops before it's been told the final time.
+
+  // The made up clock is well ahead of the real one by now. Another of the application's threads should still get the time on it.
+  int64_t toNext = MILCAN_ERROR;
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, timeToNextSync, &toNext) == 0) {
+    pthread_join(thread, NULL);
+  }
+  if((toNext <= 0) || (toNext > (int64_t)(period_us * 1000))) {
+    printf("Time to the next sync from another thread is %ldns (the period is %luns)\n", toNext, period_us * 1000);
+    ret = EXIT_FAILURE;
+  }
+
+  // Every slot time should be the first time after now that the slot comes round on the grid. The current slot has already started
+  // so it's next due once the counter has gone all the way round.
+  milcan_get_status(device0, &status);
+  uint64_t cycle = 1024 * status.sync_period;
+  uint64_t current = milcan_slot_time(device0, status.sync);
+  uint64_t following = milcan_slot_time(device0, (status.sync + 1) & 0x3FF);
+  if((current <= now) || (current > (now + cycle)) || (current == status.sync_phase) || (((current - status.sync_phase) % cycle) != 0)
+    || (following <= now) || (following > (now + cycle)) || (((following - status.sync_phase - status.sync_period) % cycle) != 0)) {
+    printf("Slot %u starts at %lu and slot %u at %lu (now %lu, sync phase %lu, period %lu)\n", status.sync, current,
+      (status.sync + 1) & 0x3FF, following, now, status.sync_phase, status.sync_period);
+    ret = EXIT_FAILURE;
+  }
+
+  milcan_get_status(device0, &status);
+  milcan_get_stats(device0, &stats);
+  printf("Replayed %us in %luus: messages %u to %u of %u, mode %u, Sync Master %u, counter %u (%u Rx overflows)\n", seconds, took / 1000,
+    first, first + received - 1, syncs, status.mode, status.sync_master, status.sync, stats.rx_overflows);
+  if((received == 0) || ((first + received) != syncs) || (status.mode != MILCAN_A_MODE_OPERATIONAL) || (status.sync_master != syncMaster) || (status.sync != ((syncs - 1) & 0x3FF))) {
+    ret = EXIT_FAILURE;
+  }
+  milcan_close(device0);
+  device0 = NULL;
+  unlink(REPLAY_TEST_FILE);
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
+// Captures device0 to a pcapng file while it sends frameCount frames to device1, then reads the file back. Every frame sent should be
+// there as sent and, because the virtual bus echoes our own frames, as received.
+#define CAPTURE_TEST_FILE "/tmp/milcan_capture.pcapng"
+
+int testCapture(uint8_t testNo, uint16_t syncFreqHz, uint8_t device0type, uint8_t device0num, uint8_t device0addr, uint8_t device1type, uint8_t device1num, uint8_t device1addr, uint32_t frameCount) {
+  int ret = EXIT_SUCCESS;
+  struct milcan_frame framein;
+  struct milcan_frame frameout;
+  struct milcan_status status;
+  struct milcan_stats stats;
+  uint32_t queued = 0, received = 0, captured_tx = 0, captured_rx = 0, captured_sync = 0;
+
+  memset(&frameout, 0, sizeof(struct milcan_frame));
+  frameout.frame_type = MILCAN_FRAME_TYPE_MESSAGE;
+  frameout.frame.can_id = MILCAN_MAKE_ID(1, 0, 11, 12, device0addr);
+  frameout.frame.len = 4;
+
+  printf("Starting Test %u\n", testNo);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, device0addr, device0type, device0num, MILCAN_A_OPTION_SYNC_MASTER);
+  device1 = milcan_open(MILCAN_A_500K, syncFreqHz, device1addr, device1type, device1num, 0);
+  if((device0 == NULL) || (device1 == NULL)) {
+    LOGE(TAG, "Unable to open the devices.");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+  if(milcan_capture_start(device0, CAPTURE_TEST_FILE) != MILCAN_OK) {
+    printf("Test FAILED. Unable to start capturing.\n");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+
+  uint64_t timeout = nanos() + SECS_TO_NS(20);
+  do {
+    milcan_get_status(device1, &status);  // device0 is the Sync Master so it gets there first.
+    if((status.mode == MILCAN_A_MODE_OPERATIONAL) && (queued < frameCount) && ((queued - received) < 10)) {
+      frameout.frame.data[0] = queued & 0xFF;
+      frameout.frame.data[1] = (queued >> 8) & 0xFF;
+      milcan_send(device0, &frameout);
+      queued++;
+    }
+    while(milcan_recv(device0, &framein) > 0);
+    while(milcan_recv(device1, &framein) > 0) {
+      if((framein.frame_type == MILCAN_FRAME_TYPE_MESSAGE) && (framein.frame.can_id == frameout.frame.can_id)) {
+        received++;
+      }
+    }
+    usleep(SLEEP_TIME_US);
+  } while((received < frameCount) && (nanos() < timeout));
+  if(milcan_capture_stop(device0) != MILCAN_OK) {
+    printf("Unable to write the capture file.\n");
+    ret = EXIT_FAILURE;
+  }
+  milcan_get_stats(device0, &stats);
+
+  // Skip the section header and interface blocks and count our frames, both ways, and the sync frames that we sent.
+  FILE* file = fopen(CAPTURE_TEST_FILE, "rb");
+  uint8_t block[256];
+  uint32_t header[2];
+  uint32_t sync_id = MILCAN_MAKE_ID(0, 0, MILCAN_ID_PRIMARY_SYSTEM_MANAGEMENT, MILCAN_ID_SECONDARY_SYSTEM_MANAGEMENT_SYNC_FRAME, device0addr);
+  while((file != NULL) && (fread(header, sizeof(header), 1, file) == 1) && (header[1] >= 8) && (header[1] <= sizeof(block))) {
+    if(fread(block, header[1] - 8, 1, file) != 1) break;
+    if(header[0] == 6) {  // Enhanced Packet Block.
+      uint32_t can_id, direction;
+      memcpy(&can_id, &block[20], sizeof(can_id));
+      memcpy(&direction, &block[20 + sizeof(struct can_frame) + 4], sizeof(direction));
+      can_id = ntohl(can_id);
+      if(can_id == frameout.frame.can_id) {
+        if(direction == CAPTURE_TX) captured_tx++;
+        if(direction == CAPTURE_RX) captured_rx++;
+      } else if((can_id == sync_id) && (direction == CAPTURE_TX)) {
+        captured_sync++;
+      }
+    }
+  }
+  if(file != NULL) fclose(file);
+
+  printf("Sent %u, received %u. Captured %u sent, %u received and %u sync frames (%u dropped)\n", queued, received, captured_tx,
+    captured_rx, captured_sync, stats.capture_dropped);
+  if((received != frameCount) || (captured_tx != frameCount) || (captured_rx != frameCount) || (captured_sync == 0) || (stats.capture_dropped != 0)) {
+    ret = EXIT_FAILURE;
+  }
+  milcan_close(device1);
+  device1 = NULL;
+  milcan_close(device0);
+  device0 = NULL;
+  unlink(CAPTURE_TEST_FILE);
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
+// A backend registered from outside the library, to test milcan_register_backend(). It's the virtual bus again, but keeping its
+// node in milcan_backend_ctx() rather than in the interface.
+#define CAN_INTERFACE_TEST_BACKEND  (15)
+
+static int testBackendOpen(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  struct vbus_node* node = calloc(1, sizeof(struct vbus_node));
+  if(node == NULL) {
+    return MILCAN_ERROR;
+  }
+  if(vbusAttach(node, moduleNumber, speed) != MILCAN_OK) {
+    free(node);
+    return MILCAN_ERROR;
+  }
+  *milcan_backend_ctx(interface) = node;
+  return MILCAN_OK;
+}
+
+static void testBackendClose(void* interface) {
+  struct vbus_node* node = *milcan_backend_ctx(interface);
+  vbusDetach(node);
+  free(node);
+}
+
+static int testBackendSend(void* interface, struct can_frame* frame) {
+  return vbusWrite(*milcan_backend_ctx(interface), frame);
+}
+
+static int testBackendRecvBatch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  int n = 0;
+  while((n < max) && (vbusRead(*milcan_backend_ctx(interface), &(frames[n]), &(rx_times[n])) == MILCAN_OK)) {
+    n++;
+  }
+  return n;
+}
+
+static const struct milcan_backend testBackend = {
+  .name = "test",
+  .open = testBackendOpen,
+  .close = testBackendClose,
+  .send = testBackendSend,
+  .recv_batch = testBackendRecvBatch,
+};
+
+// The virtual bus again, but with an adapter that can be unplugged, to test MILCAN_A_OPTION_AUTO_RECONNECT. While it's unplugged it
+// can't be opened and nothing can be sent or received.
+#define CAN_INTERFACE_FLAKY_BACKEND (14)
+
+static _Atomic uint8_t flakyUnplugged = FALSE;
+
+static int flakyBackendOpen(void* interface, uint16_t moduleNumber, uint8_t speed) {
+  if(atomic_load(&flakyUnplugged)) {
+    return MILCAN_ERROR;
+  }
+  return testBackendOpen(interface, moduleNumber, speed);
+}
+
+static int flakyBackendSend(void* interface, struct can_frame* frame) {
+  if(atomic_load(&flakyUnplugged)) {
+    return MILCAN_ERROR;
+  }
+  return testBackendSend(interface, frame);
+}
+
+static int flakyBackendRecvBatch(void* interface, struct can_frame* frames, uint64_t* rx_times, int max) {
+  if(atomic_load(&flakyUnplugged)) {
+    return 0;
+  }
+  return testBackendRecvBatch(interface, frames, rx_times, max);
+}
+
+static int flakyBackendConnected(void* interface) {
+  return atomic_load(&flakyUnplugged) ? FALSE : TRUE;
+}
+
+static const struct milcan_backend flakyBackend = {
+  .name = "flaky",
+  .open = flakyBackendOpen,
+  .close = testBackendClose,
+  .send = flakyBackendSend,
+  .recv_batch = flakyBackendRecvBatch,
+  .connected = flakyBackendConnected,
+};
+
+// device0 sends frameCount numbered frames to device1, the Sync Master, and its adapter is unplugged for outageMs part way through.
+// Every frame still in the Tx Q should arrive, in order, once the adapter has been reopened, without closing device0. The ones that the
+// adapter had already taken go with it, so there can be one gap, no bigger than its Tx slots, and never seen to complete.
+int testReconnect(uint8_t testNo, uint16_t syncFreqHz, uint8_t busNum, uint8_t device0addr, uint8_t device1addr, uint32_t frameCount, uint32_t outageMs) {
+  int ret = EXIT_SUCCESS;
+  struct milcan_frame framein;
+  struct milcan_frame frameout;
+  struct milcan_status status;
+  struct milcan_stats stats;
+  uint32_t queued = 0, received = 0, next = 0, gaps = 0, missing = 0, out_of_order = 0, lost = 0, restored = 0;
+  uint64_t unplug_at = 0, replug_at = 0, lost_at = 0, restored_at = 0;
+
+  if(milcan_register_backend(CAN_INTERFACE_FLAKY_BACKEND, &flakyBackend) != MILCAN_OK) {
+    printf("Test FAILED. Unable to register the backend.\n");
+    return EXIT_FAILURE;
+  }
+  memset(&frameout, 0, sizeof(struct milcan_frame));
+  frameout.frame_type = MILCAN_FRAME_TYPE_MESSAGE;
+  frameout.frame.can_id = MILCAN_MAKE_ID(1, 0, 11, 12, device0addr);
+  frameout.frame.len = 4;
+
+  printf("Starting Test %u\n", testNo);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, device0addr, CAN_INTERFACE_FLAKY_BACKEND, busNum, MILCAN_A_OPTION_AUTO_RECONNECT | MILCAN_A_OPTION_TX_COMPLETE);
+  device1 = milcan_open(MILCAN_A_500K, syncFreqHz, device1addr, CAN_INTERFACE_VBUS, busNum, MILCAN_A_OPTION_SYNC_MASTER);
+  if((device0 == NULL) || (device1 == NULL)) {
+    LOGE(TAG, "Unable to open the devices.");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+
+  uint64_t timeout = nanos() + SECS_TO_NS(20);
+  do {
+    uint64_t now = nanos();
+    milcan_get_status(device0, &status);
+    // Keep queueing through the outage. The frames wait in the Tx Q.
+    if(((status.mode == MILCAN_A_MODE_OPERATIONAL) || (unplug_at != 0)) && (queued < frameCount) && ((queued - received - missing) < 10)) {
+      frameout.frame.data[0] = queued & 0xFF;
+      frameout.frame.data[1] = (queued >> 8) & 0xFF;
+      milcan_send(device0, &frameout);
+      queued++;
+    }
+    if((unplug_at == 0) && (queued >= (frameCount / 3))) {
+      printf("Unplugging the adapter for %ums\n", outageMs);
+      atomic_store(&flakyUnplugged, TRUE);
+      unplug_at = now;
+    } else if((unplug_at != 0) && (replug_at == 0) && (now >= (unplug_at + MS_TO_NS(outageMs)))) {
+      atomic_store(&flakyUnplugged, FALSE);
+      replug_at = now;
+    }
+    while(milcan_recv(device0, &framein) > 0) {
+      if(framein.frame_type == MILCAN_FRAME_TYPE_ADAPTER) {
+        if(framein.frame.can_id == MILCAN_ADAPTER_LOST) {
+          lost++;
+          lost_at = framein.rx_timestamp;
+        } else if(framein.frame.can_id == MILCAN_ADAPTER_RESTORED) {
+          restored++;
+          restored_at = framein.rx_timestamp;
+        }
+      }
+    }
+    while(milcan_recv(device1, &framein) > 0) {
+      if((framein.frame_type == MILCAN_FRAME_TYPE_MESSAGE) && (framein.frame.can_id == frameout.frame.can_id)) {
+        uint32_t number = framein.frame.data[0] | (framein.frame.data[1] << 8);
+        if(number > next) {
+          gaps++;
+          missing += number - next;
+        } else if(number < next) {
+          out_of_order++;
+        }
+        next = number + 1;
+        received++;
+      }
+    }
+    usleep(SLEEP_TIME_US);
+  } while(((next < frameCount) || (restored == 0)) && (nanos() < timeout));
+  atomic_store(&flakyUnplugged, FALSE);
+
+  milcan_get_stats(device0, &stats);
+  printf("Sent %u, received %u (%u out of order, %u missing, %u unconfirmed). Lost %u, restored %u after %luus (%u attempts)\n", queued,
+    received, out_of_order, missing, stats.tx_unconfirmed, lost, restored, stats.outage_last_ns / 1000, stats.reconnect_attempts);
+  if((restored_at > lost_at) && (restored > 0)) {
+    printf("Notified of an outage of %luus\n", (restored_at - lost_at) / 1000);
+  }
+  if(((received + missing) != frameCount) || (out_of_order != 0) || (gaps > 1) || (missing > VBUS_TX_SIZE) ||
+    (missing > stats.tx_unconfirmed) || (lost != 1) || (restored != 1) || (stats.reconnects != 1) ||
+    (stats.adapter_lost != 1) || (stats.outage_last_ns < MS_TO_NS(outageMs)) || (stats.outage_total_ns != stats.outage_last_ns)) {
+    ret = EXIT_FAILURE;
+  }
+  milcan_close(device1);
+  device1 = NULL;
+  milcan_close(device0);
+  device0 = NULL;
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
+// device0, the Sync Master, is asked to enter the Configuration Mode and then, straight away, to leave it again. Both commands should
+// be acted on, in order, so it should go to System Configuration and then back to Pre-Operational.
+int testCommands(uint8_t testNo, uint16_t syncFreqHz, uint8_t busNum, uint8_t device0addr, uint8_t device1addr) {
+  int ret = EXIT_FAILURE;
+  struct milcan_frame framein;
+  struct milcan_status status;
+  uint8_t posted = FALSE, entered = FALSE, left = FALSE;
+
+  printf("Starting Test %u\n", testNo);
+  device0 = milcan_open(MILCAN_A_500K, syncFreqHz, device0addr, CAN_INTERFACE_VBUS, busNum, MILCAN_A_OPTION_SYNC_MASTER);
+  device1 = milcan_open(MILCAN_A_500K, syncFreqHz, device1addr, CAN_INTERFACE_VBUS, busNum, 0);
+  if((device0 == NULL) || (device1 == NULL)) {
+    LOGE(TAG, "Unable to open the devices.");
+    tidyTestsExit();
+    return EXIT_FAILURE;
+  }
+
+  uint64_t timeout = nanos() + SECS_TO_NS(20);
+  do {
+    milcan_get_status(device0, &status);
+    if((posted == FALSE) && (status.mode == MILCAN_A_MODE_OPERATIONAL)) {
+      printf("Operational. Asking to enter and then leave the Configuration Mode.\n");
+      milcan_change_to_config_mode(device0);
+      milcan_exit_configuration_mode(device0);
+      posted = TRUE;
+    }
+    while(milcan_recv(device0, &framein) > 0) {
+      if((posted == TRUE) && (framein.frame_type == MILCAN_FRAME_TYPE_CHANGE_MODE)) {
+        if(framein.frame.can_id == MILCAN_A_MODE_SYSTEM_CONFIGURATION) {
+          printf("Entered the Configuration Mode\n");
+          entered = TRUE;
+        } else if((framein.frame.can_id == MILCAN_A_MODE_PRE_OPERATIONAL) && (entered == TRUE)) {
+          printf("Left the Configuration Mode\n");
+          left = TRUE;
+        }
+      }
+    }
+    while(milcan_recv(device1, &framein) > 0);
+    usleep(SLEEP_TIME_US);
+  } while((left == FALSE) && (nanos() < timeout));
+
+  if(left == TRUE) {
+    ret = EXIT_SUCCESS;
+  }
+  milcan_close(device1);
+  device1 = NULL;
+  milcan_close(device0);
+  device0 = NULL;
+  printf("Test Finished\n");
+  if(ret == EXIT_SUCCESS) {
+    printf("Test PASSED.\n");
+  } else {
+    printf("Test FAILED.\n");
+  }
+  return ret;
+}
+
 // Entry point
 int main(int argc, char *argv[])
 {
@@ -1721,6 +2325,41 @@ int main(int argc, char *argv[])
       CAN_INTERFACE_CANDO, 0, 10, 10
       , SECS_TO_NS(15), 0, SECS_TO_NS(30));
       break;
+    case 'B':
+      ret = testStartup(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, CAN_INTERFACE_GSUSB_SO, 0, 10, CAN_INTERFACE_CANDO, 0, 12, MILCAN_A_OPTION_FAST_CLOCK);
+      break;
+    case 'C': // Linux only. Two nodes on vcan0 (ip link add dev vcan0 type vcan && ip link set up vcan0), so no hardware is needed.
+      ret = test0(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 10, 10, CAN_INTERFACE_SOCKET_CAN, CAN_INTERFACE_SOCKET_CAN_VIRTUAL | 0, 12, CAN_INTERFACE_SOCKET_CAN, CAN_INTERFACE_SOCKET_CAN_VIRTUAL | 0, 10);
+      break;
+    case 'D': // Two nodes on virtual bus 0 in this process, so it runs anywhere.
+      ret = test0(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 10, 10, CAN_INTERFACE_VBUS, 0, 12, CAN_INTERFACE_VBUS, 0, 10);
+      break;
+    case 'E': // Two nodes on shared bus 0. Run tests with a different address in another process to join in.
+      ret = test0(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 10, 10, CAN_INTERFACE_SHMBUS, 0, 12, CAN_INTERFACE_SHMBUS, 0, 10);
+      break;
+    case 'F': // Two nodes on virtual bus 1 through a backend registered by us.
+      if(milcan_register_backend(CAN_INTERFACE_TEST_BACKEND, &testBackend) != MILCAN_OK) {
+        printf("Test FAILED. Unable to register the backend.\n");
+        ret = EXIT_FAILURE;
+        break;
+      }
+      ret = test0(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 10, 10, CAN_INTERFACE_TEST_BACKEND, 1, 12, CAN_INTERFACE_TEST_BACKEND, 1, 10);
+      break;
+    case 'G': // Tx complete notifications, on virtual bus 2.
+      ret = testTxComplete(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, CAN_INTERFACE_VBUS, 2, 10, CAN_INTERFACE_VBUS, 2, 12, 1000);
+      break;
+    case 'H': // Plays a recording back through the state machine, faster than real time.
+      ret = testReplay(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 10, 12, 5);
+      break;
+    case 'I': // Capture to a pcapng file, on virtual bus 3.
+      ret = testCapture(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, CAN_INTERFACE_VBUS, 3, 10, CAN_INTERFACE_VBUS, 3, 12, 1000);
+      break;
+    case 'J': // The adapter is unplugged for a while and reopened in the background, on virtual bus 4.
+      ret = testReconnect(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 4, 12, 10, 300, 200);
+      break;
+    case 'K': // Enter and leave the Configuration Mode back to back, on virtual bus 5.
+      ret = testCommands(testNo, MILCAN_A_500K_DEFAULT_SYNC_HZ, 5, 10, 12);
+      break;
     default:
       printf("ERROR! Unknown test type.");
       ret = EXIT_FAILURE;
@@ -0,0 +1,54 @@
+// benchtimestamp.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../utils/timestamp.h"
+
+#define TAG "benchtimestamp"
+
+// Compare the cost of the different ways of getting "now".
+
+#define NUM_CALLS 10000000
+
+volatile uint64_t sink = 0; // Stops the compiler optimising the calls away.
+
+typedef uint64_t (*clock_fn)();
+
+void bench(const char* name, clock_fn fn) {
+    uint64_t start = nanos();
+    for(uint32_t i = 0; i < NUM_CALLS; i++) {
+        sink += fn();
+    }
+    uint64_t taken = nanos() - start;
+    printf("%-28s %8.2fns per call\n", name, (double)taken / NUM_CALLS);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Timestamp benchmark (%u calls each)\n\n", NUM_CALLS);
+
+    bench("nanos() (PRECISE)", nanos);
+
+    nanos_set_source(TIMESTAMP_SOURCE_COARSE);
+    bench("nanos_fast() (COARSE)", nanos_fast);
+
+    if(nanos_set_source(TIMESTAMP_SOURCE_COUNTER) == TIMESTAMP_SOURCE_COUNTER) {
+        bench("nanos_fast() (COUNTER)", nanos_fast);
+        // Check the counter against the kernel clock.
+        uint64_t drift = 0;
+        for(int i = 0; i < 1000; i++) {
+            uint64_t a = nanos();
+            uint64_t b = nanos_fast();
+            uint64_t d = (a > b) ? (a - b) : (b - a);
+            if(d > drift) drift = d;
+        }
+        printf("%-28s %8luns\n", "Max counter vs PRECISE", drift);
+    } else {
+        printf("nanos_fast() (COUNTER)       not available on this CPU\n");
+    }
+
+    nanos_tick();
+    bench("nanos_cached()", nanos_cached);
+
+    return EXIT_SUCCESS;
+}
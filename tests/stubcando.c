@@ -0,0 +1,186 @@
+// stubcando.c
+// A stand in for libCANdo.so with STUB_DEVICES CANdo that are all on one bus. A frame sent by one is received by every other open one.
+// Build it as libCANdo.so and run testcando with LD_LIBRARY_PATH pointing at it. stubCANdoUnplug() pulls one out (and puts it back).
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "../CANdoImport.h"
+
+#define STUB_DEVICES  (4)
+#define STUB_QUEUE    (64)
+
+struct stub_device {
+  int open;
+  int unplugged;  // Can't be opened, sent to or received from.
+  TCANdoCAN queue[STUB_QUEUE];  // Frames sent by the others that haven't been received yet.
+  int head;
+  int count;
+};
+
+static struct stub_device devices[STUB_DEVICES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stub_device* stubDevice(const PCANdoUSB usb) {
+  if((usb == NULL) || !usb->OpenFlag || (usb->No < 0) || (usb->No >= STUB_DEVICES)) {
+    return NULL;
+  }
+  return &devices[usb->No];
+}
+
+int CANdoGetPID(unsigned int CANdoNo, const TCANdoDeviceString PID) {
+  strcpy((char*)PID, CANDO_PID);
+  return CANDO_SUCCESS;
+}
+
+int CANdoGetDevices(const TCANdoDevice CANdoDevices[], unsigned int* NoOfDevices) {
+  TCANdoDevice* list = (TCANdoDevice*)CANdoDevices;
+  if(*NoOfDevices > STUB_DEVICES) {
+    *NoOfDevices = STUB_DEVICES;
+  }
+  for(unsigned int n = 0; n < *NoOfDevices; n++) {
+    list[n].HardwareType = CANDO_TYPE_CANDO;
+    snprintf((char*)list[n].SerialNo, CANDO_STRING_LENGTH, "%u", 1000 + n);
+  }
+  return CANDO_SUCCESS;
+}
+
+int CANdoOpenDevice(const PCANdoUSB CANdoUSBPointer, const PCANdoDevice CANdoDevicePointer) {
+  int n;
+  sscanf((char*)CANdoDevicePointer->SerialNo, "%d", &n);
+  n -= 1000;
+  pthread_mutex_lock(&lock);
+  if((n < 0) || (n >= STUB_DEVICES) || devices[n].open || devices[n].unplugged) {
+    pthread_mutex_unlock(&lock);
+    return CANDO_NOT_FOUND;
+  }
+  memset(&devices[n], 0, sizeof(struct stub_device));
+  devices[n].open = 1;
+  pthread_mutex_unlock(&lock);
+  CANdoUSBPointer->TotalNo = STUB_DEVICES;
+  CANdoUSBPointer->No = n;
+  CANdoUSBPointer->OpenFlag = CANDO_OPEN;
+  strcpy((char*)CANdoUSBPointer->Description, "Stub CANdo");
+  strcpy((char*)CANdoUSBPointer->SerialNo, (char*)CANdoDevicePointer->SerialNo);
+  return CANDO_SUCCESS;
+}
+
+int CANdoOpen(const PCANdoUSB CANdoUSBPointer) {
+  TCANdoDevice device = { .HardwareType = CANDO_TYPE_CANDO, .SerialNo = "1000" };
+  return CANdoOpenDevice(CANdoUSBPointer, &device);
+}
+
+int CANdoClose(const PCANdoUSB CANdoUSBPointer) {
+  struct stub_device* device = stubDevice(CANdoUSBPointer);
+  if(device == NULL) {
+    return CANDO_CONNECTION_CLOSED;
+  }
+  pthread_mutex_lock(&lock);
+  device->open = 0;
+  pthread_mutex_unlock(&lock);
+  CANdoUSBPointer->OpenFlag = CANDO_CLOSED;
+  return CANDO_SUCCESS;
+}
+
+int CANdoTransmit(const PCANdoUSB CANdoUSBPointer, unsigned char IDExtended, unsigned int ID, unsigned char RTR, unsigned char DLC,
+    const unsigned char* Data, unsigned char BufferNo, unsigned char RepeatTime) {
+  struct stub_device* sender = stubDevice(CANdoUSBPointer);
+  if(sender == NULL) {
+    return CANDO_CONNECTION_CLOSED;
+  }
+  if(sender->unplugged) {
+    return CANDO_WRITE_ERROR;
+  }
+  pthread_mutex_lock(&lock);
+  for(int n = 0; n < STUB_DEVICES; n++) {
+    struct stub_device* device = &devices[n];
+    if(!device->open || (device == sender) || (device->count >= STUB_QUEUE)) {
+      continue;
+    }
+    TCANdoCAN* message = &device->queue[(device->head + device->count) % STUB_QUEUE];
+    memset(message, 0, sizeof(TCANdoCAN));
+    message->IDE = IDExtended;
+    message->RTR = RTR;
+    message->ID = ID;
+    message->DLC = DLC;
+    memcpy(message->Data, Data, (DLC > 8) ? 8 : DLC);
+    device->count++;
+  }
+  pthread_mutex_unlock(&lock);
+  return CANDO_SUCCESS;
+}
+
+int CANdoReceive(const PCANdoUSB CANdoUSBPointer, const PCANdoCANBuffer CANdoCANBufferPointer, const PCANdoStatus CANdoStatusPointer) {
+  struct stub_device* device = stubDevice(CANdoUSBPointer);
+  if(device == NULL) {
+    return CANDO_CONNECTION_CLOSED;
+  }
+  if(device->unplugged) {
+    return CANDO_READ_ERROR;
+  }
+  pthread_mutex_lock(&lock);
+  while((device->count > 0) && !CANdoCANBufferPointer->FullFlag) {
+    CANdoCANBufferPointer->CANMessage[CANdoCANBufferPointer->WriteIndex] = device->queue[device->head];
+    device->head = (device->head + 1) % STUB_QUEUE;
+    device->count--;
+    CANdoCANBufferPointer->WriteIndex = (CANdoCANBufferPointer->WriteIndex + 1) % CANDO_CAN_BUFFER_LENGTH;
+    if(CANdoCANBufferPointer->WriteIndex == CANdoCANBufferPointer->ReadIndex) {
+      CANdoCANBufferPointer->FullFlag = 1;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return CANDO_SUCCESS;
+}
+
+// Not part of libCANdo. Unplug CANdo n (or plug it back in).
+void stubCANdoUnplug(int n, int unplugged) {
+  pthread_mutex_lock(&lock);
+  devices[n].unplugged = unplugged;
+  pthread_mutex_unlock(&lock);
+}
+
+void CANdoGetVersion(unsigned int* APIVersionPointer, unsigned int* DLLVersionPointer, unsigned int* DriverVersionPointer) {
+  *APIVersionPointer = 0;
+  *DLLVersionPointer = 0;
+  *DriverVersionPointer = 0;
+}
+
+int CANdoSetBaudRate(const PCANdoUSB CANdoUSBPointer, unsigned char SJW, unsigned char BRP, unsigned char PHSEG1, unsigned char PHSEG2,
+    unsigned char PROPSEG, unsigned char SAM) {
+  return (stubDevice(CANdoUSBPointer) == NULL) ? CANDO_CONNECTION_CLOSED : CANDO_SUCCESS;
+}
+
+int CANdoSetMode(const PCANdoUSB CANdoUSBPointer, unsigned char Mode) {
+  return (stubDevice(CANdoUSBPointer) == NULL) ? CANDO_CONNECTION_CLOSED : CANDO_SUCCESS;
+}
+
+int CANdoSetFilters(const PCANdoUSB CANdoUSBPointer, unsigned int Rx1Mask, unsigned char Rx1IDE1, unsigned int Rx1Filter1,
+    unsigned char Rx1IDE2, unsigned int Rx1Filter2, unsigned int Rx2Mask, unsigned char Rx2IDE1, unsigned int Rx2Filter1,
+    unsigned char Rx2IDE2, unsigned int Rx2Filter2, unsigned char Rx2IDE3, unsigned int Rx2Filter3, unsigned char Rx2IDE4,
+    unsigned int Rx2Filter4) {
+  return (stubDevice(CANdoUSBPointer) == NULL) ? CANDO_CONNECTION_CLOSED : CANDO_SUCCESS;
+}
+
+int CANdoSetState(const PCANdoUSB CANdoUSBPointer, unsigned char State) {
+  return (stubDevice(CANdoUSBPointer) == NULL) ? CANDO_CONNECTION_CLOSED : CANDO_SUCCESS;
+}
+
+// Everything else just has to be there to be mapped.
+int CANdoFlushBuffers(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoRequestStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoRequestDateStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoRequestBusLoadStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoRequestSetupStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoRequestAnalogInputStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoClearStatus(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoAnalogStoreRead(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoAnalogStoreWrite(const PCANdoUSB CANdoUSBPointer, unsigned char InputNo, unsigned char IDExtended, unsigned int ID,
+    unsigned char Start, unsigned char Length, double ScalingFactor, double Offset, unsigned char Padding, unsigned char RepeatTime) {
+  return CANDO_SUCCESS;
+}
+int CANdoAnalogStoreClear(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoTransmitStoreRead(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
+int CANdoTransmitStoreWrite(const PCANdoUSB CANdoUSBPointer, unsigned char IDExtended, unsigned int ID, unsigned char RTR,
+    unsigned char DLC, const unsigned char* Data, unsigned char RepeatTime) {
+  return CANDO_SUCCESS;
+}
+int CANdoTransmitStoreClear(const PCANdoUSB CANdoUSBPointer) { return CANDO_SUCCESS; }
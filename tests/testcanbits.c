@@ -0,0 +1,131 @@
+// testcanbits.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../utils/canbits.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testcanbits"
+
+// Check the table driven frame length against a bit at a time reference and time it.
+
+#define NUM_RANDOM  (1000000)
+#define NUM_CALLS   (10000000)
+
+volatile uint32_t sink = 0; // Stops the compiler optimising the calls away.
+
+// Build the frame a bit at a time, exactly as it goes on the wire (SOF to the end of the CRC).
+static int build_bits(uint8_t* bits, uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data) {
+    int n = 0;
+    uint8_t len = rtr ? 0 : ((dlc > 8) ? 8 : dlc);
+    bits[n++] = 0;                                              // SOF
+    for(int b = 28; b >= 18; b--) bits[n++] = (id >> b) & 1;    // Base ID
+    bits[n++] = 1;                                              // SRR
+    bits[n++] = 1;                                              // IDE
+    for(int b = 17; b >= 0; b--) bits[n++] = (id >> b) & 1;     // ID extension
+    bits[n++] = rtr ? 1 : 0;                                    // RTR
+    bits[n++] = 0;                                              // r1
+    bits[n++] = 0;                                              // r0
+    for(int b = 3; b >= 0; b--) bits[n++] = (dlc >> b) & 1;     // DLC
+    for(int i = 0; i < len; i++) {
+        for(int b = 7; b >= 0; b--) bits[n++] = (data[i] >> b) & 1;
+    }
+    return n;
+}
+
+static uint16_t ref_crc(const uint8_t* bits, int n) {
+    uint16_t crc = 0;
+    for(int i = 0; i < n; i++) {
+        uint8_t next = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7FFF;
+        if(next) crc ^= 0x4599;
+    }
+    return crc;
+}
+
+static uint32_t ref_bits(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data, uint16_t* crc) {
+    uint8_t bits[160];
+    int n = build_bits(bits, id, rtr, dlc, data);
+    *crc = ref_crc(bits, n);
+    for(int b = 14; b >= 0; b--) bits[n++] = (*crc >> b) & 1;
+    uint32_t stuffs = 0;
+    int run = 0;
+    uint8_t last = 1;
+    for(int i = 0; i < n; i++) {
+        if((run > 0) && (bits[i] == last)) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if(run == 5) {
+            stuffs++;
+            last = !last;   // The stuff bit.
+            run = 1;
+        }
+    }
+    return n + stuffs + 13;
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t data[8];
+    int failed = 0;
+    uint32_t shortest = UINT32_MAX, longest = 0;
+
+    srandom(1);
+    // A few that stuff a lot, then random ones.
+    for(int n = 0; n < NUM_RANDOM; n++) {
+        uint32_t id;
+        uint8_t rtr, dlc;
+        if(n < 4) {
+            id = (n & 1) ? 0x1FFFFFFF : 0;
+            rtr = 0;
+            dlc = 8;
+            for(int i = 0; i < 8; i++) data[i] = (n & 2) ? 0xFF : 0x00;
+        } else {
+            id = random() & 0x1FFFFFFF;
+            rtr = ((random() % 16) == 0);
+            dlc = random() % 9;
+            for(int i = 0; i < 8; i++) data[i] = (random() % 4) ? (random() & 0xFF) : ((random() & 1) ? 0xFF : 0x00);
+        }
+        uint16_t crc;
+        uint32_t expected = ref_bits(id, rtr, dlc, data, &crc);
+        uint32_t got = canBitsExtended(id, rtr, dlc, data);
+        if((got != expected) || (canBitsCrc15(id, rtr, dlc, data) != crc)) {
+            printf("FAIL: id %08x rtr %u dlc %u: %u bits (expected %u), CRC %04x (expected %04x)\n", id, rtr, dlc, got, expected, canBitsCrc15(id, rtr, dlc, data), crc);
+            failed = 1;
+            break;
+        }
+        if(got > canBitsWorst(dlc)) {
+            printf("FAIL: id %08x dlc %u: %u bits is more than the worst case %u\n", id, dlc, got, canBitsWorst(dlc));
+            failed = 1;
+            break;
+        }
+        if(dlc == 8 && !rtr) {
+            if(got < shortest) shortest = got;
+            if(got > longest) longest = got;
+        }
+    }
+    printf("%d frames checked. 8 byte frames took %u to %u bits (worst case %u)\n", NUM_RANDOM, shortest, longest, canBitsWorst(8));
+
+    uint64_t start = nanos();
+    for(uint32_t i = 0; i < NUM_CALLS; i++) {
+        data[0] = i;
+        sink += canBitsExtended(i & 0x1FFFFFFF, 0, 8, data);
+    }
+    uint64_t taken = nanos() - start;
+    printf("%-28s %8.2fns per call\n", "canBitsExtended() (8 bytes)", (double)taken / NUM_CALLS);
+
+    start = nanos();
+    for(uint32_t i = 0; i < NUM_CALLS; i++) {
+        uint16_t crc;
+        data[0] = i;
+        sink += ref_bits(i & 0x1FFFFFFF, 0, 8, data, &crc);
+    }
+    taken = nanos() - start;
+    printf("%-28s %8.2fns per call\n", "Bit at a time (8 bytes)", (double)taken / NUM_CALLS);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+// testcando.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+
+#include "../CANdoC.h"
+#include "../milcan.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testcando"
+
+// Two CANdo open at once in one process, using stubcando.c in place of libCANdo.so (run with LD_LIBRARY_PATH=.). Each has its own
+// connection and Rx ring: a frame sent by one is only received by the other, and closing one leaves the other working. Frames are
+// read in bulk (across the end of the Rx ring) and by the reader thread. Unplugging one is spotted and it can be opened again.
+
+struct opener {
+    struct cando_ctx* ctx;
+    u_int16_t deviceNum;
+    int ok;
+};
+
+static int check(const char* name, long got, long expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %ld, expected %ld\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static void* openCANdo(void* arg) {
+    struct opener* o = (struct opener*)arg;
+    o->ok = CANdoInitialise2(o->ctx) && (CANdoConnect(o->ctx, o->deviceNum) == CANDO_CONNECT_OK) && CANdoStart(o->ctx, 2);
+    return NULL;
+}
+
+static int receive(struct cando_ctx* ctx, struct can_frame* frame) {
+    CANdoRx(ctx);
+    return CANdoReadRxQueue(ctx, frame);
+}
+
+int main(int argc, char *argv[]) {
+    struct cando_ctx* a = calloc(1, sizeof(struct cando_ctx));
+    struct cando_ctx* b = calloc(1, sizeof(struct cando_ctx));
+    struct opener oa = { .ctx = a, .deviceNum = 0 }, ob = { .ctx = b, .deviceNum = 1 };
+    struct can_frame frame;
+    unsigned char data[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    pthread_t ta, tb;
+    int failed = 0;
+
+    // Open both at the same time.
+    pthread_create(&ta, NULL, openCANdo, &oa);
+    pthread_create(&tb, NULL, openCANdo, &ob);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+    if(!oa.ok || !ob.ok) {
+        printf("FAIL: unable to open both CANdo (is the stub libCANdo.so on LD_LIBRARY_PATH?)\n");
+        return EXIT_FAILURE;
+    }
+    failed |= check("a's device", CANdoUSBStatus(a)->No, 0);
+    failed |= check("b's device", CANdoUSBStatus(b)->No, 1);
+    failed |= check("libraries loaded", a->Lib == b->Lib, 1);
+    failed |= check("library users", a->Lib->Users, 2);
+
+    failed |= check("a sends", CANdoTx(a, 1, 0x123456, 8, data), TRUE);
+    failed |= check("b sends", CANdoTx(b, 0, 0x100, 2, data), TRUE);
+    failed |= check("b receives", receive(b, &frame), TRUE);
+    failed |= check("b's frame", frame.can_id, CAN_EFF_FLAG | 0x123456);
+    failed |= check("b's frame length", frame.len, 8);
+    failed |= check("b's extra frames", receive(b, &frame), FALSE);
+    failed |= check("a receives", receive(a, &frame), TRUE);
+    failed |= check("a's frame", frame.can_id, 0x100);
+    failed |= check("a's extra frames", receive(a, &frame), FALSE);
+
+    // Enough frames to go round b's Rx ring, read in bulk. They come out in order across the wrap.
+    struct can_frame batch[100];
+    uint32_t sent = 0, received = 0;
+    while(sent < (CANDO_CAN_BUFFER_LENGTH + 500)) {
+        for(int f = 0; f < 60; f++, sent++) {
+            CANdoTx(a, 1, sent, 8, data);
+        }
+        CANdoRx(b);
+        int n;
+        while((n = CANdoReadRxBatch(b, batch, 100)) > 0) {
+            for(int f = 0; f < n; f++, received++) {
+                if(batch[f].can_id != (CAN_EFF_FLAG | received)) {
+                    failed |= check("bulk frame", batch[f].can_id, CAN_EFF_FLAG | received);
+                    break;
+                }
+            }
+        }
+    }
+    failed |= check("bulk frames", received, sent);
+
+    // The reader thread reads b in the background and rings its doorbell.
+    uint64_t rx_times[100];
+    uint32_t doorbell = atomic_load(&(b->Doorbell));
+    uint64_t before = nanos();
+    failed |= check("reader starts", CANdoReaderStart(b), TRUE);
+    for(uint32_t f = 0; f < 50; f++) {
+        CANdoTx(a, 0, f, 1, data);
+    }
+    received = 0;
+    for(int tries = 0; (tries < 1000) && (received < 50); tries++) {
+        int n = CANdoReaderRead(b, batch, rx_times, 100);
+        for(int f = 0; f < n; f++, received++) {
+            failed |= check("reader frame", batch[f].can_id, received);
+            failed |= check("reader time stamp", rx_times[f] >= before, 1);
+        }
+        if(n == 0) usleep(1000);
+    }
+    failed |= check("reader frames", received, 50);
+    failed |= check("doorbell rung", atomic_load(&(b->Doorbell)) != doorbell, 1);
+    CANdoReaderStop(b);
+
+    // Closing a doesn't touch b, and the library stays loaded while b is using it.
+    CANdoCloseAndRelease(a);
+    CANdoFinalise();
+    failed |= check("a closed", CANdoUSBStatus(a)->OpenFlag, CANDO_CLOSED);
+    failed |= check("b still open", CANdoUSBStatus(b)->OpenFlag, CANDO_OPEN);
+    failed |= check("library users after closing a", b->Lib->Users, 1);
+    failed |= check("b sends after a closed", CANdoTx(b, 0, 0x200, 0, data), TRUE);
+
+    // A can open again on the same device.
+    failed |= check("a opens again", CANdoInitialise2(a) && (CANdoConnect(a, 0) == CANDO_CONNECT_OK), 1);
+    failed |= check("b sends to the new a", CANdoTx(b, 0, 0x300, 0, data), TRUE);
+    failed |= check("new a receives", receive(a, &frame), TRUE);
+    failed |= check("new a's frame", frame.can_id, 0x300);
+
+    // Unplug a. It takes CANDO_LOST_ERRORS USB errors in a row to decide that it has gone, and b doesn't notice.
+    void* stub = dlopen("libCANdo.so", RTLD_LAZY);
+    void (*unplug)(int, int) = (stub != NULL) ? (void (*)(int, int))dlsym(stub, "stubCANdoUnplug") : NULL;
+    if(unplug == NULL) {
+        printf("FAIL: the stub libCANdo.so has no stubCANdoUnplug()\n");
+        return EXIT_FAILURE;
+    }
+    unplug(0, 1);
+    for(int n = 1; n < CANDO_LOST_ERRORS; n++) {
+        CANdoRx(a);
+    }
+    failed |= check("a lost before enough errors", CANdoLost(a), FALSE);
+    failed |= check("a sends while unplugged", CANdoTx(a, 0, 0x400, 0, data), FALSE);
+    failed |= check("a lost", CANdoLost(a), TRUE);
+    failed |= check("b lost", CANdoLost(b), FALSE);
+    CANdoCloseAndRelease(a);
+    failed |= check("a opens while unplugged", CANdoInitialise2(a) && (CANdoConnect(a, 0) == CANDO_CONNECT_OK), 0);
+    CANdoCloseAndRelease(a);
+    unplug(0, 0);
+    failed |= check("a opens when plugged back in", CANdoInitialise2(a) && (CANdoConnect(a, 0) == CANDO_CONNECT_OK), 1);
+    failed |= check("a lost after opening again", CANdoLost(a), FALSE);
+    failed |= check("b sends to a again", CANdoTx(b, 0, 0x500, 0, data), TRUE);
+    failed |= check("a receives again", receive(a, &frame), TRUE);
+    failed |= check("a's frame again", frame.can_id, 0x500);
+    dlclose(stub);
+
+    CANdoCloseAndRelease(a);
+    CANdoCloseAndRelease(b);
+    CANdoFinalise();
+    free(a);
+    free(b);
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+// testcapture.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../capture.h"
+#include "../milcan.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testcapture"
+
+// Captures frames in both directions, times how long adding each one to the ring takes, then reads the pcapng file back and checks
+// every block.
+
+#define CAPTURE_FILE  "/tmp/testcapture.pcapng"
+#define FRAMES        (200000)
+#define BURST         (CAPTURE_RING_SIZE / 2)   // Frames added between pauses, so the writer can keep up.
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %lu, expected %lu\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static uint32_t get32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+    struct capture* capture = calloc(1, sizeof(struct capture));
+    struct can_frame frame;
+    uint64_t dropped = 0, add_ns = 0;
+    int failed = 0;
+
+    failed |= check("start", captureStart(capture, CAPTURE_FILE), MILCAN_OK);
+    failed |= check("start again", captureStart(capture, CAPTURE_FILE), (uint64_t)MILCAN_ERROR);
+    memset(&frame, 0, sizeof(frame));
+    frame.len = 8;
+    for(uint32_t n = 0; n < FRAMES; n += BURST) {
+        uint64_t before = nanos();
+        for(uint32_t f = n; (f < (n + BURST)) && (f < FRAMES); f++) {
+            frame.can_id = CAN_EFF_FLAG | f;
+            frame.data[0] = f & 0xFF;
+            if(!captureFrame(capture, &frame, 1000000000UL + (f * 1000UL), (f & 1) ? CAPTURE_TX : CAPTURE_RX)) {
+                dropped++;
+            }
+        }
+        add_ns += nanos() - before;
+        usleep(20000);
+    }
+    failed |= check("stop", captureStop(capture), MILCAN_OK);
+    failed |= check("dropped", dropped, 0);
+    printf("Adding a frame to the ring takes %luns\n", add_ns / FRAMES);
+
+    // Read it back.
+    FILE* f = fopen(CAPTURE_FILE, "rb");
+    if(f == NULL) {
+        printf("FAIL: no capture file\n");
+        return EXIT_FAILURE;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* file = malloc(size);
+    if(fread(file, 1, size, f) != (size_t)size) {
+        printf("FAIL: unable to read the capture file\n");
+        return EXIT_FAILURE;
+    }
+    fclose(f);
+
+    failed |= check("section header", get32(file), 0x0A0D0D0A);
+    failed |= check("byte order", get32(file + 8), 0x1A2B3C4D);
+    const uint8_t* idb = file + get32(file + 4);
+    failed |= check("interface block", get32(idb), 1);
+    failed |= check("link type", idb[8] | (idb[9] << 8), LINKTYPE_CAN_SOCKETCAN);
+    failed |= check("time stamp resolution", idb[16] | (idb[17] << 8), 9);
+    failed |= check("time stamp resolution value", idb[20], 9);
+
+    const uint8_t* p = idb + get32(idb + 4);
+    uint64_t packets = 0, last = 0;
+    while((p < (file + size)) && !failed) {
+        uint32_t length = get32(p + 4);
+        failed |= check("packet block", get32(p), 6);
+        failed |= check("trailing length", get32(p + length - 4), length);
+        uint64_t stamp = ((uint64_t)get32(p + 12) << 32) | get32(p + 16);
+        failed |= check("time stamps in order", stamp > last, 1);
+        last = stamp;
+        failed |= check("captured length", get32(p + 20), sizeof(struct can_frame));
+        failed |= check("CAN ID", ntohl(get32(p + 28)), CAN_EFF_FLAG | packets);
+        failed |= check("data", p[28 + 8], packets & 0xFF);
+        failed |= check("direction", get32(p + 28 + sizeof(struct can_frame) + 4), (packets & 1) ? CAPTURE_TX : CAPTURE_RX);
+        packets++;
+        p += length;
+    }
+    failed |= check("packets", packets, FRAMES);
+    free(file);
+    unlink(CAPTURE_FILE);
+    captureFree(capture);
+    free(capture);
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+// testreplay.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "../replay.h"
+#include "../milcan.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testreplay"
+
+// Reads a small candump log on a made up clock at the recorded timing, twice as fast and unpaced, converts it to the binary format and
+// reads that back, then times reading a large recording in both formats.
+
+#define TEXT_FILE     "/tmp/testreplay.log"
+#define BINARY_FILE   "/tmp/testreplay.bin"
+#define BIG_FRAMES    (2000000)
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %lu, expected %lu\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// Three frames 1ms and 2ms apart, with lines that should be skipped in between.
+static const char* smallLog =
+    "(1700000000.000000) can0 123#1122\n"
+    "garbage\n"
+    "\n"
+    "(1700000000.001000) can0 12345678#R\n"
+    "(1700000000.001500) can0 123##0112233\n"
+    "(1700000000.003000) can0 7FF#0001020304050607\n";
+
+static void writeFile(const char* path, const char* text) {
+    FILE* f = fopen(path, "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+// Reads everything that's due at now. Returns how many frames.
+static int readDue(struct replay_node* node, uint64_t now, struct can_frame* frames, uint64_t* times) {
+    int n = 0;
+    nanos_set_cached(now);
+    while(replayRead(node, &(frames[n]), &(times[n])) == MILCAN_OK) {
+        n++;
+    }
+    return n;
+}
+
+// The three frames in smallLog, played speed_pc fast from start.
+static int checkSmall(const char* name, uint16_t number, uint32_t speed_pc) {
+    struct replay_node node;
+    struct can_frame frames[4];
+    uint64_t times[4];
+    uint64_t start = 1000000000;
+    uint64_t gap1 = (1000000 * REPLAY_REALTIME) / speed_pc, gap2 = (3000000 * REPLAY_REALTIME) / speed_pc;
+    int failed = 0;
+
+    printf("%s\n", name);
+    failed |= check("attach", replayAttach(&node, number), MILCAN_OK);
+    failed |= check("frames at the start", readDue(&node, start, frames, times), 1);
+    failed |= check("first frame", frames[0].can_id, 0x123);
+    failed |= check("first frame length", frames[0].len, 2);
+    failed |= check("first frame data", frames[0].data[1], 0x22);
+    failed |= check("first frame time", times[0], start);
+    failed |= check("next event", replayNextEvent(&node), start + gap1);
+    failed |= check("frames just before the second", readDue(&node, start + gap1 - 1, frames, times), 0);
+    failed |= check("frames at the second", readDue(&node, start + gap1, frames, times), 1);
+    failed |= check("second frame", frames[0].can_id, CAN_EFF_FLAG | CAN_RTR_FLAG | 0x12345678);
+    failed |= check("second frame time", times[0], start + gap1);
+    failed |= check("frames long after", readDue(&node, start + gap2 + 1000000, frames, times), 1);
+    failed |= check("third frame", frames[0].can_id, 0x7FF);
+    failed |= check("third frame length", frames[0].len, 8);
+    failed |= check("third frame data", frames[0].data[7], 7);
+    failed |= check("third frame time", times[0], start + gap2);
+    failed |= check("done", replayDone(&node), TRUE);
+    failed |= check("next event at the end", replayNextEvent(&node), UINT64_MAX);
+    replayDetach(&node);
+    return failed;
+}
+
+// Reads the whole of a file unpaced. Returns how many frames.
+static uint64_t readAll(uint16_t number, uint64_t* ns, uint64_t* skipped) {
+    struct replay_node node;
+    struct can_frame frame;
+    uint64_t rx_time, count = 0;
+    if(replayAttach(&node, number) != MILCAN_OK) {
+        return 0;
+    }
+    uint64_t before = nanos();
+    nanos_set_cached(before);
+    while(replayRead(&node, &frame, &rx_time) == MILCAN_OK) {
+        count++;
+    }
+    *ns = nanos() - before;
+    *skipped = node.skipped;
+    replayDetach(&node);
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    struct replay_node node;
+    struct can_frame frames[4];
+    uint64_t times[4], ns, skipped;
+    int failed = 0;
+
+    writeFile(TEXT_FILE, smallLog);
+    replaySetFile(0, TEXT_FILE, REPLAY_REALTIME);
+    replaySetFile(1, TEXT_FILE, 200);
+    failed |= checkSmall("Text at the recorded timing", 0, REPLAY_REALTIME);
+    failed |= checkSmall("Text twice as fast", 1, 200);
+
+    replaySetFile(2, TEXT_FILE, REPLAY_UNPACED);
+    failed |= check("attach unpaced", replayAttach(&node, 2), MILCAN_OK);
+    failed |= check("unpaced frames", readDue(&node, 5000, frames, times), 3);
+    failed |= check("unpaced time", times[2], 5000);
+    failed |= check("skipped lines", node.skipped, 2);
+    replayDetach(&node);
+
+    failed |= check("frames converted", replayConvert(TEXT_FILE, BINARY_FILE), 3);
+    replaySetFile(3, BINARY_FILE, REPLAY_REALTIME);
+    failed |= checkSmall("Binary at the recorded timing", 3, REPLAY_REALTIME);
+    failed |= check("unset file", replayAttach(&node, 4), (uint64_t)MILCAN_ERROR);
+
+    // A big recording, read as fast as we can.
+    FILE* f = fopen(TEXT_FILE, "w");
+    for(uint32_t n = 0; n < BIG_FRAMES; n++) {
+        fprintf(f, "(%u.%06u) can0 %08X#%016lX\n", 1700000000 + (n / 10000), (n % 10000) * 100, 0x10000000 | n, (uint64_t)n * 0x0101010101UL);
+    }
+    fclose(f);
+    failed |= check("big frames converted", replayConvert(TEXT_FILE, BINARY_FILE), BIG_FRAMES);
+    replaySetFile(0, TEXT_FILE, REPLAY_UNPACED);
+    replaySetFile(3, BINARY_FILE, REPLAY_UNPACED);
+    failed |= check("big text frames", readAll(0, &ns, &skipped), BIG_FRAMES);
+    failed |= check("big text skipped", skipped, 0);
+    printf("Text: %u frames in %luus (%.1f million frames/s)\n", BIG_FRAMES, ns / 1000, (BIG_FRAMES * 1000.0) / ns);
+    failed |= check("big binary frames", readAll(3, &ns, &skipped), BIG_FRAMES);
+    printf("Binary: %u frames in %luus (%.1f million frames/s)\n", BIG_FRAMES, ns / 1000, (BIG_FRAMES * 1000.0) / ns);
+
+    unlink(TEXT_FILE);
+    unlink(BINARY_FILE);
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
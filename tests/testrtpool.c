@@ -0,0 +1,88 @@
+// testrtpool.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>   // mincore()
+
+#include "../milcan.h"
+#include "../interfaces.h"
+#include "../txq.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testrtpool"
+
+// Builds a real time Tx pool (MILCAN_A_OPTION_RT_MEMORY) big enough that malloc() takes it straight from mmap(), then asks the kernel
+// whether every page of it is resident. Then takes every frame from the pool and puts it back.
+
+#define POOL_SIZE   (65536)
+
+// txq.c counts heap allocations made after open through here. There's no open in this test.
+void * interface_calloc(struct milcan_a* interface, size_t count, size_t size) {
+    return calloc(count, size);
+}
+
+uint64_t interface_now(struct milcan_a* interface) {
+    return nanos_fast();
+}
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %lu, expected %lu\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+// How many of the pages that p to p + size touches aren't resident.
+static uint64_t pagesMissing(void* p, size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)p & ~(page - 1);
+    size_t pages = (((uintptr_t)p + size - start) + page - 1) / page;
+    unsigned char* vec = calloc(pages, 1);
+    uint64_t missing = 0;
+    if(mincore((void*)start, pages * page, (void*)vec) != 0) {
+        printf("FAIL: mincore() failed\n");
+        free(vec);
+        return pages;
+    }
+    for(size_t n = 0; n < pages; n++) {
+        if(!(vec[n] & 1)) {
+            missing++;
+        }
+    }
+    free(vec);
+    return missing;
+}
+
+int main(int argc, char *argv[]) {
+    struct milcan_a* interface = calloc(1, sizeof(struct milcan_a));
+    struct milcan_frame* frames[8];
+    int failed = 0;
+
+    failed |= check("pool", txQPoolInit(interface, POOL_SIZE), 0);
+    failed |= check("frame pages not resident", pagesMissing(interface->tx.pool.frames, POOL_SIZE * sizeof(struct milcan_frame)), 0);
+    failed |= check("node pages not resident", pagesMissing(interface->tx.pool.nodes, POOL_SIZE * sizeof(struct list_milcan_frame)), 0);
+    failed |= check("free list pages not resident", pagesMissing(interface->tx.pool.free_frames, POOL_SIZE * sizeof(struct milcan_frame*)), 0);
+
+    for(int n = 0; n < 8; n++) {
+        frames[n] = txQFrameAlloc(interface);
+        failed |= check("frame from the pool", frames[n] != NULL, 1);
+        failed |= check("frame is zeroed", frames[n]->frame.can_id, 0);
+    }
+    failed |= check("free frames", interface->tx.pool.free_frame_count, POOL_SIZE - 8);
+    for(int n = 0; n < 8; n++) {
+        txQFrameFree(interface, frames[n]);
+    }
+    failed |= check("free frames after freeing", interface->tx.pool.free_frame_count, POOL_SIZE);
+    failed |= check("pool exhausted", interface->stats.tx_pool_exhausted, 0);
+    txQPoolFree(interface);
+    free(interface);
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
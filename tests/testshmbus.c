@@ -0,0 +1,155 @@
+// testshmbus.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <inttypes.h>
+#include <sys/wait.h>
+
+#include "../shmbus.h"
+#include "../milcan.h"
+#include "../utils/canbits.h"
+#include "../utils/futex.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testshmbus"
+
+// Checks arbitration on a shared bus with two nodes and a made up clock, then forks and times a frame going from one process to the
+// other and back on an unpaced bus, with the receiver asleep on its doorbell and then polling.
+
+#define BUS           (15)
+#define BIT_NS        (1000)  // 1M
+#define ROUND_TRIPS   (10000)
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %lu, expected %lu\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static void queue(struct shmbus_node* node, uint32_t id) {
+    struct can_frame frame = { .can_id = CAN_EFF_FLAG | id, .len = 8, .data = { 0, 1, 2, 3, 4, 5, 6, 7 } };
+    if(shmbusWrite(node, &frame) != MILCAN_OK) {
+        printf("FAIL: unable to queue 0x%08x\n", id);
+    }
+}
+
+static uint64_t bits(uint32_t id) {
+    uint8_t data[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    return canBitsExtended(id, 0, 8, data);
+}
+
+// Wait for the next frame from someone else, polling or sleeping on the doorbell (as the event thread's governor would).
+static int wait_frame(struct shmbus_node* node, struct can_frame* frame, uint32_t not_id, int sleep) {
+    uint64_t rx_time;
+    for(;;) {
+        nanos_tick();
+        if(shmbusRead(node, frame, &rx_time) == MILCAN_OK) {
+            if((frame->can_id & CAN_EFF_MASK) != not_id) {
+                return MILCAN_OK;
+            }
+            continue; // Our own.
+        }
+        if(sleep) {
+            futexWait(shmbusDoorbell(node), node->doorbell_seen, 100000000L);
+        } else {
+            sched_yield();  // Let the other process run if we're sharing a core.
+        }
+    }
+}
+
+static int ping_pong(int sleep) {
+    struct shmbus_node parent, node;
+    struct can_frame frame;
+
+    shmbusSetSpeedup(BUS, VBUS_UNPACED);
+    if(shmbusAttach(&parent, BUS, MILCAN_A_1M) != MILCAN_OK) {  // Before the child says it's ready.
+        printf("FAIL: unable to attach the parent\n");
+        return 1;
+    }
+    fflush(stdout);  // Or the child prints what we've buffered again when it exits.
+    pid_t child = fork();
+    if(child == 0) {
+        // Send back everything we get.
+        if(shmbusAttach(&node, BUS, MILCAN_A_1M) != MILCAN_OK) exit(EXIT_FAILURE);
+        nanos_tick();
+        queue(&node, 0x2);  // Ready.
+        for(int i = 0; i < ROUND_TRIPS; i++) {
+            wait_frame(&node, &frame, 0x2, sleep);
+            nanos_tick();
+            queue(&node, 0x2);
+        }
+        shmbusDetach(&node);
+        exit(EXIT_SUCCESS);
+    }
+
+    wait_frame(&parent, &frame, 0x1, sleep);
+    uint64_t start = nanos();
+    for(int i = 0; i < ROUND_TRIPS; i++) {
+        nanos_tick();
+        queue(&parent, 0x1);
+        wait_frame(&parent, &frame, 0x1, sleep);
+    }
+    uint64_t elapsed = nanos() - start;
+    int status;
+    waitpid(child, &status, 0);
+    shmbusDetach(&parent);
+    printf("Round trip between processes (%s): %luns average over %u\n", sleep ? "sleeping" : "polling", elapsed / ROUND_TRIPS, ROUND_TRIPS);
+    return check("child exit status", WEXITSTATUS(status), EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[]) {
+    struct shmbus_node a, b;
+    struct can_frame frame;
+    uint64_t rx_time, frames, busy_ns;
+    int failed = 0;
+
+    shmbusRemove(BUS);  // Start from a new bus.
+    if((shmbusAttach(&a, BUS, MILCAN_A_1M) != MILCAN_OK) || (shmbusAttach(&b, BUS, MILCAN_A_1M) != MILCAN_OK)) {
+        printf("FAIL: unable to attach\n");
+        return EXIT_FAILURE;
+    }
+
+    // 0x500 starts straight away. The other two wait for it and then go lowest ID first.
+    nanos_set_cached(1000000);
+    queue(&a, 0x500);
+    queue(&a, 0x300);
+    queue(&b, 0x100);
+    failed |= check("frames before the first has finished", shmbusRead(&b, &frame, &rx_time) == MILCAN_OK, 0);
+    failed |= check("next event", shmbusNextEvent(&b), 1000000 + (bits(0x500) * BIT_NS));
+
+    nanos_set_cached(2000000);
+    uint32_t order[3] = { 0x500, 0x100, 0x300 };
+    uint64_t expected = 1000000;
+    for(int i = 0; i < 3; i++) {
+        expected += bits(order[i]) * BIT_NS;
+        if(shmbusRead(&b, &frame, &rx_time) != MILCAN_OK) {
+            printf("FAIL: frame %d missing\n", i);
+            failed = 1;
+            break;
+        }
+        failed |= check("arbitration order", frame.can_id & CAN_EFF_MASK, order[i]);
+        failed |= check("end of frame", rx_time, expected);
+    }
+    int count = 0;
+    while(shmbusRead(&a, &frame, &rx_time) == MILCAN_OK) count++;
+    failed |= check("frames looped back to a", count, 3);
+    failed |= check("next event when idle", shmbusNextEvent(&a), UINT64_MAX);
+    shmbusGetStats(BUS, &frames, &busy_ns);
+    failed |= check("bus frames", frames, 3);
+    failed |= check("bus busy", busy_ns, expected - 1000000);
+    shmbusDetach(&a);
+    shmbusDetach(&b);
+
+    failed |= ping_pong(TRUE);
+    failed |= ping_pong(FALSE);
+    shmbusRemove(BUS);
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+// testsleep.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../utils/timestamp.h"
+
+#define TAG "testsleep"
+
+// Sends "sync frames" the way the event thread does: nanos_sleep_until() each deadline on a fixed grid (the next one is one period
+// after the last deadline, not after we woke) and measures the periods with nanos(). Any jitter shows up in the period error and any
+// drift between the clock that we sleep on and the one that the deadlines are on shows up in the average period. Run on each source.
+// How much jitter there is depends on the machine and how busy it is, so it's only reported. Drift or waking early fails.
+
+#define PERIOD_NS       (7812500)   // 128Hz
+#define NUM_PERIODS     (256)
+#define SPIN_NS         (50000)     // SYNC_SPIN_NS
+#define PERIOD_PC       (1)         // The sync timing target in tests.c.
+#define MAX_DRIFT_NS    (1000)      // Allowed error in the average period.
+
+static int run(const char* name) {
+    uint64_t deadline = nanos_fast() + PERIOD_NS;
+    uint64_t last = 0, first = 0, worst = 0;
+    uint32_t passes = 0, early = 0;
+
+    for(int n = 0; n <= NUM_PERIODS; n++) {
+        uint64_t woke = nanos_sleep_until(deadline, SPIN_NS);
+        uint64_t at = nanos();
+        if(woke < deadline) {
+            early++;
+        }
+        if(n == 0) {
+            first = at;
+        } else {
+            uint64_t period = at - last;
+            uint64_t error = (period > PERIOD_NS) ? (period - PERIOD_NS) : (PERIOD_NS - period);
+            if(error > worst) {
+                worst = error;
+            }
+            if(error <= ((PERIOD_NS * PERIOD_PC) / 100)) {
+                passes++;
+            }
+        }
+        last = at;
+        deadline += PERIOD_NS;
+    }
+    int64_t drift = (int64_t)((last - first) / NUM_PERIODS) - PERIOD_NS;
+    printf("%-8s %u/%u periods within %u%%, worst error %luns, average period error %ldns, %u early\n", name, passes, NUM_PERIODS,
+        PERIOD_PC, worst, drift, early);
+    if((drift > MAX_DRIFT_NS) || (drift < -MAX_DRIFT_NS) || (early != 0)) {
+        printf("FAIL: %s\n", name);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    nanos_set_source(TIMESTAMP_SOURCE_PRECISE);
+    failed |= run("PRECISE");
+    if(nanos_set_source(TIMESTAMP_SOURCE_COUNTER) == TIMESTAMP_SOURCE_COUNTER) {
+        failed |= run("COUNTER");
+    } else {
+        printf("No usable CPU counter on this CPU.\n");
+    }
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+// testsyncest.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../syncest.h"
+
+#define TAG "testsyncest"
+
+// Feed the estimator sync frames from a master whose clock is 0.1% slow, seen with up to 200us of Rx jitter, and check that the
+// predicted sync times stay much closer to the real ones than the raw Rx times do.
+
+#define PTU_NS          (15625000)  // 64Hz
+#define MASTER_PTU_NS   (15640625)  // 0.1% slow
+#define JITTER_NS       (200000)
+#define NUM_SYNCS       (3000)      // Enough to wrap the counter twice.
+
+int main(int argc, char *argv[]) {
+    struct sync_estimator est;
+    uint64_t start = 1000000000;
+    uint64_t worst = 0;
+    int failed = 0;
+
+    srandom(1);
+    syncEstInit(&est, PTU_NS);
+    for(int n = 0; n < NUM_SYNCS; n++) {
+        if((n % 100) == 50) {
+            continue;   // Drop the odd sync frame.
+        }
+        uint64_t sent = start + ((uint64_t)n * MASTER_PTU_NS);
+        int64_t k = syncEstAdd(&est, (uint16_t)(n & SYNC_EST_COUNTER_MASK), sent + (random() % JITTER_NS));
+        if(k != n) {
+            printf("FAIL: sync %d unwrapped to %ld\n", n, k);
+            failed = 1;
+        }
+        if(n >= SYNC_EST_WINDOW) {
+            uint64_t predicted = syncEstTimeOf(&est, k + 1);
+            uint64_t actual = sent + MASTER_PTU_NS + (JITTER_NS / 2);   // Where the middle of the jitter will be.
+            uint64_t err = (predicted > actual) ? (predicted - actual) : (actual - predicted);
+            if(err > worst) worst = err;
+        }
+    }
+    printf("Period %.1fns (master %uns), worst next sync prediction error %luns (jitter %uns)\n", est.period_ns, MASTER_PTU_NS, worst, JITTER_NS);
+    if(worst > (JITTER_NS / 2)) {
+        printf("FAIL: prediction is no better than the raw Rx times\n");
+        failed = 1;
+    }
+    if((est.period_ns < (MASTER_PTU_NS - 5000)) || (est.period_ns > (MASTER_PTU_NS + 5000))) {
+        printf("FAIL: period estimate is off\n");
+        failed = 1;
+    }
+
+    // A jump in the counter (e.g. a new Sync Master) starts again.
+    syncEstAdd(&est, 500, start + ((uint64_t)NUM_SYNCS * MASTER_PTU_NS));
+    if(est.count != 1) {
+        printf("FAIL: counter jump kept %u samples\n", est.count);
+        failed = 1;
+    }
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
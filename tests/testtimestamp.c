@@ -0,0 +1,75 @@
+// testtimestamp.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "../utils/timestamp.h"
+
+#define TAG "testtimestamp"
+
+// Runs nanos_fast() on the CPU counter for a few seconds next to nanos() and checks that it doesn't wander away from it (it's
+// re-anchored every 100ms) and never goes backwards, while a second thread reads it as fast as it can across the re-anchors.
+
+#define RUN_NS      SECS_TO_NS(3)
+#define MAX_ERROR   (20000)   // ns
+
+static volatile int running = 1;
+static uint64_t backwards = 0;
+
+static void * reader(void * unused) {
+    uint64_t last = nanos_fast();
+    while(running) {
+        uint64_t now = nanos_fast();
+        if(now < last) {
+            backwards++;
+        }
+        last = now;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if(nanos_set_source(TIMESTAMP_SOURCE_COUNTER) != TIMESTAMP_SOURCE_COUNTER) {
+        printf("No usable CPU counter on this CPU. Nothing to test.\n");
+        printf("PASS\n");
+        return EXIT_SUCCESS;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, reader, NULL);
+
+    uint64_t worst = 0, samples = 0, last = 0;
+    uint64_t end = nanos() + RUN_NS;
+    while(nanos() < end) {
+        // The counter's time should be between the two kernel clock reads.
+        uint64_t before = nanos();
+        uint64_t fast = nanos_fast();
+        uint64_t after = nanos();
+        uint64_t error = 0;
+        if(fast < before) {
+            error = before - fast;
+        } else if(fast > after) {
+            error = fast - after;
+        }
+        if(error > worst) {
+            worst = error;
+        }
+        if(fast < last) {
+            backwards++;
+        }
+        last = fast;
+        samples++;
+        usleep(1000);
+    }
+    running = 0;
+    pthread_join(thread, NULL);
+
+    printf("%lu samples, worst error %luns, went backwards %lu times\n", samples, worst, backwards);
+    if((worst > MAX_ERROR) || (backwards != 0)) {
+        printf("FAIL\n");
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
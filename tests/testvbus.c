@@ -0,0 +1,99 @@
+// testvbus.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../vbus.h"
+#include "../milcan.h"
+#include "../utils/canbits.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testvbus"
+
+// Three nodes on one virtual bus at 1M, run on a made up clock. Frames queued while the bus is busy go in arbitration order, every
+// node (the sender too) receives every frame, and each frame takes its length in bits x 1us.
+
+#define BIT_NS        (1000)  // 1M
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %lu, expected %lu\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static void queue(struct vbus_node* node, uint32_t id) {
+    struct can_frame frame = { .can_id = CAN_EFF_FLAG | id, .len = 8, .data = { 0, 1, 2, 3, 4, 5, 6, 7 } };
+    if(vbusWrite(node, &frame) != MILCAN_OK) {
+        printf("FAIL: unable to queue 0x%08x\n", id);
+    }
+}
+
+static uint64_t bits(uint32_t id) {
+    uint8_t data[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    return canBitsExtended(id, 0, 8, data);
+}
+
+int main(int argc, char *argv[]) {
+    struct vbus_node a, b, c;
+    struct can_frame frame;
+    uint64_t rx_time, frames, busy_ns;
+    int failed = 0;
+
+    if((vbusAttach(&a, 0, MILCAN_A_1M) != MILCAN_OK) || (vbusAttach(&b, 0, MILCAN_A_1M) != MILCAN_OK) || (vbusAttach(&c, 0, MILCAN_A_1M) != MILCAN_OK)) {
+        printf("FAIL: unable to attach\n");
+        return EXIT_FAILURE;
+    }
+
+    // 0x500 starts straight away. The other three wait for it and then go lowest ID first, whoever queued them.
+    nanos_set_cached(1000000);
+    queue(&a, 0x500);
+    queue(&a, 0x300);
+    queue(&b, 0x100);
+    queue(&c, 0x200);
+    failed |= check("frames before the first has finished", vbusRead(&b, &frame, &rx_time) == MILCAN_OK, 0);
+
+    nanos_set_cached(2000000);
+    uint32_t order[4] = { 0x500, 0x100, 0x200, 0x300 };
+    uint64_t expected = 1000000;
+    for(int i = 0; i < 4; i++) {
+        expected += bits(order[i]) * BIT_NS;
+        if(vbusRead(&b, &frame, &rx_time) != MILCAN_OK) {
+            printf("FAIL: frame %d missing\n", i);
+            failed = 1;
+            break;
+        }
+        failed |= check("arbitration order", frame.can_id & CAN_EFF_MASK, order[i]);
+        failed |= check("end of frame", rx_time, expected);
+    }
+    failed |= check("extra frames", vbusRead(&b, &frame, &rx_time) == MILCAN_OK, 0);
+
+    // The senders see their own frames too.
+    int count = 0;
+    while(vbusRead(&a, &frame, &rx_time) == MILCAN_OK) count++;
+    failed |= check("frames looped back to a", count, 4);
+    count = 0;
+    while(vbusRead(&c, &frame, &rx_time) == MILCAN_OK) count++;
+    failed |= check("frames seen by c", count, 4);
+
+    vbusGetStats(0, &frames, &busy_ns);
+    failed |= check("bus frames", frames, 4);
+    failed |= check("bus busy", busy_ns, expected - 1000000);
+
+    // Unpaced frames take no time at all.
+    vbusSetSpeedup(0, VBUS_UNPACED);
+    queue(&a, 0x400);
+    failed |= check("unpaced frame arrived", vbusRead(&b, &frame, &rx_time) == MILCAN_OK, 1);
+    failed |= check("unpaced frame time", rx_time, 2000000);
+
+    vbusDetach(&a);
+    vbusDetach(&b);
+    vbusDetach(&c);
+
+    if(failed) {
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+// testwcrt.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "../wcrt.h"
+#include "../milcan.h"
+#include "../utils/timestamp.h"
+
+#define TAG "testwcrt"
+
+// Checks the response time analysis against the example from Davis et al. "Controller Area Network (CAN) schedulability analysis:
+// Refuted, revisited and revised", where the lowest priority frame's worst case is its second instance, then times a design loop.
+
+#define FRAME_NS      (160000)  // An 8 byte frame at 1M, worst case stuffing.
+#define NUM_SETS      (1000)
+#define SET_SIZE      (100)
+
+static int check(const char* name, uint64_t got, uint64_t expected) {
+    if(got != expected) {
+        printf("FAIL: %s is %luns, expected %luns\n", name, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct wcrt_bus bus = { .speed = MILCAN_A_1M, .sync_freq_hz = 0, .sync_source = 1, .sync_jitter_ns = 0 };
+    struct wcrt_summary summary;
+    int failed = 0;
+
+    // Three frames of 1 unit, periods 2.5, 3.5 and 3.5 units. Listed out of order on purpose.
+    struct wcrt_message davis[3] = {
+        { .id = MILCAN_MAKE_ID(3, 0, 0x40, 0, 3), .dlc = 8, .period_ns = 560000, .deadline_ns = 560000 },
+        { .id = MILCAN_MAKE_ID(3, 0, 0x40, 0, 1), .dlc = 8, .period_ns = 400000, .deadline_ns = 400000 },
+        { .id = MILCAN_MAKE_ID(3, 0, 0x40, 0, 2), .dlc = 8, .period_ns = 560000, .deadline_ns = 560000 },
+    };
+    if(wcrtAnalyse(&bus, davis, 3, &summary) != MILCAN_OK) {
+        printf("FAIL: Davis set should just be schedulable\n");
+        failed = 1;
+    }
+    failed |= check("A blocking", davis[0].blocking_ns, FRAME_NS);
+    failed |= check("A response", davis[0].response_ns, 2 * FRAME_NS);
+    failed |= check("B response", davis[1].response_ns, 3 * FRAME_NS);
+    failed |= check("C response", davis[2].response_ns, 560000);  // The original analysis says 480000.
+    failed |= check("C slack", (uint64_t)davis[2].slack_ns, 0);
+    printf("Davis set: utilisation %.3f, C response %luus\n", summary.utilisation, davis[2].response_ns / 1000);
+
+    // Add the sync frames. Now C misses.
+    bus.sync_freq_hz = 64;
+    if(wcrtAnalyse(&bus, davis, 3, &summary) != MILCAN_ERROR) {
+        printf("FAIL: Davis set with sync frames should not be schedulable\n");
+        failed = 1;
+    }
+    if(summary.unschedulable == 0 || davis[summary.min_slack_index].schedulable) {
+        printf("FAIL: summary doesn't point at the failing message\n");
+        failed = 1;
+    }
+
+    // Overloaded.
+    struct wcrt_message overload[2] = {
+        { .id = MILCAN_MAKE_ID(1, 0, 0x40, 0, 1), .dlc = 8, .period_ns = 200000 },
+        { .id = MILCAN_MAKE_ID(1, 0, 0x40, 0, 2), .dlc = 8, .period_ns = 200000 },
+    };
+    wcrtAnalyse(&bus, overload, 2, &summary);
+    if(overload[1].response_ns != WCRT_UNBOUNDED || summary.utilisation < 1.0) {
+        printf("FAIL: overloaded bus was not spotted\n");
+        failed = 1;
+    }
+
+    // A design loop: lots of random sets of HRT, SRT and NRT frames on a 500K bus at 128Hz.
+    static struct wcrt_message set[SET_SIZE];
+    uint32_t ok = 0;
+    bus.speed = MILCAN_A_500K;
+    bus.sync_freq_hz = MILCAN_A_500K_DEFAULT_SYNC_HZ;
+    srandom(1);
+    uint64_t start = nanos();
+    for(int n = 0; n < NUM_SETS; n++) {
+        for(int i = 0; i < SET_SIZE; i++) {
+            uint8_t priority = 1 + (random() % 7);
+            set[i].id = MILCAN_MAKE_ID(priority, 0, 0x40 + (random() % 16), random() % 256, random() % 256);
+            set[i].dlc = random() % 9;
+            set[i].period_ns = 7812500ULL << (random() % (priority + 2));
+            set[i].jitter_ns = random() % 100000;
+            set[i].deadline_ns = 0;
+        }
+        if(wcrtAnalyse(&bus, set, SET_SIZE, &summary) == MILCAN_OK) ok++;
+    }
+    uint64_t taken = nanos() - start;
+    printf("%u sets of %u messages in %luus (%luus per set), %u schedulable\n", NUM_SETS, SET_SIZE, taken / 1000, taken / 1000 / NUM_SETS, ok);
+
+    printf("%s\n", failed ? "FAILED" : "PASSED");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,7 +2,7 @@
 #include <inttypes.h>
 #include <string.h>     /* String function definitions */
 #include <errno.h>      /* Error number definitions */
-//#include <unistd.h>
+#include <unistd.h>     // sysconf()
 #include <stdint.h>
 #include <stdlib.h>
 #include "milcan.h"
@@ -10,6 +10,7 @@
 #define LOG_LEVEL 3
 #include "utils/logs.h"
 #include "interfaces.h"
+#include "txq.h"
 
 #include <stdio.h>      /* Standard input/output definitions */
 
@@ -27,6 +28,104 @@ void txQ_print_sizes(struct milcan_a* interface) {
     }
 }
 
+/// @brief Writes to every page of p so that they're all faulted in now. The writes are volatile so the compiler can't drop them.
+static void txQPrefault(void* p, size_t size) {
+    volatile uint8_t* bytes = (volatile uint8_t*)p;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for(size_t n = 0; n < size; n += page) {
+        bytes[n] = 0;
+    }
+    if(size > 0) {
+        bytes[size - 1] = 0;    // The last page, if p doesn't start on a page boundary.
+    }
+}
+
+/// @brief Allocates and pre-touches a pool of frames and list entries so that the Tx Q doesn't use the heap.
+int txQPoolInit(struct milcan_a* interface, uint32_t size) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    pool->frames = malloc(size * sizeof(struct milcan_frame));
+    pool->nodes = malloc(size * sizeof(struct list_milcan_frame));
+    pool->free_frames = malloc(size * sizeof(struct milcan_frame*));
+    if((pool->frames == NULL) || (pool->nodes == NULL) || (pool->free_frames == NULL)) {
+        txQPoolFree(interface);
+        return ENOMEM;
+    }
+    // Big allocations come straight from mmap() as untouched pages. Fault them all in now so we don't later.
+    txQPrefault(pool->frames, size * sizeof(struct milcan_frame));
+    txQPrefault(pool->nodes, size * sizeof(struct list_milcan_frame));
+    txQPrefault(pool->free_frames, size * sizeof(struct milcan_frame*));
+    memset(pool->frames, 0, size * sizeof(struct milcan_frame));
+    memset(pool->nodes, 0, size * sizeof(struct list_milcan_frame));
+    pool->free_nodes = NULL;
+    for(uint32_t i = 0; i < size; i++) {
+        pool->free_frames[i] = &(pool->frames[i]);
+        pool->nodes[i].next = pool->free_nodes;
+        pool->free_nodes = &(pool->nodes[i]);
+    }
+    pool->free_frame_count = size;
+    pool->size = size;
+    return 0;
+}
+
+/// @brief Releases the pool.
+void txQPoolFree(struct milcan_a* interface) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    free(pool->frames);
+    free(pool->nodes);
+    free(pool->free_frames);
+    memset(pool, 0, sizeof(struct milcan_tx_pool));
+}
+
+static int txQInPool(struct milcan_tx_pool* pool, void* p, void* base, size_t size) {
+    return (pool->size > 0) && ((char*)p >= (char*)base) && ((char*)p < ((char*)base + (pool->size * size)));
+}
+
+/// @brief Gets a frame to queue, from the pool if there is one. Call with the txBufferMutex held.
+struct milcan_frame* txQFrameAlloc(struct milcan_a* interface) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    if(pool->free_frame_count > 0) {
+        pool->free_frame_count--;
+        return pool->free_frames[pool->free_frame_count];
+    }
+    if(pool->size > 0) {
+        interface->stats.tx_pool_exhausted++;
+    }
+    return interface_calloc(interface, 1, sizeof(struct milcan_frame));
+}
+
+/// @brief Returns a frame from txQFrameAlloc(). Call with the txBufferMutex held.
+void txQFrameFree(struct milcan_a* interface, struct milcan_frame* frame) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    if(txQInPool(pool, frame, pool->frames, sizeof(struct milcan_frame))) {
+        pool->free_frames[pool->free_frame_count++] = frame;
+    } else {
+        free(frame);
+    }
+}
+
+static struct list_milcan_frame* txQNodeAlloc(struct milcan_a* interface) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    struct list_milcan_frame* node = pool->free_nodes;
+    if(node != NULL) {
+        pool->free_nodes = node->next;
+        return node;
+    }
+    if(pool->size > 0) {
+        interface->stats.tx_pool_exhausted++;
+    }
+    return interface_calloc(interface, 1, sizeof(struct list_milcan_frame));
+}
+
+static void txQNodeFree(struct milcan_a* interface, struct list_milcan_frame* node) {
+    struct milcan_tx_pool* pool = &(interface->tx.pool);
+    if(txQInPool(pool, node, pool->nodes, sizeof(struct list_milcan_frame))) {
+        node->next = pool->free_nodes;
+        pool->free_nodes = node;
+    } else {
+        free(node);
+    }
+}
+
 /// @brief Adds a CAN frame to the output buffer. They will be added taking into account the message priority. Invalid messages will be discarded.
 /// @param frame The CAN frame to transmit.
 int txQAdd(struct milcan_a* interface, struct milcan_frame* frame) {
@@ -39,13 +138,14 @@ int txQAdd(struct milcan_a* interface, struct milcan_frame* frame) {
     // Bits 0 to 7 - Source Address (unique ID of ECU)
 
     // The lower the ID the higher the priority so the further up the queue it should be placed.
-    struct list_milcan_frame* list_frame = calloc(1, sizeof(struct list_milcan_frame));
-    if(frame == NULL) {
+    struct list_milcan_frame* list_frame = txQNodeAlloc(interface);
+    if(list_frame == NULL) {
         return ENOMEM;  // We're out of memory!
     }
     frame->frame.can_id |= CAN_EFF_FLAG;
     if(frame->mortal != 0) {
-        frame->mortal += nanos();
+        // When we're polled the caller's clock may not be ours so use the time it gave us.
+        frame->mortal += interface_now(interface);
     }
     list_frame->frame = frame;
     list_frame->next = NULL;
@@ -71,24 +171,51 @@ int txQAdd(struct milcan_a* interface, struct milcan_frame* frame) {
     return 0;
 }
 
-/// @brief Returns a pointer to the next milcan_frame of the required priority to be sent. If the queue is empty then returns NULL. Any mortal frame that has exceeded it's time to live will automtaiclaly be discarded.
-struct milcan_frame* txQRead(struct milcan_a* interface, uint8_t priority) {
+/// @brief Puts a frame from txQRead() back on the front of its queue (e.g. the adapter wouldn't take it). It was the first in its
+/// queue when it was read, so it goes first again. Returns 0 or ENOMEM.
+int txQReturn(struct milcan_a* interface, struct milcan_frame* frame) {
+    struct list_milcan_frame* list_frame = txQNodeAlloc(interface);
+    if(list_frame == NULL) {
+        return ENOMEM;  // We're out of memory!
+    }
+    uint8_t priority = ((frame->frame.can_id & MILCAN_ID_PRIORITY_MASK) >> 26) & 0x07;
+    list_frame->frame = frame;
+    list_frame->next = interface->tx.tx_queue[priority];
+    interface->tx.tx_queue[priority] = list_frame;
+    return 0;
+}
+
+/// @brief Returns a pointer to the next milcan_frame of the required priority without taking it off the queue. If the queue is empty then returns NULL. Any mortal frame that has exceeded it's time to live will automtaiclaly be discarded.
+struct milcan_frame* txQPeek(struct milcan_a* interface, uint8_t priority) {
     if(priority >= MILCAN_ID_PRIORITY_COUNT) {
         LOGE(TAG, "Invalid priority level.");
         return NULL;
     }
     struct list_milcan_frame* head = interface->tx.tx_queue[priority];
-    struct milcan_frame* frame = NULL;
-    uint64_t now = nanos();
+    uint64_t now = nanos_cached();
 
-    while((frame == NULL) && (interface->tx.tx_queue[priority] != NULL)) {
+    while(head != NULL) {
         if((head->frame->mortal == 0) || (head->frame->mortal > now)) {
-            frame = head->frame;
+            return head->frame;
         }
+        txQFrameFree(interface, head->frame);   // It's expired.
         interface->tx.tx_queue[priority] = head->next;
-        free(head);
+        txQNodeFree(interface, head);
         head = interface->tx.tx_queue[priority];
     }
-    
+
+    return NULL;
+}
+
+/// @brief Returns a pointer to the next milcan_frame of the required priority to be sent. If the queue is empty then returns NULL. Any mortal frame that has exceeded it's time to live will automtaiclaly be discarded.
+struct milcan_frame* txQRead(struct milcan_a* interface, uint8_t priority) {
+    struct milcan_frame* frame = txQPeek(interface, priority);
+
+    if(frame != NULL) {
+        struct list_milcan_frame* head = interface->tx.tx_queue[priority];
+        interface->tx.tx_queue[priority] = head->next;
+        txQNodeFree(interface, head);
+    }
+
     return frame;
 }
@@ -12,4 +12,22 @@ extern int txQAdd(struct milcan_a* interface, struct milcan_frame* frame);
 /// @brief Returns a pointer to the next CAN frame to be sent. If the queue is empty then returns NULL.
 extern struct milcan_frame* txQRead(struct milcan_a* interface, uint8_t priority);
 
+/// @brief Puts a frame from txQRead() back on the front of its queue (e.g. the adapter wouldn't take it). Returns 0 or ENOMEM.
+extern int txQReturn(struct milcan_a* interface, struct milcan_frame* frame);
+
+/// @brief Returns a pointer to the next CAN frame to be sent without taking it off the queue. If the queue is empty then returns NULL.
+extern struct milcan_frame* txQPeek(struct milcan_a* interface, uint8_t priority);
+
+/// @brief Allocates and pre-touches a pool of frames and list entries so that the Tx Q doesn't use the heap.
+extern int txQPoolInit(struct milcan_a* interface, uint32_t size);
+
+/// @brief Releases the pool.
+extern void txQPoolFree(struct milcan_a* interface);
+
+/// @brief Gets a frame to queue, from the pool if there is one. Call with the txBufferMutex held.
+extern struct milcan_frame* txQFrameAlloc(struct milcan_a* interface);
+
+/// @brief Returns a frame from txQFrameAlloc(). Call with the txBufferMutex held.
+extern void txQFrameFree(struct milcan_a* interface, struct milcan_frame* frame);
+
 #endif  // __TXQ_H__
\ No newline at end of file
@@ -0,0 +1,125 @@
+// canbits.c
+#include <inttypes.h>
+#include <pthread.h>
+#include "canbits.h"
+
+// Works out exactly how long a frame is on the wire. Bit stuffing depends on the actual bits (including the CRC) so we build the
+// stuffable part of the frame, compute the CRC and then count the stuff bits a byte at a time using lookup tables.
+//
+// An extended ID frame from SOF to the end of the CRC is 54 + (8 * DLC) bits, all of which can be stuffed:
+//   SOF(1) ID[28:18](11) SRR(1) IDE(1) ID[17:0](18) RTR(1) r1(1) r0(1) DLC(4) | Data(8 * DLC) | CRC(15)
+// The 39 bit header isn't byte aligned so we put one more bit in front of SOF to make it 5 bytes. For the CRC it's a 0, which doesn't
+// change it. For stuffing it's the recessive idle bus, which can't start a run because SOF is dominant. The last 7 bits of the CRC
+// have their own table.
+
+#define CAN_CRC15_POLY    (0x4599)
+#define CAN_HEADER_BITS   (39)
+
+// Stuffing state: the last bit in bit 3 and how many of it in a row (0 to 4) in bits 0 to 2.
+#define STUFF_STATE(last, run)  (((last) << 3) | (run))
+#define STUFF_LAST(state)       (((state) >> 3) & 1)
+#define STUFF_RUN(state)        ((state) & 7)
+
+static uint16_t crc_table[256];
+static uint8_t stuff_table[16][256];  // New state in the low nibble, stuff bits in the high nibble.
+static uint8_t stuff_tail[16][128];   // The same for 7 bits.
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+// One bit through the stuffing state machine. Returns the new state and adds any stuff bit to stuffs.
+static inline uint8_t stuff_bit(uint8_t state, uint8_t bit, uint32_t* stuffs) {
+  uint8_t run = ((STUFF_RUN(state) != 0) && (STUFF_LAST(state) == bit)) ? (STUFF_RUN(state) + 1) : 1;
+  if(run == 5) {
+    (*stuffs)++;
+    return STUFF_STATE(!bit, 1);  // The stuff bit is the opposite and starts the next run.
+  }
+  return STUFF_STATE(bit, run);
+}
+
+static void build_tables() {
+  for(uint16_t i = 0; i < 256; i++) {
+    uint16_t crc = i << 7;
+    for(int b = 0; b < 8; b++) {
+      crc = (crc & 0x4000) ? (((crc << 1) ^ CAN_CRC15_POLY) & 0x7FFF) : ((crc << 1) & 0x7FFF);
+    }
+    crc_table[i] = crc;
+  }
+  for(uint8_t state = 0; state < 16; state++) {
+    for(uint16_t byte = 0; byte < 256; byte++) {
+      uint32_t stuffs = 0;
+      uint8_t s = state;
+      for(int b = 7; b >= 0; b--) {
+        s = stuff_bit(s, (byte >> b) & 1, &stuffs);
+      }
+      stuff_table[state][byte] = (uint8_t)((stuffs << 4) | s);
+    }
+    for(uint8_t bits = 0; bits < 128; bits++) {
+      uint32_t stuffs = 0;
+      uint8_t s = state;
+      for(int b = 6; b >= 0; b--) {
+        s = stuff_bit(s, (bits >> b) & 1, &stuffs);
+      }
+      stuff_tail[state][bits] = (uint8_t)((stuffs << 4) | s);
+    }
+  }
+}
+
+static inline uint16_t crc_byte(uint16_t crc, uint8_t byte) {
+  return ((crc << 8) ^ crc_table[((crc >> 7) ^ byte) & 0xFF]) & 0x7FFF;
+}
+
+static inline uint8_t stuff_byte(uint8_t state, uint8_t byte, uint32_t* stuffs) {
+  uint8_t entry = stuff_table[state][byte];
+  *stuffs += entry >> 4;
+  return entry & 0x0F;
+}
+
+// SOF to DLC as the low 39 bits.
+static inline uint64_t header_bits(uint32_t id, uint8_t rtr, uint8_t dlc) {
+  return ((uint64_t)((id >> 18) & 0x7FF) << 27)   // SOF is 0, base ID
+    | ((uint64_t)3 << 25)                         // SRR and IDE are 1
+    | ((uint64_t)(id & 0x3FFFF) << 7)             // ID extension
+    | ((uint64_t)(rtr ? 1 : 0) << 6)              // RTR, then r1 and r0 are 0
+    | (dlc & 0x0F);
+}
+
+/// Returns the CAN CRC-15 of an extended ID frame (SOF to the end of the data).
+uint16_t canBitsCrc15(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data) {
+  uint64_t header = header_bits(id, rtr, dlc);
+  uint8_t len = rtr ? 0 : ((dlc > 8) ? 8 : dlc);
+  uint16_t crc = 0;
+
+  pthread_once(&tables_once, build_tables);
+  for(int b = 32; b >= 0; b -= 8) {
+    crc = crc_byte(crc, (header >> b) & 0xFF);
+  }
+  for(uint8_t i = 0; i < len; i++) {
+    crc = crc_byte(crc, data[i]);
+  }
+  return crc;
+}
+
+/// Returns the exact number of bits that an extended ID frame takes on the bus, with bit stuffing and the interframe space.
+uint32_t canBitsExtended(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data) {
+  uint64_t header = header_bits(id, rtr, dlc) | ((uint64_t)1 << CAN_HEADER_BITS);  // The idle bit before SOF.
+  uint8_t len = rtr ? 0 : ((dlc > 8) ? 8 : dlc);
+  uint16_t crc = canBitsCrc15(id, rtr, dlc, data);
+  uint32_t stuffs = 0;
+  uint8_t state = STUFF_STATE(1, 0);
+
+  for(int b = 32; b >= 0; b -= 8) {
+    state = stuff_byte(state, (header >> b) & 0xFF, &stuffs);
+  }
+  for(uint8_t i = 0; i < len; i++) {
+    state = stuff_byte(state, data[i], &stuffs);
+  }
+  state = stuff_byte(state, crc >> 7, &stuffs);
+  stuffs += stuff_tail[state][crc & 0x7F] >> 4;
+  return 54 + (8 * len) + stuffs + CAN_BITS_UNSTUFFED_TAIL;
+}
+
+/// Returns the worst case number of bits that an extended ID frame with this DLC can take on the bus, with the interframe space.
+uint32_t canBitsWorst(uint8_t dlc) {
+  uint32_t stuffable = 54 + (8 * ((dlc > 8) ? 8 : dlc));
+  // One stuff bit for every 4 bits after the first 5.
+  return stuffable + ((stuffable - 1) / 4) + CAN_BITS_UNSTUFFED_TAIL;
+}
@@ -0,0 +1,20 @@
+// canbits.h
+
+#ifndef __CANBITS_H__
+#define __CANBITS_H__
+
+#include <inttypes.h>
+
+// Bits in an extended ID frame that can't be stuffed: CRC delimiter, ACK slot and delimiter, 7 bit EOF and 3 bit interframe space.
+#define CAN_BITS_UNSTUFFED_TAIL   (13)
+
+/// Returns the CAN CRC-15 of an extended ID frame (SOF to the end of the data).
+extern uint16_t canBitsCrc15(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data);
+
+/// Returns the exact number of bits that an extended ID frame takes on the bus, with bit stuffing and the interframe space.
+extern uint32_t canBitsExtended(uint32_t id, uint8_t rtr, uint8_t dlc, const uint8_t* data);
+
+/// Returns the worst case number of bits that an extended ID frame with this DLC can take on the bus, with the interframe space.
+extern uint32_t canBitsWorst(uint8_t dlc);
+
+#endif // __CANBITS_H__
@@ -0,0 +1,46 @@
+// futex.c
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include "futex.h"
+
+// A thread can sleep on a 32 bit word and be woken by another thread or process changing it. The kernel only puts us to sleep if the
+// word still holds the value that we expect, so a wake up between us looking at it and going to sleep can't be lost. On Linux that's
+// futex(2) and on FreeBSD _umtx_op(2). We don't use the private versions as the word may be in shared memory.
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#elif defined(__FreeBSD__)
+#include <sys/types.h>
+#include <sys/umtx.h>
+#endif
+
+/// Sleeps while *word is still expected, for at most timeout_ns. The word can be in memory shared between processes.
+/// Returns straight away if it has already changed. May wake early, so check what you're waiting for again.
+void futexWait(_Atomic uint32_t* word, uint32_t expected, uint64_t timeout_ns) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ns / 1000000000L;
+  timeout.tv_nsec = timeout_ns % 1000000000L;
+#if defined(__linux__)
+  syscall(SYS_futex, word, FUTEX_WAIT, expected, &timeout, NULL, 0);
+#elif defined(__FreeBSD__)
+  // A NULL size means that the last argument is a relative struct timespec.
+  _umtx_op((void*)word, UMTX_OP_WAIT_UINT, expected, NULL, &timeout);
+#else
+  if(atomic_load(word) == expected) {
+    sched_yield();
+  }
+#endif
+}
+
+/// Wakes everything sleeping in futexWait() on word, in any process. Change the word first.
+void futexWake(_Atomic uint32_t* word) {
+#if defined(__linux__)
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#elif defined(__FreeBSD__)
+  _umtx_op((void*)word, UMTX_OP_WAKE, INT_MAX, NULL, NULL);
+#endif
+}
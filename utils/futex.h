@@ -0,0 +1,16 @@
+// futex.h
+
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+/// Sleeps while *word is still expected, for at most timeout_ns. The word can be in memory shared between processes.
+/// Returns straight away if it has already changed. May wake early, so check what you're waiting for again.
+extern void futexWait(_Atomic uint32_t* word, uint32_t expected, uint64_t timeout_ns);
+
+/// Wakes everything sleeping in futexWait() on word, in any process. Change the word first.
+extern void futexWake(_Atomic uint32_t* word);
+
+#endif // __FUTEX_H__
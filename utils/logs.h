@@ -17,10 +17,10 @@
 #endif  // LOG_LEVEL
 
 #define LOCAL_LOG_LEVEL(level, tag, format, ...) do {\
-    if(level == LOG_LEVEL_ERROR)      { fprintf(stderr, "%lu: ERROR: %s: %s() line %i: %s: " format "\n", nanos(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
-    else if(level == LOG_LEVEL_WARN)  { fprintf(stdout, "%lu:  WARN: %s: %s() line %i: %s: " format "\n", nanos(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
-    else if(level == LOG_LEVEL_DEBUG) { fprintf(stdout, "%lu: DEBUG: %s: %s() line %i: %s: " format "\n", nanos(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
-    else if(level == LOG_LEVEL_INFO)  { fprintf(stdout, "%lu:  INFO: %s: %s() line %i: %s: " format "\n", nanos(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
+    if(level == LOG_LEVEL_ERROR)      { fprintf(stderr, "%lu: ERROR: %s: %s() line %i: %s: " format "\n", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
+    else if(level == LOG_LEVEL_WARN)  { fprintf(stdout, "%lu:  WARN: %s: %s() line %i: %s: " format "\n", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
+    else if(level == LOG_LEVEL_DEBUG) { fprintf(stdout, "%lu: DEBUG: %s: %s() line %i: %s: " format "\n", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
+    else if(level == LOG_LEVEL_INFO)  { fprintf(stdout, "%lu:  INFO: %s: %s() line %i: %s: " format "\n", nanos_fast(), __FILE__, __FUNCTION__, __LINE__, tag __VA_OPT__(,) __VA_ARGS__); } \
   } while (0)
 
 #define LOG_LEVEL_LOCAL(level, tag, format, ...) do {\
@@ -3,7 +3,11 @@
 #include <stdio.h>      /* Standard input/output definitions */
 #include <sys/types.h>
 #include <errno.h>      /* Error number definitions */
+#ifdef __linux__
+#include <sched.h>
+#else
 #include <sys/rtprio.h>
+#endif
 
 #include "priorities.h"
 // #define LOG_LEVEL 3
@@ -11,6 +15,76 @@
 
 #define TAG "Priorities"
 
+#ifdef __linux__
+// Linux doesn't have rtprio(). RTP_PRIO_REALTIME is SCHED_RR (FreeBSD maps one onto the other) but the priorities go the other way
+// (the higher the number the more urgent), so rtprio's 0 (highest) to 31 (lowest) is mapped onto the top of the SCHED_RR range.
+
+void displayRTpriority() {
+  struct sched_param param;
+  LOGI(TAG, "Getting Real Time Priority settings.");
+  int policy = sched_getscheduler(0);
+  if((policy < 0) || (sched_getparam(0, &param) < 0)) {
+    switch(errno) {
+      default:
+        LOGE(TAG, "ERROR sched_getscheduler returned unknown error (%i).", errno);
+        break;
+      case EINVAL:
+        LOGE(TAG, "EINVAL The specified process was out of range.");
+        break;
+      case ESRCH:
+        LOGE(TAG, "ESRCH The specified process or thread could not be found.");
+        break;
+    }
+  } else {
+    switch(policy) {
+      case SCHED_FIFO:
+        LOGI(TAG, "Real Time Priority type is: SCHED_FIFO.");
+        break;
+      case SCHED_RR:
+        LOGI(TAG, "Real Time Priority type is: SCHED_RR.");
+        break;
+      case SCHED_OTHER:
+        LOGI(TAG, "Real Time Priority type is: SCHED_OTHER.");
+        break;
+      default:
+        LOGI(TAG, "Real Time Priority type is: %i.", policy);
+        break;
+    }
+    LOGI(TAG, "Real Time Priority priority is: %i.", param.sched_priority);
+  }
+}
+
+int setRTpriority(u_short prio) {
+  struct sched_param param;
+
+  LOGI(TAG, "Setting the Real Time Priority type to SCHED_RR and priority to %u.", prio);
+  param.sched_priority = sched_get_priority_max(SCHED_RR) - prio; // 0 = highest priority, 31 = lowest.
+  if(param.sched_priority < sched_get_priority_min(SCHED_RR)) {
+    param.sched_priority = sched_get_priority_min(SCHED_RR);
+  }
+  int ret = sched_setscheduler(0, SCHED_RR, &param);
+  if(ret < 0) {
+    switch(errno) {
+      default:
+        LOGE(TAG, "ERROR sched_setscheduler returned unknown error (%i).", errno);
+        break;
+      case EINVAL:
+        LOGE(TAG, "EINVAL The priority %i is out of range.", param.sched_priority);
+        break;
+      case EPERM:
+        LOGE(TAG, "EPERM The calling thread is not allowed to set the priority. Try running as SU or root.");
+        break;
+      case ESRCH:
+        LOGE(TAG, "ESRCH The specified process or thread could not be found.");
+        break;
+    }
+  }
+  displayRTpriority();
+  return ret;
+}
+
+#else
+
 void displayRTpriority() {
   // Get the current real time priority
   struct rtprio rtdata;
@@ -101,3 +175,5 @@ int setRTpriority(u_short prio) {
   displayRTpriority();
   return ret;
 }
+
+#endif  // __linux__
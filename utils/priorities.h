@@ -4,6 +4,7 @@
 #define __PRIORITIES_H__
 
 #include <inttypes.h>
+#include <sys/types.h>  // u_short
 
 extern void displayRTpriority();
 extern int setRTpriority(u_short prio);
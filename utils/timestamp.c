@@ -4,12 +4,35 @@
 
 #include <inttypes.h>
 #include <sys/time.h>
+#ifndef _POSIX_C_SOURCE
 #define _POSIX_C_SOURCE 199309L
+#endif
 #include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "timestamp.h"
 
 // #define CLOCK_SOURCE    CLOCK_MONOTONIC_FAST
 // #define CLOCK_SOURCE    CLOCK_MONOTONIC
+#if defined(CLOCK_MONOTONIC_PRECISE)
 #define CLOCK_SOURCE    CLOCK_MONOTONIC_PRECISE
+#else
+#define CLOCK_SOURCE    CLOCK_MONOTONIC   // Linux doesn't have _PRECISE. Its CLOCK_MONOTONIC is already the precise one.
+#endif
+
+// The cheap kernel clock used by TIMESTAMP_SOURCE_COARSE (and as the fallback when there is no usable counter).
+#if defined(CLOCK_MONOTONIC_FAST)
+#define CLOCK_SOURCE_COARSE   CLOCK_MONOTONIC_FAST
+#elif defined(CLOCK_MONOTONIC_COARSE)
+#define CLOCK_SOURCE_COARSE   CLOCK_MONOTONIC_COARSE
+#else
+#define CLOCK_SOURCE_COARSE   CLOCK_MONOTONIC
+#endif
+
+#define COUNTER_CALIBRATE_NS  (10000000L) // Calibrate the counter over 10ms.
+#define COUNTER_REANCHOR_NS   (100000000L)// Check the counter against the kernel clock every 100ms.
+#define COUNTER_SHIFT         (24)        // Fixed point shift for the counter to ns multiplier.
+#define COUNTER_WAIT_SPINS    (1024)      // How long a reader waits for a re-anchor to finish before reading the kernel clock instead.
 
 /// Convert seconds to milliseconds
 #define SEC_TO_MS(sec) ((sec)*1000)
@@ -49,4 +72,241 @@ uint64_t nanos() {
     return ns;
 }
 
+// The CPU's free running counter. Reading it doesn't enter the kernel.
+#if defined(__aarch64__)
+#define HAVE_COUNTER  1
+static inline uint64_t read_counter() {
+    uint64_t count;
+    __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r" (count) : : "memory");
+    return count;
+}
+#elif defined(__x86_64__)
+#define HAVE_COUNTER  1
+static inline uint64_t read_counter() {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#else
+#define HAVE_COUNTER  0
+static inline uint64_t read_counter() {
+    return 0;
+}
+#endif
+
+// The counter is converted to ns with counter_base_ns + ((count - counter_base) * counter_mult). No counter runs at exactly the rate
+// that we measure in 10ms, so every COUNTER_REANCHOR_NS whichever thread reads it next compares it with the kernel clock again. If we've
+// fallen behind we step forward. If we've got ahead we can't step back (time would go backwards) so the rate is trimmed to lose the
+// difference over the next period instead. Either way we stay within a few us of nanos(), which is what the counter times get mixed
+// with. The anchor is published under a sequence lock (odd while it's being written) so readers never see half of one.
+static _Atomic int timestamp_source = TIMESTAMP_SOURCE_PRECISE;
+static _Atomic uint32_t counter_seq = 0;        // Odd while the anchor below is being changed.
+static _Atomic uint64_t counter_base = 0;       // Counter value at the anchor.
+static _Atomic uint64_t counter_base_ns = 0;    // nanos_fast() at the anchor.
+static _Atomic uint64_t counter_mult = 0;       // ns per tick << COUNTER_SHIFT.
+static _Atomic uint64_t counter_sync = 0;       // Counter value when it was last compared with the kernel clock.
+static _Atomic uint64_t counter_sync_ns = 0;    // The kernel clock at that point.
+static uint64_t counter_reanchor = 0;           // COUNTER_REANCHOR_NS in counter ticks.
+static __thread uint64_t cached_ns = 0; // This thread's "now" for the current event loop pass.
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return SEC_TO_NS((uint64_t)ts.tv_sec) + (uint64_t)ts.tv_nsec;
+}
+
+// Read the counter and the kernel clock together. The counter is read either side and the midpoint used. We can be preempted in the
+// middle, so it's done a few times and the tightest pair kept.
+static uint64_t counter_pair(uint64_t* now_ns) {
+    uint64_t best = UINT64_MAX, count = 0;
+    for(int i = 0; i < 5; i++) {
+        uint64_t before = read_counter();
+        uint64_t ns = clock_ns(CLOCK_SOURCE);
+        uint64_t after = read_counter();
+        if((after - before) < best) {
+            best = after - before;
+            count = before + ((after - before) / 2);
+            *now_ns = ns;
+        }
+    }
+    return count;
+}
+
+/// Measure the counter against the kernel clock. Returns 0 on success. Called with counter_seq odd.
+static int counter_calibrate() {
+    if(!HAVE_COUNTER) {
+        return -1;
+    }
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = COUNTER_CALIBRATE_NS };
+    uint64_t start_ns, end_ns;
+    uint64_t start = counter_pair(&start_ns);
+    nanosleep(&delay, NULL);
+    uint64_t end = counter_pair(&end_ns);
+    if((end <= start) || (end_ns <= start_ns)) {
+        return -1;  // The counter isn't running (or isn't readable from user space).
+    }
+    uint64_t mult = (uint64_t)((((unsigned __int128)(end_ns - start_ns)) << COUNTER_SHIFT) / (end - start));
+    if(mult == 0) {
+        return -1;
+    }
+    counter_reanchor = (uint64_t)((((unsigned __int128)COUNTER_REANCHOR_NS) << COUNTER_SHIFT) / mult);
+    atomic_store_explicit(&counter_mult, mult, memory_order_relaxed);
+    atomic_store_explicit(&counter_base_ns, end_ns, memory_order_relaxed);
+    atomic_store_explicit(&counter_base, end, memory_order_relaxed);
+    atomic_store_explicit(&counter_sync_ns, end_ns, memory_order_relaxed);
+    atomic_store_explicit(&counter_sync, end, memory_order_relaxed);
+    return 0;
+}
+
+// Compare the counter with the kernel clock again and move the anchor. Only one thread does it at a time: if another one already is, we
+// just carry on with the old anchor.
+static void counter_reanchor_now(uint32_t seq) {
+    if(!atomic_compare_exchange_strong(&counter_seq, &seq, seq + 1)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    uint64_t mult = atomic_load_explicit(&counter_mult, memory_order_relaxed);
+    uint64_t base = atomic_load_explicit(&counter_base, memory_order_relaxed);
+    uint64_t base_ns = atomic_load_explicit(&counter_base_ns, memory_order_relaxed);
+    uint64_t sync = atomic_load_explicit(&counter_sync, memory_order_relaxed);
+    uint64_t sync_ns = atomic_load_explicit(&counter_sync_ns, memory_order_relaxed);
+    uint64_t now_ns;
+    uint64_t count = counter_pair(&now_ns);
+    uint64_t projected = base_ns + (uint64_t)(((unsigned __int128)(count - base) * mult) >> COUNTER_SHIFT);
+
+    if((count > sync) && (now_ns > sync_ns)) {
+        // The rate measured over everything since the last comparison, which is much longer (so much better) than the calibration.
+        mult = (uint64_t)((((unsigned __int128)(now_ns - sync_ns)) << COUNTER_SHIFT) / (count - sync));
+    }
+    if(projected > now_ns) {
+        // We're ahead. Run slow enough to lose it over the next period, but never at less than half speed.
+        uint64_t trim = (uint64_t)((((unsigned __int128)(projected - now_ns)) << COUNTER_SHIFT) / counter_reanchor);
+        mult = (trim < (mult / 2)) ? (mult - trim) : (mult / 2);
+        now_ns = projected;
+    }
+    if(mult != 0) {
+        atomic_store_explicit(&counter_mult, mult, memory_order_relaxed);
+    }
+    atomic_store_explicit(&counter_base_ns, now_ns, memory_order_relaxed);
+    atomic_store_explicit(&counter_base, count, memory_order_relaxed);
+    atomic_store_explicit(&counter_sync_ns, now_ns, memory_order_relaxed);
+    atomic_store_explicit(&counter_sync, count, memory_order_relaxed);
+    atomic_store_explicit(&counter_seq, seq + 2, memory_order_release);
+}
+
+// The counter on the nanos() time base. A re-anchor only takes a few clock reads, but the thread doing it can be preempted part way
+// through by one of the same priority on the same CPU, which would then wait for ever. So we only wait so long and then read the
+// clock that it anchors to.
+static uint64_t counter_ns() {
+    uint32_t spins = 0;
+    for(;;) {
+        uint32_t seq = atomic_load_explicit(&counter_seq, memory_order_acquire);
+        if(seq & 1) {
+            if(++spins >= COUNTER_WAIT_SPINS) {
+                return clock_ns(CLOCK_SOURCE);
+            }
+            continue;   // Being re-anchored.
+        }
+        uint64_t base = atomic_load_explicit(&counter_base, memory_order_relaxed);
+        uint64_t base_ns = atomic_load_explicit(&counter_base_ns, memory_order_relaxed);
+        uint64_t mult = atomic_load_explicit(&counter_mult, memory_order_relaxed);
+        uint64_t count = read_counter();
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&counter_seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        if((count - base) >= counter_reanchor) {
+            counter_reanchor_now(seq);
+            continue;
+        }
+        return base_ns + (uint64_t)(((unsigned __int128)(count - base) * mult) >> COUNTER_SHIFT);
+    }
+}
+
+/// Select the clock source used by nanos_fast(). Other threads may be reading the clock while this is called.
+int nanos_set_source(int source) {
+    int current = atomic_load(&timestamp_source);
+    if(source == current) {
+        return current;    // Already running on it. Don't recalibrate underneath other threads.
+    }
+    switch(source) {
+        case TIMESTAMP_SOURCE_COUNTER: {
+            // Nobody reads the anchor until timestamp_source says COUNTER, but another thread could be calibrating too.
+            uint32_t seq = atomic_load(&counter_seq) & ~1U;
+            while(!atomic_compare_exchange_weak(&counter_seq, &seq, seq + 1)) {
+                seq &= ~1U;
+            }
+            int rep = counter_calibrate();
+            atomic_store_explicit(&counter_seq, seq + 2, memory_order_release);
+            if(rep != 0) {
+                source = TIMESTAMP_SOURCE_COARSE;   // No usable counter so use the next cheapest thing.
+            }
+            break;
+        }
+        case TIMESTAMP_SOURCE_COARSE:
+            break;
+        default:
+            source = TIMESTAMP_SOURCE_PRECISE;
+            break;
+    }
+    atomic_store(&timestamp_source, source);
+    return source;
+}
+
+/// Get the clock source currently used by nanos_fast().
+int nanos_get_source() {
+    return atomic_load(&timestamp_source);
+}
+
+/// Get a time stamp in nanoseconds from the selected clock source.
+uint64_t nanos_fast() {
+    switch(atomic_load_explicit(&timestamp_source, memory_order_relaxed)) {
+        case TIMESTAMP_SOURCE_COUNTER:
+            return counter_ns();
+        case TIMESTAMP_SOURCE_COARSE:
+            return clock_ns(CLOCK_SOURCE_COARSE);
+        default:
+            return clock_ns(CLOCK_SOURCE);
+    }
+}
+
+/// Refresh this thread's cached time stamp and return it.
+uint64_t nanos_tick() {
+    cached_ns = nanos_fast();
+    return cached_ns;
+}
+
+/// Set this thread's cached time stamp.
+void nanos_set_cached(uint64_t now) {
+    cached_ns = now;
+}
+
+/// Get this thread's cached time stamp. If this thread has never ticked we read the clock instead.
+uint64_t nanos_cached() {
+    if(cached_ns == 0) {
+        return nanos_tick();
+    }
+    return cached_ns;
+}
+
+/// Wait until deadline_ns (nanos_fast() time base). We sleep until spin_ns before the deadline and then spin for the rest, which gets us
+/// the accuracy of spinning without burning the whole wait. Returns the time we woke up at (and refreshes this thread's cached time stamp).
+uint64_t nanos_sleep_until(uint64_t deadline_ns, uint64_t spin_ns) {
+    uint64_t now = nanos_fast();
+    if((now < deadline_ns) && ((deadline_ns - now) > spin_ns)) {
+        // The sleep is on CLOCK_MONOTONIC but nanos_fast() may be the counter or the coarse clock, which can be a little way off it. So
+        // sleep for as long as nanos_fast() says is left, counted from CLOCK_MONOTONIC's now.
+        struct timespec wake;
+        uint64_t wake_ns = clock_ns(CLOCK_MONOTONIC) + (deadline_ns - spin_ns - now);
+        wake.tv_sec = NS_TO_SEC(wake_ns);
+        wake.tv_nsec = wake_ns % SEC_TO_NS(1);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+        }
+    }
+    while((now = nanos_fast()) < deadline_ns) {
+    }
+    cached_ns = now;
+    return now;
+}
+
 #endif  // __TIMESTAMP_H___
\ No newline at end of file
@@ -17,4 +17,30 @@ extern uint64_t micros();
 /// Get a time stamp in nanoseconds.
 extern uint64_t nanos();
 
+// Clock sources for nanos_fast(). All of them share the CLOCK_MONOTONIC time base.
+#define TIMESTAMP_SOURCE_PRECISE  0 // clock_gettime(CLOCK_MONOTONIC_PRECISE). The default.
+#define TIMESTAMP_SOURCE_COUNTER  1 // CPU counter (CNTVCT/TSC) calibrated against CLOCK_MONOTONIC and re-anchored to it every 100ms.
+#define TIMESTAMP_SOURCE_COARSE   2 // CLOCK_MONOTONIC_FAST (or _COARSE). Only tick resolution.
+
+/// Select the clock source used by nanos_fast(). Returns the source actually selected (TIMESTAMP_SOURCE_COUNTER falls back to TIMESTAMP_SOURCE_COARSE if there is no usable counter).
+extern int nanos_set_source(int source);
+
+/// Get the clock source currently used by nanos_fast().
+extern int nanos_get_source();
+
+/// Get a time stamp in nanoseconds from the selected clock source.
+extern uint64_t nanos_fast();
+
+/// Refresh this thread's cached time stamp from nanos_fast() and return it. Call once per event loop pass.
+extern uint64_t nanos_tick();
+
+/// Set this thread's cached time stamp. Used to inject an external clock.
+extern void nanos_set_cached(uint64_t now);
+
+/// Get this thread's cached time stamp (as of the last nanos_tick() or nanos_set_cached()).
+extern uint64_t nanos_cached();
+
+/// Sleep (clock_nanosleep with TIMER_ABSTIME) until spin_ns before deadline_ns then spin until the deadline. Returns the wake up time and refreshes the cached time stamp.
+extern uint64_t nanos_sleep_until(uint64_t deadline_ns, uint64_t spin_ns);
+
 #endif // __TIMESTAMP_H__
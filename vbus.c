@@ -0,0 +1,262 @@
+// vbus.c
+#include <stdio.h>      /* Standard input/output definitions */
+#include <string.h>     /* String function definitions */
+#include <inttypes.h>
+#include <pthread.h>
+#include "vbus.h"
+#include "bustime.h"
+#include "utils/canbits.h"
+// #define LOG_LEVEL 3
+#include "utils/logs.h"
+#include "utils/timestamp.h"
+
+#define TAG "vbus"
+
+// A CAN bus simulated in memory so that tests can run without any adapters. Nothing runs in the background: each time a node reads or
+// writes, the bus is moved on to that node's nanos_cached() time. The frame on the wire finishes (bits x bit time after it started)
+// and is delivered to every node, sender included, then the lowest arbitration ID waiting at the head of any node's Tx queue goes
+// next. Because the bus runs on nanos_cached(), interfaces opened with MILCAN_A_OPTION_NO_THREAD and driven by milcan_poll() with a
+// made up clock can run a soak test much faster than real time.
+
+static struct vbus vbuses[VBUS_MAX_BUSES];
+static pthread_mutex_t vbusRegistry = PTHREAD_MUTEX_INITIALIZER;
+
+/// @brief The order that frames win arbitration in (lowest first): the 11 bit base ID, then RTR (standard) or SRR (extended), then
+/// IDE, then the 18 bit extension and RTR.
+uint32_t vbusArbitrationKey(struct can_frame* frame) {
+  uint32_t rtr = (frame->can_id & CAN_RTR_FLAG) ? 1 : 0;
+  if(frame->can_id & CAN_EFF_FLAG) {
+    uint32_t id = frame->can_id & CAN_EFF_MASK;
+    return ((id >> 18) << 21) | (1 << 20) | (1 << 19) | ((id & 0x3FFFF) << 1) | rtr;
+  }
+  return ((frame->can_id & CAN_SFF_MASK) << 21) | (rtr << 20);
+}
+
+/// @brief How many bits the frame takes on the bus, including the interframe space.
+uint32_t vbusFrameBits(struct can_frame* frame) {
+  if(!(frame->can_id & CAN_EFF_FLAG)) {
+    return canBitsWorst(frame->len);
+  }
+  return canBitsExtended(frame->can_id & CAN_EFF_MASK, (frame->can_id & CAN_RTR_FLAG) ? 1 : 0, frame->len, frame->data);
+}
+
+// Hand the frame that's just finished to every node.
+static void vbusDeliver(struct vbus* bus) {
+  for(int n = 0; n < VBUS_MAX_NODES; n++) {
+    struct vbus_node* node = bus->nodes[n];
+    if(node == NULL) continue;
+    if(node->rx_count >= VBUS_RX_SIZE) {
+      node->rx_dropped++;
+      continue;
+    }
+    memcpy(&(node->rx[(node->rx_head + node->rx_count) % VBUS_RX_SIZE]), &(bus->wire), sizeof(struct vbus_frame));
+    node->rx_count++;
+  }
+}
+
+// Run the bus up to now. Call with the bus locked.
+static void vbusAdvance(struct vbus* bus, uint64_t now) {
+  for(;;) {
+    if(bus->busy) {
+      if(now < bus->wire.time) {
+        return; // Still on the wire.
+      }
+      vbusDeliver(bus);
+      bus->busy = FALSE;
+      bus->idle_since = bus->wire.time;
+    }
+
+    // Arbitration starts as soon as the bus is idle and something is waiting.
+    uint64_t start = UINT64_MAX;
+    for(int n = 0; n < VBUS_MAX_NODES; n++) {
+      struct vbus_node* node = bus->nodes[n];
+      if((node != NULL) && (node->tx_count > 0) && (node->tx[node->tx_head].time < start)) {
+        start = node->tx[node->tx_head].time;
+      }
+    }
+    if(start == UINT64_MAX) {
+      return; // Nothing to send.
+    }
+    if(start < bus->idle_since) start = bus->idle_since;
+    if(start > now) {
+      return;
+    }
+    struct vbus_node* winner = NULL;
+    uint32_t winner_key = UINT32_MAX;
+    for(int n = 0; n < VBUS_MAX_NODES; n++) {
+      struct vbus_node* node = bus->nodes[n];
+      if((node != NULL) && (node->tx_count > 0) && (node->tx[node->tx_head].time <= start)) {
+        uint32_t key = vbusArbitrationKey(&(node->tx[node->tx_head].frame));
+        if((winner == NULL) || (key < winner_key)) {
+          winner = node;
+          winner_key = key;
+        }
+      }
+    }
+    uint64_t length = (vbusFrameBits(&(winner->tx[winner->tx_head].frame)) * bus->bit_ns) / bus->speedup;
+    memcpy(&(bus->wire.frame), &(winner->tx[winner->tx_head].frame), sizeof(struct can_frame));
+    bus->wire.time = start + length;
+    bus->busy = TRUE;
+    bus->frames++;
+    bus->busy_ns += length;
+    winner->tx_head = (winner->tx_head + 1) % VBUS_TX_SIZE;
+    winner->tx_count--;
+  }
+}
+
+/// @brief Attaches node to virtual bus number (0 to VBUS_MAX_BUSES - 1) running at speed (MILCAN_A_250K etc.). Returns MILCAN_OK or MILCAN_ERROR.
+int vbusAttach(struct vbus_node* node, uint16_t number, uint8_t speed) {
+  int ret = MILCAN_ERROR;
+  memset(node, 0, sizeof(struct vbus_node));
+  if(number >= VBUS_MAX_BUSES) {
+    LOGE(TAG, "There is no virtual bus %u.", number);
+    return MILCAN_ERROR;
+  }
+  struct vbus* bus = &(vbuses[number]);
+  pthread_mutex_lock(&vbusRegistry);
+  if(bus->users == 0) {
+    uint32_t speedup = bus->speedup;
+    memset(bus, 0, sizeof(struct vbus));
+    pthread_mutex_init(&(bus->lock), NULL);
+    bus->bit_ns = busTimeBitNs(speed);
+    bus->speedup = (speedup == 0) ? 1 : speedup;
+  }
+  pthread_mutex_lock(&(bus->lock));
+  for(int n = 0; n < VBUS_MAX_NODES; n++) {
+    if(bus->nodes[n] == NULL) {
+      bus->nodes[n] = node;
+      node->bus = bus;
+      bus->users++;
+      ret = MILCAN_OK;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&(bus->lock));
+  pthread_mutex_unlock(&vbusRegistry);
+  if(ret != MILCAN_OK) {
+    LOGE(TAG, "Virtual bus %u already has %u nodes.", number, VBUS_MAX_NODES);
+  }
+  return ret;
+}
+
+/// @brief Detaches node from its bus. Anything it hadn't sent is dropped.
+void vbusDetach(struct vbus_node* node) {
+  struct vbus* bus = node->bus;
+  if(bus == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&vbusRegistry);
+  pthread_mutex_lock(&(bus->lock));
+  for(int n = 0; n < VBUS_MAX_NODES; n++) {
+    if(bus->nodes[n] == node) {
+      bus->nodes[n] = NULL;
+    }
+  }
+  bus->users--;
+  pthread_mutex_unlock(&(bus->lock));
+  if(bus->users == 0) {
+    pthread_mutex_destroy(&(bus->lock));
+  }
+  pthread_mutex_unlock(&vbusRegistry);
+  node->bus = NULL;
+}
+
+/// @brief Queues a frame to send. It goes on the bus when it wins arbitration. Returns MILCAN_OK or MILCAN_ERROR if the Tx slots are full.
+int vbusWrite(struct vbus_node* node, struct can_frame* frame) {
+  struct vbus* bus = node->bus;
+  int ret = MILCAN_ERROR;
+  if(bus == NULL) {
+    return MILCAN_ERROR;
+  }
+  uint64_t now = nanos_cached();
+  pthread_mutex_lock(&(bus->lock));
+  vbusAdvance(bus, now);
+  if(node->tx_count < VBUS_TX_SIZE) {
+    struct vbus_frame* slot = &(node->tx[(node->tx_head + node->tx_count) % VBUS_TX_SIZE]);
+    memcpy(&(slot->frame), frame, sizeof(struct can_frame));
+    slot->time = now;
+    node->tx_count++;
+    vbusAdvance(bus, now);  // If the bus is idle it starts now.
+    ret = MILCAN_OK;
+  }
+  pthread_mutex_unlock(&(bus->lock));
+  return ret;
+}
+
+/// @brief Gets the next received frame and when it finished on the bus. Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+int vbusRead(struct vbus_node* node, struct can_frame* frame, uint64_t* rx_time) {
+  struct vbus* bus = node->bus;
+  int ret = MILCAN_ERROR_EOF;
+  if(bus == NULL) {
+    return MILCAN_ERROR_EOF;
+  }
+  pthread_mutex_lock(&(bus->lock));
+  vbusAdvance(bus, nanos_cached());
+  if(node->rx_count > 0) {
+    memcpy(frame, &(node->rx[node->rx_head].frame), sizeof(struct can_frame));
+    *rx_time = node->rx[node->rx_head].time;
+    node->rx_head = (node->rx_head + 1) % VBUS_RX_SIZE;
+    node->rx_count--;
+    ret = MILCAN_OK;
+  }
+  pthread_mutex_unlock(&(bus->lock));
+  return ret;
+}
+
+/// @brief How many more frames can be queued with vbusWrite().
+int vbusTxFree(struct vbus_node* node) {
+  return VBUS_TX_SIZE - node->tx_count;
+}
+
+/// @brief When the bus next has something to do (a frame finishing or starting). UINT64_MAX if nothing is waiting.
+uint64_t vbusNextEvent(struct vbus_node* node) {
+  struct vbus* bus = node->bus;
+  uint64_t next = UINT64_MAX;
+  if(bus == NULL) {
+    return next;
+  }
+  pthread_mutex_lock(&(bus->lock));
+  if(bus->busy) {
+    next = bus->wire.time;
+  } else {
+    for(int n = 0; n < VBUS_MAX_NODES; n++) {
+      struct vbus_node* other = bus->nodes[n];
+      if((other != NULL) && (other->tx_count > 0) && (other->tx[other->tx_head].time < next)) {
+        next = other->tx[other->tx_head].time;
+      }
+    }
+  }
+  pthread_mutex_unlock(&(bus->lock));
+  return next;
+}
+
+/// @brief Makes frames on bus number take 1/speedup of their real time (1 is wire rate, VBUS_UNPACED is no time at all).
+int vbusSetSpeedup(uint16_t number, uint32_t speedup) {
+  if((number >= VBUS_MAX_BUSES) || (speedup == 0)) {
+    return MILCAN_ERROR;
+  }
+  struct vbus* bus = &(vbuses[number]);
+  pthread_mutex_lock(&vbusRegistry);
+  if(bus->users > 0) {
+    pthread_mutex_lock(&(bus->lock));
+    bus->speedup = speedup;
+    pthread_mutex_unlock(&(bus->lock));
+  } else {
+    bus->speedup = speedup; // Used when the first node attaches.
+  }
+  pthread_mutex_unlock(&vbusRegistry);
+  return MILCAN_OK;
+}
+
+/// @brief Reads how many frames bus number has carried and for how long it has been busy. Returns MILCAN_OK or MILCAN_ERROR.
+int vbusGetStats(uint16_t number, uint64_t* frames, uint64_t* busy_ns) {
+  if(number >= VBUS_MAX_BUSES) {
+    return MILCAN_ERROR;
+  }
+  struct vbus* bus = &(vbuses[number]);
+  pthread_mutex_lock(&vbusRegistry);
+  *frames = bus->frames;
+  *busy_ns = bus->busy_ns;
+  pthread_mutex_unlock(&vbusRegistry);
+  return MILCAN_OK;
+}
@@ -0,0 +1,81 @@
+// vbus.h
+#ifndef __VBUS_H__
+#define __VBUS_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "can.h"
+
+#define VBUS_MAX_BUSES    (16)          // Bus numbers 0 to 15.
+#define VBUS_MAX_NODES    (32)          // How many interfaces can attach to one bus.
+#define VBUS_RX_SIZE      (256)         // Frames each node can have waiting to be read.
+#define VBUS_TX_SIZE      (16)          // Frames each node can have waiting to win arbitration (like an adapter's Tx slots).
+#define VBUS_UNPACED      (UINT32_MAX)  // Speed up so far that frames take no time on the bus.
+
+/// @brief A frame and a time (when it was queued, or when it finished on the bus).
+struct vbus_frame {
+  struct can_frame frame;
+  uint64_t time;
+};
+
+struct vbus;
+
+/// @brief One interface's connection to a virtual bus.
+struct vbus_node {
+  struct vbus* bus;                       // NULL if not attached.
+  struct vbus_frame rx[VBUS_RX_SIZE];     // Received frames (including our own, like a real adapter's echo).
+  uint32_t rx_head;                       // The next to read.
+  uint32_t rx_count;                      // How many are waiting.
+  uint64_t rx_dropped;                    // Frames lost because rx was full.
+  struct vbus_frame tx[VBUS_TX_SIZE];     // Frames waiting for the bus, oldest first.
+  uint32_t tx_head;
+  uint32_t tx_count;
+};
+
+/// @brief A simulated CAN bus that interfaces in the same process attach to.
+struct vbus {
+  int users;                              // How many nodes are attached. The bus is set up by the first and freed by the last.
+  pthread_mutex_t lock;
+  uint64_t bit_ns;                        // One bit at the bus speed, divided by speedup.
+  uint32_t speedup;                       // 1 runs at wire rate. See vbusSetSpeedup().
+  struct vbus_node* nodes[VBUS_MAX_NODES];
+  uint8_t busy;                           // Is a frame on the wire?
+  struct vbus_frame wire;                 // The frame on the wire and when it finishes.
+  uint64_t idle_since;                    // When the bus last went idle.
+  uint64_t frames;                        // Frames sent on the bus.
+  uint64_t busy_ns;                       // Time the bus has been busy.
+};
+
+/// @brief The order that frames win arbitration in (lowest first): the 11 bit base ID, then RTR (standard) or SRR (extended), then
+/// IDE, then the 18 bit extension and RTR.
+extern uint32_t vbusArbitrationKey(struct can_frame* frame);
+
+/// @brief How many bits the frame takes on the bus, including the interframe space.
+extern uint32_t vbusFrameBits(struct can_frame* frame);
+
+/// @brief Attaches node to virtual bus number (0 to VBUS_MAX_BUSES - 1) running at speed (MILCAN_A_250K etc.). Returns MILCAN_OK or MILCAN_ERROR.
+extern int vbusAttach(struct vbus_node* node, uint16_t number, uint8_t speed);
+
+/// @brief Detaches node from its bus. Anything it hadn't sent is dropped.
+extern void vbusDetach(struct vbus_node* node);
+
+/// @brief Queues a frame to send. It goes on the bus when it wins arbitration. Returns MILCAN_OK or MILCAN_ERROR if the Tx slots are full.
+extern int vbusWrite(struct vbus_node* node, struct can_frame* frame);
+
+/// @brief Gets the next received frame and when it finished on the bus. Returns MILCAN_OK or MILCAN_ERROR_EOF if there's nothing to read.
+extern int vbusRead(struct vbus_node* node, struct can_frame* frame, uint64_t* rx_time);
+
+/// @brief How many more frames can be queued with vbusWrite().
+extern int vbusTxFree(struct vbus_node* node);
+
+/// @brief When the bus next has something to do (a frame finishing or starting). UINT64_MAX if nothing is waiting.
+extern uint64_t vbusNextEvent(struct vbus_node* node);
+
+/// @brief Makes frames on bus number take 1/speedup of their real time (1 is wire rate, VBUS_UNPACED is no time at all).
+/// It can be set before the first node attaches. Returns MILCAN_OK or MILCAN_ERROR.
+extern int vbusSetSpeedup(uint16_t number, uint32_t speedup);
+
+/// @brief Reads how many frames bus number has carried and for how long it has been busy. Returns MILCAN_OK or MILCAN_ERROR.
+extern int vbusGetStats(uint16_t number, uint64_t* frames, uint64_t* busy_ns);
+
+#endif  // __VBUS_H__
@@ -0,0 +1,173 @@
+// wcrt.c
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>     /* String function definitions */
+#include "wcrt.h"
+#include "bustime.h"
+#include "utils/canbits.h"
+
+// Classic CAN worst case response time analysis (Tindell, as revised by Davis et al. so that a frame that is delayed into its next
+// period is still counted). CAN is non-preemptive, so each frame can be blocked by one lower priority frame that has just started,
+// then has to wait for every higher priority frame (and sync frame) that is queued before it wins arbitration.
+// Everything is integer nanoseconds so thousands of candidate sets can be checked quickly.
+
+#define WCRT_ID(id)   ((id) & MILCAN_ID_MASK)
+
+// How many PTUs each priority has to get its frame onto the bus. HRT0 is "immediately" but still has to fit in the PTU.
+static const uint16_t wcrtPriorityPTUs[MILCAN_ID_PRIORITY_COUNT] = { 1, 1, 8, 64, 8, 64, 1024, 0 };
+
+/// @brief Returns the MilCAN deadline for this priority (1, 8, 64 or 1024 PTU), or WCRT_NO_DEADLINE for NRT.
+uint64_t wcrtPriorityDeadline(uint8_t priority, uint64_t ptu_ns) {
+  if((priority > MILCAN_ID_PRIORITY_MAX) || (wcrtPriorityPTUs[priority] == 0)) {
+    return WCRT_NO_DEADLINE;
+  }
+  return ptu_ns * wcrtPriorityPTUs[priority];
+}
+
+static int wcrtCompare(const void* a, const void* b) {
+  uint32_t ida = WCRT_ID(((const struct wcrt_message*)a)->id);
+  uint32_t idb = WCRT_ID(((const struct wcrt_message*)b)->id);
+  return (ida < idb) ? -1 : ((ida > idb) ? 1 : 0);
+}
+
+static inline uint64_t wcrtCeilDiv(uint64_t a, uint64_t b) {
+  return (a + b - 1) / b;
+}
+
+// Time taken by every frame in hp (plus the sync frames if they're higher priority) that can be queued in a window of length w.
+static uint64_t wcrtInterference(struct wcrt_message* hp, uint32_t count, struct wcrt_message* sync, uint64_t w) {
+  uint64_t total = 0;
+  for(uint32_t k = 0; k < count; k++) {
+    total += wcrtCeilDiv(w + hp[k].jitter_ns, hp[k].period_ns) * hp[k].tx_ns;
+  }
+  if(sync != NULL) {
+    total += wcrtCeilDiv(w + sync->jitter_ns, sync->period_ns) * sync->tx_ns;
+  }
+  return total;
+}
+
+// Works out msgs[i]'s response time. Everything before it in msgs is higher priority.
+static void wcrtAnalyseOne(struct wcrt_message* msgs, uint32_t i, struct wcrt_message* sync, uint64_t bit_ns, double hp_util, uint64_t horizon_ns) {
+  struct wcrt_message* m = &msgs[i];
+  uint64_t b = m->blocking_ns;
+
+  m->response_ns = WCRT_UNBOUNDED;
+  m->schedulable = FALSE;
+  if((hp_util + ((double)m->tx_ns / (double)m->period_ns)) >= 1.0) {
+    return; // The busy period never ends.
+  }
+
+  // How long the bus can stay busy with this priority or higher. That's how many of our frames we have to check.
+  uint64_t t = b + m->tx_ns;
+  for(;;) {
+    uint64_t next = b + wcrtInterference(msgs, i + 1, sync, t);
+    if(next == t) break;
+    if(next > horizon_ns) return;
+    t = next;
+  }
+  uint64_t instances = wcrtCeilDiv(t + m->jitter_ns, m->period_ns);
+
+  // The queuing delay of each instance. A higher priority frame queued up to a bit time after we start can still win arbitration.
+  // Each instance has to wait at least as long as the one before it plus that frame, which saves most of the iterations.
+  uint64_t worst = 0;
+  uint64_t w = b;
+  for(uint64_t q = 0; q < instances; q++) {
+    uint64_t released = q * m->period_ns;
+    uint64_t limit = (m->checked_ns == WCRT_NO_DEADLINE) ? WCRT_NO_DEADLINE : (m->checked_ns + released);
+    if(q > 0) w += m->tx_ns;
+    for(;;) {
+      uint64_t next = b + (q * m->tx_ns) + wcrtInterference(msgs, i, sync, w + bit_ns);
+      int converged = (next == w) ? TRUE : FALSE;
+      w = next;
+      if(converged || ((m->jitter_ns + w + m->tx_ns) > limit)) break;
+    }
+    uint64_t end = m->jitter_ns + w + m->tx_ns;
+    uint64_t r = (end > released) ? (end - released) : 0;
+    if(r > worst) worst = r;
+    if(worst > m->checked_ns) break;  // Already missed. No need to look any further.
+  }
+  m->response_ns = worst;
+  m->schedulable = (worst <= m->checked_ns) ? TRUE : FALSE;
+}
+
+/// @brief Works out the worst case response time of every message. msgs are sorted into priority (ID) order.
+/// Returns MILCAN_OK if every message meets its deadline, MILCAN_ERROR if not, MILCAN_ERROR_FATAL if a message has no period.
+int wcrtAnalyse(struct wcrt_bus* bus, struct wcrt_message* msgs, uint32_t count, struct wcrt_summary* summary) {
+  uint64_t bit_ns = busTimeBitNs(bus->speed);
+  uint64_t ptu_ns = 0;
+  struct wcrt_message sync;
+  int have_sync = (bus->sync_freq_hz != 0) ? TRUE : FALSE;
+
+  memset(summary, 0, sizeof(struct wcrt_summary));
+  summary->min_slack_ns = INT64_MAX;
+  for(uint32_t n = 0; n < count; n++) {
+    if(msgs[n].period_ns == 0) {
+      return MILCAN_ERROR_FATAL;  // Every message needs a period (or minimum interval).
+    }
+  }
+  memset(&sync, 0, sizeof(struct wcrt_message));
+  if(have_sync) {
+    ptu_ns = (uint64_t)(1000000000L / bus->sync_freq_hz);
+    sync.id = MILCAN_MAKE_ID(0, 0, MILCAN_ID_PRIMARY_SYSTEM_MANAGEMENT, MILCAN_ID_SECONDARY_SYSTEM_MANAGEMENT_SYNC_FRAME, bus->sync_source);
+    sync.dlc = BUS_TIME_SYNC_DLC;
+    sync.period_ns = ptu_ns;
+    sync.jitter_ns = bus->sync_jitter_ns;
+    sync.tx_ns = canBitsWorst(sync.dlc) * bit_ns;
+    summary->utilisation = (double)sync.tx_ns / (double)sync.period_ns;
+  }
+
+  qsort(msgs, count, sizeof(struct wcrt_message), wcrtCompare);
+
+  // Blocking is the longest frame below us, so work up from the bottom.
+  uint64_t longest_below = 0;
+  for(uint32_t n = count; n > 0; n--) {
+    struct wcrt_message* m = &msgs[n - 1];
+    m->tx_ns = canBitsWorst(m->dlc) * bit_ns;
+    m->blocking_ns = longest_below;
+    if(have_sync && (WCRT_ID(sync.id) > WCRT_ID(m->id)) && (sync.tx_ns > m->blocking_ns)) {
+      m->blocking_ns = sync.tx_ns;
+    }
+    if(m->tx_ns > longest_below) longest_below = m->tx_ns;
+  }
+
+  double hp_util = 0.0;
+  int sync_counted = FALSE;
+  for(uint32_t i = 0; i < count; i++) {
+    struct wcrt_message* m = &msgs[i];
+    uint8_t priority = ((m->id & MILCAN_ID_PRIORITY_MASK) >> 26) & 0x07;
+    struct wcrt_message* hp_sync = (have_sync && (WCRT_ID(sync.id) < WCRT_ID(m->id))) ? &sync : NULL;
+
+    if((hp_sync != NULL) && !sync_counted) {
+      hp_util += summary->utilisation;
+      sync_counted = TRUE;
+    }
+    if(m->deadline_ns != 0) {
+      m->checked_ns = m->deadline_ns;
+    } else if(have_sync) {
+      m->checked_ns = wcrtPriorityDeadline(priority, ptu_ns);
+    } else {
+      m->checked_ns = (priority == MILCAN_ID_PRIORITY_MAX) ? WCRT_NO_DEADLINE : m->period_ns;
+    }
+
+    wcrtAnalyseOne(msgs, i, hp_sync, bit_ns, hp_util, WCRT_MAX_BUSY_PTUS * (have_sync ? ptu_ns : m->period_ns));
+    hp_util += (double)m->tx_ns / (double)m->period_ns;
+
+    if(!m->schedulable) {
+      summary->unschedulable++;
+    }
+    if(m->checked_ns == WCRT_NO_DEADLINE) {
+      m->slack_ns = INT64_MAX;
+    } else if(m->response_ns == WCRT_UNBOUNDED) {
+      m->slack_ns = INT64_MIN;
+    } else {
+      m->slack_ns = (int64_t)m->checked_ns - (int64_t)m->response_ns;
+    }
+    if(m->slack_ns < summary->min_slack_ns) {
+      summary->min_slack_ns = m->slack_ns;
+      summary->min_slack_index = i;
+    }
+  }
+  summary->utilisation = hp_util + ((have_sync && !sync_counted) ? summary->utilisation : 0.0);
+
+  return (summary->unschedulable == 0) ? MILCAN_OK : MILCAN_ERROR;
+}
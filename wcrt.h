@@ -0,0 +1,49 @@
+// wcrt.h
+#ifndef __WCRT_H__
+#define __WCRT_H__
+
+#include <inttypes.h>
+
+#define WCRT_NO_DEADLINE    (UINT64_MAX)  // NRT frames don't have a deadline.
+#define WCRT_UNBOUNDED      (UINT64_MAX)  // The response time when the bus is overloaded at that priority.
+#define WCRT_MAX_BUSY_PTUS  (1024)        // A bus that can stay busy for longer than the longest MilCAN deadline counts as overloaded.
+
+/// @brief The bus that a message set is analysed on.
+struct wcrt_bus {
+  uint8_t speed;              // MILCAN_A_250K, MILCAN_A_500K or MILCAN_A_1M.
+  uint16_t sync_freq_hz;      // The sync frame frequency. 0 to leave the sync frames out.
+  uint8_t sync_source;        // The Sync Master's address (sets the sync frame's ID).
+  uint64_t sync_jitter_ns;    // How late the Sync Master can send a sync frame.
+};
+
+/// @brief One message in the set. Fill in the first five fields, wcrtAnalyse() fills in the rest.
+struct wcrt_message {
+  uint32_t id;                // The CAN ID (e.g. from MILCAN_MAKE_ID()). The priority comes from this.
+  uint8_t dlc;                // 0 to 8.
+  uint64_t period_ns;         // The minimum time between two of these.
+  uint64_t jitter_ns;         // How late after being triggered the frame can be queued.
+  uint64_t deadline_ns;       // 0 to use the MilCAN deadline for its priority.
+  uint64_t checked_ns;        // The deadline that was checked against.
+  uint64_t tx_ns;             // Worst case time on the bus (bit stuffing and interframe space).
+  uint64_t blocking_ns;       // The longest lower priority frame that can be in the way.
+  uint64_t response_ns;       // Worst case time from being triggered to the end of the frame.
+  int64_t slack_ns;           // deadline - response. Negative if the deadline is missed.
+  uint8_t schedulable;        // TRUE if the response time is within the deadline.
+};
+
+/// @brief The results for the whole set.
+struct wcrt_summary {
+  double utilisation;         // Fraction of the bus that the set (and the sync frames) uses.
+  uint32_t unschedulable;     // How many messages can miss their deadline.
+  int64_t min_slack_ns;       // The smallest slack of any message that has a deadline.
+  uint32_t min_slack_index;   // Which message that was.
+};
+
+/// @brief Returns the MilCAN deadline for this priority (1, 8, 64 or 1024 PTU), or WCRT_NO_DEADLINE for NRT.
+extern uint64_t wcrtPriorityDeadline(uint8_t priority, uint64_t ptu_ns);
+
+/// @brief Works out the worst case response time of every message. msgs are sorted into priority (ID) order.
+/// Returns MILCAN_OK if every message meets its deadline, MILCAN_ERROR if not, MILCAN_ERROR_FATAL if a message has no period.
+extern int wcrtAnalyse(struct wcrt_bus* bus, struct wcrt_message* msgs, uint32_t count, struct wcrt_summary* summary);
+
+#endif  // __WCRT_H__